@@ -38,6 +38,7 @@
 #include "gsupplicant.h"
 
 #define TIMEOUT 5000
+#define BSS_FETCH_MAX 8
 
 #define IEEE80211_CAP_ESS	0x0001
 #define IEEE80211_CAP_IBSS	0x0002
@@ -168,6 +169,9 @@ struct _GSupplicantInterface {
 	GHashTable *network_table;
 	GHashTable *net_mapping;
 	GHashTable *bss_mapping;
+	GHashTable *bss_fetching;
+	GQueue bss_queue;
+	unsigned int bss_requests;
 	void *data;
 };
 
@@ -194,6 +198,7 @@ struct g_supplicant_bss {
 	dbus_bool_t psk;
 	dbus_bool_t ieee8021x;
 	unsigned int wps_capabilities;
+	GSequenceIter *signal_iter;
 };
 
 struct _GSupplicantNetwork {
@@ -211,6 +216,7 @@ struct _GSupplicantNetwork {
 	dbus_bool_t wps;
 	unsigned int wps_capabilities;
 	GHashTable *bss_table;
+	GSequence *bss_signals;
 	GHashTable *config_table;
 };
 
@@ -431,10 +437,14 @@ static void callback_network_changed(GSupplicantNetwork *network,
 	callbacks_pointer->network_changed(network, property);
 }
 
+static void bss_fetch_cancel(GSupplicantInterface *interface);
+
 static void remove_interface(gpointer data)
 {
 	GSupplicantInterface *interface = data;
 
+	bss_fetch_cancel(interface);
+
 	g_hash_table_destroy(interface->bss_mapping);
 	g_hash_table_destroy(interface->net_mapping);
 	g_hash_table_destroy(interface->network_table);
@@ -470,6 +480,7 @@ static void remove_network(gpointer data)
 	GSupplicantNetwork *network = data;
 
 	g_hash_table_destroy(network->bss_table);
+	g_sequence_free(network->bss_signals);
 
 	callback_network_removed(network);
 
@@ -485,6 +496,9 @@ static void remove_bss(gpointer data)
 {
 	struct g_supplicant_bss *bss = data;
 
+	if (bss->signal_iter != NULL)
+		g_sequence_remove(bss->signal_iter);
+
 	g_free(bss->path);
 	g_free(bss);
 }
@@ -1120,6 +1134,43 @@ static char *create_group(struct g_supplicant_bss *bss)
 	return g_string_free(str, FALSE);
 }
 
+/* Sorts the BSSs of a network by descending signal */
+static gint compare_signal(gconstpointer a, gconstpointer b,
+							gpointer user_data)
+{
+	const struct g_supplicant_bss *bss_a = a;
+	const struct g_supplicant_bss *bss_b = b;
+
+	return bss_b->signal - bss_a->signal;
+}
+
+/*
+ * The best BSS is the first one of the signal ordered sequence, so
+ * this does not walk the BSS table. Returns TRUE if the network
+ * signal changed.
+ */
+static gboolean update_network_signal(GSupplicantNetwork *network)
+{
+	struct g_supplicant_bss *best;
+	GSequenceIter *iter;
+
+	iter = g_sequence_get_begin_iter(network->bss_signals);
+	if (g_sequence_iter_is_end(iter) == TRUE)
+		return FALSE;
+
+	best = g_sequence_get(iter);
+	network->best_bss = best;
+
+	if (best->signal == network->signal)
+		return FALSE;
+
+	network->signal = best->signal;
+
+	SUPPLICANT_DBG("New network signal %d", network->signal);
+
+	return TRUE;
+}
+
 static void add_or_replace_bss_to_network(struct g_supplicant_bss *bss)
 {
 	GSupplicantInterface *interface = bss->interface;
@@ -1163,6 +1214,7 @@ static void add_or_replace_bss_to_network(struct g_supplicant_bss *bss)
 
 	network->bss_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, remove_bss);
+	network->bss_signals = g_sequence_new(NULL);
 
 	network->config_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							g_free, g_free);
@@ -1179,15 +1231,15 @@ done:
 		network->wps_capabilities |= bss->wps_capabilities;
 	}
 
-	if (bss->signal > network->signal) {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-		callback_network_changed(network, "Signal");
-	}
-
 	g_hash_table_replace(interface->bss_mapping, bss->path, network);
 	g_hash_table_replace(network->bss_table, bss->path, bss);
 
+	bss->signal_iter = g_sequence_insert_sorted(network->bss_signals,
+						bss, compare_signal, NULL);
+
+	if (update_network_signal(network) == TRUE)
+		callback_network_changed(network, "Signal");
+
 	g_hash_table_replace(bss_mapping, bss->path, interface);
 }
 
@@ -1557,6 +1609,10 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 			return NULL;
 	}
 
+	/* Its properties are on their way already */
+	if (g_hash_table_lookup(interface->bss_fetching, path) != NULL)
+		return NULL;
+
 	bss = g_try_new0(struct g_supplicant_bss, 1);
 	if (bss == NULL)
 		return NULL;
@@ -1589,46 +1645,143 @@ static void interface_bss_added_with_keys(DBusMessageIter *iter,
 	add_or_replace_bss_to_network(bss);
 }
 
-static void interface_bss_added_without_keys(DBusMessageIter *iter,
-						void *user_data)
+/*
+ * BSSs announced without their properties, e.g. the BSSs property of
+ * an interface after a scan, are fetched with at most
+ * BSS_FETCH_MAX GetAll calls in flight instead of one call per BSS
+ * at once. A BSS is only added to its network once its properties
+ * are known, since they decide the network group.
+ */
+static void bss_fetch_next(GSupplicantInterface *interface);
+
+static void bss_fetch_setup(DBusMessageIter *iter, void *user_data)
+{
+	const char *bss_interface = SUPPLICANT_INTERFACE ".BSS";
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING,
+							&bss_interface);
+}
+
+static void bss_fetch_result(const char *error, DBusMessageIter *iter,
+							void *user_data)
+{
+	struct g_supplicant_bss *bss = user_data;
+	GSupplicantInterface *interface = bss->interface;
+
+	/* The interface or the BSS went away meanwhile */
+	if (interface == NULL) {
+		remove_bss(bss);
+		return;
+	}
+
+	g_hash_table_remove(interface->bss_fetching, bss->path);
+	interface->bss_requests--;
+
+	if (error != NULL) {
+		SUPPLICANT_DBG("BSS %s properties error %s", bss->path, error);
+		remove_bss(bss);
+	} else {
+		supplicant_dbus_property_foreach(iter, bss_property, bss);
+
+		bss_compute_security(bss);
+		add_or_replace_bss_to_network(bss);
+	}
+
+	bss_fetch_next(interface);
+}
+
+static void bss_fetch_next(GSupplicantInterface *interface)
 {
 	struct g_supplicant_bss *bss;
+	int err;
 
-	SUPPLICANT_DBG("");
+	while (interface->bss_requests < BSS_FETCH_MAX) {
+		bss = g_queue_pop_head(&interface->bss_queue);
+		if (bss == NULL)
+			return;
 
-	bss = interface_bss_added(iter, user_data);
+		err = supplicant_dbus_method_call(bss->path,
+					DBUS_INTERFACE_PROPERTIES, "GetAll",
+					bss_fetch_setup, bss_fetch_result,
+					bss);
+		if (err < 0) {
+			g_hash_table_remove(interface->bss_fetching,
+								bss->path);
+			remove_bss(bss);
+			continue;
+		}
+
+		interface->bss_requests++;
+	}
+}
+
+/* Drops a BSS whose properties are not fetched yet */
+static gboolean bss_fetch_remove(GSupplicantInterface *interface,
+							const char *path)
+{
+	struct g_supplicant_bss *bss;
+	GList *link;
+
+	bss = g_hash_table_lookup(interface->bss_fetching, path);
 	if (bss == NULL)
-		return;
+		return FALSE;
 
-	supplicant_dbus_property_get_all(bss->path,
-					SUPPLICANT_INTERFACE ".BSS",
-							bss_property, bss);
+	g_hash_table_remove(interface->bss_fetching, path);
 
-	bss_compute_security(bss);
-	add_or_replace_bss_to_network(bss);
+	link = g_queue_find(&interface->bss_queue, bss);
+	if (link != NULL) {
+		g_queue_delete_link(&interface->bss_queue, link);
+		remove_bss(bss);
+		return TRUE;
+	}
+
+	/* In flight, freed by its reply */
+	bss->interface = NULL;
+	interface->bss_requests--;
+
+	bss_fetch_next(interface);
+
+	return TRUE;
 }
 
-static void update_signal(gpointer key, gpointer value,
-						gpointer user_data)
+static void bss_fetch_cancel(GSupplicantInterface *interface)
 {
-	struct g_supplicant_bss *bss = value;
-	GSupplicantNetwork *network = user_data;
+	struct g_supplicant_bss *bss;
+	GHashTableIter iter;
+	gpointer value;
 
-	if (bss->signal > network->signal) {
-		network->signal = bss->signal;
-		network->best_bss = bss;
+	while ((bss = g_queue_pop_head(&interface->bss_queue)) != NULL) {
+		g_hash_table_remove(interface->bss_fetching, bss->path);
+		remove_bss(bss);
 	}
+
+	g_hash_table_iter_init(&iter, interface->bss_fetching);
+	while (g_hash_table_iter_next(&iter, NULL, &value) == TRUE) {
+		bss = value;
+		bss->interface = NULL;
+	}
+
+	g_hash_table_destroy(interface->bss_fetching);
+	interface->bss_fetching = NULL;
+	interface->bss_requests = 0;
 }
 
-static void update_network_signal(GSupplicantNetwork *network)
+static void interface_bss_added_without_keys(DBusMessageIter *iter,
+						void *user_data)
 {
-	if (g_hash_table_size(network->bss_table) <= 1)
+	GSupplicantInterface *interface = user_data;
+	struct g_supplicant_bss *bss;
+
+	SUPPLICANT_DBG("");
+
+	bss = interface_bss_added(iter, user_data);
+	if (bss == NULL)
 		return;
 
-	g_hash_table_foreach(network->bss_table,
-				update_signal, network);
+	g_hash_table_replace(interface->bss_fetching, bss->path, bss);
+	g_queue_push_tail(&interface->bss_queue, bss);
 
-	SUPPLICANT_DBG("New network signal %d", network->signal);
+	bss_fetch_next(interface);
 }
 
 static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
@@ -1641,6 +1794,9 @@ static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 	if (path == NULL)
 		return;
 
+	if (bss_fetch_remove(interface, path) == TRUE)
+		return;
+
 	network = g_hash_table_lookup(interface->bss_mapping, path);
 	if (network == NULL)
 		return;
@@ -1650,10 +1806,13 @@ static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 	g_hash_table_remove(interface->bss_mapping, path);
 	g_hash_table_remove(network->bss_table, path);
 
-	update_network_signal(network);
-
-	if (g_hash_table_size(network->bss_table) == 0)
+	if (g_hash_table_size(network->bss_table) == 0) {
 		g_hash_table_remove(interface->network_table, network->group);
+		return;
+	}
+
+	if (update_network_signal(network) == TRUE)
+		callback_network_changed(network, "Signal");
 }
 
 static void interface_property(const char *key, DBusMessageIter *iter,
@@ -1818,6 +1977,9 @@ static GSupplicantInterface *interface_alloc(const char *path)
 								NULL, NULL);
 	interface->bss_mapping = g_hash_table_new_full(g_str_hash, g_str_equal,
 								NULL, NULL);
+	interface->bss_fetching = g_hash_table_new_full(g_str_hash,
+						g_str_equal, NULL, NULL);
+	g_queue_init(&interface->bss_queue);
 
 	g_hash_table_replace(interface_table, interface->path, interface);
 
@@ -2136,6 +2298,7 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 
 		memcpy(new_bss, bss, sizeof(struct g_supplicant_bss));
 		new_bss->path = g_strdup(bss->path);
+		new_bss->signal_iter = NULL;
 
 		g_hash_table_remove(interface->network_table, network->group);
 
@@ -2144,22 +2307,10 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 		return;
 	}
 
-	if (bss->signal == network->signal)
-		return;
+	g_sequence_sort_changed_iter(bss->signal_iter, compare_signal, NULL);
 
-	/*
-	 * If the new signal is lower than the SSID signal, we need
-	 * to check for the new maximum.
-	 */
-	if (bss->signal < network->signal) {
-		if (bss != network->best_bss)
-			return;
-		network->signal = bss->signal;
-		update_network_signal(network);
-	} else {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-	}
+	if (update_network_signal(network) == FALSE)
+		return;
 
 	SUPPLICANT_DBG("New network signal for %s %d dBm", network->ssid, network->signal);
 
@@ -31,6 +31,27 @@ extern "C" {
 gchar **connman_storage_get_services();
 GKeyFile *connman_storage_load_service(const char *service_id);
 
+#define CONNMAN_STORAGE_FAVORITE	(1 << 0)
+#define CONNMAN_STORAGE_AUTOCONNECT	(1 << 1)
+#define CONNMAN_STORAGE_HIDDEN		(1 << 2)
+
+/* The frequently queried settings of a saved service */
+struct connman_storage_service {
+	char *identifier;
+	char *name;
+	char *ssid;
+	int frequency;
+	unsigned int flags;
+	GTimeVal modified;
+};
+
+typedef void (* connman_storage_service_cb_t) (
+			const struct connman_storage_service *service,
+			void *user_data);
+
+int connman_storage_foreach_service(const char *prefix, unsigned int flags,
+			connman_storage_service_cb_t func, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
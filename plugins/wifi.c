@@ -369,59 +369,48 @@ static int add_scan_param(gchar *hex_ssid, char *raw_ssid, int ssid_len,
 	return 1;
 }
 
+struct hidden_scan_data {
+	GSupplicantScanParams *scan_data;
+	int max_ssids;
+	int num_ssids;
+	int add_param_failed;
+};
+
+static void add_hidden_service(const struct connman_storage_service *service,
+							void *user_data)
+{
+	struct hidden_scan_data *params = user_data;
+	int ret;
+
+	ret = add_scan_param(service->ssid, NULL, 0, service->frequency,
+				params->scan_data, params->max_ssids,
+				service->name);
+	if (ret < 0)
+		params->add_param_failed++;
+	else if (ret > 0)
+		params->num_ssids++;
+}
+
 static int get_hidden_connections(int max_ssids,
 				GSupplicantScanParams *scan_data)
 {
 	struct connman_config_entry **entries;
-	GKeyFile *keyfile;
-	gchar **services;
-	char *ssid, *name;
-	int i, freq, ret;
-	gboolean value;
-	int num_ssids = 0, add_param_failed = 0;
-
-	services = connman_storage_get_services();
-	for (i = 0; services && services[i]; i++) {
-		if (strncmp(services[i], "wifi_", 5) != 0)
-			continue;
-
-		keyfile = connman_storage_load_service(services[i]);
-		if (keyfile == NULL)
-			continue;
-
-		value = g_key_file_get_boolean(keyfile,
-					services[i], "Hidden", NULL);
-		if (value == FALSE) {
-			g_key_file_free(keyfile);
-			continue;
-		}
-
-		value = g_key_file_get_boolean(keyfile,
-					services[i], "Favorite", NULL);
-		if (value == FALSE) {
-			g_key_file_free(keyfile);
-			continue;
-		}
+	struct hidden_scan_data params;
+	char *ssid;
+	int i, ret;
+	int num_ssids, add_param_failed;
 
-		ssid = g_key_file_get_string(keyfile,
-					services[i], "SSID", NULL);
+	params.scan_data = scan_data;
+	params.max_ssids = max_ssids;
+	params.num_ssids = 0;
+	params.add_param_failed = 0;
 
-		freq = g_key_file_get_integer(keyfile, services[i],
-					"Frequency", NULL);
+	connman_storage_foreach_service("wifi_",
+			CONNMAN_STORAGE_HIDDEN | CONNMAN_STORAGE_FAVORITE,
+			add_hidden_service, &params);
 
-		name = g_key_file_get_string(keyfile, services[i], "Name",
-								NULL);
-
-		ret = add_scan_param(ssid, NULL, 0, freq, scan_data,
-				max_ssids, name);
-		if (ret < 0)
-			add_param_failed++;
-		else if (ret > 0)
-			num_ssids++;
-
-		g_free(name);
-		g_key_file_free(keyfile);
-	}
+	num_ssids = params.num_ssids;
+	add_param_failed = params.add_param_failed;
 
 	/*
 	 * Check if there are any hidden AP that needs to be provisioned.
@@ -458,8 +447,6 @@ static int get_hidden_connections(int max_ssids,
 		DBG("Unable to scan %d out of %d SSIDs (max is %d)",
 			add_param_failed, num_ssids, max_ssids);
 
-	g_strfreev(services);
-
 	return num_ssids > max_ssids ? max_ssids : num_ssids;
 }
 
@@ -811,88 +798,44 @@ static void free_entry(gpointer data)
 	g_free(entry);
 }
 
+static void add_latest_service(const struct connman_storage_service *service,
+							void *user_data)
+{
+	GSequence *latest_list = user_data;
+	struct last_connected *entry;
+
+	if (service->frequency == 0)
+		return;
+
+	entry = g_try_new(struct last_connected, 1);
+	if (entry == NULL)
+		return;
+
+	entry->ssid = g_strdup(service->ssid);
+	entry->modified = service->modified;
+	entry->freq = service->frequency;
+
+	g_sequence_insert_sorted(latest_list, entry, sort_entry, NULL);
+}
+
 static int get_latest_connections(int max_ssids,
 				GSupplicantScanParams *scan_data)
 {
 	GSequenceIter *iter;
 	GSequence *latest_list;
 	struct last_connected *entry;
-	GKeyFile *keyfile;
-	GTimeVal modified;
-	gchar **services;
-	gchar *str;
-	char *ssid;
-	int i, freq;
-	int num_ssids = 0;
+	int i;
+	int num_ssids;
 
 	latest_list = g_sequence_new(free_entry);
 	if (latest_list == NULL)
 		return -ENOMEM;
 
-	services = connman_storage_get_services();
-	for (i = 0; services && services[i]; i++) {
-		if (strncmp(services[i], "wifi_", 5) != 0)
-			continue;
-
-		keyfile = connman_storage_load_service(services[i]);
-		if (keyfile == NULL)
-			continue;
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "Favorite", NULL);
-		if (str == NULL || g_strcmp0(str, "true")) {
-			if (str)
-				g_free(str);
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_free(str);
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "AutoConnect", NULL);
-		if (str == NULL || g_strcmp0(str, "true")) {
-			if (str)
-				g_free(str);
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_free(str);
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "Modified", NULL);
-		if (str != NULL) {
-			g_time_val_from_iso8601(str, &modified);
-			g_free(str);
-		}
-
-		ssid = g_key_file_get_string(keyfile,
-					services[i], "SSID", NULL);
-
-		freq = g_key_file_get_integer(keyfile, services[i],
-					"Frequency", NULL);
-		if (freq) {
-			entry = g_try_new(struct last_connected, 1);
-			if (entry == NULL) {
-				g_sequence_free(latest_list);
-				g_key_file_free(keyfile);
-				g_free(ssid);
-				return -ENOMEM;
-			}
-
-			entry->ssid = ssid;
-			entry->modified = modified;
-			entry->freq = freq;
-
-			g_sequence_insert_sorted(latest_list, entry,
-						sort_entry, NULL);
-			num_ssids++;
-		} else
-			g_free(ssid);
-
-		g_key_file_free(keyfile);
-	}
+	connman_storage_foreach_service("wifi_",
+			CONNMAN_STORAGE_FAVORITE | CONNMAN_STORAGE_AUTOCONNECT,
+			add_latest_service, latest_list);
 
-	g_strfreev(services);
+	num_ssids = g_sequence_get_length(latest_list);
 
 	num_ssids = num_ssids > max_ssids ? max_ssids : num_ssids;
 
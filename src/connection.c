@@ -202,6 +202,8 @@ static void set_vpn_routes(struct gateway_data *new_gateway,
 	if (config != NULL) {
 		int index = __connman_ipconfig_get_index(ipconfig);
 		struct get_gateway_params *params;
+		char *phy_gateway;
+		int phy_index;
 
 		config->vpn = TRUE;
 		if (peer != NULL)
@@ -217,9 +219,17 @@ static void set_vpn_routes(struct gateway_data *new_gateway,
 		params->vpn_gateway = g_strdup(gateway);
 
 		/*
-		 * Find the gateway that is serving the VPN link
+		 * Find the gateway that is serving the VPN link. The
+		 * kernel is only asked when the route mirror has no
+		 * answer, which is always the case for IPv6.
 		 */
-		__connman_inet_get_route(gateway, get_gateway_cb, params);
+		if (__connman_rtnl_get_route(gateway, &phy_index,
+						&phy_gateway) == 0) {
+			get_gateway_cb(phy_gateway, phy_index, params);
+			g_free(phy_gateway);
+		} else
+			__connman_inet_get_route(gateway, get_gateway_cb,
+								params);
 	}
 
 	if (active_gateway == NULL)
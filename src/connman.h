@@ -108,6 +108,7 @@ int __connman_log_init(const char *program, const char *debug,
 		connman_bool_t detach, connman_bool_t backtrace,
 		const char *program_name, const char *program_version);
 void __connman_log_cleanup(connman_bool_t backtrace);
+void __connman_log_dump(DBusMessageIter *array, unsigned int count);
 void __connman_log_enable(struct connman_debug_desc *start,
 					struct connman_debug_desc *stop);
 
@@ -127,6 +128,10 @@ void __connman_task_cleanup(void);
 
 #include <connman/inet.h>
 
+int __connman_inet_init(void);
+void __connman_inet_cleanup(void);
+void __connman_inet_update_ifname(int index, const char *name);
+
 char **__connman_inet_get_running_interfaces(void);
 int __connman_inet_modify_address(int cmd, int flags, int index, int family,
 				const char *address,
@@ -192,6 +197,26 @@ int __connman_inet_rtnl_addattr_l(struct nlmsghdr *n, size_t max_length,
 int __connman_inet_rtnl_addattr32(struct nlmsghdr *n, size_t maxlen,
 			int type, __u32 data);
 
+struct __connman_inet_batch;
+
+typedef void (*__connman_inet_batch_cb_t) (int err, void *user_data);
+
+struct __connman_inet_batch *__connman_inet_batch_new(void);
+void __connman_inet_batch_free(struct __connman_inet_batch *batch);
+int __connman_inet_batch_add_route(struct __connman_inet_batch *batch,
+				int cmd, int index, int family,
+				const char *host, const char *gateway,
+				unsigned char prefixlen,
+				__connman_inet_batch_cb_t callback,
+				void *user_data);
+int __connman_inet_batch_modify_address(struct __connman_inet_batch *batch,
+				int cmd, int flags, int index, int family,
+				const char *address, const char *peer,
+				unsigned char prefixlen, const char *broadcast,
+				__connman_inet_batch_cb_t callback,
+				void *user_data);
+int __connman_inet_batch_commit(struct __connman_inet_batch *batch);
+
 #include <connman/resolver.h>
 
 int __connman_resolver_init(connman_bool_t dnsproxy);
@@ -200,6 +225,9 @@ int __connman_resolvfile_append(int index, const char *domain, const char *serve
 int __connman_resolvfile_remove(int index, const char *domain, const char *server);
 int __connman_resolver_redo_servers(int index);
 
+int __connman_storage_init(unsigned int write_delay);
+void __connman_storage_cleanup(void);
+
 GKeyFile *__connman_storage_open_global(void);
 GKeyFile *__connman_storage_load_global(void);
 int __connman_storage_save_global(GKeyFile *keyfile);
@@ -208,6 +236,10 @@ void __connman_storage_delete_global(void);
 GKeyFile *__connman_storage_load_config(const char *ident);
 
 GKeyFile *__connman_storage_open_service(const char *ident);
+/*
+ * With a write delay configured, 0 only means the save was queued.
+ * Failures of the deferred write are logged when it is flushed.
+ */
 int __connman_storage_save_service(GKeyFile *keyfile, const char *ident);
 GKeyFile *__connman_storage_load_provider(const char *identifier);
 void __connman_storage_save_provider(GKeyFile *keyfile, const char *identifier);
@@ -281,13 +313,14 @@ void __connman_ipconfig_enable_ipv6(struct connman_ipconfig *ipconfig);
 int __connman_ipconfig_init(void);
 void __connman_ipconfig_cleanup(void);
 
-struct rtnl_link_stats;
+struct rtnl_link_stats64;
 
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats);
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats);
+						struct rtnl_link_stats64 *stats);
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats);
+void __connman_ipconfig_stats(int index, struct rtnl_link_stats64 *stats);
 void __connman_ipconfig_newaddr(int index, int family, const char *label,
 				unsigned char prefixlen, const char *address);
 void __connman_ipconfig_deladdr(int index, int family, const char *label,
@@ -680,10 +713,15 @@ void __connman_service_set_agent_passphrase(struct connman_service *service,
 						const char *agent_passphrase);
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_error, unsigned int tx_error,
-			unsigned int rx_dropped, unsigned int tx_dropped);
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_error, uint64_t tx_error,
+			uint64_t rx_dropped, uint64_t tx_dropped);
+void __connman_service_sample(struct connman_service *service,
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_error, uint64_t tx_error,
+			uint64_t rx_dropped, uint64_t tx_dropped);
 
 int __connman_service_counter_register(const char *counter);
 void __connman_service_counter_unregister(const char *counter);
@@ -745,6 +783,11 @@ unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
 int __connman_rtnl_request_update(void);
 int __connman_rtnl_send(const void *buf, size_t len);
+connman_bool_t __connman_rtnl_compare_subnet(int index, const char *host);
+void __connman_rtnl_address_added(int index, int family,
+				const char *address, unsigned char prefixlen);
+int __connman_rtnl_get_route(const char *dst_address, int *index,
+							char **gateway);
 
 connman_bool_t __connman_session_mode();
 void __connman_session_set_mode(connman_bool_t enable);
@@ -756,17 +799,23 @@ int __connman_session_init(void);
 void __connman_session_cleanup(void);
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
+struct connman_stats_bucket {
+	time_t start;
+	struct connman_stats_data home;
+	struct connman_stats_data roaming;
+};
+
 int __connman_stats_init(void);
 void __connman_stats_cleanup(void);
 int __connman_stats_service_register(struct connman_service *service);
@@ -778,11 +827,57 @@ int __connman_stats_get(struct connman_service *service,
 				connman_bool_t roaming,
 				struct connman_stats_data *data);
 
+int __connman_stats_query(struct connman_service *service,
+				time_t start, time_t end,
+				unsigned int interval,
+				struct connman_stats_bucket **buckets,
+				unsigned int *count);
+
 int __connman_iptables_init(void);
 void __connman_iptables_cleanup(void);
 int __connman_iptables_command(const char *format, ...)
 				__attribute__((format(printf, 1, 2)));
 int __connman_iptables_commit(const char *table_name);
+void __connman_iptables_abort(const char *table_name);
+
+struct connman_iptables_rule;
+
+struct connman_iptables_rule *__connman_iptables_rule_new(
+					const char *table_name,
+					const char *chain_name);
+void __connman_iptables_rule_free(struct connman_iptables_rule *rule);
+int __connman_iptables_rule_set_source(struct connman_iptables_rule *rule,
+				const char *address, unsigned char prefixlen);
+int __connman_iptables_rule_set_destination(
+				struct connman_iptables_rule *rule,
+				const char *address, unsigned char prefixlen);
+int __connman_iptables_rule_set_in_interface(
+				struct connman_iptables_rule *rule,
+				const char *ifname);
+int __connman_iptables_rule_set_out_interface(
+				struct connman_iptables_rule *rule,
+				const char *ifname);
+int __connman_iptables_rule_set_target(struct connman_iptables_rule *rule,
+						const char *target_name);
+int __connman_iptables_rule_append(struct connman_iptables_rule *rule);
+int __connman_iptables_rule_insert(struct connman_iptables_rule *rule);
+int __connman_iptables_rule_delete(struct connman_iptables_rule *rule);
+int __connman_iptables_rule_compare(struct connman_iptables_rule *rule);
+
+int __connman_firewall_init(void);
+void __connman_firewall_cleanup(void);
+
+struct connman_firewall_nat;
+
+struct connman_firewall_nat *__connman_firewall_nat_new(const char *address,
+						unsigned char prefixlen);
+void __connman_firewall_nat_free(struct connman_firewall_nat *nat);
+int __connman_firewall_nat_enable(struct connman_firewall_nat *nat,
+						const char *interface);
+int __connman_firewall_nat_disable(struct connman_firewall_nat *nat);
+int __connman_firewall_flush_nat(void);
+int __connman_firewall_commit(void);
+void __connman_firewall_abort(void);
 
 int __connman_dnsproxy_init(void);
 void __connman_dnsproxy_cleanup(void);
@@ -791,6 +886,7 @@ void __connman_dnsproxy_remove_listener(int index);
 int __connman_dnsproxy_append(int index, const char *domain, const char *server);
 int __connman_dnsproxy_remove(int index, const char *domain, const char *server);
 void __connman_dnsproxy_flush(void);
+void __connman_dnsproxy_list_servers(DBusMessageIter *iter);
 
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
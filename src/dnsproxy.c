@@ -23,6 +23,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -32,9 +33,9 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <resolv.h>
-#include <gweb/gresolv.h>
 
 #include <glib.h>
 
@@ -95,6 +96,13 @@ struct server_data {
 	gboolean enabled;
 	gboolean connected;
 	struct partial_reply *incoming_reply;
+	int srtt;
+	int rttvar;
+	unsigned int samples;
+	unsigned int failures;
+	unsigned int queries;
+	unsigned int replies;
+	unsigned int timeouts;
 };
 
 struct request_data {
@@ -108,7 +116,9 @@ struct request_data {
 	guint16 srcid;
 	guint16 dstid;
 	guint16 altid;
-	guint timeout;
+	GList *list_link;
+	GList *wheel_link;
+	unsigned int wheel_slot;
 	guint watch;
 	guint numserv;
 	guint numresp;
@@ -119,6 +129,18 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	gboolean append_domain;
+	gboolean cache_checked;
+	gboolean prefetch;
+	GSList *servers;
+	GList *fanout_link;
+	gint64 fanout_at;
+};
+
+/* A server the request was sent to */
+struct request_server {
+	struct server_data *server;
+	gint64 sent;
+	gboolean replied;
 };
 
 struct listener_data {
@@ -133,19 +155,47 @@ struct cache_data {
 	time_t inserted;
 	time_t valid_until;
 	time_t cache_until;
+	time_t stale_until;
+	gboolean prefetched;
 	int timeout;
 	uint16_t type;
 	uint16_t answers;
 	unsigned int data_len;
 	unsigned char *data; /* contains DNS header + body */
+	struct cache_entry *entry;
+	unsigned int heap_index;
 };
 
+/*
+ * One cached answer per name, query type and class. The key is made
+ * by cache_key(), name points to the wire format name inside it.
+ */
 struct cache_entry {
 	char *key;
+	const char *name;
+	uint16_t type;
+	uint16_t class;
 	int want_refresh;
 	int hits;
-	struct cache_data *ipv4;
-	struct cache_data *ipv6;
+	time_t hits_decayed;
+	unsigned int size;
+	GList *lru_link;
+	struct cache_data *data;
+};
+
+/*
+ * Negative answers (NXDOMAIN and NODATA) are cached per name, query
+ * type and class as described in RFC 2308. The whole answer up to the
+ * end of the authority section is kept so that the SOA record can be
+ * returned to the client.
+ */
+struct neg_cache_entry {
+	char *key;
+	time_t inserted;
+	time_t cache_until;
+	GList *lru_link;
+	unsigned int data_len;
+	unsigned char *data; /* contains TCP length, DNS header + body */
 };
 
 struct domain_question {
@@ -171,26 +221,222 @@ struct domain_rr {
  */
 #define MIN_CACHE_TTL (30)
 
+/* Room for "type/class/" in front of the name in a cache key */
+#define CACHE_KEY_MAX (12 + NS_MAXDNAME + 1)
+
+/*
+ * Cached answers are sent without EDNS0, so a UDP client only gets
+ * them if they fit into a plain DNS message. Bigger ones are sent
+ * truncated to make the client ask again over TCP.
+ */
+#define DNS_UDP_MAX 512
+
 /*
  * We limit the cache size to some sane value so that cached data does
  * not occupy too much memory. Each cached entry occupies on average
  * about 100 bytes memory (depending on DNS name length).
  * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * Both the amount of memory (DNSCacheSize) and the number of cached
+ * names (DNSCacheEntries) can be set in main.conf. When either limit
+ * is reached, the least recently used names are evicted.
+ */
+static unsigned int cache_max_size;
+static unsigned int cache_max_entries;
+
+/*
+ * Popular entries are refreshed in the background once they have
+ * lived cache_prefetch percent of their lifetime, so that they do not
+ * expire while in use. Expired responses are kept for cache_stale_time
+ * seconds more and are served with STALE_TTL if all upstream servers
+ * fail to answer. The hit count used for popularity is halved every
+ * HITS_DECAY_PERIOD seconds.
  */
-#define MAX_CACHE_SIZE 256
+static unsigned int cache_prefetch;
+static unsigned int cache_stale_time;
+
+/*
+ * The cache can be saved to CACHE_SNAPSHOT_FILE on shutdown and every
+ * CACHE_SNAPSHOT_INTERVAL seconds, so that a restart does not begin
+ * with an empty cache. The file is mapped and its records are used
+ * in place. It is only restored if the default service is the one
+ * the snapshot was taken on, as the cache is invalidated when the
+ * default service changes.
+ */
+#define CACHE_SNAPSHOT_FILE STORAGEDIR "/dnsproxy.cache"
+#define CACHE_SNAPSHOT_MAGIC 0x434e4e44 /* "DNNC" */
+#define CACHE_SNAPSHOT_VERSION 1
+#define CACHE_SNAPSHOT_INTERVAL (15 * 60)
+#define CACHE_SNAPSHOT_IDENT_MAX 128
+
+struct cache_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t saved;
+	uint32_t count;
+	uint32_t reserved;
+	char ident[CACHE_SNAPSHOT_IDENT_MAX];
+};
+
+/*
+ * Each record is followed by the wire format name (with its
+ * terminating zero) and the cached packet, padded to 8 bytes. Times
+ * are wall clock so they stay meaningful over a restart.
+ */
+struct cache_snapshot_record {
+	uint32_t record_len;
+	uint16_t type;
+	uint16_t class;
+	int64_t inserted;
+	int64_t valid_until;
+	int64_t cache_until;
+	int32_t timeout;
+	int32_t hits;
+	uint16_t answers;
+	uint16_t name_len;
+	uint32_t data_len;
+};
+
+#define CACHE_SNAPSHOT_ALIGN(len) (((len) + 7) & ~7)
+
+static gboolean cache_snapshot_enabled;
+static GMappedFile *cache_snapshot;
+static gboolean cache_snapshot_ready;
+static char *cache_service_ident;
+static guint cache_snapshot_timer;
+static unsigned int cache_snapshot_insertions;
+
+#define PREFETCH_MIN_HITS 3
+#define HITS_DECAY_PERIOD 300
+#define STALE_TTL 30
 
 static int cache_size;
+static unsigned int cache_bytes;
 static GHashTable *cache;
 static int cache_refcount;
+
+/*
+ * The entries are kept in least recently used order (head is the most
+ * recently used one) and every cached response is put into a min-heap
+ * ordered by its expiry time. This way both eviction and expiry only
+ * touch the entries that are actually removed.
+ */
+static GQueue cache_lru = G_QUEUE_INIT;
+static struct cache_data **cache_heap;
+static unsigned int cache_heap_len;
+static unsigned int cache_heap_alloc;
+
+static struct {
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int insertions;
+	unsigned int evictions;
+	unsigned int expirations;
+	unsigned int prefetches;
+	unsigned int stale;
+	unsigned int neg_hits;
+	unsigned int neg_insertions;
+	unsigned int neg_evictions;
+} cache_stats;
+
+static GHashTable *neg_cache;
+static GQueue neg_cache_lru = G_QUEUE_INIT;
+static unsigned int neg_cache_bytes;
+static unsigned int neg_cache_max_size;
 static GSList *server_list = NULL;
-static GSList *request_list = NULL;
 static GHashTable *listener_table = NULL;
 static time_t next_refresh;
 
-static guint16 get_id()
+/*
+ * UDP queries are read from the listener socket in batches with
+ * recvmmsg() into a preallocated set of buffers, and the answers
+ * found in the cache are sent back with a single sendmmsg(). Cached
+ * answers that do not fit into a reply buffer are sent directly.
+ */
+#define UDP_BATCH_SIZE 16
+#define UDP_BATCH_ROUNDS 4
+#define UDP_REQUEST_SIZE 768
+#define UDP_REPLY_SIZE 2048
+
+struct udp_batch {
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_in6 addr[UDP_BATCH_SIZE];
+	unsigned char buf[UDP_BATCH_SIZE][UDP_REQUEST_SIZE];
+	int replies;
+	struct mmsghdr reply_msgs[UDP_BATCH_SIZE];
+	struct iovec reply_iov[UDP_BATCH_SIZE];
+	struct sockaddr_in6 reply_addr[UDP_BATCH_SIZE];
+	unsigned char reply_buf[UDP_BATCH_SIZE][2 + UDP_REPLY_SIZE];
+};
+
+static struct udp_batch *udp_batch;
+static gboolean udp_batch_disabled;
+
+/*
+ * Outstanding requests are kept in request_list in arrival order and
+ * indexed by both of their upstream ids (dstid and altid) in
+ * request_ids, so that replies are matched without a list walk.
+ */
+static GQueue request_list = G_QUEUE_INIT;
+static GHashTable *request_ids = NULL;
+
+/*
+ * Request timeouts are driven by a single timer wheel with one second
+ * resolution instead of a timer per request. The wheel must have more
+ * slots than the longest timeout in seconds.
+ */
+#define REQUEST_WHEEL_SLOTS 64
+
+static GQueue request_wheel[REQUEST_WHEEL_SLOTS];
+static unsigned int request_wheel_pos;
+static unsigned int request_wheel_count;
+static guint request_wheel_timer;
+
+/*
+ * Every server keeps a smoothed round trip time and its variance
+ * (scaled by 8 and 4 like in TCP, in milliseconds) and the number of
+ * consecutive failures. A query is first sent to the best one, or
+ * the best two if the best is not known to work, and only fans out
+ * to the remaining servers if no reply comes within the retransmit
+ * timeout of the best server. Requests waiting for the fan out are
+ * kept in fanout_queue in deadline order, driven by a single timer.
+ */
+#define SERVER_RTT_INITIAL 200
+#define SERVER_FAILURE_SHIFT_MAX 5
+#define FANOUT_TIMEOUT_MIN 50
+#define FANOUT_TIMEOUT_MAX 1000
+
+static GQueue fanout_queue = G_QUEUE_INIT;
+static guint fanout_timer;
+
+static guint16 get_id(void)
+{
+	guint16 id;
+	int i;
+
+	/*
+	 * Pick an id that is not used by any outstanding request. We
+	 * give up after a while and use the last one, which can only
+	 * happen if tens of thousands of requests are in flight.
+	 */
+	for (i = 0; i < 64; i++) {
+		id = random();
+
+		if (request_ids == NULL || g_hash_table_lookup(request_ids,
+						GUINT_TO_POINTER(id)) == NULL)
+			break;
+	}
+
+	return id;
+}
+
+static void request_alloc_ids(struct request_data *req)
 {
-	return random();
+	req->dstid = get_id();
+
+	do {
+		req->altid = get_id();
+	} while (req->altid == req->dstid);
 }
 
 static int protocol_offset(int protocol)
@@ -231,278 +477,740 @@ static time_t round_down_ttl(time_t end_time, int ttl)
 
 static struct request_data *find_request(guint16 id)
 {
-	GSList *list;
+	if (request_ids == NULL)
+		return NULL;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	return g_hash_table_lookup(request_ids, GUINT_TO_POINTER(id));
+}
 
-		if (req->dstid == id || req->altid == id)
-			return req;
-	}
+static void request_insert(struct request_data *req)
+{
+	g_queue_push_tail(&request_list, req);
+	req->list_link = request_list.tail;
 
-	return NULL;
+	g_hash_table_replace(request_ids, GUINT_TO_POINTER(req->dstid), req);
+	g_hash_table_replace(request_ids, GUINT_TO_POINTER(req->altid), req);
 }
 
-static struct server_data *find_server(int index,
-					const char *server,
-						int protocol)
+static void request_remove(struct request_data *req)
 {
-	GSList *list;
+	if (req->list_link == NULL)
+		return;
 
-	DBG("index %d server %s proto %d", index, server, protocol);
+	g_queue_delete_link(&request_list, req->list_link);
+	req->list_link = NULL;
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+	if (find_request(req->dstid) == req)
+		g_hash_table_remove(request_ids, GUINT_TO_POINTER(req->dstid));
 
-		if (index < 0 && data->index < 0 &&
-				g_str_equal(data->server, server) == TRUE &&
-				data->protocol == protocol)
-			return data;
+	if (find_request(req->altid) == req)
+		g_hash_table_remove(request_ids, GUINT_TO_POINTER(req->altid));
+}
 
-		if (index < 0 ||
-				data->index < 0 || data->server == NULL)
-			continue;
+static void request_clear_timeout(struct request_data *req)
+{
+	if (req->wheel_link == NULL)
+		return;
 
-		if (data->index == index &&
-				g_str_equal(data->server, server) == TRUE &&
-				data->protocol == protocol)
-			return data;
-	}
+	g_queue_delete_link(&request_wheel[req->wheel_slot], req->wheel_link);
+	req->wheel_link = NULL;
 
-	return NULL;
+	request_wheel_count--;
 }
 
-/* we can keep using the same resolve's */
-static GResolv *ipv4_resolve;
-static GResolv *ipv6_resolve;
+static unsigned int server_rto(struct server_data *server)
+{
+	if (server->samples == 0)
+		return SERVER_RTT_INITIAL;
+
+	return (server->srtt >> 3) + server->rttvar;
+}
 
-static void dummy_resolve_func(GResolvResultStatus status,
-					char **results, gpointer user_data)
+static unsigned int server_score(struct server_data *server)
 {
+	return server_rto(server) << MIN(server->failures,
+					SERVER_FAILURE_SHIFT_MAX);
 }
 
-/*
- * Refresh a DNS entry, but also age the hit count a bit */
-static void refresh_dns_entry(struct cache_entry *entry, char *name)
+static gint server_compare(gconstpointer a, gconstpointer b)
 {
-	int age = 1;
+	unsigned int score_a = server_score((struct server_data *) a);
+	unsigned int score_b = server_score((struct server_data *) b);
 
-	if (ipv4_resolve == NULL) {
-		ipv4_resolve = g_resolv_new(0);
-		g_resolv_set_address_family(ipv4_resolve, AF_INET);
-		g_resolv_add_nameserver(ipv4_resolve, "127.0.0.1", 53, 0);
-	}
+	if (score_a < score_b)
+		return -1;
 
-	if (ipv6_resolve == NULL) {
-		ipv6_resolve = g_resolv_new(0);
-		g_resolv_set_address_family(ipv6_resolve, AF_INET6);
-		g_resolv_add_nameserver(ipv6_resolve, "127.0.0.1", 53, 0);
-	}
+	return score_a > score_b;
+}
 
-	if (entry->ipv4 == NULL) {
-		DBG("Refresing A record for %s", name);
-		g_resolv_lookup_hostname(ipv4_resolve, name,
-					dummy_resolve_func, NULL);
-		age = 4;
-	}
+static void server_rtt_sample(struct server_data *server, int rtt)
+{
+	int delta;
 
-	if (entry->ipv6 == NULL) {
-		DBG("Refresing AAAA record for %s", name);
-		g_resolv_lookup_hostname(ipv6_resolve, name,
-					dummy_resolve_func, NULL);
-		age = 4;
+	if (server->samples++ == 0) {
+		server->srtt = rtt << 3;
+		server->rttvar = rtt << 1;
+		return;
 	}
 
-	entry->hits -= age;
-	if (entry->hits < 0)
-		entry->hits = 0;
-}
+	delta = rtt - (server->srtt >> 3);
+	server->srtt += delta;
 
-static int dns_name_length(unsigned char *buf)
-{
-	if ((buf[0] & NS_CMPRSFLGS) == NS_CMPRSFLGS) /* compressed name */
-		return 2;
-	return strlen((char *)buf);
+	if (delta < 0)
+		delta = -delta;
+
+	server->rttvar += delta - (server->rttvar >> 2);
 }
 
-static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
+static void request_server_sent(struct request_data *req,
+					struct server_data *server)
 {
-	unsigned char *c;
-	uint32_t *i;
-	uint16_t *w;
-	int l;
+	struct request_server *rs;
 
-	/* skip the header */
-	c = buf + 12;
-	len -= 12;
+	server->queries++;
 
-	/* skip the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c);
-	c += l;
-	len -= l;
-	c += 4;
-	len -= 4;
+	rs = g_try_new0(struct request_server, 1);
+	if (rs == NULL)
+		return;
 
-	/* now we get the answer records */
+	rs->server = server;
+	rs->sent = g_get_monotonic_time();
 
-	while (len > 0) {
-		/* first a name */
-		l = dns_name_length(c);
-		c += l;
-		len -= l;
-		if (len < 0)
-			break;
-		/* then type + class, 2 bytes each */
-		c += 4;
-		len -= 4;
-		if (len < 0)
-			break;
+	req->servers = g_slist_prepend(req->servers, rs);
+}
 
-		/* now the 4 byte TTL field */
-		i = (uint32_t *)c;
-		*i = htonl(new_ttl);
-		c += 4;
-		len -= 4;
-		if (len < 0)
-			break;
+static struct request_server *request_server_find(struct request_data *req,
+						struct server_data *server)
+{
+	GSList *list;
 
-		/* now the 2 byte rdlen field */
-		w = (uint16_t *)c;
-		c += ntohs(*w) + 2;
-		len -= ntohs(*w) + 2;
+	for (list = req->servers; list; list = list->next) {
+		struct request_server *rs = list->data;
+
+		if (rs->server == server)
+			return rs;
 	}
+
+	return NULL;
 }
 
-static void send_cached_response(int sk, unsigned char *buf, int len,
-				const struct sockaddr *to, socklen_t tolen,
-				int protocol, int id, uint16_t answers, int ttl)
+/*
+ * Only the first reply from a server is measured. Error replies
+ * (SERVFAIL and REFUSED) count as failures, as a server that quickly
+ * refuses to answer is not a fast server.
+ */
+static void request_server_reply(struct request_data *req,
+				struct server_data *server, int rcode)
 {
-	struct domain_hdr *hdr;
-	unsigned char *ptr = buf;
-	int err, offset, dns_len, adj_len = len - 2;
+	struct request_server *rs;
+	gint64 rtt;
 
-	/*
-	 * The cached packet contains always the TCP offset (two bytes)
-	 * so skip them for UDP.
-	 */
-	switch (protocol) {
-	case IPPROTO_UDP:
-		ptr += 2;
-		len -= 2;
-		dns_len = len;
-		offset = 0;
-		break;
-	case IPPROTO_TCP:
-		offset = 2;
-		dns_len = ptr[0] * 256 + ptr[1];
-		break;
-	default:
+	rs = request_server_find(req, server);
+	if (rs == NULL || rs->replied == TRUE)
 		return;
-	}
 
-	if (len < 12)
+	rs->replied = TRUE;
+	server->replies++;
+
+	if (rcode == 2 || rcode == 5) {
+		server->failures++;
 		return;
+	}
 
-	hdr = (void *) (ptr + offset);
+	rtt = (g_get_monotonic_time() - rs->sent) / 1000;
 
-	hdr->id = id;
-	hdr->qr = 1;
-	hdr->rcode = 0;
-	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
-	hdr->arcount = 0;
+	server_rtt_sample(server, MIN(rtt, G_MAXINT >> 3));
+	server->failures = 0;
 
-	/* if this is a negative reply, we are authorative */
-	if (answers == 0)
-		hdr->aa = 1;
-	else
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+	DBG("server %s rtt %d srtt %d rttvar %d", server->server, (int) rtt,
+				server->srtt >> 3, server->rttvar >> 2);
+}
+
+/*
+ * If account is set, the servers that did not reply to the request
+ * count as failed if they had enough time to do so. Otherwise they
+ * just lost the race.
+ */
+static void request_servers_release(struct request_data *req,
+						gboolean account)
+{
+	gint64 now = g_get_monotonic_time();
+	GSList *list;
 
-	DBG("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
-		sk, hdr->id, answers, ptr, len, dns_len);
+	for (list = req->servers; list; list = list->next) {
+		struct request_server *rs = list->data;
+		struct server_data *server = rs->server;
 
-	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
-	if (err < 0) {
-		connman_error("Cannot send cached DNS response: %s",
-				strerror(errno));
-		return;
+		if (account == TRUE && rs->replied == FALSE &&
+				(now - rs->sent) / 1000 > server_rto(server)) {
+			server->failures++;
+			server->timeouts++;
+		}
+
+		g_free(rs);
 	}
 
-	if (err != len || (dns_len != (len - 2) && protocol == IPPROTO_TCP) ||
-				(dns_len != len && protocol == IPPROTO_UDP))
-		DBG("Packet length mismatch, sent %d wanted %d dns %d",
-			err, len, dns_len);
+	g_slist_free(req->servers);
+	req->servers = NULL;
 }
 
-static void send_response(int sk, unsigned char *buf, int len,
-				const struct sockaddr *to, socklen_t tolen,
-				int protocol)
+static void request_cancel_fanout(struct request_data *req)
 {
-	struct domain_hdr *hdr;
-	int err, offset = protocol_offset(protocol);
-
-	DBG("sk %d", sk);
-
-	if (offset < 0)
+	if (req->fanout_link == NULL)
 		return;
 
-	if (len < 12)
-		return;
+	g_queue_delete_link(&fanout_queue, req->fanout_link);
+	req->fanout_link = NULL;
+}
 
-	hdr = (void *) (buf + offset);
+static void destroy_request_data(struct request_data *req)
+{
+	request_clear_timeout(req);
+	request_cancel_fanout(req);
+	request_servers_release(req, TRUE);
+	request_remove(req);
 
-	DBG("id 0x%04x qr %d opcode %d", hdr->id, hdr->qr, hdr->opcode);
+	g_free(req->resp);
+	g_free(req->request);
+	g_free(req->name);
+	g_free(req);
+}
 
-	hdr->qr = 1;
-	hdr->rcode = 2;
+static void request_timeout(struct request_data *req);
+static gboolean cache_send_stale(struct request_data *req);
 
-	hdr->ancount = 0;
-	hdr->nscount = 0;
-	hdr->arcount = 0;
+static gboolean request_wheel_tick(gpointer user_data)
+{
+	GQueue *slot;
+	struct request_data *req;
 
-	err = sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
-	if (err < 0) {
-		connman_error("Failed to send DNS response to %d: %s",
-				sk, strerror(errno));
-		return;
+	request_wheel_pos = (request_wheel_pos + 1) % REQUEST_WHEEL_SLOTS;
+	slot = &request_wheel[request_wheel_pos];
+
+	while ((req = g_queue_peek_head(slot)) != NULL) {
+		request_clear_timeout(req);
+		request_timeout(req);
 	}
+
+	if (request_wheel_count > 0)
+		return TRUE;
+
+	request_wheel_timer = 0;
+
+	return FALSE;
 }
 
-static gboolean request_timeout(gpointer user_data)
+static void request_set_timeout(struct request_data *req,
+						unsigned int seconds)
 {
-	struct request_data *req = user_data;
-	struct listener_data *ifdata;
+	unsigned int slot;
 
-	DBG("id 0x%04x", req->srcid);
+	request_clear_timeout(req);
 
-	if (req == NULL)
-		return FALSE;
+	if (seconds == 0)
+		seconds = 1;
+	else if (seconds >= REQUEST_WHEEL_SLOTS)
+		seconds = REQUEST_WHEEL_SLOTS - 1;
 
-	ifdata = req->ifdata;
+	slot = (request_wheel_pos + seconds) % REQUEST_WHEEL_SLOTS;
 
-	request_list = g_slist_remove(request_list, req);
-	req->numserv--;
+	g_queue_push_tail(&request_wheel[slot], req);
+	req->wheel_link = request_wheel[slot].tail;
+	req->wheel_slot = slot;
 
-	if (req->resplen > 0 && req->resp != NULL) {
-		int sk, err;
+	request_wheel_count++;
 
-		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
+	if (request_wheel_timer == 0)
+		request_wheel_timer = g_timeout_add_seconds(1,
+						request_wheel_tick, NULL);
+}
 
-		err = sendto(sk, req->resp, req->resplen, MSG_NOSIGNAL,
-						&req->sa, req->sa_len);
-		if (err < 0)
-			return FALSE;
-	} else if (req->request && req->numserv == 0) {
-		struct domain_hdr *hdr;
+static int request_fanout(struct request_data *req);
 
-		if (req->protocol == IPPROTO_TCP) {
-			hdr = (void *) (req->request + 2);
-			hdr->id = req->srcid;
-			send_response(req->client_sk, req->request,
-				req->request_len, NULL, 0, IPPROTO_TCP);
+static gboolean fanout_expired(gpointer user_data);
 
-		} else if (req->protocol == IPPROTO_UDP) {
-			int sk;
+static void fanout_arm(void)
+{
+	struct request_data *req;
+	gint64 delay;
+
+	if (fanout_timer > 0) {
+		g_source_remove(fanout_timer);
+		fanout_timer = 0;
+	}
+
+	req = g_queue_peek_head(&fanout_queue);
+	if (req == NULL)
+		return;
+
+	delay = (req->fanout_at - g_get_monotonic_time() + 999) / 1000;
+	if (delay < 0)
+		delay = 0;
+
+	fanout_timer = g_timeout_add(delay, fanout_expired, NULL);
+}
+
+static gboolean fanout_expired(gpointer user_data)
+{
+	gint64 now = g_get_monotonic_time();
+	struct request_data *req;
+
+	fanout_timer = 0;
+
+	while ((req = g_queue_peek_head(&fanout_queue)) != NULL &&
+						req->fanout_at <= now) {
+		request_cancel_fanout(req);
+
+		DBG("id 0x%04x no reply yet, sent to %d more servers",
+					req->srcid, request_fanout(req));
+	}
+
+	fanout_arm();
+
+	return FALSE;
+}
+
+static void request_schedule_fanout(struct request_data *req,
+					struct server_data *best)
+{
+	unsigned int timeout;
+	GList *link;
+
+	request_cancel_fanout(req);
+
+	timeout = server_rto(best);
+	if (timeout < FANOUT_TIMEOUT_MIN)
+		timeout = FANOUT_TIMEOUT_MIN;
+	else if (timeout > FANOUT_TIMEOUT_MAX)
+		timeout = FANOUT_TIMEOUT_MAX;
+
+	req->fanout_at = g_get_monotonic_time() + timeout * 1000;
+
+	/* Most requests go to the end, so search from there */
+	for (link = fanout_queue.tail; link; link = link->prev) {
+		struct request_data *other = link->data;
+
+		if (other->fanout_at <= req->fanout_at)
+			break;
+	}
+
+	if (link == NULL) {
+		g_queue_push_head(&fanout_queue, req);
+		req->fanout_link = fanout_queue.head;
+
+		fanout_arm();
+		return;
+	}
+
+	g_queue_insert_after(&fanout_queue, link, req);
+	req->fanout_link = link->next;
+}
+
+static struct server_data *find_server(int index,
+					const char *server,
+						int protocol)
+{
+	GSList *list;
+
+	DBG("index %d server %s proto %d", index, server, protocol);
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+
+		if (index < 0 && data->index < 0 &&
+				g_str_equal(data->server, server) == TRUE &&
+				data->protocol == protocol)
+			return data;
+
+		if (index < 0 ||
+				data->index < 0 || data->server == NULL)
+			continue;
+
+		if (data->index == index &&
+				g_str_equal(data->server, server) == TRUE &&
+				data->protocol == protocol)
+			return data;
+	}
+
+	return NULL;
+}
+
+static gboolean resolv(struct request_data *req,
+				gpointer request, gpointer name);
+
+static int cache_key(char *key, unsigned int size, const char *question,
+					uint16_t type, uint16_t class)
+{
+	return snprintf(key, size, "%u/%u/%s", type, class, question);
+}
+
+/*
+ * Meta types (OPT, TSIG, zone transfers, ANY etc.) do not name a
+ * record set that could be cached.
+ */
+static gboolean cache_type_is_cacheable(uint16_t type)
+{
+	if (type == 0 || type == 41)
+		return FALSE;
+
+	if (type >= 128 && type <= 255)
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Find the question of a client request. Returns the wire format
+ * name and fills type and class, or NULL if the request has no
+ * question of reasonable length.
+ */
+static char *request_question(gpointer request, unsigned int len,
+				int protocol, uint16_t *type, uint16_t *class)
+{
+	struct domain_question *q;
+	char *question;
+	int offset;
+	size_t qlen;
+
+	offset = protocol_offset(protocol);
+	if (request == NULL || offset < 0 || len < (unsigned int) offset + 12)
+		return NULL;
+
+	question = (char *) request + offset + 12;
+	len -= offset + 12;
+
+	qlen = strnlen(question, len);
+	if (qlen > NS_MAXDNAME || qlen + 1 + sizeof(*q) > len)
+		return NULL;
+
+	q = (void *) (question + qlen + 1);
+	*type = ntohs(q->type);
+	*class = ntohs(q->class);
+
+	return question;
+}
+
+/* turn a DNS name into a hostname with dots */
+static void cache_key_to_hostname(const char *key, char *name,
+							unsigned int size)
+{
+	char *c;
+
+	strncpy(name, key[0] ? key + 1 : key, size - 1);
+	name[size - 1] = '\0';
+
+	c = name;
+	while (*c) {
+		int jump = key[c - name];
+
+		c += jump;
+		if (c >= name + size - 1 || *c == '\0')
+			break;
+
+		*c++ = '.';
+	}
+}
+
+/*
+ * Send a query for the cached name directly to the upstream servers,
+ * bypassing the cache. The answer only updates the cache and is not
+ * forwarded to anybody.
+ */
+static int cache_send_query(struct cache_entry *entry)
+{
+	unsigned char buf[12 + NS_MAXDNAME + 1 + 4];
+	struct domain_hdr *hdr = (void *) buf;
+	struct domain_question *q;
+	struct request_data *req;
+	char name[NS_MAXDNAME + 1];
+	unsigned int keylen, len;
+
+	keylen = strlen(entry->name) + 1;
+	len = sizeof(*hdr) + keylen + sizeof(*q);
+	if (len > sizeof(buf))
+		return -EINVAL;
+
+	cache_key_to_hostname(entry->name, name, sizeof(name));
+
+	req = g_try_new0(struct request_data, 1);
+	if (req == NULL)
+		return -ENOMEM;
+
+	request_alloc_ids(req);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->rd = 1;
+	hdr->qdcount = htons(1);
+	buf[0] = req->dstid & 0xff;
+	buf[1] = req->dstid >> 8;
+
+	memcpy(buf + sizeof(*hdr), entry->name, keylen);
+	q = (void *) (buf + sizeof(*hdr) + keylen);
+	q->type = htons(entry->type);
+	q->class = htons(entry->class);
+
+	req->protocol = IPPROTO_UDP;
+	req->prefetch = TRUE;
+	req->cache_checked = TRUE;
+	req->request_len = len;
+	req->request = g_try_malloc(len);
+	req->name = g_strdup(name);
+	if (req->request == NULL) {
+		destroy_request_data(req);
+		return -ENOMEM;
+	}
+	memcpy(req->request, buf, len);
+
+	DBG("name %s type %d id 0x%04x", name, entry->type, req->dstid);
+
+	resolv(req, req->request, req->name);
+	if (req->numserv == 0) {
+		destroy_request_data(req);
+		return -EIO;
+	}
+
+	request_set_timeout(req, 5);
+	request_insert(req);
+
+	return 0;
+}
+
+/*
+ * Refresh a DNS entry, but also age the hit count a bit */
+static void refresh_dns_entry(struct cache_entry *entry)
+{
+	int age = 1;
+
+	if (entry->data == NULL) {
+		DBG("Refreshing %s", entry->key);
+		cache_send_query(entry);
+		age = 4;
+	}
+
+	entry->hits -= age;
+	if (entry->hits < 0)
+		entry->hits = 0;
+}
+
+/*
+ * Rewrite the TTL of every resource record after the question
+ * section to new_ttl. buf points to the DNS header.
+ */
+static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
+{
+	unsigned char *c, *end = buf + len;
+	uint32_t ttl = htonl(new_ttl);
+	int l;
+
+	if (len < 12)
+		return;
+
+	/* skip the header */
+	c = buf + 12;
+
+	/* skip the query, which is a name and 2 16 bit words */
+	l = dn_skipname(c, end);
+	if (l < 0)
+		return;
+	c += l + 4;
+
+	/* now we get the resource records */
+	while (c < end) {
+		uint16_t rdlen;
+
+		/* first a name */
+		l = dn_skipname(c, end);
+		if (l < 0)
+			break;
+		c += l;
+
+		/* type + class, TTL and rdlen */
+		if (c + sizeof(struct domain_rr) > end)
+			break;
+
+		/* then type + class, 2 bytes each */
+		c += 4;
+
+		/* now the 4 byte TTL field */
+		memcpy(c, &ttl, 4);
+		c += 4;
+
+		/* now the 2 byte rdlen field */
+		rdlen = c[0] << 8 | c[1];
+		c += 2 + rdlen;
+	}
+}
+
+/*
+ * Patch the cached packet in buf for the client and return the
+ * length of the data starting at *out that should be sent. An answer
+ * too big for a UDP client is cut down to the question with TC set,
+ * so that the client retries over TCP.
+ */
+static int prepare_cached_response(unsigned char *buf, int len,
+				int protocol, int id, uint16_t answers,
+				int ttl, unsigned char **out)
+{
+	struct domain_hdr *hdr;
+	unsigned char *ptr = buf;
+	int offset, dns_len, adj_len = len - 2, qlen;
+
+	/*
+	 * The cached packet contains always the TCP offset (two bytes)
+	 * so skip them for UDP.
+	 */
+	switch (protocol) {
+	case IPPROTO_UDP:
+		ptr += 2;
+		len -= 2;
+		dns_len = len;
+		offset = 0;
+		break;
+	case IPPROTO_TCP:
+		offset = 2;
+		dns_len = ptr[0] * 256 + ptr[1];
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (len < 12)
+		return -EINVAL;
+
+	hdr = (void *) (ptr + offset);
+
+	hdr->id = id;
+	hdr->qr = 1;
+	hdr->tc = 0;
+	hdr->rcode = 0;
+	hdr->ancount = htons(answers);
+	hdr->nscount = 0;
+	hdr->arcount = 0;
+
+	if (protocol == IPPROTO_UDP && len > DNS_UDP_MAX) {
+		qlen = dn_skipname(ptr + 12, ptr + len);
+		if (qlen < 0 || 12 + qlen + 4 > len)
+			return -EINVAL;
+
+		hdr->tc = 1;
+		hdr->ancount = 0;
+		len = dns_len = 12 + qlen + 4;
+	} else if (answers == 0) {
+		/* if this is a negative reply, we are authorative */
+		hdr->aa = 1;
+	} else
+		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+
+	DBG("id 0x%04x answers %d ptr %p length %d dns %d",
+		hdr->id, answers, ptr, len, dns_len);
+
+	if ((dns_len != (len - 2) && protocol == IPPROTO_TCP) ||
+				(dns_len != len && protocol == IPPROTO_UDP))
+		DBG("Packet length mismatch, wanted %d dns %d", len, dns_len);
+
+	*out = ptr;
+
+	return len;
+}
+
+static void send_cached_response(int sk, unsigned char *buf, int len,
+				const struct sockaddr *to, socklen_t tolen,
+				int protocol, int id, uint16_t answers, int ttl)
+{
+	unsigned char *ptr;
+	int err;
+
+	len = prepare_cached_response(buf, len, protocol, id, answers,
+								ttl, &ptr);
+	if (len < 0)
+		return;
+
+	DBG("sk %d", sk);
+
+	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
+	if (err < 0) {
+		connman_error("Cannot send cached DNS response: %s",
+				strerror(errno));
+		return;
+	}
+
+	if (err != len)
+		DBG("Packet length mismatch, sent %d wanted %d", err, len);
+}
+
+static void send_response(int sk, unsigned char *buf, int len,
+				const struct sockaddr *to, socklen_t tolen,
+				int protocol)
+{
+	struct domain_hdr *hdr;
+	int err, offset = protocol_offset(protocol);
+
+	DBG("sk %d", sk);
+
+	if (offset < 0)
+		return;
+
+	if (len < 12)
+		return;
+
+	hdr = (void *) (buf + offset);
+
+	DBG("id 0x%04x qr %d opcode %d", hdr->id, hdr->qr, hdr->opcode);
+
+	hdr->qr = 1;
+	hdr->rcode = 2;
+
+	hdr->ancount = 0;
+	hdr->nscount = 0;
+	hdr->arcount = 0;
+
+	err = sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+	if (err < 0) {
+		connman_error("Failed to send DNS response to %d: %s",
+				sk, strerror(errno));
+		return;
+	}
+}
+
+static void request_timeout(struct request_data *req)
+{
+	struct listener_data *ifdata;
+
+	DBG("id 0x%04x", req->srcid);
+
+	if (req->prefetch == TRUE) {
+		destroy_request_data(req);
+		return;
+	}
+
+	ifdata = req->ifdata;
+
+	request_remove(req);
+	req->numserv--;
+
+	if (req->resplen > 0 && req->resp != NULL) {
+		int sk, err;
+
+		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
+
+		err = sendto(sk, req->resp, req->resplen, MSG_NOSIGNAL,
+						&req->sa, req->sa_len);
+		if (err < 0)
+			DBG("Cannot send response, errno %d/%s",
+					errno, strerror(errno));
+	} else if (cache_send_stale(req) == TRUE) {
+		DBG("id 0x%04x answered from stale cache", req->srcid);
+	} else if (req->request && req->numserv == 0) {
+		struct domain_hdr *hdr;
+
+		if (req->protocol == IPPROTO_TCP) {
+			hdr = (void *) (req->request + 2);
+			hdr->id = req->srcid;
+			send_response(req->client_sk, req->request,
+				req->request_len, NULL, 0, IPPROTO_TCP);
+
+		} else if (req->protocol == IPPROTO_UDP) {
+			int sk;
 
 			hdr = (void *) (req->request);
 			hdr->id = req->srcid;
@@ -513,10 +1221,7 @@ static gboolean request_timeout(gpointer user_data)
 		}
 	}
 
-	g_free(req->resp);
-	g_free(req);
-
-	return FALSE;
+	destroy_request_data(req);
 }
 
 static int append_query(unsigned char *buf, unsigned int size,
@@ -574,6 +1279,196 @@ static int append_query(unsigned char *buf, unsigned int size,
 	return ptr - buf;
 }
 
+static void cache_heap_swap(unsigned int a, unsigned int b)
+{
+	struct cache_data *tmp = cache_heap[a];
+
+	cache_heap[a] = cache_heap[b];
+	cache_heap[b] = tmp;
+
+	cache_heap[a]->heap_index = a;
+	cache_heap[b]->heap_index = b;
+}
+
+static void cache_heap_sift_up(unsigned int i)
+{
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (cache_heap[parent]->stale_until <=
+						cache_heap[i]->stale_until)
+			break;
+
+		cache_heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void cache_heap_sift_down(unsigned int i)
+{
+	while (TRUE) {
+		unsigned int left = 2 * i + 1, right = left + 1;
+		unsigned int smallest = i;
+
+		if (left < cache_heap_len &&
+				cache_heap[left]->stale_until <
+					cache_heap[smallest]->stale_until)
+			smallest = left;
+
+		if (right < cache_heap_len &&
+				cache_heap[right]->stale_until <
+					cache_heap[smallest]->stale_until)
+			smallest = right;
+
+		if (smallest == i)
+			break;
+
+		cache_heap_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+static int cache_heap_push(struct cache_data *data)
+{
+	if (cache_heap_len == cache_heap_alloc) {
+		struct cache_data **heap;
+		unsigned int alloc = cache_heap_alloc ?
+					cache_heap_alloc * 2 : 64;
+
+		heap = g_try_renew(struct cache_data *, cache_heap, alloc);
+		if (heap == NULL)
+			return -ENOMEM;
+
+		cache_heap = heap;
+		cache_heap_alloc = alloc;
+	}
+
+	data->heap_index = cache_heap_len;
+	cache_heap[cache_heap_len++] = data;
+	cache_heap_sift_up(data->heap_index);
+
+	return 0;
+}
+
+static void cache_heap_remove(struct cache_data *data)
+{
+	unsigned int i = data->heap_index;
+
+	if (i >= cache_heap_len || cache_heap[i] != data)
+		return;
+
+	cache_heap_len--;
+	if (i == cache_heap_len)
+		return;
+
+	cache_heap[i] = cache_heap[cache_heap_len];
+	cache_heap[i]->heap_index = i;
+
+	cache_heap_sift_down(i);
+	cache_heap_sift_up(i);
+}
+
+static int cache_data_attach(struct cache_entry *entry,
+					struct cache_data *data)
+{
+	int err;
+
+	err = cache_heap_push(data);
+	if (err < 0)
+		return err;
+
+	data->entry = entry;
+	entry->data = data;
+
+	entry->size += sizeof(*data) + data->data_len;
+	cache_bytes += sizeof(*data) + data->data_len;
+
+	return 0;
+}
+
+static void cache_data_free(struct cache_entry *entry,
+				struct cache_data *data)
+{
+	cache_heap_remove(data);
+
+	entry->size -= sizeof(*data) + data->data_len;
+	cache_bytes -= sizeof(*data) + data->data_len;
+
+	if (entry->data == data)
+		entry->data = NULL;
+
+	g_free(data->data);
+	g_free(data);
+}
+
+static void cache_lru_touch(struct cache_entry *entry)
+{
+	if (entry->lru_link == NULL || entry->lru_link == cache_lru.head)
+		return;
+
+	g_queue_unlink(&cache_lru, entry->lru_link);
+	g_queue_push_head_link(&cache_lru, entry->lru_link);
+}
+
+/*
+ * Drop every cached response whose lifetime (including the time it
+ * may be served stale) has ended. Popular entries are kept around
+ * (without data) so that they get refreshed.
+ */
+static void cache_expire(time_t current_time)
+{
+	while (cache_heap_len > 0 &&
+			cache_heap[0]->stale_until < current_time) {
+		struct cache_data *data = cache_heap[0];
+		struct cache_entry *entry = data->entry;
+
+		DBG("cache timeout \"%s\"", entry->key);
+
+		cache_data_free(entry, data);
+		cache_stats.expirations++;
+
+		if (entry->hits > 2) {
+			entry->want_refresh = 1;
+			continue;
+		}
+
+		g_hash_table_remove(cache, entry->key);
+	}
+}
+
+/*
+ * Make sure that "bytes" more bytes (and one more name if new_entry
+ * is set) fit into the cache by evicting the least recently used
+ * names. The protected entry is the one being updated by the caller.
+ */
+static int cache_make_room(unsigned int bytes, gboolean new_entry,
+					struct cache_entry *protect)
+{
+	if (bytes > cache_max_size)
+		return -ENOBUFS;
+
+	while (cache_bytes + bytes > cache_max_size ||
+			(new_entry == TRUE &&
+				(unsigned int) cache_size >= cache_max_entries)) {
+		struct cache_entry *entry;
+
+		if (cache_lru.tail == NULL)
+			return -ENOBUFS;
+
+		entry = cache_lru.tail->data;
+		if (entry == protect)
+			return -ENOBUFS;
+
+		DBG("evicting \"%s\" hits %d size %u", entry->key,
+						entry->hits, entry->size);
+
+		g_hash_table_remove(cache, entry->key);
+		cache_stats.evictions++;
+	}
+
+	return 0;
+}
+
 static gboolean cache_check_is_valid(struct cache_data *data,
 				time_t current_time)
 {
@@ -587,32 +1482,20 @@ static gboolean cache_check_is_valid(struct cache_data *data,
 }
 
 /*
- * remove stale cached entries so that they can be refreshed
+ * remove cached data that cannot even be served stale anymore
  */
 static void cache_enforce_validity(struct cache_entry *entry)
 {
 	time_t current_time = time(NULL);
 
-	if (cache_check_is_valid(entry->ipv4, current_time) == FALSE
-							&& entry->ipv4) {
-		DBG("cache timeout \"%s\" type A", entry->key);
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-
-	}
-
-	if (cache_check_is_valid(entry->ipv6, current_time) == FALSE
-							&& entry->ipv6) {
-		DBG("cache timeout \"%s\" type AAAA", entry->key);
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
+	if (entry->data && entry->data->stale_until < current_time) {
+		DBG("cache timeout \"%s\"", entry->key);
+		cache_data_free(entry, entry->data);
+		cache_stats.expirations++;
 	}
 }
 
-static uint16_t cache_check_validity(char *question, uint16_t type,
-				struct cache_entry *entry)
+static gboolean cache_check_validity(struct cache_entry *entry)
 {
 	time_t current_time = time(NULL);
 	int want_refresh = 0;
@@ -626,234 +1509,175 @@ static uint16_t cache_check_validity(char *question, uint16_t type,
 
 	cache_enforce_validity(entry);
 
-	switch (type) {
-	case 1:		/* IPv4 */
-		if (cache_check_is_valid(entry->ipv4, current_time) == FALSE) {
-			DBG("cache %s \"%s\" type A", entry->ipv4 ?
-					"timeout" : "entry missing", question);
-
-			if (want_refresh)
-				entry->want_refresh = 1;
-
-			/*
-			 * We do not remove cache entry if there is still
-			 * valid IPv6 entry found in the cache.
-			 */
-			if (cache_check_is_valid(entry->ipv6, current_time)
-					== FALSE && want_refresh == FALSE) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
+	if (cache_check_is_valid(entry->data, current_time) == TRUE)
+		return TRUE;
 
-	case 28:	/* IPv6 */
-		if (cache_check_is_valid(entry->ipv6, current_time) == FALSE) {
-			DBG("cache %s \"%s\" type AAAA", entry->ipv6 ?
-					"timeout" : "entry missing", question);
+	DBG("cache %s \"%s\"", entry->data ? "timeout" : "entry missing",
+								entry->key);
 
-			if (want_refresh)
-				entry->want_refresh = 1;
+	if (want_refresh)
+		entry->want_refresh = 1;
 
-			if (cache_check_is_valid(entry->ipv4, current_time)
-					== FALSE && want_refresh == FALSE) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
-	}
+	/*
+	 * We do not remove the cache entry if it still has data that
+	 * may be served stale.
+	 */
+	if (entry->data == NULL && want_refresh == FALSE)
+		g_hash_table_remove(cache, entry->key);
 
-	return type;
+	return FALSE;
 }
 
-static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
+static struct cache_entry *cache_lookup(const char *question,
+					uint16_t type, uint16_t class)
 {
-	char *question;
-	struct cache_entry *entry;
-	struct domain_question *q;
-	uint16_t type;
-	int offset, proto_offset;
+	char key[CACHE_KEY_MAX];
 
-	if (request == NULL)
+	if (cache == NULL)
 		return NULL;
 
-	proto_offset = protocol_offset(proto);
-	if (proto_offset < 0)
-		return NULL;
+	cache_key(key, sizeof(key), question, type, class);
+
+	return g_hash_table_lookup(cache, key);
+}
 
-	question = request + proto_offset + 12;
+static struct cache_entry *cache_check(gpointer request, unsigned int len,
+								int proto)
+{
+	char *question;
+	struct cache_entry *entry;
+	uint16_t type, class;
 
-	offset = strlen(question) + 1;
-	q = (void *) (question + offset);
-	type = ntohs(q->type);
+	question = request_question(request, len, proto, &type, &class);
+	if (question == NULL)
+		return NULL;
 
-	/* We only cache either A (1) or AAAA (28) requests */
-	if (type != 1 && type != 28)
+	if (cache_type_is_cacheable(type) == FALSE)
 		return NULL;
 
-	entry = g_hash_table_lookup(cache, question);
-	if (entry == NULL)
+	entry = cache_lookup(question, type, class);
+	if (entry == NULL) {
+		cache_stats.misses++;
 		return NULL;
+	}
 
-	type = cache_check_validity(question, type, entry);
-	if (type == 0)
+	if (cache_check_validity(entry) == FALSE) {
+		cache_stats.misses++;
 		return NULL;
+	}
+
+	cache_stats.hits++;
+	cache_lru_touch(entry);
 
-	*qtype = type;
 	return entry;
 }
 
-/*
- * Get a label/name from DNS resource record. The function decompresses the
- * label if necessary. The function does not convert the name to presentation
- * form. This means that the result string will contain label lengths instead
- * of dots between labels. We intentionally do not want to convert to dotted
- * format so that we can cache the wire format string directly.
- */
-static int get_name(int counter,
-		unsigned char *pkt, unsigned char *start, unsigned char *max,
-		unsigned char *output, int output_max, int *output_len,
-		unsigned char **end, char *name, int *name_len)
+static void cache_decay_hits(struct cache_entry *entry, time_t current_time)
 {
-	unsigned char *p;
-
-	/* Limit recursion to 10 (this means up to 10 labels in domain name) */
-	if (counter > 10)
-		return -EINVAL;
-
-	p = start;
-	while (*p) {
-		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
-			uint16_t offset = (*p & 0x3F) * 256 + *(p + 1);
-
-			if (offset >= max - pkt)
-				return -ENOBUFS;
-
-			if (*end == NULL)
-				*end = p + 2;
-
-			return get_name(counter + 1, pkt, pkt + offset, max,
-					output, output_max, output_len, end,
-					name, name_len);
-		} else {
-			unsigned label_len = *p;
-
-			if (pkt + label_len > max)
-				return -ENOBUFS;
+	time_t periods;
 
-			if (*output_len > output_max)
-				return -ENOBUFS;
+	periods = (current_time - entry->hits_decayed) / HITS_DECAY_PERIOD;
+	if (periods <= 0)
+		return;
 
-			/*
-			 * We need the original name in order to check
-			 * if this answer is the correct one.
-			 */
-			name[(*name_len)++] = label_len;
-			memcpy(name + *name_len, p + 1,	label_len + 1);
-			*name_len += label_len;
+	entry->hits = periods >= 31 ? 0 : entry->hits >> periods;
+	entry->hits_decayed += periods * HITS_DECAY_PERIOD;
+}
 
-			/* We compress the result */
-			output[0] = NS_CMPRSFLGS;
-			output[1] = 0x0C;
-			*output_len = 2;
+/*
+ * Account a cache hit and start a prefetch of popular entries that
+ * are getting close to the end of their lifetime. Returns the TTL
+ * left that is given to the client.
+ */
+static int cache_hit(struct cache_entry *entry, struct cache_data *data)
+{
+	time_t current_time = time(NULL);
+	time_t lifetime;
 
-			p += label_len + 1;
+	cache_decay_hits(entry, current_time);
+	entry->hits++;
 
-			if (*end == NULL)
-				*end = p;
+	if (cache_prefetch > 0 && data->prefetched == FALSE &&
+					entry->hits >= PREFETCH_MIN_HITS) {
+		lifetime = data->cache_until - data->inserted;
 
-			if (p >= max)
-				return -ENOBUFS;
+		if ((current_time - data->inserted) * 100 >=
+						lifetime * cache_prefetch &&
+				cache_send_query(entry) == 0) {
+			data->prefetched = TRUE;
+			cache_stats.prefetches++;
 		}
 	}
 
-	return 0;
+	return data->valid_until - current_time;
 }
 
-static int parse_rr(unsigned char *buf, unsigned char *start,
-			unsigned char *max,
-			unsigned char *response, unsigned int *response_size,
-			uint16_t *type, uint16_t *class, int *ttl, int *rdlen,
-			unsigned char **end,
-			char *name)
+/*
+ * All the upstream servers failed to answer the request, send the
+ * expired answer from the cache if we still have it.
+ */
+static gboolean cache_send_stale(struct request_data *req)
 {
-	struct domain_rr *rr;
-	int err, offset;
-	int name_len = 0, output_len = 0, max_rsp = *response_size;
-
-	err = get_name(0, buf, start, max, response, max_rsp,
-		&output_len, end, name, &name_len);
-	if (err < 0)
-		return err;
-
-	offset = output_len;
-
-	if ((unsigned int) offset > *response_size)
-		return -ENOBUFS;
-
-	rr = (void *) (*end);
-
-	if (rr == NULL)
-		return -EINVAL;
-
-	*type = ntohs(rr->type);
-	*class = ntohs(rr->class);
-	*ttl = ntohl(rr->ttl);
-	*rdlen = ntohs(rr->rdlen);
-
-	if (*ttl < 0)
-		return -EINVAL;
-
-	memcpy(response + offset, *end, sizeof(struct domain_rr));
-
-	offset += sizeof(struct domain_rr);
-	*end += sizeof(struct domain_rr);
-
-	if ((unsigned int) (offset + *rdlen) > *response_size)
-		return -ENOBUFS;
+	struct cache_entry *entry;
+	struct cache_data *data;
+	char *question;
+	uint16_t type, class;
+	int sk;
 
-	memcpy(response + offset, *end, *rdlen);
+	question = request_question(req->request, req->request_len,
+					req->protocol, &type, &class);
+	if (question == NULL)
+		return FALSE;
 
-	*end += *rdlen;
+	entry = cache_lookup(question, type, class);
+	if (entry == NULL)
+		return FALSE;
 
-	*response_size = offset + *rdlen;
+	data = entry->data;
+	if (data == NULL || data->stale_until < time(NULL))
+		return FALSE;
 
-	return 0;
-}
+	DBG("serving stale \"%s\"", entry->key);
 
-static gboolean check_alias(GSList *aliases, char *name)
-{
-	GSList *list;
+	cache_stats.stale++;
 
-	if (aliases != NULL) {
-		for (list = aliases; list; list = list->next) {
-			int len = strlen((char *)list->data);
-			if (strncmp((char *)list->data, name, len) == 0)
-				return TRUE;
-		}
+	if (req->protocol == IPPROTO_TCP) {
+		send_cached_response(req->client_sk, data->data,
+				data->data_len, NULL, 0, IPPROTO_TCP,
+				req->srcid, data->answers, STALE_TTL);
+		return TRUE;
 	}
 
-	return FALSE;
+	sk = g_io_channel_unix_get_fd(req->ifdata->udp_listener_channel);
+	send_cached_response(sk, data->data, data->data_len,
+				&req->sa, req->sa_len, IPPROTO_UDP,
+				req->srcid, data->answers, STALE_TTL);
+
+	return TRUE;
 }
 
+/*
+ * Parse an answer for caching. The question is returned in wire
+ * format, we intentionally do not want to convert it to dotted format
+ * so that we can use the wire format string directly in the cache key.
+ *
+ * The answer section is cached as is, including any CNAME chain and
+ * signatures, so that the compression pointers in it stay valid when
+ * it is put back after the same header and question. The TTL of the
+ * answer is the smallest TTL of its records.
+ */
 static int parse_response(unsigned char *buf, int buflen,
 			char *question, int qlen,
 			uint16_t *type, uint16_t *class, int *ttl,
-			unsigned char *response, unsigned int *response_len,
+			unsigned char **response, unsigned int *response_len,
 			uint16_t *answers)
 {
 	struct domain_hdr *hdr = (void *) buf;
 	struct domain_question *q;
-	unsigned char *ptr;
+	unsigned char *ptr, *end = buf + buflen;
 	uint16_t qdcount = ntohs(hdr->qdcount);
 	uint16_t ancount = ntohs(hdr->ancount);
-	int err, i;
-	uint16_t qtype, qclass;
-	unsigned char *next = NULL;
-	unsigned int maxlen = *response_len;
-	GSList *aliases = NULL, *list;
-	char name[NS_MAXDNAME + 1];
+	int i, len;
 
 	if (buflen < 12)
 		return -EINVAL;
@@ -864,409 +1688,468 @@ static int parse_response(unsigned char *buf, int buflen,
 	if (hdr->qr != 1 || qdcount != 1)
 		return -EINVAL;
 
+	/* A truncated answer is not complete */
+	if (hdr->tc == 1 || ancount == 0)
+		return -ENOMSG;
+
 	ptr = buf + sizeof(struct domain_hdr);
 
-	strncpy(question, (char *) ptr, qlen);
-	qlen = strlen(question);
-	ptr += qlen + 1; /* skip \0 */
+	len = strnlen((char *) ptr, end - ptr);
+	if (len >= qlen || ptr + len + 1 + sizeof(*q) > end)
+		return -EINVAL;
+
+	memcpy(question, ptr, len + 1);
+	ptr += len + 1; /* skip \0 */
 
 	q = (void *) ptr;
-	qtype = ntohs(q->type);
+	*type = ntohs(q->type);
+	*class = ntohs(q->class);
 
-	/* We cache only A and AAAA records */
-	if (qtype != 1 && qtype != 28)
+	if (cache_type_is_cacheable(*type) == FALSE)
 		return -ENOMSG;
 
-	qclass = ntohs(q->class);
+	ptr += sizeof(*q); /* ptr points now to answers */
 
-	ptr += 2 + 2; /* ptr points now to answers */
+	*response = ptr;
 
-	err = -ENOMSG;
-	*response_len = 0;
-	*answers = 0;
-
-	/*
-	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
-	 * A or AAAA question. We traverse the answers and parse the
-	 * resource records. Only A and AAAA records are cached, all
-	 * the other records in answers are skipped.
-	 */
 	for (i = 0; i < ancount; i++) {
-		/*
-		 * Get one address at a time to this buffer.
-		 * The max size of the answer is
-		 *   2 (pointer) + 2 (type) + 2 (class) +
-		 *   4 (ttl) + 2 (rdlen) + addr (16 or 4) = 28
-		 * for A or AAAA record.
-		 * For CNAME the size can be bigger.
-		 */
-		unsigned char rsp[NS_MAXCDNAME];
-		unsigned int rsp_len = sizeof(rsp) - 1;
-		int ret, rdlen;
+		struct domain_rr *rr;
+		uint32_t rr_ttl;
 
-		memset(rsp, 0, sizeof(rsp));
+		len = dn_skipname(ptr, end);
+		if (len < 0 || ptr + len + sizeof(*rr) > end)
+			return -EINVAL;
 
-		ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name);
-		if (ret != 0) {
-			err = ret;
-			goto out;
-		}
+		rr = (void *) (ptr + len);
 
-		/*
-		 * Now rsp contains compressed or uncompressed resource
-		 * record. Next we check if this record answers the question.
-		 * The name var contains the uncompressed label.
-		 * One tricky bit is the CNAME records as they alias
-		 * the name we might be interested in.
-		 */
+		/* TTL values with the top bit set mean zero (RFC 2181) */
+		rr_ttl = ntohl(rr->ttl);
+		if (rr_ttl > INT32_MAX)
+			rr_ttl = 0;
 
-		/*
-		 * Go to next answer if the class is not the one we are
-		 * looking for.
-		 */
-		if (*class != qclass) {
-			ptr = next;
-			next = NULL;
-			continue;
-		}
+		if (i == 0 || (int) rr_ttl < *ttl)
+			*ttl = rr_ttl;
 
-		/*
-		 * Try to resolve aliases also, type is CNAME(5).
-		 * This is important as otherwise the aliased names would not
-		 * be cached at all as the cache would not contain the aliased
-		 * question.
-		 *
-		 * If any CNAME is found in DNS packet, then we cache the alias
-		 * IP address instead of the question (as the server
-		 * said that question has only an alias).
-		 * This means in practice that if e.g., ipv6.google.com is
-		 * queried, DNS server returns CNAME of that name which is
-		 * ipv6.l.google.com. We then cache the address of the CNAME
-		 * but return the question name to client. So the alias
-		 * status of the name is not saved in cache and thus not
-		 * returned to the client. We do not return DNS packets from
-		 * cache to client saying that ipv6.google.com is an alias to
-		 * ipv6.l.google.com but we return instead a DNS packet that
-		 * says ipv6.google.com has address xxx which is in fact the
-		 * address of ipv6.l.google.com. For caching purposes this
-		 * should not cause any issues.
-		 */
-		if (*type == 5 && strncmp(question, name, qlen) == 0) {
-			/*
-			 * So now the alias answered the question. This is
-			 * not very useful from caching point of view as
-			 * the following A or AAAA records will not match the
-			 * question. We need to find the real A/AAAA record
-			 * of the alias and cache that.
-			 */
-			unsigned char *end = NULL;
-			int name_len = 0, output_len;
+		ptr += len + sizeof(*rr) + ntohs(rr->rdlen);
+		if (ptr > end)
+			return -EINVAL;
+	}
 
-			memset(rsp, 0, sizeof(rsp));
-			rsp_len = sizeof(rsp) - 1;
+	*response_len = ptr - *response;
+	*answers = ancount;
 
-			/*
-			 * Alias is in rdata part of the message,
-			 * and next-rdlen points to it. So we need to get
-			 * the real name of the alias.
-			 */
-			ret = get_name(0, buf, next - rdlen, buf + buflen,
-					rsp, rsp_len, &output_len, &end,
-					name, &name_len);
-			if (ret != 0) {
-				/* just ignore the error at this point */
-				ptr = next;
-				next = NULL;
-				continue;
-			}
+	return 0;
+}
 
-			/*
-			 * We should now have the alias of the entry we might
-			 * want to cache. Just remember it for a while.
-			 * We check the alias list when we have parsed the
-			 * A or AAAA record.
-			 */
-			aliases = g_slist_prepend(aliases, g_strdup(name));
+static gboolean cache_invalidate_entry(gpointer key, gpointer value,
+					gpointer user_data)
+{
+	struct cache_entry *entry = value;
 
-			ptr = next;
-			next = NULL;
-			continue;
-		}
+	/* first, delete any expired elements */
+	cache_enforce_validity(entry);
 
-		if (*type == qtype) {
-			/*
-			 * We found correct type (A or AAAA)
-			 */
-			if (check_alias(aliases, name) == TRUE ||
-				(aliases == NULL && strncmp(question, name,
-							qlen) == 0)) {
-				/*
-				 * We found an alias or the name of the rr
-				 * matches the question. If so, we append
-				 * the compressed label to the cache.
-				 * The end result is a response buffer that
-				 * will contain one or more cached and
-				 * compressed resource records.
-				 */
-				if (*response_len + rsp_len > maxlen) {
-					err = -ENOBUFS;
-					goto out;
-				}
-				memcpy(response + *response_len, rsp, rsp_len);
-				*response_len += rsp_len;
-				(*answers)++;
-				err = 0;
-			}
-		}
+	/* if anything is not expired, mark the entry for refresh */
+	if (entry->hits > 0 && entry->data)
+		entry->want_refresh = 1;
 
-		ptr = next;
-		next = NULL;
-	}
+	/* delete the cached data */
+	if (entry->data)
+		cache_data_free(entry, entry->data);
 
-out:
-	for (list = aliases; list; list = list->next)
-		g_free(list->data);
-	g_slist_free(aliases);
+	/* keep the entry if we want it refreshed, delete it otherwise */
+	if (entry->want_refresh)
+		return FALSE;
+	else
+		return TRUE;
+}
 
-	return err;
+/*
+ * cache_invalidate is called from places where the DNS landscape
+ * has changed, say because connections are added or we entered a VPN.
+ * The logic is to wipe all cache data, but mark all non-expired
+ * parts of the cache for refresh rather than deleting the whole cache.
+ */
+static void cache_invalidate(void)
+{
+	DBG("Invalidating the DNS cache %p", cache);
+
+	if (cache == NULL)
+		return;
+
+	g_hash_table_foreach_remove(cache, cache_invalidate_entry, NULL);
+
+	g_hash_table_remove_all(neg_cache);
 }
 
-struct cache_timeout {
-	time_t current_time;
-	int max_timeout;
-	int try_harder;
-};
+static void cache_refresh_entry(struct cache_entry *entry)
+{
 
-static gboolean cache_check_entry(gpointer key, gpointer value,
+	cache_enforce_validity(entry);
+
+	if (entry->hits > 2 && entry->data == NULL)
+		entry->want_refresh = 1;
+
+	if (entry->want_refresh) {
+		entry->want_refresh = 0;
+
+		refresh_dns_entry(entry);
+	}
+}
+
+static void cache_refresh_iterator(gpointer key, gpointer value,
 					gpointer user_data)
 {
-	struct cache_timeout *data = user_data;
 	struct cache_entry *entry = value;
-	int max_timeout;
 
-	/* Scale the number of hits by half as part of cache aging */
+	cache_refresh_entry(entry);
+}
+
+static void cache_refresh(void)
+{
+	if (cache == NULL)
+		return;
 
-	entry->hits /= 2;
+	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
+}
 
-	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
-	 */
+static void neg_cache_element_destroy(gpointer value)
+{
+	struct neg_cache_entry *entry = value;
 
-	if (entry->ipv4 != NULL && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	if (entry->lru_link != NULL)
+		g_queue_delete_link(&neg_cache_lru, entry->lru_link);
 
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
-	}
+	neg_cache_bytes -= sizeof(*entry) + strlen(entry->key) + 1 +
+							entry->data_len;
 
-	if (entry->ipv6 != NULL && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	g_free(entry->data);
+	g_free(entry->key);
+	g_free(entry);
+}
 
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
-	}
+static void neg_cache_remove(const char *question, uint16_t type,
+							uint16_t class)
+{
+	char key[CACHE_KEY_MAX];
 
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
+	if (neg_cache == NULL)
+		return;
 
-	return FALSE;
+	cache_key(key, sizeof(key), question, type, class);
+	g_hash_table_remove(neg_cache, key);
 }
 
-static void cache_cleanup(void)
+static int neg_cache_make_room(unsigned int bytes)
 {
-	static int max_timeout;
-	struct cache_timeout data;
-	int count = 0;
+	if (bytes > neg_cache_max_size)
+		return -ENOBUFS;
 
-	data.current_time = time(NULL);
-	data.max_timeout = 0;
-	data.try_harder = 0;
+	while (neg_cache_bytes + bytes > neg_cache_max_size) {
+		struct neg_cache_entry *entry;
 
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-	}
-	DBG("removed %d in the first pass", count);
+		if (neg_cache_lru.tail == NULL)
+			return -ENOBUFS;
 
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = 1;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+		entry = neg_cache_lru.tail->data;
 
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+		g_hash_table_remove(neg_cache, entry->key);
+		cache_stats.neg_evictions++;
+	}
+
+	return 0;
 }
 
-static gboolean cache_invalidate_entry(gpointer key, gpointer value,
-					gpointer user_data)
+/*
+ * Find the SOA record in the authority section. The negative answer
+ * may be cached for the minimum of the SOA TTL and the SOA MINIMUM
+ * field (RFC 2308 section 5), capped at MAX_CACHE_TTL. Returns the
+ * end of the authority section or NULL if the answer cannot be cached.
+ */
+static unsigned char *parse_negative(unsigned char *buf, unsigned int len,
+					char *question, unsigned int qsize,
+					uint16_t *qtype, uint16_t *qclass,
+					int *ttl)
 {
-	struct cache_entry *entry = value;
+	struct domain_hdr *hdr = (void *) buf;
+	unsigned char *ptr, *end = buf + len;
+	uint16_t nscount = ntohs(hdr->nscount);
+	unsigned int qlen;
+	int l, i;
 
-	/* first, delete any expired elements */
-	cache_enforce_validity(entry);
+	*ttl = -1;
 
-	/* if anything is not expired, mark the entry for refresh */
-	if (entry->hits > 0 && (entry->ipv4 || entry->ipv6))
-		entry->want_refresh = 1;
+	if (len < sizeof(*hdr) || ntohs(hdr->qdcount) != 1)
+		return NULL;
 
-	/* delete the cached data */
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
+	ptr = buf + sizeof(*hdr);
+
+	qlen = strnlen((char *) ptr, end - ptr);
+	if (qlen >= qsize || ptr + qlen + 1 + 4 > end)
+		return NULL;
+
+	memcpy(question, ptr, qlen + 1);
+	*qtype = ptr[qlen + 1] << 8 | ptr[qlen + 2];
+	*qclass = ptr[qlen + 3] << 8 | ptr[qlen + 4];
+	ptr += qlen + 1 + 4;
+
+	for (i = 0; i < nscount; i++) {
+		struct domain_rr *rr;
+		unsigned char *rdata;
+		uint16_t rdlen;
+		uint32_t minimum, soa_ttl;
+
+		l = dn_skipname(ptr, end);
+		if (l < 0 || ptr + l + sizeof(*rr) > end)
+			return NULL;
+
+		rr = (void *) (ptr + l);
+		rdata = ptr + l + sizeof(*rr);
+		rdlen = ntohs(rr->rdlen);
+		if (rdata + rdlen > end)
+			return NULL;
+
+		ptr = rdata + rdlen;
+
+		if (ntohs(rr->type) != 6 || *ttl >= 0)
+			continue;
+
+		/* MNAME and RNAME, then 5 32 bit values */
+		l = dn_skipname(rdata, ptr);
+		if (l < 0)
+			return NULL;
+		rdata += l;
+
+		l = dn_skipname(rdata, ptr);
+		if (l < 0 || rdata + l + 20 > ptr)
+			return NULL;
+		rdata += l;
+
+		memcpy(&minimum, rdata + 16, 4);
+
+		/* Clamp before storing, a TTL of 2^31 or more is valid */
+		soa_ttl = MIN(ntohl(rr->ttl), ntohl(minimum));
+		*ttl = MIN(soa_ttl, MAX_CACHE_TTL);
 	}
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
+	if (*ttl < 0)
+		return NULL;
+
+	return ptr;
+}
+
+static int neg_cache_update(int protocol, unsigned char *msg,
+						unsigned int msg_len)
+{
+	int offset = protocol_offset(protocol);
+	struct domain_hdr *hdr = (void *) (msg + offset);
+	struct neg_cache_entry *entry;
+	char question[NS_MAXDNAME + 1];
+	char key[CACHE_KEY_MAX];
+	unsigned char *end, *ptr;
+	unsigned int len, size;
+	uint16_t type, class;
+	time_t current_time;
+	int ttl;
+
+	if (neg_cache == NULL || offset < 0 || msg_len < (unsigned int)
+					offset + sizeof(struct domain_hdr))
+		return 0;
+
+	/* Only NXDOMAIN and NODATA answers are negative */
+	if (hdr->rcode != 3 && hdr->rcode != 0)
+		return 0;
+
+	/* A truncated answer is not proof that there is no data */
+	if (hdr->tc == 1 || hdr->ancount != 0)
+		return 0;
+
+	end = parse_negative(msg + offset, msg_len - offset,
+				question, sizeof(question), &type, &class, &ttl);
+	if (end == NULL || ttl == 0)
+		return 0;
+
+	cache_key(key, sizeof(key), question, type, class);
+
+	/* We keep the TCP length even for UDP, as the positive cache */
+	len = 2 + end - (msg + offset);
+	size = sizeof(*entry) + strlen(key) + 1 + len;
+
+	g_hash_table_remove(neg_cache, key);
+
+	if (neg_cache_make_room(size) < 0)
+		return 0;
+
+	entry = g_try_new0(struct neg_cache_entry, 1);
+	if (entry == NULL)
+		return -ENOMEM;
+
+	entry->data = ptr = g_try_malloc(len);
+	if (entry->data == NULL) {
+		g_free(entry);
+		return -ENOMEM;
 	}
 
-	/* keep the entry if we want it refreshed, delete it otherwise */
-	if (entry->want_refresh)
-		return FALSE;
-	else
-		return TRUE;
+	current_time = time(NULL);
+
+	entry->key = g_strdup(key);
+	entry->inserted = current_time;
+	entry->cache_until = current_time + ttl;
+	entry->data_len = len;
+
+	ptr[0] = (len - 2) / 256;
+	ptr[1] = (len - 2) - ptr[0] * 256;
+	memcpy(ptr + 2, msg + offset, len - 2);
+
+	/* The additional section (EDNS0 etc.) is not cached */
+	hdr = (void *) (ptr + 2);
+	hdr->arcount = 0;
+
+	g_hash_table_replace(neg_cache, entry->key, entry);
+	g_queue_push_head(&neg_cache_lru, entry);
+	entry->lru_link = neg_cache_lru.head;
+	neg_cache_bytes += size;
+
+	cache_stats.neg_insertions++;
+
+	DBG("negative cache \"%s\" type %d rcode %d ttl %d bytes %u/%u",
+		question, type, hdr->rcode, ttl, neg_cache_bytes,
+		neg_cache_max_size);
+
+	return 0;
 }
 
 /*
- * cache_invalidate is called from places where the DNS landscape
- * has changed, say because connections are added or we entered a VPN.
- * The logic is to wipe all cache data, but mark all non-expired
- * parts of the cache for refresh rather than deleting the whole cache.
+ * Answer the request from the negative cache. Returns TRUE if the
+ * answer was sent.
  */
-static void cache_invalidate(void)
+static gboolean neg_cache_reply(struct request_data *req, gpointer request)
 {
-	DBG("Invalidating the DNS cache %p", cache);
+	struct neg_cache_entry *entry;
+	struct domain_hdr *hdr;
+	char key[CACHE_KEY_MAX];
+	char *question;
+	unsigned char *ptr;
+	uint16_t type, class;
+	time_t current_time;
+	int offset, len, sk, err;
 
-	if (cache == NULL)
-		return;
+	if (neg_cache == NULL)
+		return FALSE;
 
-	g_hash_table_foreach_remove(cache, cache_invalidate_entry, NULL);
-}
+	question = request_question(request, req->request_len,
+					req->protocol, &type, &class);
+	if (question == NULL)
+		return FALSE;
 
-static void cache_refresh_entry(struct cache_entry *entry)
-{
+	offset = protocol_offset(req->protocol);
 
-	cache_enforce_validity(entry);
+	cache_key(key, sizeof(key), question, type, class);
 
-	if (entry->hits > 2 && entry->ipv4 == NULL)
-		entry->want_refresh = 1;
-	if (entry->hits > 2 && entry->ipv6 == NULL)
-		entry->want_refresh = 1;
+	entry = g_hash_table_lookup(neg_cache, key);
+	if (entry == NULL)
+		return FALSE;
 
-	if (entry->want_refresh) {
-		char *c;
-		char dns_name[NS_MAXDNAME + 1];
-		entry->want_refresh = 0;
+	current_time = time(NULL);
 
-		/* turn a DNS name into a hostname with dots */
-		strncpy(dns_name, entry->key, NS_MAXDNAME);
-		c = dns_name;
-		while (c && *c) {
-			int jump;
-			jump = *c;
-			*c = '.';
-			c += jump + 1;
-		}
-		DBG("Refreshing %s\n", dns_name);
-		/* then refresh the hostname */
-		refresh_dns_entry(entry, &dns_name[1]);
+	if (entry->cache_until < current_time) {
+		g_hash_table_remove(neg_cache, key);
+		return FALSE;
 	}
-}
 
-static void cache_refresh_iterator(gpointer key, gpointer value,
-					gpointer user_data)
-{
-	struct cache_entry *entry = value;
+	g_queue_unlink(&neg_cache_lru, entry->lru_link);
+	g_queue_push_head_link(&neg_cache_lru, entry->lru_link);
 
-	cache_refresh_entry(entry);
-}
+	cache_stats.neg_hits++;
 
-static void cache_refresh(void)
-{
-	if (cache == NULL)
-		return;
+	/*
+	 * The cached packet contains always the TCP offset (two bytes)
+	 * so skip them for UDP.
+	 */
+	ptr = entry->data;
+	len = entry->data_len;
 
-	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
+	if (req->protocol == IPPROTO_UDP) {
+		ptr += 2;
+		len -= 2;
+		sk = g_io_channel_unix_get_fd(
+				req->ifdata->udp_listener_channel);
+	} else
+		sk = req->client_sk;
+
+	hdr = (void *) (ptr + offset);
+	hdr->id = req->srcid;
+	hdr->qr = 1;
+
+	update_cached_ttl((unsigned char *) hdr, entry->data_len - 2,
+				entry->cache_until - current_time);
+
+	DBG("negative cache hit \"%s\" rcode %d", question, hdr->rcode);
+
+	err = sendto(sk, ptr, len, MSG_NOSIGNAL,
+			req->protocol == IPPROTO_UDP ? &req->sa : NULL,
+			req->protocol == IPPROTO_UDP ? req->sa_len : 0);
+	if (err < 0)
+		connman_error("Cannot send cached DNS response: %s",
+				strerror(errno));
+
+	return TRUE;
 }
 
-static int reply_query_type(unsigned char *msg, int len)
+static struct cache_entry *cache_entry_new(const char *key, int keylen,
+					int qlen, uint16_t type,
+					uint16_t class, time_t current_time)
 {
-	unsigned char *c;
-	uint16_t *w;
-	int l;
-	int type;
+	struct cache_entry *entry;
 
-	/* skip the header */
-	c = msg + sizeof(struct domain_hdr);
-	len -= sizeof(struct domain_hdr);
+	entry = g_try_new0(struct cache_entry, 1);
+	if (entry == NULL)
+		return NULL;
 
-	if (len < 0)
-		return 0;
+	entry->key = g_strdup(key);
+	entry->name = entry->key + keylen - qlen;
+	entry->type = type;
+	entry->class = class;
+	entry->size = sizeof(*entry) + keylen + 1;
+	entry->want_refresh = 0;
+	entry->hits = 0;
+	entry->hits_decayed = current_time;
 
-	/* now the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c) + 1;
-	c += l;
-	w = (uint16_t *) c;
-	type = ntohs(*w);
+	return entry;
+}
 
-	return type;
+/* Add a new entry as the most recently used one */
+static void cache_entry_insert(struct cache_entry *entry)
+{
+	g_hash_table_replace(cache, entry->key, entry);
+	g_queue_push_head(&cache_lru, entry);
+	entry->lru_link = cache_lru.head;
+	cache_bytes += sizeof(*entry) + strlen(entry->key) + 1;
+	cache_size++;
 }
 
 static int cache_update(struct server_data *srv, unsigned char *msg,
 			unsigned int msg_len)
 {
 	int offset = protocol_offset(srv->protocol);
-	int err, qlen, ttl = 0;
+	int err, qlen, keylen, ttl = 0;
 	uint16_t answers = 0, type = 0, class = 0;
 	struct domain_hdr *hdr = (void *)(msg + offset);
 	struct domain_question *q;
 	struct cache_entry *entry;
 	struct cache_data *data;
 	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
+	char key[CACHE_KEY_MAX];
+	unsigned char *response = NULL;
 	unsigned char *ptr;
-	unsigned int rsplen;
+	unsigned int rsplen = 0, data_len, needed;
 	gboolean new_entry = TRUE;
 	time_t current_time;
 
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
-
 	current_time = time(NULL);
 
+	cache_expire(current_time);
+
 	/* don't do a cache refresh more than twice a minute */
 	if (next_refresh < current_time) {
 		cache_refresh();
@@ -1282,105 +2165,71 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	if (hdr->rcode != 0)
 		return 0;
 
-	rsplen = sizeof(response) - 1;
 	question[sizeof(question) - 1] = '\0';
 
 	err = parse_response(msg + offset, msg_len - offset,
 				question, sizeof(question) - 1,
 				&type, &class, &ttl,
-				response, &rsplen, &answers);
-
-	/*
-	 * special case: if we do a ipv6 lookup and get no result
-	 * for a record that's already in our ipv4 cache.. we want
-	 * to cache the negative response.
-	 */
-	if ((err == -ENOMSG || err == -ENOBUFS) &&
-			reply_query_type(msg + offset,
-					msg_len - offset) == 28) {
-		entry = g_hash_table_lookup(cache, question);
-		if (entry && entry->ipv4 && entry->ipv6 == NULL) {
-			int cache_offset = 0;
-
-			data = g_try_new(struct cache_data, 1);
-			if (data == NULL)
-				return -ENOMEM;
-			data->inserted = entry->ipv4->inserted;
-			data->type = type;
-			data->answers = ntohs(hdr->ancount);
-			data->timeout = entry->ipv4->timeout;
-			if (srv->protocol == IPPROTO_UDP)
-				cache_offset = 2;
-			data->data_len = msg_len + cache_offset;
-			data->data = ptr = g_malloc(data->data_len);
-			ptr[0] = (data->data_len - 2) / 256;
-			ptr[1] = (data->data_len - 2) - ptr[0] * 256;
-			if (srv->protocol == IPPROTO_UDP)
-				ptr += 2;
-			data->valid_until = entry->ipv4->valid_until;
-			data->cache_until = entry->ipv4->cache_until;
-			memcpy(ptr, msg, msg_len);
-			entry->ipv6 = data;
-			/*
-			 * we will get a "hit" when we serve the response
-			 * out of the cache
-			 */
-			entry->hits--;
-			if (entry->hits < 0)
-				entry->hits = 0;
-			return 0;
-		}
-	}
+				&response, &rsplen, &answers);
 
 	if (err < 0 || ttl == 0)
 		return 0;
 
 	qlen = strlen(question);
+	keylen = cache_key(key, sizeof(key), question, type, class);
 
 	/*
-	 * If the cache contains already data, check if the
-	 * type of the cached data is the same and do not add
-	 * to cache if data is already there.
-	 * This is needed so that we can cache both A and AAAA
-	 * records for the same name.
+	 * If the cache contains already data for this name, type and
+	 * class, do not add to cache if data is already there.
 	 */
-	entry = g_hash_table_lookup(cache, question);
-	if (entry == NULL) {
-		entry = g_try_new(struct cache_entry, 1);
-		if (entry == NULL)
-			return -ENOMEM;
+	entry = g_hash_table_lookup(cache, key);
+	if (entry != NULL) {
+		struct cache_data *old = entry->data;
 
-		data = g_try_new(struct cache_data, 1);
-		if (data == NULL) {
-			g_free(entry);
-			return -ENOMEM;
+		/*
+		 * Prefetched and expired (stale) data is replaced by
+		 * the new answer.
+		 */
+		if (old != NULL) {
+			if (old->prefetched == FALSE &&
+					cache_check_is_valid(old,
+						current_time) == TRUE)
+				return 0;
+
+			cache_data_free(entry, old);
 		}
 
-		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
-		entry->want_refresh = 0;
-		entry->hits = 0;
+		new_entry = FALSE;
+	}
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
-	} else {
-		if (type == 1 && entry->ipv4 != NULL)
-			return 0;
+	/*
+	 * The "2" in start of the length is the TCP offset. We allocate it
+	 * here even for UDP packet because it simplifies the sending
+	 * of cached packet.
+	 */
+	data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
 
-		if (type == 28 && entry->ipv6 != NULL)
-			return 0;
+	needed = sizeof(struct cache_data) + data_len;
+	if (new_entry == TRUE)
+		needed += sizeof(struct cache_entry) + keylen + 1;
 
-		data = g_try_new(struct cache_data, 1);
-		if (data == NULL)
-			return -ENOMEM;
+	if (cache_make_room(needed, new_entry, entry) < 0) {
+		DBG("no room for \"%s\" in cache", key);
+		return 0;
+	}
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
+	data = g_try_new0(struct cache_data, 1);
+	if (data == NULL)
+		return -ENOMEM;
 
+	if (new_entry == TRUE) {
+		entry = cache_entry_new(key, keylen, qlen, type, class,
+							current_time);
+		if (entry == NULL) {
+			g_free(data);
+			return -ENOMEM;
+		}
+	} else {
 		/*
 		 * compensate for the hit we'll get for serving
 		 * the response out of the cache
@@ -1388,8 +2237,6 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 		entry->hits--;
 		if (entry->hits < 0)
 			entry->hits = 0;
-
-		new_entry = FALSE;
 	}
 
 	if (ttl < MIN_CACHE_TTL)
@@ -1399,13 +2246,8 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	data->type = type;
 	data->answers = answers;
 	data->timeout = ttl;
-	/*
-	 * The "2" in start of the length is the TCP offset. We allocate it
-	 * here even for UDP packet because it simplifies the sending
-	 * of cached packet.
-	 */
-	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
-	data->data = ptr = g_malloc(data->data_len);
+	data->data_len = data_len;
+	data->data = ptr = g_try_malloc(data->data_len);
 	data->valid_until = current_time + ttl;
 
 	/*
@@ -1416,12 +2258,11 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 		ttl = MAX_CACHE_TTL;
 
 	data->cache_until = round_down_ttl(current_time + ttl, ttl);
+	data->stale_until = data->cache_until + cache_stale_time;
 
 	if (data->data == NULL) {
-		g_free(entry->key);
 		g_free(data);
-		g_free(entry);
-		return -ENOMEM;
+		goto fail;
 	}
 
 	/*
@@ -1435,7 +2276,7 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	if (srv->protocol == IPPROTO_UDP)
 		ptr += 2;
 
-	memcpy(ptr, msg, offset + 12);
+	memcpy(ptr + offset, msg + offset, 12);
 	memcpy(ptr + offset + 12, question, qlen + 1); /* copy also the \0 */
 
 	q = (void *) (ptr + offset + 12 + qlen + 1);
@@ -1444,47 +2285,339 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	memcpy(ptr + offset + 12 + qlen + 1 + sizeof(struct domain_question),
 		response, rsplen);
 
-	if (new_entry == TRUE) {
-		g_hash_table_replace(cache, entry->key, entry);
-		cache_size++;
+	if (cache_data_attach(entry, data) < 0) {
+		g_free(data->data);
+		g_free(data);
+		goto fail;
 	}
 
-	DBG("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
-								"dns len %u",
-		cache_size, new_entry ? "new " : "old ",
-		question, type, ttl,
-		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
+	if (new_entry == TRUE)
+		cache_entry_insert(entry);
+	else
+		cache_lru_touch(entry);
+
+	cache_stats.insertions++;
+
+	neg_cache_remove(question, type, class);
+
+	DBG("cache %d/%u bytes %u/%u %squestion \"%s\" type %d answers %d "
+					"ttl %d size %u packet %u dns len %u",
+		cache_size, cache_max_entries, cache_bytes, cache_max_size,
+		new_entry ? "new " : "old ",
+		question, type, answers, ttl, entry->size,
 		data->data_len,
 		srv->protocol == IPPROTO_TCP ?
 			(unsigned int)(data->data[0] * 256 + data->data[1]) :
 			data->data_len);
 
 	return 0;
+
+fail:
+	if (new_entry == TRUE) {
+		g_free(entry->key);
+		g_free(entry);
+	}
+
+	return -ENOMEM;
+}
+
+static int cache_snapshot_save(void)
+{
+	struct cache_snapshot_header *hdr;
+	GError *error = NULL;
+	time_t current_time = time(NULL);
+	unsigned char *buf, *ptr;
+	gsize len = sizeof(*hdr);
+	GList *list;
+	int err = 0;
+
+	if (cache == NULL || cache_service_ident == NULL)
+		return 0;
+
+	for (list = cache_lru.head; list; list = list->next) {
+		struct cache_entry *entry = list->data;
+
+		if (entry->data == NULL ||
+				entry->data->cache_until < current_time)
+			continue;
+
+		len += CACHE_SNAPSHOT_ALIGN(
+				sizeof(struct cache_snapshot_record) +
+				strlen(entry->name) + 1 +
+				entry->data->data_len);
+	}
+
+	buf = g_try_malloc0(len);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	hdr = (void *) buf;
+	hdr->magic = CACHE_SNAPSHOT_MAGIC;
+	hdr->version = CACHE_SNAPSHOT_VERSION;
+	hdr->saved = current_time;
+	g_strlcpy(hdr->ident, cache_service_ident, sizeof(hdr->ident));
+
+	/* Least recently used first, so the order is kept on restore */
+	ptr = buf + sizeof(*hdr);
+	for (list = cache_lru.tail; list; list = list->prev) {
+		struct cache_entry *entry = list->data;
+		struct cache_data *data = entry->data;
+		struct cache_snapshot_record *rec = (void *) ptr;
+
+		if (data == NULL || data->cache_until < current_time)
+			continue;
+
+		rec->name_len = strlen(entry->name) + 1;
+		rec->data_len = data->data_len;
+		rec->record_len = CACHE_SNAPSHOT_ALIGN(sizeof(*rec) +
+					rec->name_len + rec->data_len);
+		rec->type = entry->type;
+		rec->class = entry->class;
+		rec->inserted = data->inserted;
+		rec->valid_until = data->valid_until;
+		rec->cache_until = data->cache_until;
+		rec->timeout = data->timeout;
+		rec->hits = entry->hits;
+		rec->answers = data->answers;
+
+		memcpy(ptr + sizeof(*rec), entry->name, rec->name_len);
+		memcpy(ptr + sizeof(*rec) + rec->name_len, data->data,
+							data->data_len);
+
+		ptr += rec->record_len;
+		hdr->count++;
+	}
+
+	if (g_file_set_contents(CACHE_SNAPSHOT_FILE, (gchar *) buf, len,
+						&error) == FALSE) {
+		connman_error("Failed to save DNS cache: %s", error->message);
+		g_error_free(error);
+		err = -EIO;
+	} else
+		DBG("saved %u entries %zu bytes", hdr->count, len);
+
+	cache_snapshot_insertions = cache_stats.insertions;
+
+	g_free(buf);
+
+	return err;
+}
+
+static gboolean cache_snapshot_periodic(gpointer user_data)
+{
+	if (cache_stats.insertions != cache_snapshot_insertions)
+		cache_snapshot_save();
+
+	return TRUE;
+}
+
+static void cache_snapshot_drop(void)
+{
+	if (cache_snapshot == NULL)
+		return;
+
+	g_mapped_file_unref(cache_snapshot);
+	cache_snapshot = NULL;
+	cache_snapshot_ready = FALSE;
+}
+
+static void cache_snapshot_load(void)
+{
+	struct cache_snapshot_header *hdr;
+	GError *error = NULL;
+
+	cache_snapshot = g_mapped_file_new(CACHE_SNAPSHOT_FILE, FALSE, &error);
+	if (cache_snapshot == NULL) {
+		DBG("no DNS cache snapshot: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	hdr = (void *) g_mapped_file_get_contents(cache_snapshot);
+
+	if (g_mapped_file_get_length(cache_snapshot) < sizeof(*hdr) ||
+			hdr->magic != CACHE_SNAPSHOT_MAGIC ||
+			hdr->version != CACHE_SNAPSHOT_VERSION ||
+			hdr->ident[sizeof(hdr->ident) - 1] != '\0') {
+		connman_warn("Ignoring invalid DNS cache snapshot");
+		cache_snapshot_drop();
+		return;
+	}
+
+	DBG("snapshot of %s with %u entries from %lld", hdr->ident,
+				hdr->count, (long long) hdr->saved);
+}
+
+static void cache_snapshot_restore(void)
+{
+	struct cache_snapshot_header *hdr;
+	time_t current_time = time(NULL);
+	unsigned char *ptr, *end;
+	unsigned int i, restored = 0;
+
+	if (cache_snapshot == NULL || cache_snapshot_ready == FALSE ||
+								cache == NULL)
+		return;
+
+	hdr = (void *) g_mapped_file_get_contents(cache_snapshot);
+	ptr = (unsigned char *) hdr + sizeof(*hdr);
+	end = (unsigned char *) hdr + g_mapped_file_get_length(cache_snapshot);
+
+	for (i = 0; i < hdr->count; i++) {
+		struct cache_snapshot_record *rec = (void *) ptr;
+		struct cache_entry *entry;
+		struct cache_data *data;
+		char key[CACHE_KEY_MAX];
+		const char *name;
+		int keylen;
+
+		if (ptr + sizeof(*rec) > end || rec->record_len > end - ptr ||
+				rec->record_len < sizeof(*rec) +
+					rec->name_len + rec->data_len ||
+				rec->name_len == 0 ||
+				rec->name_len > NS_MAXDNAME + 1 ||
+				rec->data_len < 2 + 12)
+			break;
+
+		name = (const char *) ptr + sizeof(*rec);
+		ptr += rec->record_len;
+
+		if (name[rec->name_len - 1] != '\0' ||
+				strlen(name) + 1 != rec->name_len)
+			break;
+
+		if (rec->cache_until < current_time)
+			continue;
+
+		keylen = cache_key(key, sizeof(key), name, rec->type,
+								rec->class);
+		if (keylen < 0 || keylen >= (int) sizeof(key))
+			break;
+
+		if (g_hash_table_lookup(cache, key) != NULL)
+			continue;
+
+		if (cache_make_room(sizeof(*entry) + keylen + 1 +
+				sizeof(*data) + rec->data_len, TRUE,
+							NULL) < 0)
+			break;
+
+		data = g_try_new0(struct cache_data, 1);
+		if (data == NULL)
+			break;
+
+		data->data = g_try_malloc(rec->data_len);
+		entry = cache_entry_new(key, keylen, rec->name_len - 1,
+				rec->type, rec->class, current_time);
+		if (data->data == NULL || entry == NULL) {
+			g_free(data->data);
+			g_free(data);
+			if (entry != NULL) {
+				g_free(entry->key);
+				g_free(entry);
+			}
+			break;
+		}
+
+		memcpy(data->data, name + rec->name_len, rec->data_len);
+		data->data_len = rec->data_len;
+		data->type = rec->type;
+		data->answers = rec->answers;
+		data->timeout = rec->timeout;
+		data->inserted = rec->inserted;
+		data->valid_until = rec->valid_until;
+		data->cache_until = rec->cache_until;
+		data->stale_until = data->cache_until + cache_stale_time;
+
+		entry->hits = rec->hits;
+
+		if (cache_data_attach(entry, data) < 0) {
+			g_free(data->data);
+			g_free(data);
+			g_free(entry->key);
+			g_free(entry);
+			break;
+		}
+
+		cache_entry_insert(entry);
+		restored++;
+	}
+
+	DBG("restored %u of %u entries", restored, hdr->count);
+
+	cache_snapshot_drop();
+}
+
+/*
+ * The cache is about to be invalidated, save it for the service
+ * that is no longer the default one.
+ */
+static void cache_snapshot_default_leave(struct connman_service *service)
+{
+	const char *ident = NULL;
+
+	if (service != NULL)
+		ident = __connman_service_get_ident(service);
+
+	if (cache_service_ident != NULL &&
+				g_strcmp0(cache_service_ident, ident) != 0)
+		cache_snapshot_save();
+}
+
+/*
+ * Only restore the snapshot if it was taken on the new default
+ * service, otherwise the answers may not be valid here.
+ */
+static void cache_snapshot_default_changed(struct connman_service *service)
+{
+	const char *ident = NULL;
+	struct cache_snapshot_header *hdr;
+
+	if (service != NULL)
+		ident = __connman_service_get_ident(service);
+
+	g_free(cache_service_ident);
+	cache_service_ident = g_strdup(ident);
+
+	if (cache_snapshot == NULL || ident == NULL)
+		return;
+
+	hdr = (void *) g_mapped_file_get_contents(cache_snapshot);
+	if (g_strcmp0(hdr->ident, ident) != 0) {
+		DBG("snapshot of %s not used for %s", hdr->ident, ident);
+		cache_snapshot_drop();
+		return;
+	}
+
+	cache_snapshot_ready = TRUE;
+	cache_snapshot_restore();
 }
 
 static int ns_resolv(struct server_data *server, struct request_data *req,
 				gpointer request, gpointer name)
 {
 	GList *list;
-	int sk, err, type = 0;
+	int sk, err;
 	char *dot, *lookup = (char *) name;
-	struct cache_entry *entry;
+	struct cache_entry *entry = NULL;
+
+	if (req->cache_checked == FALSE) {
+		entry = cache_check(request, req->request_len, req->protocol);
+		req->cache_checked = TRUE;
+
+		if (entry == NULL && neg_cache_reply(req, request) == TRUE)
+			return 1;
+	}
 
-	entry = cache_check(request, &type, req->protocol);
 	if (entry != NULL) {
 		int ttl_left = 0;
 		struct cache_data *data;
 
-		DBG("cache hit %s type %s", lookup, type == 1 ? "A" : "AAAA");
-		if (type == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		DBG("cache hit %s type %d", lookup, entry->type);
+		data = entry->data;
 
-		if (data) {
-			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
-		}
+		if (data)
+			ttl_left = cache_hit(entry, data);
 
 		if (data != NULL && req->protocol == IPPROTO_TCP) {
 			send_cached_response(req->client_sk, data->data,
@@ -1518,6 +2651,7 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 	}
 
 	req->numserv++;
+	request_server_sent(req, server);
 
 	/* If we have more than one dot, we don't add domains */
 	dot = strchr(lookup, '.');
@@ -1577,21 +2711,10 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		if (err < 0)
 			return -EIO;
 
-		req->numserv++;
-	}
-
-	return 0;
-}
-
-static void destroy_request_data(struct request_data *req)
-{
-	if (req->timeout > 0)
-		g_source_remove(req->timeout);
+		req->numserv++;
+	}
 
-	g_free(req->resp);
-	g_free(req->request);
-	g_free(req->name);
-	g_free(req);
+	return 0;
 }
 
 static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
@@ -1624,6 +2747,8 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 
 	req->numresp++;
 
+	request_server_reply(req, data, hdr->rcode);
+
 	if (hdr->rcode == 0 || req->resp == NULL) {
 
 		/*
@@ -1685,13 +2810,35 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 		memcpy(req->resp, reply, reply_len);
 		req->resplen = reply_len;
 
+		/*
+		 * A negative answer to a query that we sent with and
+		 * without the search domain says nothing about the
+		 * name the client asked for.
+		 */
+		if (req->append_domain == FALSE)
+			neg_cache_update(protocol, reply, reply_len);
+
 		cache_update(data, reply, reply_len);
 	}
 
+	/*
+	 * Do not wait for the fan out timeout if the server refused
+	 * to answer, ask the other servers right away.
+	 */
+	if ((hdr->rcode == 2 || hdr->rcode == 5) && req->fanout_link != NULL) {
+		request_cancel_fanout(req);
+		request_fanout(req);
+	}
+
 	if (hdr->rcode > 0 && req->numresp < req->numserv)
 		return -EINVAL;
 
-	request_list = g_slist_remove(request_list, req);
+	request_remove(req);
+
+	if (req->prefetch == TRUE) {
+		destroy_request_data(req);
+		return 0;
+	}
 
 	if (protocol == IPPROTO_UDP) {
 		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
@@ -1721,15 +2868,13 @@ static void cache_element_destroy(gpointer value)
 	if (entry == NULL)
 		return;
 
-	if (entry->ipv4 != NULL) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-	}
+	if (entry->data != NULL)
+		cache_data_free(entry, entry->data);
 
-	if (entry->ipv6 != NULL) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-	}
+	if (entry->lru_link != NULL)
+		g_queue_delete_link(&cache_lru, entry->lru_link);
+
+	cache_bytes -= entry->size;
 
 	g_free(entry->key);
 	g_free(entry);
@@ -1743,13 +2888,89 @@ static gboolean try_remove_cache(gpointer user_data)
 	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
 		DBG("No cache users, removing it.");
 
+		DBG("cache hits %u misses %u insertions %u evictions %u "
+			"expirations %u prefetches %u stale %u",
+			cache_stats.hits, cache_stats.misses,
+			cache_stats.insertions, cache_stats.evictions,
+			cache_stats.expirations, cache_stats.prefetches,
+			cache_stats.stale);
+		DBG("negative cache hits %u insertions %u evictions %u",
+			cache_stats.neg_hits, cache_stats.neg_insertions,
+			cache_stats.neg_evictions);
+
 		g_hash_table_destroy(cache);
 		cache = NULL;
+
+		g_hash_table_destroy(neg_cache);
+		neg_cache = NULL;
+
+		g_free(cache_heap);
+		cache_heap = NULL;
+		cache_heap_len = cache_heap_alloc = 0;
+		cache_bytes = 0;
 	}
 
 	return FALSE;
 }
 
+static void append_server_dict(DBusMessageIter *iter,
+					struct server_data *server)
+{
+	DBusMessageIter dict;
+	const char *protocol;
+	char *ifname;
+	dbus_bool_t enabled = server->enabled;
+	dbus_uint32_t rtt = server->srtt >> 3;
+	dbus_uint32_t rttvar = server->rttvar >> 2;
+	dbus_uint32_t score = server_score(server);
+
+	protocol = server->protocol == IPPROTO_TCP ? "tcp" : "udp";
+
+	connman_dbus_dict_open(iter, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Server",
+					DBUS_TYPE_STRING, &server->server);
+
+	ifname = connman_inet_ifname(server->index);
+	if (ifname != NULL)
+		connman_dbus_dict_append_basic(&dict, "Interface",
+					DBUS_TYPE_STRING, &ifname);
+	g_free(ifname);
+
+	connman_dbus_dict_append_basic(&dict, "Protocol",
+					DBUS_TYPE_STRING, &protocol);
+	connman_dbus_dict_append_basic(&dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &enabled);
+
+	if (server->samples > 0) {
+		connman_dbus_dict_append_basic(&dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &rtt);
+		connman_dbus_dict_append_basic(&dict, "RoundTripVariance",
+					DBUS_TYPE_UINT32, &rttvar);
+	}
+
+	connman_dbus_dict_append_basic(&dict, "Score",
+					DBUS_TYPE_UINT32, &score);
+	connman_dbus_dict_append_basic(&dict, "Queries",
+					DBUS_TYPE_UINT32, &server->queries);
+	connman_dbus_dict_append_basic(&dict, "Replies",
+					DBUS_TYPE_UINT32, &server->replies);
+	connman_dbus_dict_append_basic(&dict, "Timeouts",
+					DBUS_TYPE_UINT32, &server->timeouts);
+	connman_dbus_dict_append_basic(&dict, "Failures",
+					DBUS_TYPE_UINT32, &server->failures);
+
+	connman_dbus_dict_close(iter, &dict);
+}
+
+void __connman_dnsproxy_list_servers(DBusMessageIter *iter)
+{
+	GSList *list;
+
+	for (list = server_list; list; list = list->next)
+		append_server_dict(iter, list->data);
+}
+
 static void server_destroy_socket(struct server_data *data)
 {
 	DBG("index %d server %s proto %d", data->index,
@@ -1775,9 +2996,22 @@ static void server_destroy_socket(struct server_data *data)
 	data->incoming_reply = NULL;
 }
 
+static void request_drop_server(struct request_data *req,
+					struct server_data *server)
+{
+	struct request_server *rs;
+
+	rs = request_server_find(req, server);
+	if (rs != NULL) {
+		req->servers = g_slist_remove(req->servers, rs);
+		g_free(rs);
+	}
+}
+
 static void destroy_server(struct server_data *server)
 {
 	GList *list;
+	int i;
 
 	DBG("index %d server %s sock %d", server->index, server->server,
 			server->channel != NULL ?
@@ -1786,6 +3020,15 @@ static void destroy_server(struct server_data *server)
 	server_list = g_slist_remove(server_list, server);
 	server_destroy_socket(server);
 
+	for (list = request_list.head; list; list = list->next)
+		request_drop_server(list->data, server);
+
+	/* Answered requests may still wait on the wheel */
+	for (i = 0; i < REQUEST_WHEEL_SLOTS; i++) {
+		for (list = request_wheel[i].head; list; list = list->next)
+			request_drop_server(list->data, server);
+	}
+
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		DBG("Removing DNS server %s", server->server);
 
@@ -1849,7 +3092,7 @@ static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
 		return FALSE;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		GSList *list;
+		GList *list, *next;
 hangup:
 		DBG("TCP server channel closed, sk %d", sk);
 
@@ -1860,10 +3103,12 @@ hangup:
 		g_free(server->incoming_reply);
 		server->incoming_reply = NULL;
 
-		for (list = request_list; list; list = list->next) {
+		for (list = request_list.head; list; list = next) {
 			struct request_data *req = list->data;
 			struct domain_hdr *hdr;
 
+			next = list->next;
+
 			if (req->protocol == IPPROTO_UDP)
 				continue;
 
@@ -1883,7 +3128,11 @@ hangup:
 			send_response(req->client_sk, req->request,
 				req->request_len, NULL, 0, IPPROTO_TCP);
 
-			request_list = g_slist_remove(request_list, req);
+			/*
+			 * Answered, so it must not stay on the timer wheel
+			 * with a reference to the server freed below.
+			 */
+			destroy_request_data(req);
 		}
 
 		destroy_server(server);
@@ -1892,8 +3141,7 @@ hangup:
 	}
 
 	if ((condition & G_IO_OUT) && !server->connected) {
-		GSList *list;
-		GList *domains;
+		GList *list, *domains;
 		int no_request_sent = TRUE;
 		struct server_data *udp_server;
 
@@ -1920,7 +3168,7 @@ hangup:
 			server->timeout = 0;
 		}
 
-		for (list = request_list; list; ) {
+		for (list = request_list.head; list; ) {
 			struct request_data *req = list->data;
 			int status;
 
@@ -1939,7 +3187,6 @@ hangup:
 				 * so the request can be released
 				 */
 				list = list->next;
-				request_list = g_slist_remove(request_list, req);
 				destroy_request_data(req);
 				continue;
 			}
@@ -1951,11 +3198,7 @@ hangup:
 
 			no_request_sent = FALSE;
 
-			if (req->timeout > 0)
-				g_source_remove(req->timeout);
-
-			req->timeout = g_timeout_add_seconds(30,
-						request_timeout, req);
+			request_set_timeout(req, 30);
 			list = list->next;
 		}
 
@@ -2119,11 +3362,18 @@ static int server_create_socket(struct server_data *data)
 		}
 	}
 
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
 		cache = g_hash_table_new_full(g_str_hash,
 					g_str_equal,
 					NULL,
 					cache_element_destroy);
+		neg_cache = g_hash_table_new_full(g_str_hash,
+					g_str_equal,
+					NULL,
+					neg_cache_element_destroy);
+
+		cache_snapshot_restore();
+	}
 
 	return 0;
 }
@@ -2219,36 +3469,104 @@ static struct server_data *create_server(int index,
 	return data;
 }
 
+static gboolean server_ready(struct server_data *data)
+{
+	if (data->protocol == IPPROTO_TCP) {
+		DBG("server %s ignored proto TCP", data->server);
+		return FALSE;
+	}
+
+	DBG("server %s enabled %d", data->server, data->enabled);
+
+	if (data->enabled == FALSE)
+		return FALSE;
+
+	if (data->channel == NULL && data->protocol == IPPROTO_UDP) {
+		if (server_create_socket(data) < 0) {
+			DBG("socket creation failed while resolving");
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Send the request to the best servers first, see fanout_queue.
+ */
 static gboolean resolv(struct request_data *req,
 				gpointer request, gpointer name)
 {
-	GSList *list;
+	GSList *list, *servers = NULL;
+	struct server_data *best;
+	unsigned int fanout = 1;
+	gboolean found = FALSE;
 
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
 
-		if (data->protocol == IPPROTO_TCP) {
-			DBG("server %s ignored proto TCP", data->server);
-			continue;
+		if (server_ready(data) == TRUE)
+			servers = g_slist_prepend(servers, data);
+	}
+
+	/* g_slist_sort() is stable, so the order of equals is kept */
+	servers = g_slist_sort(g_slist_reverse(servers), server_compare);
+	if (servers == NULL)
+		return FALSE;
+
+	best = servers->data;
+	if (best->samples == 0 || best->failures > 0)
+		fanout = 2;
+
+	for (list = servers; list; list = list->next) {
+		int err;
+
+		if (fanout == 0) {
+			request_schedule_fanout(req, best);
+			break;
+		}
+
+		err = ns_resolv(list->data, req, request, name);
+		if (err > 0) {
+			found = TRUE;
+			break;
 		}
 
-		DBG("server %s enabled %d", data->server, data->enabled);
+		if (err == 0)
+			fanout--;
+	}
+
+	g_slist_free(servers);
+
+	return found;
+}
+
+/*
+ * Send the request to the servers that have not been asked yet.
+ * Returns the number of servers the request was sent to.
+ */
+static int request_fanout(struct request_data *req)
+{
+	GSList *list;
+	int count = 0;
+
+	if (req->request == NULL || req->name == NULL)
+		return 0;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
 
-		if (data->enabled == FALSE)
+		if (request_server_find(req, data) != NULL)
 			continue;
 
-		if (data->channel == NULL && data->protocol == IPPROTO_UDP) {
-			if (server_create_socket(data) < 0) {
-				DBG("socket creation failed while resolving");
-				continue;
-			}
-		}
+		if (server_ready(data) == FALSE)
+			continue;
 
-		if (ns_resolv(data, req, request, name) > 0)
-			return TRUE;
+		if (ns_resolv(data, req, req->request, req->name) == 0)
+			count++;
 	}
 
-	return FALSE;
+	return count;
 }
 
 static void append_domain(int index, const char *domain)
@@ -2352,28 +3670,35 @@ int __connman_dnsproxy_remove(int index, const char *domain,
 
 void __connman_dnsproxy_flush(void)
 {
-	GSList *list;
+	GList *list;
 
-	list = request_list;
+	list = request_list.head;
 	while (list) {
 		struct request_data *req = list->data;
 
 		list = list->next;
 
+		/*
+		 * Prefetch requests have no client to answer from the
+		 * cache, they are only sent again.
+		 */
+		if (req->prefetch == FALSE)
+			req->cache_checked = FALSE;
+
+		/* The servers have changed, start over */
+		request_cancel_fanout(req);
+		request_servers_release(req, FALSE);
+
 		if (resolv(req, req->request, req->name) == TRUE) {
 			/*
 			 * A cached result was sent,
 			 * so the request can be released
 			 */
-			request_list =
-				g_slist_remove(request_list, req);
 			destroy_request_data(req);
 			continue;
 		}
 
-		if (req->timeout > 0)
-			g_source_remove(req->timeout);
-		req->timeout = g_timeout_add_seconds(5, request_timeout, req);
+		request_set_timeout(req, 5);
 	}
 }
 
@@ -2406,9 +3731,15 @@ static void dnsproxy_default_changed(struct connman_service *service)
 
 	DBG("service %p", service);
 
+	if (cache_snapshot_enabled == TRUE)
+		cache_snapshot_default_leave(service);
+
 	/* DNS has changed, invalidate the cache */
 	cache_invalidate();
 
+	if (cache_snapshot_enabled == TRUE)
+		cache_snapshot_default_changed(service);
+
 	if (service == NULL) {
 		/* When no services are active, then disable DNS proxying */
 		dnsproxy_offline_mode(TRUE);
@@ -2525,7 +3856,7 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	socklen_t client_addr_len = sizeof(client_addr);
 	GSList *list;
 	struct listener_data *ifdata = user_data;
-	int waiting_for_connect = FALSE, qtype = 0;
+	int waiting_for_connect = FALSE;
 	struct cache_entry *entry;
 
 	DBG("condition 0x%x", condition);
@@ -2572,8 +3903,7 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	req->protocol = IPPROTO_TCP;
 
 	req->srcid = buf[2] | (buf[3] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
+	request_alloc_ids(req);
 	req->request_len = len;
 
 	buf[2] = req->dstid & 0xff;
@@ -2587,20 +3917,16 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	 * Check if the answer is found in the cache before
 	 * creating sockets to the server.
 	 */
-	entry = cache_check(buf, &qtype, IPPROTO_TCP);
+	entry = cache_check(buf, req->request_len, IPPROTO_TCP);
 	if (entry != NULL) {
 		int ttl_left = 0;
 		struct cache_data *data;
 
-		DBG("cache hit %s type %s", query, qtype == 1 ? "A" : "AAAA");
-		if (qtype == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		DBG("cache hit %s type %d", query, entry->type);
+		data = entry->data;
 
 		if (data != NULL) {
-			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+			ttl_left = cache_hit(entry, data);
 
 			send_cached_response(client_sk, data->data,
 					data->data_len, NULL, 0, IPPROTO_TCP,
@@ -2610,6 +3936,9 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 			return TRUE;
 		} else
 			DBG("data missing, ignoring cache for this query");
+	} else if (neg_cache_reply(req, buf) == TRUE) {
+		g_free(req);
+		return TRUE;
 	}
 
 	for (list = server_list; list; list = list->next) {
@@ -2655,59 +3984,132 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	}
 	memcpy(req->name, query, sizeof(query));
 
-	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
-
-	request_list = g_slist_append(request_list, req);
+	request_set_timeout(req, 30);
+	request_insert(req);
 
 	return TRUE;
 }
 
-static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+/*
+ * Queue a cached answer to be sent with the rest of the batch. Returns
+ * FALSE if it does not fit, and the caller has to send it directly.
+ */
+static gboolean udp_batch_queue_cached(struct cache_data *data,
+				struct sockaddr *sa, socklen_t sa_len,
+				int id, int ttl)
 {
-	unsigned char buf[768];
-	char query[512];
-	struct request_data *req;
-	struct sockaddr_in6 client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
-	int sk, err, len;
-	struct listener_data *ifdata = user_data;
+	struct msghdr *hdr;
+	unsigned char *buf, *ptr;
+	int slot, len;
 
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		ifdata->udp_listener_watch = 0;
+	if (udp_batch == NULL || udp_batch->replies >= UDP_BATCH_SIZE)
 		return FALSE;
+
+	if (data->data_len > sizeof(udp_batch->reply_buf[0]) ||
+			sa_len > sizeof(udp_batch->reply_addr[0]))
+		return FALSE;
+
+	slot = udp_batch->replies;
+	buf = udp_batch->reply_buf[slot];
+
+	memcpy(buf, data->data, data->data_len);
+
+	len = prepare_cached_response(buf, data->data_len, IPPROTO_UDP,
+					id, data->answers, ttl, &ptr);
+	if (len < 0)
+		return FALSE;
+
+	memcpy(&udp_batch->reply_addr[slot], sa, sa_len);
+
+	udp_batch->reply_iov[slot].iov_base = ptr;
+	udp_batch->reply_iov[slot].iov_len = len;
+
+	hdr = &udp_batch->reply_msgs[slot].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name = &udp_batch->reply_addr[slot];
+	hdr->msg_namelen = sa_len;
+	hdr->msg_iov = &udp_batch->reply_iov[slot];
+	hdr->msg_iovlen = 1;
+
+	udp_batch->replies++;
+
+	return TRUE;
+}
+
+static void udp_batch_flush(int sk)
+{
+	int sent = 0, err;
+
+	while (sent < udp_batch->replies) {
+		err = sendmmsg(sk, &udp_batch->reply_msgs[sent],
+				udp_batch->replies - sent, MSG_NOSIGNAL);
+		if (err > 0) {
+			sent += err;
+			continue;
+		}
+
+		if (err < 0 && errno == EINTR)
+			continue;
+
+		if (err < 0 && errno != ENOSYS) {
+			connman_error("Cannot send cached DNS responses: %s",
+							strerror(errno));
+			break;
+		}
+
+		/* No sendmmsg() support, send one by one */
+		for (; sent < udp_batch->replies; sent++) {
+			struct msghdr *hdr;
+
+			hdr = &udp_batch->reply_msgs[sent].msg_hdr;
+
+			err = sendto(sk, hdr->msg_iov->iov_base,
+					hdr->msg_iov->iov_len, MSG_NOSIGNAL,
+					hdr->msg_name, hdr->msg_namelen);
+			if (err < 0)
+				connman_error("Cannot send cached DNS "
+					"response: %s", strerror(errno));
+		}
 	}
 
-	sk = g_io_channel_unix_get_fd(channel);
+	DBG("sk %d sent %d cached responses", sk, udp_batch->replies);
+
+	udp_batch->replies = 0;
+}
+
+static void udp_listener_request(struct listener_data *ifdata, int sk,
+				unsigned char *buf, int len,
+				struct sockaddr *client_addr,
+				socklen_t client_addr_len, gboolean batched)
+{
+	char query[512];
+	struct request_data *req;
+	struct cache_entry *entry;
+	int err;
 
-	memset(&client_addr, 0, client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, (void *)&client_addr,
-		       &client_addr_len);
 	if (len < 2)
-		return TRUE;
+		return;
 
 	DBG("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
 	err = parse_request(buf, len, query, sizeof(query));
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
-		send_response(sk, buf, len, (void *)&client_addr,
+		send_response(sk, buf, len, client_addr,
 				client_addr_len, IPPROTO_UDP);
-		return TRUE;
+		return;
 	}
 
 	req = g_try_new0(struct request_data, 1);
 	if (req == NULL)
-		return TRUE;
+		return;
 
-	memcpy(&req->sa, &client_addr, client_addr_len);
+	memcpy(&req->sa, client_addr, client_addr_len);
 	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 
 	req->srcid = buf[0] | (buf[1] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
+	request_alloc_ids(req);
 	req->request_len = len;
 
 	buf[0] = req->dstid & 0xff;
@@ -2717,14 +4119,148 @@ static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	req->ifdata = (struct listener_data *) ifdata;
 	req->append_domain = FALSE;
 
+	if (batched == TRUE && cache != NULL) {
+		entry = cache_check(buf, len, IPPROTO_UDP);
+		req->cache_checked = TRUE;
+
+		if (entry != NULL) {
+			struct cache_data *data;
+			int ttl_left;
+
+			DBG("cache hit %s type %d", query, entry->type);
+
+			data = entry->data;
+			if (data != NULL) {
+				ttl_left = cache_hit(entry, data);
+
+				if (udp_batch_queue_cached(data, &req->sa,
+						req->sa_len, req->srcid,
+						ttl_left) == FALSE)
+					send_cached_response(sk, data->data,
+						data->data_len, &req->sa,
+						req->sa_len, IPPROTO_UDP,
+						req->srcid, data->answers,
+						ttl_left);
+
+				g_free(req);
+				return;
+			}
+		} else if (neg_cache_reply(req, buf) == TRUE) {
+			g_free(req);
+			return;
+		}
+	}
+
 	if (resolv(req, buf, query) == TRUE) {
 		/* a cached result was sent, so the request can be released */
-	        g_free(req);
-		return TRUE;
+		g_free(req);
+		return;
+	}
+
+	/*
+	 * Keep the query so that it can be resent and answered from
+	 * the stale cache if no server replies.
+	 */
+	req->request = g_try_malloc(len);
+	if (req->request != NULL)
+		memcpy(req->request, buf, len);
+
+	req->name = g_strdup(query);
+
+	request_set_timeout(req, 5);
+	request_insert(req);
+}
+
+/*
+ * Drain the listener socket with recvmmsg(). We stop after a few
+ * full batches so that other sources get to run on the main loop.
+ */
+static int udp_listener_batch(struct listener_data *ifdata, int sk)
+{
+	int round, i, count;
+
+	for (round = 0; round < UDP_BATCH_ROUNDS; round++) {
+		for (i = 0; i < UDP_BATCH_SIZE; i++) {
+			struct msghdr *hdr = &udp_batch->msgs[i].msg_hdr;
+
+			udp_batch->iov[i].iov_base = udp_batch->buf[i];
+			udp_batch->iov[i].iov_len = UDP_REQUEST_SIZE;
+
+			memset(hdr, 0, sizeof(*hdr));
+			memset(&udp_batch->addr[i], 0,
+					sizeof(udp_batch->addr[i]));
+			hdr->msg_name = &udp_batch->addr[i];
+			hdr->msg_namelen = sizeof(udp_batch->addr[i]);
+			hdr->msg_iov = &udp_batch->iov[i];
+			hdr->msg_iovlen = 1;
+		}
+
+		count = recvmmsg(sk, udp_batch->msgs, UDP_BATCH_SIZE,
+							MSG_DONTWAIT, NULL);
+		if (count < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+							errno == EINTR)
+				return 0;
+
+			return -errno;
+		}
+
+		if (count == 0)
+			return 0;
+
+		DBG("sk %d batch of %d queries", sk, count);
+
+		udp_batch->replies = 0;
+
+		for (i = 0; i < count; i++)
+			udp_listener_request(ifdata, sk, udp_batch->buf[i],
+					udp_batch->msgs[i].msg_len,
+					udp_batch->msgs[i].msg_hdr.msg_name,
+					udp_batch->msgs[i].msg_hdr.msg_namelen,
+					TRUE);
+
+		if (udp_batch->replies > 0)
+			udp_batch_flush(sk);
+
+		if (count < UDP_BATCH_SIZE)
+			break;
+	}
+
+	return 0;
+}
+
+static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	unsigned char buf[UDP_REQUEST_SIZE];
+	struct sockaddr_in6 client_addr;
+	socklen_t client_addr_len = sizeof(client_addr);
+	int sk, len;
+	struct listener_data *ifdata = user_data;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		ifdata->udp_listener_watch = 0;
+		return FALSE;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	if (udp_batch != NULL && udp_batch_disabled == FALSE) {
+		int err = udp_listener_batch(ifdata, sk);
+		if (err != -ENOSYS)
+			return TRUE;
+
+		DBG("recvmmsg() not supported, batching disabled");
+		udp_batch_disabled = TRUE;
 	}
 
-	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
-	request_list = g_slist_append(request_list, req);
+	memset(&client_addr, 0, client_addr_len);
+	len = recvfrom(sk, buf, sizeof(buf), 0, (void *)&client_addr,
+		       &client_addr_len);
+
+	udp_listener_request(ifdata, sk, buf, len, (void *)&client_addr,
+					client_addr_len, FALSE);
 
 	return TRUE;
 }
@@ -2884,24 +4420,19 @@ static int create_listener(struct listener_data *ifdata)
 static void destroy_listener(struct listener_data *ifdata)
 {
 	int index;
-	GSList *list;
 
 	index = connman_inet_ifindex("lo");
 	if (ifdata->index == index)
 		__connman_resolvfile_remove(index, NULL, "127.0.0.1");
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	while (request_list.head != NULL) {
+		struct request_data *req = request_list.head->data;
 
 		DBG("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
 		destroy_request_data(req);
-		list->data = NULL;
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
-
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
 }
@@ -2974,6 +4505,17 @@ int __connman_dnsproxy_init(void)
 
 	srandom(time(NULL));
 
+	udp_batch = g_try_new0(struct udp_batch, 1);
+
+	request_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	cache_max_size = connman_setting_get_uint("DNSCacheSize");
+	cache_max_entries = connman_setting_get_uint("DNSCacheEntries");
+	cache_prefetch = connman_setting_get_uint("DNSCachePrefetch");
+	cache_stale_time = connman_setting_get_uint("DNSCacheStaleTime");
+	neg_cache_max_size = connman_setting_get_uint("DNSNegativeCacheSize");
+	cache_snapshot_enabled = connman_setting_get_bool("DNSCacheSnapshot");
+
 	listener_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, g_free);
 
@@ -2986,11 +4528,20 @@ int __connman_dnsproxy_init(void)
 	if (err < 0)
 		goto destroy;
 
+	if (cache_snapshot_enabled == TRUE) {
+		cache_snapshot_load();
+		cache_snapshot_timer = g_timeout_add_seconds(
+					CACHE_SNAPSHOT_INTERVAL,
+					cache_snapshot_periodic, NULL);
+	}
+
 	return 0;
 
 destroy:
 	__connman_dnsproxy_remove_listener(index);
 	g_hash_table_destroy(listener_table);
+	g_hash_table_destroy(request_ids);
+	request_ids = NULL;
 
 	return err;
 }
@@ -3004,4 +4555,31 @@ void __connman_dnsproxy_cleanup(void)
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
 
 	g_hash_table_destroy(listener_table);
+
+	if (request_wheel_timer > 0) {
+		g_source_remove(request_wheel_timer);
+		request_wheel_timer = 0;
+	}
+
+	if (fanout_timer > 0) {
+		g_source_remove(fanout_timer);
+		fanout_timer = 0;
+	}
+
+	if (cache_snapshot_enabled == TRUE) {
+		cache_snapshot_save();
+		cache_snapshot_drop();
+
+		g_source_remove(cache_snapshot_timer);
+		cache_snapshot_timer = 0;
+
+		g_free(cache_service_ident);
+		cache_service_ident = NULL;
+	}
+
+	g_hash_table_destroy(request_ids);
+	request_ids = NULL;
+
+	g_free(udp_batch);
+	udp_batch = NULL;
 }
@@ -0,0 +1,231 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+
+#include "connman.h"
+
+/*
+ * Firewall backend on top of the legacy iptables interface. Edits are
+ * staged in the nat table shadow and pushed with one table replace.
+ * Each nat remembers what the kernel had at the last commit, so that
+ * an aborted or failed commit can roll its staged state back.
+ */
+
+struct connman_firewall_nat {
+	char *address;
+	unsigned char prefixlen;
+
+	struct connman_iptables_rule *rule;
+
+	/* staged state */
+	char *interface;
+
+	/* state in the kernel as of the last commit */
+	char *committed_interface;
+};
+
+static GSList *nat_list;
+
+struct connman_firewall_nat *__connman_firewall_nat_new(const char *address,
+						unsigned char prefixlen)
+{
+	struct connman_firewall_nat *nat;
+
+	nat = g_try_new0(struct connman_firewall_nat, 1);
+	if (nat == NULL)
+		return NULL;
+
+	nat->address = g_strdup(address);
+	nat->prefixlen = prefixlen;
+
+	nat_list = g_slist_prepend(nat_list, nat);
+
+	return nat;
+}
+
+void __connman_firewall_nat_free(struct connman_firewall_nat *nat)
+{
+	if (nat == NULL)
+		return;
+
+	nat_list = g_slist_remove(nat_list, nat);
+
+	__connman_iptables_rule_free(nat->rule);
+	g_free(nat->committed_interface);
+	g_free(nat->interface);
+	g_free(nat->address);
+	g_free(nat);
+}
+
+static struct connman_iptables_rule *new_nat_rule(
+					struct connman_firewall_nat *nat)
+{
+	struct connman_iptables_rule *rule;
+
+	rule = __connman_iptables_rule_new("nat", "POSTROUTING");
+	if (rule == NULL)
+		return NULL;
+
+	if (nat->address != NULL &&
+			__connman_iptables_rule_set_source(rule, nat->address,
+						nat->prefixlen) < 0)
+		goto err;
+
+	if (__connman_iptables_rule_set_target(rule, "MASQUERADE") < 0)
+		goto err;
+
+	return rule;
+
+err:
+	__connman_iptables_rule_free(rule);
+
+	return NULL;
+}
+
+int __connman_firewall_nat_enable(struct connman_firewall_nat *nat,
+						const char *interface)
+{
+	int err;
+
+	if (nat->interface != NULL)
+		return -EALREADY;
+
+	if (nat->rule == NULL) {
+		nat->rule = new_nat_rule(nat);
+		if (nat->rule == NULL)
+			return -EINVAL;
+	}
+
+	/* Enable masquerading */
+	err = __connman_iptables_rule_set_out_interface(nat->rule, interface);
+	if (err < 0)
+		return err;
+
+	err = __connman_iptables_rule_append(nat->rule);
+	if (err < 0)
+		return err;
+
+	nat->interface = g_strdup(interface);
+
+	return 0;
+}
+
+int __connman_firewall_nat_disable(struct connman_firewall_nat *nat)
+{
+	int err;
+
+	if (nat->interface == NULL)
+		return 0;
+
+	/* Disable masquerading */
+	err = __connman_iptables_rule_set_out_interface(nat->rule,
+							nat->interface);
+	if (err < 0)
+		return err;
+
+	/* A rule removed behind our back is as good as disabled */
+	err = __connman_iptables_rule_delete(nat->rule);
+	if (err < 0 && err != -ENOENT)
+		return err;
+
+	g_free(nat->interface);
+	nat->interface = NULL;
+
+	return 0;
+}
+
+int __connman_firewall_flush_nat(void)
+{
+	GSList *list;
+	int err;
+
+	err = __connman_iptables_command("-t nat -F POSTROUTING");
+	if (err < 0)
+		return err;
+
+	for (list = nat_list; list != NULL; list = list->next) {
+		struct connman_firewall_nat *nat = list->data;
+
+		g_free(nat->interface);
+		nat->interface = NULL;
+	}
+
+	return 0;
+}
+
+static void reset_nat(gboolean commit)
+{
+	GSList *list;
+
+	for (list = nat_list; list != NULL; list = list->next) {
+		struct connman_firewall_nat *nat = list->data;
+
+		if (commit == TRUE) {
+			g_free(nat->committed_interface);
+			nat->committed_interface = g_strdup(nat->interface);
+		} else {
+			g_free(nat->interface);
+			nat->interface = g_strdup(nat->committed_interface);
+		}
+	}
+}
+
+int __connman_firewall_commit(void)
+{
+	int err;
+
+	/* A failed commit drops the shadow, the kernel keeps the old rules */
+	err = __connman_iptables_commit("nat");
+	if (err < 0) {
+		reset_nat(FALSE);
+		return err;
+	}
+
+	reset_nat(TRUE);
+
+	return 0;
+}
+
+void __connman_firewall_abort(void)
+{
+	__connman_iptables_abort("nat");
+
+	reset_nat(FALSE);
+}
+
+int __connman_firewall_init(void)
+{
+	DBG("");
+
+	return __connman_iptables_init();
+}
+
+void __connman_firewall_cleanup(void)
+{
+	DBG("");
+
+	__connman_iptables_cleanup();
+}
@@ -0,0 +1,881 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2012  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/table.h>
+#include <libnftnl/chain.h>
+#include <libnftnl/set.h>
+#include <libnftnl/rule.h>
+#include <libnftnl/expr.h>
+
+#include "connman.h"
+
+/*
+ * Firewall backend on top of nf_tables. ConnMan owns the "connman" table
+ * outright. Masqueraded source prefixes live in an interval set, so
+ * adding or removing a tethering client network only sends set element
+ * updates; the handful of rules are only rewritten when the set of
+ * outgoing interfaces changes. Every commit is one atomic netlink batch.
+ */
+
+#define CONNMAN_TABLE		"connman"
+#define CONNMAN_NAT_PREROUTING	"nat-prerouting"
+#define CONNMAN_NAT_POSTROUTING	"nat-postrouting"
+#define CONNMAN_NAT_SOURCES	"nat-sources"
+#define CONNMAN_NAT_SOURCES_ID	1
+
+/* nftables' datatype number for ipv4_addr */
+#define NFT_TYPE_IPADDR		7
+
+#define BATCH_LIMIT		(8 * MNL_SOCKET_BUFFER_SIZE)
+
+struct connman_firewall_nat {
+	char *address;
+	unsigned char prefixlen;
+
+	/* staged state */
+	char *interface;
+
+	/* state in the kernel as of the last commit */
+	char *committed_interface;
+};
+
+struct nat_interval {
+	uint32_t start;
+	uint64_t end;		/* exclusive, 1 << 32 when open ended */
+};
+
+static struct mnl_socket *nl;
+static uint32_t nl_seq;
+static char *batch_buf;
+
+static GSList *nat_list;
+static gboolean rebuild;
+
+static GArray *committed_intervals;
+static GSList *committed_rules;
+
+struct connman_firewall_nat *__connman_firewall_nat_new(const char *address,
+						unsigned char prefixlen)
+{
+	struct connman_firewall_nat *nat;
+
+	if (prefixlen > 32)
+		return NULL;
+
+	nat = g_try_new0(struct connman_firewall_nat, 1);
+	if (nat == NULL)
+		return NULL;
+
+	if (address != NULL) {
+		struct in_addr addr;
+
+		if (inet_pton(AF_INET, address, &addr) != 1) {
+			g_free(nat);
+			return NULL;
+		}
+	}
+
+	nat->address = g_strdup(address);
+	nat->prefixlen = prefixlen;
+
+	nat_list = g_slist_prepend(nat_list, nat);
+
+	return nat;
+}
+
+void __connman_firewall_nat_free(struct connman_firewall_nat *nat)
+{
+	if (nat == NULL)
+		return;
+
+	/* Whatever the nat still had in the kernel goes with the next commit */
+	nat_list = g_slist_remove(nat_list, nat);
+
+	g_free(nat->committed_interface);
+	g_free(nat->interface);
+	g_free(nat->address);
+	g_free(nat);
+}
+
+int __connman_firewall_nat_enable(struct connman_firewall_nat *nat,
+						const char *interface)
+{
+	if (nat->interface != NULL)
+		return -EALREADY;
+
+	if (interface == NULL || strlen(interface) >= IFNAMSIZ)
+		return -EINVAL;
+
+	nat->interface = g_strdup(interface);
+
+	return 0;
+}
+
+int __connman_firewall_nat_disable(struct connman_firewall_nat *nat)
+{
+	g_free(nat->interface);
+	nat->interface = NULL;
+
+	return 0;
+}
+
+int __connman_firewall_flush_nat(void)
+{
+	GSList *list;
+
+	for (list = nat_list; list != NULL; list = list->next) {
+		struct connman_firewall_nat *nat = list->data;
+
+		g_free(nat->interface);
+		nat->interface = NULL;
+	}
+
+	rebuild = TRUE;
+
+	return 0;
+}
+
+static gint compare_interval(gconstpointer a, gconstpointer b)
+{
+	const struct nat_interval *ia = a, *ib = b;
+
+	if (ia->start < ib->start)
+		return -1;
+
+	return ia->start > ib->start;
+}
+
+/*
+ * The kernel does not merge overlapping or adjacent intervals, so the
+ * staged source prefixes are folded into disjoint ranges first.
+ */
+static GArray *desired_intervals(void)
+{
+	GArray *intervals;
+	GSList *list;
+	unsigned int i, n;
+
+	intervals = g_array_new(FALSE, FALSE, sizeof(struct nat_interval));
+
+	for (list = nat_list; list != NULL; list = list->next) {
+		struct connman_firewall_nat *nat = list->data;
+		struct nat_interval interval;
+		struct in_addr addr;
+		uint32_t mask;
+
+		if (nat->interface == NULL || nat->address == NULL)
+			continue;
+
+		inet_pton(AF_INET, nat->address, &addr);
+
+		mask = nat->prefixlen == 0 ? 0 :
+				0xffffffff << (32 - nat->prefixlen);
+		interval.start = ntohl(addr.s_addr) & mask;
+		interval.end = (uint64_t) interval.start +
+					((uint64_t) 1 << (32 - nat->prefixlen));
+
+		g_array_append_val(intervals, interval);
+	}
+
+	if (intervals->len == 0)
+		return intervals;
+
+	g_array_sort(intervals, compare_interval);
+
+	for (i = 1, n = 0; i < intervals->len; i++) {
+		struct nat_interval *cur, *next;
+
+		cur = &g_array_index(intervals, struct nat_interval, n);
+		next = &g_array_index(intervals, struct nat_interval, i);
+
+		if (next->start <= cur->end) {
+			if (next->end > cur->end)
+				cur->end = next->end;
+			continue;
+		}
+
+		g_array_index(intervals, struct nat_interval, ++n) = *next;
+	}
+
+	g_array_set_size(intervals, n + 1);
+
+	return intervals;
+}
+
+static gboolean has_interval(GArray *intervals, struct nat_interval *interval)
+{
+	unsigned int i;
+
+	for (i = 0; i < intervals->len; i++) {
+		struct nat_interval *cur;
+
+		cur = &g_array_index(intervals, struct nat_interval, i);
+		if (cur->start == interval->start && cur->end == interval->end)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Rules are named by key: "s:<ifname>" masquerades the source set out
+ * of <ifname>, "a:<ifname>" masquerades everything (a nat without a
+ * source address). nat.c points every nat at the default interface, so
+ * one set shared by all interfaces is exact.
+ */
+static GSList *desired_rules(void)
+{
+	GSList *rules = NULL, *list;
+
+	for (list = nat_list; list != NULL; list = list->next) {
+		struct connman_firewall_nat *nat = list->data;
+		char *key;
+
+		if (nat->interface == NULL)
+			continue;
+
+		key = g_strdup_printf("%c:%s", nat->address != NULL ? 's' : 'a',
+							nat->interface);
+
+		if (g_slist_find_custom(rules, key,
+					(GCompareFunc) g_strcmp0) != NULL) {
+			g_free(key);
+			continue;
+		}
+
+		rules = g_slist_insert_sorted(rules, key,
+					(GCompareFunc) g_strcmp0);
+	}
+
+	return rules;
+}
+
+static gboolean same_rules(GSList *a, GSList *b)
+{
+	while (a != NULL && b != NULL) {
+		if (g_strcmp0(a->data, b->data) != 0)
+			return FALSE;
+
+		a = a->next;
+		b = b->next;
+	}
+
+	return a == NULL && b == NULL;
+}
+
+static void free_rules(GSList *rules)
+{
+	g_slist_free_full(rules, g_free);
+}
+
+static struct nlmsghdr *batch_msg(struct mnl_nlmsg_batch *batch,
+					uint16_t type, uint16_t flags)
+{
+	return nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch), type,
+					NFPROTO_IPV4, flags, ++nl_seq);
+}
+
+static int batch_next(struct mnl_nlmsg_batch *batch)
+{
+	if (mnl_nlmsg_batch_next(batch) == false)
+		return -ENOBUFS;
+
+	return 0;
+}
+
+static int add_table(struct mnl_nlmsg_batch *batch, uint16_t type,
+							uint16_t flags)
+{
+	struct nftnl_table *table;
+	struct nlmsghdr *nlh;
+
+	table = nftnl_table_alloc();
+	if (table == NULL)
+		return -ENOMEM;
+
+	nftnl_table_set_str(table, NFTNL_TABLE_NAME, CONNMAN_TABLE);
+
+	nlh = batch_msg(batch, type, flags);
+	nftnl_table_nlmsg_build_payload(nlh, table);
+	nftnl_table_free(table);
+
+	return batch_next(batch);
+}
+
+static int add_nat_chain(struct mnl_nlmsg_batch *batch, const char *name,
+					uint32_t hooknum, int32_t prio)
+{
+	struct nftnl_chain *chain;
+	struct nlmsghdr *nlh;
+
+	chain = nftnl_chain_alloc();
+	if (chain == NULL)
+		return -ENOMEM;
+
+	nftnl_chain_set_str(chain, NFTNL_CHAIN_TABLE, CONNMAN_TABLE);
+	nftnl_chain_set_str(chain, NFTNL_CHAIN_NAME, name);
+	nftnl_chain_set_str(chain, NFTNL_CHAIN_TYPE, "nat");
+	nftnl_chain_set_u32(chain, NFTNL_CHAIN_HOOKNUM, hooknum);
+	nftnl_chain_set_s32(chain, NFTNL_CHAIN_PRIO, prio);
+
+	nlh = batch_msg(batch, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	nftnl_chain_nlmsg_build_payload(nlh, chain);
+	nftnl_chain_free(chain);
+
+	return batch_next(batch);
+}
+
+static struct nftnl_set *sources_set_new(void)
+{
+	struct nftnl_set *set;
+
+	set = nftnl_set_alloc();
+	if (set == NULL)
+		return NULL;
+
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, CONNMAN_TABLE);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, CONNMAN_NAT_SOURCES);
+	nftnl_set_set_u32(set, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+	nftnl_set_set_u32(set, NFTNL_SET_ID, CONNMAN_NAT_SOURCES_ID);
+
+	return set;
+}
+
+static int add_sources_set(struct mnl_nlmsg_batch *batch)
+{
+	struct nftnl_set *set;
+	struct nlmsghdr *nlh;
+
+	set = sources_set_new();
+	if (set == NULL)
+		return -ENOMEM;
+
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_TYPE, NFT_TYPE_IPADDR);
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_LEN, sizeof(uint32_t));
+	nftnl_set_set_u32(set, NFTNL_SET_FLAGS, NFT_SET_INTERVAL);
+
+	nlh = batch_msg(batch, NFT_MSG_NEWSET, NLM_F_CREATE);
+	nftnl_set_nlmsg_build_payload(nlh, set);
+	nftnl_set_free(set);
+
+	return batch_next(batch);
+}
+
+static int add_set_elem(struct nftnl_set *set, uint32_t key, gboolean end)
+{
+	struct nftnl_set_elem *elem;
+
+	elem = nftnl_set_elem_alloc();
+	if (elem == NULL)
+		return -ENOMEM;
+
+	key = htonl(key);
+	nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, &key, sizeof(key));
+
+	if (end == TRUE)
+		nftnl_set_elem_set_u32(elem, NFTNL_SET_ELEM_FLAGS,
+						NFT_SET_ELEM_INTERVAL_END);
+
+	nftnl_set_elem_add(set, elem);
+
+	return 0;
+}
+
+/*
+ * Emits one NEWSETELEM or DELSETELEM message for every interval in @from
+ * that is missing from @except. An interval is a start element plus an
+ * end marker; a range reaching the top of the address space has none.
+ */
+static int add_set_elems(struct mnl_nlmsg_batch *batch, uint16_t type,
+					GArray *from, GArray *except)
+{
+	struct nftnl_set *set;
+	struct nlmsghdr *nlh;
+	unsigned int i, count = 0;
+	int err = 0;
+
+	set = sources_set_new();
+	if (set == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < from->len; i++) {
+		struct nat_interval *interval;
+
+		interval = &g_array_index(from, struct nat_interval, i);
+		if (except != NULL && has_interval(except, interval) == TRUE)
+			continue;
+
+		err = add_set_elem(set, interval->start, FALSE);
+		if (err < 0)
+			goto out;
+
+		if (interval->end <= UINT32_MAX) {
+			err = add_set_elem(set, interval->end, TRUE);
+			if (err < 0)
+				goto out;
+		}
+
+		count++;
+	}
+
+	/* An element message without elements would flush the set */
+	if (count == 0)
+		goto out;
+
+	nlh = batch_msg(batch, type, type == NFT_MSG_NEWSETELEM ?
+							NLM_F_CREATE : 0);
+	nftnl_set_elems_nlmsg_build_payload(nlh, set);
+
+	err = batch_next(batch);
+
+out:
+	nftnl_set_free(set);
+
+	return err;
+}
+
+static int add_expr(struct nftnl_rule *rule, struct nftnl_expr *expr)
+{
+	if (expr == NULL)
+		return -ENOMEM;
+
+	nftnl_rule_add_expr(rule, expr);
+
+	return 0;
+}
+
+static int add_oifname_expr(struct nftnl_rule *rule, const char *ifname)
+{
+	struct nftnl_expr *expr;
+	char name[IFNAMSIZ];
+	int err;
+
+	expr = nftnl_expr_alloc("meta");
+	err = add_expr(rule, expr);
+	if (err < 0)
+		return err;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_OIFNAME);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
+
+	expr = nftnl_expr_alloc("cmp");
+	err = add_expr(rule, expr);
+	if (err < 0)
+		return err;
+
+	memset(name, 0, sizeof(name));
+	strncpy(name, ifname, sizeof(name) - 1);
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_CMP_SREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+	nftnl_expr_set(expr, NFTNL_EXPR_CMP_DATA, name, sizeof(name));
+
+	return 0;
+}
+
+static int add_saddr_lookup_expr(struct nftnl_rule *rule)
+{
+	struct nftnl_expr *expr;
+	int err;
+
+	expr = nftnl_expr_alloc("payload");
+	err = add_expr(rule, expr);
+	if (err < 0)
+		return err;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_PAYLOAD_BASE,
+					NFT_PAYLOAD_NETWORK_HEADER);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_PAYLOAD_OFFSET,
+					offsetof(struct iphdr, saddr));
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_PAYLOAD_LEN, sizeof(uint32_t));
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG_1);
+
+	expr = nftnl_expr_alloc("lookup");
+	err = add_expr(rule, expr);
+	if (err < 0)
+		return err;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SREG, NFT_REG_1);
+	nftnl_expr_set_str(expr, NFTNL_EXPR_LOOKUP_SET, CONNMAN_NAT_SOURCES);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SET_ID,
+					CONNMAN_NAT_SOURCES_ID);
+
+	return 0;
+}
+
+static int add_masq_rule(struct mnl_nlmsg_batch *batch, const char *key)
+{
+	struct nftnl_rule *rule;
+	struct nlmsghdr *nlh;
+	int err;
+
+	rule = nftnl_rule_alloc();
+	if (rule == NULL)
+		return -ENOMEM;
+
+	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
+	nftnl_rule_set_str(rule, NFTNL_RULE_CHAIN, CONNMAN_NAT_POSTROUTING);
+	nftnl_rule_set_u32(rule, NFTNL_RULE_FAMILY, NFPROTO_IPV4);
+
+	if (key[0] == 's') {
+		err = add_saddr_lookup_expr(rule);
+		if (err < 0)
+			goto out;
+	}
+
+	err = add_oifname_expr(rule, key + 2);
+	if (err < 0)
+		goto out;
+
+	err = add_expr(rule, nftnl_expr_alloc("masq"));
+	if (err < 0)
+		goto out;
+
+	nlh = batch_msg(batch, NFT_MSG_NEWRULE, NLM_F_APPEND | NLM_F_CREATE);
+	nftnl_rule_nlmsg_build_payload(nlh, rule);
+
+	err = batch_next(batch);
+
+out:
+	nftnl_rule_free(rule);
+
+	return err;
+}
+
+static int flush_postrouting(struct mnl_nlmsg_batch *batch)
+{
+	struct nftnl_rule *rule;
+	struct nlmsghdr *nlh;
+
+	rule = nftnl_rule_alloc();
+	if (rule == NULL)
+		return -ENOMEM;
+
+	/* A rule delete without a handle flushes the chain */
+	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
+	nftnl_rule_set_str(rule, NFTNL_RULE_CHAIN, CONNMAN_NAT_POSTROUTING);
+
+	nlh = batch_msg(batch, NFT_MSG_DELRULE, 0);
+	nftnl_rule_nlmsg_build_payload(nlh, rule);
+	nftnl_rule_free(rule);
+
+	return batch_next(batch);
+}
+
+static int add_rules(struct mnl_nlmsg_batch *batch, GSList *rules)
+{
+	GSList *list;
+	int err;
+
+	for (list = rules; list != NULL; list = list->next) {
+		err = add_masq_rule(batch, list->data);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Creating the table before deleting it makes the delete safe when
+ * it does not exist yet; the whole batch is applied atomically.
+ */
+static int add_table_rebuild(struct mnl_nlmsg_batch *batch,
+				GArray *intervals, GSList *rules)
+{
+	int err;
+
+	err = add_table(batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+	if (err < 0)
+		return err;
+
+	err = add_table(batch, NFT_MSG_DELTABLE, 0);
+	if (err < 0)
+		return err;
+
+	err = add_table(batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+	if (err < 0)
+		return err;
+
+	err = add_nat_chain(batch, CONNMAN_NAT_PREROUTING,
+					NF_INET_PRE_ROUTING, -100);
+	if (err < 0)
+		return err;
+
+	err = add_nat_chain(batch, CONNMAN_NAT_POSTROUTING,
+					NF_INET_POST_ROUTING, 100);
+	if (err < 0)
+		return err;
+
+	err = add_sources_set(batch);
+	if (err < 0)
+		return err;
+
+	err = add_set_elems(batch, NFT_MSG_NEWSETELEM, intervals, NULL);
+	if (err < 0)
+		return err;
+
+	return add_rules(batch, rules);
+}
+
+/*
+ * The kernel only answers with error messages since no message asks for
+ * an ack, and it has processed the whole batch by the time sendto()
+ * returns, so everything queued on the socket can be drained at once.
+ */
+static int send_batch(struct mnl_nlmsg_batch *batch)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int err = 0, fd;
+	ssize_t len;
+
+	if (mnl_socket_sendto(nl, mnl_nlmsg_batch_head(batch),
+				mnl_nlmsg_batch_size(batch)) < 0)
+		return -errno;
+
+	fd = mnl_socket_get_fd(nl);
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		if (mnl_cb_run(buf, len, 0, 0, NULL, NULL) < 0 && err == 0)
+			err = -errno;
+	}
+
+	return err;
+}
+
+static int run_batch(GArray *intervals, GSList *rules)
+{
+	struct mnl_nlmsg_batch *batch;
+	size_t empty;
+	int err;
+
+	batch = mnl_nlmsg_batch_start(batch_buf, BATCH_LIMIT);
+	if (batch == NULL)
+		return -ENOMEM;
+
+	nftnl_batch_begin(mnl_nlmsg_batch_current(batch), ++nl_seq);
+	mnl_nlmsg_batch_next(batch);
+	empty = mnl_nlmsg_batch_size(batch);
+
+	if (rebuild == TRUE) {
+		err = add_table_rebuild(batch, intervals, rules);
+		if (err < 0)
+			goto out;
+	} else {
+		err = add_set_elems(batch, NFT_MSG_DELSETELEM,
+					committed_intervals, intervals);
+		if (err < 0)
+			goto out;
+
+		err = add_set_elems(batch, NFT_MSG_NEWSETELEM,
+					intervals, committed_intervals);
+		if (err < 0)
+			goto out;
+
+		if (same_rules(rules, committed_rules) == FALSE) {
+			err = flush_postrouting(batch);
+			if (err < 0)
+				goto out;
+
+			err = add_rules(batch, rules);
+			if (err < 0)
+				goto out;
+		}
+	}
+
+	/* Nothing but the batch begin message means nothing changed */
+	if (mnl_nlmsg_batch_size(batch) == empty)
+		goto out;
+
+	nftnl_batch_end(mnl_nlmsg_batch_current(batch), ++nl_seq);
+	mnl_nlmsg_batch_next(batch);
+
+	err = send_batch(batch);
+
+out:
+	mnl_nlmsg_batch_stop(batch);
+
+	return err;
+}
+
+static void reset_nat(gboolean commit)
+{
+	GSList *list;
+
+	for (list = nat_list; list != NULL; list = list->next) {
+		struct connman_firewall_nat *nat = list->data;
+
+		if (commit == TRUE) {
+			g_free(nat->committed_interface);
+			nat->committed_interface = g_strdup(nat->interface);
+		} else {
+			g_free(nat->interface);
+			nat->interface = g_strdup(nat->committed_interface);
+		}
+	}
+}
+
+int __connman_firewall_commit(void)
+{
+	GArray *intervals;
+	GSList *rules;
+	int err;
+
+	if (nl == NULL)
+		return -ENOTCONN;
+
+	intervals = desired_intervals();
+	rules = desired_rules();
+
+	err = run_batch(intervals, rules);
+	if (err < 0) {
+		connman_error("nftables commit failed: %s", strerror(-err));
+
+		g_array_free(intervals, TRUE);
+		free_rules(rules);
+
+		__connman_firewall_abort();
+
+		return err;
+	}
+
+	g_array_free(committed_intervals, TRUE);
+	committed_intervals = intervals;
+
+	free_rules(committed_rules);
+	committed_rules = rules;
+
+	rebuild = FALSE;
+	reset_nat(TRUE);
+
+	return 0;
+}
+
+void __connman_firewall_abort(void)
+{
+	reset_nat(FALSE);
+}
+
+int __connman_firewall_init(void)
+{
+	int err;
+
+	DBG("");
+
+	nl = mnl_socket_open(NETLINK_NETFILTER);
+	if (nl == NULL)
+		return -errno;
+
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		err = -errno;
+		goto err;
+	}
+
+	batch_buf = g_try_malloc(2 * BATCH_LIMIT);
+	if (batch_buf == NULL) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	committed_intervals = g_array_new(FALSE, FALSE,
+					sizeof(struct nat_interval));
+	committed_rules = NULL;
+
+	rebuild = TRUE;
+
+	err = __connman_firewall_commit();
+	if (err < 0)
+		goto err;
+
+	return 0;
+
+err:
+	if (committed_intervals != NULL) {
+		g_array_free(committed_intervals, TRUE);
+		committed_intervals = NULL;
+	}
+
+	g_free(batch_buf);
+	batch_buf = NULL;
+
+	mnl_socket_close(nl);
+	nl = NULL;
+
+	return err;
+}
+
+void __connman_firewall_cleanup(void)
+{
+	struct mnl_nlmsg_batch *batch;
+
+	DBG("");
+
+	if (nl == NULL)
+		return;
+
+	batch = mnl_nlmsg_batch_start(batch_buf, BATCH_LIMIT);
+	if (batch != NULL) {
+		nftnl_batch_begin(mnl_nlmsg_batch_current(batch), ++nl_seq);
+		mnl_nlmsg_batch_next(batch);
+
+		if (add_table(batch, NFT_MSG_NEWTABLE, NLM_F_CREATE) == 0 &&
+				add_table(batch, NFT_MSG_DELTABLE, 0) == 0) {
+			nftnl_batch_end(mnl_nlmsg_batch_current(batch),
+								++nl_seq);
+			mnl_nlmsg_batch_next(batch);
+
+			if (send_batch(batch) < 0)
+				connman_warn("Failed to remove nftables table");
+		}
+
+		mnl_nlmsg_batch_stop(batch);
+	}
+
+	free_rules(committed_rules);
+	committed_rules = NULL;
+
+	g_array_free(committed_intervals, TRUE);
+	committed_intervals = NULL;
+
+	g_free(batch_buf);
+	batch_buf = NULL;
+
+	mnl_socket_close(nl);
+	nl = NULL;
+}
@@ -45,6 +45,7 @@
 #include <fcntl.h>
 #include <linux/if_tun.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "connman.h"
 
@@ -52,6 +53,148 @@
 	((struct rtattr *) (((uint8_t*) (nmsg)) +	\
 	NLMSG_ALIGN((nmsg)->nlmsg_len)))
 
+/*
+ * Control sockets for the ioctl and netlink requests below. They are
+ * opened on first use and then shared by all calls, instead of opening
+ * and closing a socket for every single request.
+ */
+static int inet_sk = -1;
+static int inet6_sk = -1;
+static int rtnl_sk = -1;
+
+/*
+ * Interface index and name mapping, kept up to date by rtnl from the
+ * link events. A lookup which misses falls back to an ioctl.
+ */
+static GHashTable *ifname_cache = NULL;
+static GHashTable *ifindex_cache = NULL;
+
+static GSList *batch_list = NULL;
+
+static int control_socket(int *sk, int domain, int protocol)
+{
+	int err;
+
+	if (*sk >= 0)
+		return *sk;
+
+	*sk = socket(domain, SOCK_DGRAM | SOCK_CLOEXEC, protocol);
+	if (*sk < 0) {
+		err = -errno;
+		*sk = -1;
+		return err;
+	}
+
+	return *sk;
+}
+
+static int inet_socket(int family)
+{
+	if (family == AF_INET6)
+		return control_socket(&inet6_sk, AF_INET6, 0);
+
+	return control_socket(&inet_sk, AF_INET, 0);
+}
+
+static void close_socket(int *sk)
+{
+	if (*sk < 0)
+		return;
+
+	close(*sk);
+	*sk = -1;
+}
+
+/*
+ * Set up ifr for a request on the interface index, the name is taken
+ * from the cache when possible.
+ */
+static int inet_ifreq(struct ifreq *ifr, int index)
+{
+	const char *name = NULL;
+	int sk;
+
+	memset(ifr, 0, sizeof(*ifr));
+	ifr->ifr_ifindex = index;
+
+	if (ifname_cache != NULL)
+		name = g_hash_table_lookup(ifname_cache,
+						GINT_TO_POINTER(index));
+	if (name != NULL) {
+		strncpy(ifr->ifr_name, name, sizeof(ifr->ifr_name) - 1);
+		return 0;
+	}
+
+	sk = inet_socket(AF_INET);
+	if (sk < 0)
+		return sk;
+
+	if (ioctl(sk, SIOCGIFNAME, ifr) < 0)
+		return -errno;
+
+	return 0;
+}
+
+void __connman_inet_update_ifname(int index, const char *name)
+{
+	const char *old;
+
+	if (ifname_cache == NULL)
+		return;
+
+	old = g_hash_table_lookup(ifname_cache, GINT_TO_POINTER(index));
+	if (g_strcmp0(old, name) == 0)
+		return;
+
+	if (old != NULL) {
+		DBG("index %d name %s removed", index, old);
+
+		if (g_hash_table_lookup(ifindex_cache, old) ==
+						GINT_TO_POINTER(index))
+			g_hash_table_remove(ifindex_cache, old);
+
+		g_hash_table_remove(ifname_cache, GINT_TO_POINTER(index));
+	}
+
+	if (name == NULL)
+		return;
+
+	g_hash_table_replace(ifname_cache, GINT_TO_POINTER(index),
+							g_strdup(name));
+	g_hash_table_replace(ifindex_cache, g_strdup(name),
+						GINT_TO_POINTER(index));
+}
+
+int __connman_inet_init(void)
+{
+	DBG("");
+
+	ifname_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+								NULL, g_free);
+	ifindex_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+
+	return 0;
+}
+
+void __connman_inet_cleanup(void)
+{
+	DBG("");
+
+	while (batch_list != NULL)
+		__connman_inet_batch_free(batch_list->data);
+
+	g_hash_table_destroy(ifindex_cache);
+	ifindex_cache = NULL;
+
+	g_hash_table_destroy(ifname_cache);
+	ifname_cache = NULL;
+
+	close_socket(&inet_sk);
+	close_socket(&inet6_sk);
+	close_socket(&rtnl_sk);
+}
+
 int __connman_inet_rtnl_addattr_l(struct nlmsghdr *n, size_t max_length,
 				int type, const void *data, size_t data_length)
 {
@@ -72,28 +215,23 @@ int __connman_inet_rtnl_addattr_l(struct nlmsghdr *n, size_t max_length,
 	return 0;
 }
 
-int __connman_inet_modify_address(int cmd, int flags,
+/* Large enough for an address or a route request and its attributes */
+#define INET_REQUEST_SIZE (NLMSG_ALIGN(sizeof(struct nlmsghdr)) +	\
+			NLMSG_ALIGN(sizeof(struct rtmsg)) +		\
+			4 * RTA_LENGTH(sizeof(struct in6_addr)))
+
+static int build_address_request(struct nlmsghdr *header, size_t size,
+				int cmd, int flags,
 				int index, int family,
 				const char *address,
 				const char *peer,
 				unsigned char prefixlen,
 				const char *broadcast)
 {
-	uint8_t request[NLMSG_ALIGN(sizeof(struct nlmsghdr)) +
-			NLMSG_ALIGN(sizeof(struct ifaddrmsg)) +
-			RTA_LENGTH(sizeof(struct in6_addr)) +
-			RTA_LENGTH(sizeof(struct in6_addr))];
-
-	struct nlmsghdr *header;
-	struct sockaddr_nl nl_addr;
 	struct ifaddrmsg *ifaddrmsg;
 	struct in6_addr ipv6_addr;
 	struct in_addr ipv4_addr, ipv4_dest, ipv4_bcast;
-	int sk, err;
-
-	DBG("cmd %#x flags %#x index %d family %d address %s peer %s "
-		"prefixlen %hhu broadcast %s", cmd, flags, index, family,
-		address, peer, prefixlen, broadcast);
+	int err;
 
 	if (address == NULL)
 		return -EINVAL;
@@ -101,9 +239,8 @@ int __connman_inet_modify_address(int cmd, int flags,
 	if (family != AF_INET && family != AF_INET6)
 		return -EINVAL;
 
-	memset(&request, 0, sizeof(request));
+	memset(header, 0, size);
 
-	header = (struct nlmsghdr *)request;
 	header->nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
 	header->nlmsg_type = cmd;
 	header->nlmsg_flags = NLM_F_REQUEST | flags;
@@ -130,8 +267,7 @@ int __connman_inet_modify_address(int cmd, int flags,
 			if (inet_pton(AF_INET, peer, &ipv4_dest) < 1)
 				return -1;
 
-			err = __connman_inet_rtnl_addattr_l(header,
-							sizeof(request),
+			err = __connman_inet_rtnl_addattr_l(header, size,
 							IFA_ADDRESS,
 							&ipv4_dest,
 							sizeof(ipv4_dest));
@@ -139,16 +275,14 @@ int __connman_inet_modify_address(int cmd, int flags,
 				return err;
 		}
 
-		err = __connman_inet_rtnl_addattr_l(header,
-						sizeof(request),
+		err = __connman_inet_rtnl_addattr_l(header, size,
 						IFA_LOCAL,
 						&ipv4_addr,
 						sizeof(ipv4_addr));
 		if (err < 0)
 			return err;
 
-		err = __connman_inet_rtnl_addattr_l(header,
-						sizeof(request),
+		err = __connman_inet_rtnl_addattr_l(header, size,
 						IFA_BROADCAST,
 						&ipv4_bcast,
 						sizeof(ipv4_bcast));
@@ -159,8 +293,7 @@ int __connman_inet_modify_address(int cmd, int flags,
 		if (inet_pton(AF_INET6, address, &ipv6_addr) < 1)
 			return -1;
 
-		err = __connman_inet_rtnl_addattr_l(header,
-						sizeof(request),
+		err = __connman_inet_rtnl_addattr_l(header, size,
 						IFA_LOCAL,
 						&ipv6_addr,
 						sizeof(ipv6_addr));
@@ -168,34 +301,65 @@ int __connman_inet_modify_address(int cmd, int flags,
 			return err;
 	}
 
-	sk = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+	return 0;
+}
+
+int __connman_inet_modify_address(int cmd, int flags,
+				int index, int family,
+				const char *address,
+				const char *peer,
+				unsigned char prefixlen,
+				const char *broadcast)
+{
+	uint8_t request[INET_REQUEST_SIZE];
+	char reply[NLMSG_SPACE(sizeof(struct nlmsgerr))];
+	struct nlmsghdr *header = (struct nlmsghdr *) request;
+	struct sockaddr_nl nl_addr;
+	int sk, err;
+
+	DBG("cmd %#x flags %#x index %d family %d address %s peer %s "
+		"prefixlen %hhu broadcast %s", cmd, flags, index, family,
+		address, peer, prefixlen, broadcast);
+
+	err = build_address_request(header, sizeof(request), cmd, flags,
+					index, family, address, peer,
+					prefixlen, broadcast);
+	if (err < 0)
+		return err;
+
+	sk = control_socket(&rtnl_sk, AF_NETLINK, NETLINK_ROUTE);
 	if (sk < 0)
-		return -errno;
+		return sk;
+
+	/* Nobody waits for the replies, drop those of earlier requests */
+	while (recv(sk, reply, sizeof(reply), MSG_DONTWAIT) > 0)
+		;
 
 	memset(&nl_addr, 0, sizeof(nl_addr));
 	nl_addr.nl_family = AF_NETLINK;
 
-	if ((err = sendto(sk, request, header->nlmsg_len, 0,
-			(struct sockaddr *) &nl_addr, sizeof(nl_addr))) < 0)
-		goto done;
-
-	err = 0;
-
-done:
-	close(sk);
+	if (sendto(sk, request, header->nlmsg_len, 0,
+			(struct sockaddr *) &nl_addr, sizeof(nl_addr)) < 0)
+		return -errno;
 
-	return err;
+	return 0;
 }
 
 int connman_inet_ifindex(const char *name)
 {
 	struct ifreq ifr;
+	gpointer index;
 	int sk, err;
 
 	if (name == NULL)
 		return -1;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (ifindex_cache != NULL &&
+			g_hash_table_lookup_extended(ifindex_cache, name,
+						NULL, &index) == TRUE)
+		return GPOINTER_TO_INT(index);
+
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
 		return -1;
 
@@ -203,9 +367,6 @@ int connman_inet_ifindex(const char *name)
 	strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
 
 	err = ioctl(sk, SIOCGIFINDEX, &ifr);
-
-	close(sk);
-
 	if (err < 0)
 		return -1;
 
@@ -215,23 +376,11 @@ int connman_inet_ifindex(const char *name)
 char *connman_inet_ifname(int index)
 {
 	struct ifreq ifr;
-	int sk, err;
 
 	if (index < 0)
 		return NULL;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-	if (sk < 0)
-		return NULL;
-
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	err = ioctl(sk, SIOCGIFNAME, &ifr);
-
-	close(sk);
-
-	if (err < 0)
+	if (inet_ifreq(&ifr, index) < 0)
 		return NULL;
 
 	return g_strdup(ifr.ifr_name);
@@ -242,29 +391,18 @@ short int connman_inet_ifflags(int index)
 	struct ifreq ifr;
 	int sk, err;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
-		return -errno;
-
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
-
-	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+		return sk;
 
-	err = ifr.ifr_flags;
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
+		return err;
 
-done:
-	close(sk);
+	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0)
+		return -errno;
 
-	return err;
+	return ifr.ifr_flags;
 }
 
 int connman_inet_ifup(int index)
@@ -272,41 +410,26 @@ int connman_inet_ifup(int index)
 	struct ifreq ifr;
 	int sk, err;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
-		return -errno;
-
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
+		return sk;
 
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
+		return err;
 
-	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0)
+		return -errno;
 
-	if (ifr.ifr_flags & IFF_UP) {
-		err = -EALREADY;
-		goto done;
-	}
+	if (ifr.ifr_flags & IFF_UP)
+		return -EALREADY;
 
 	ifr.ifr_flags |= (IFF_UP|IFF_DYNAMIC);
 
-	if (ioctl(sk, SIOCSIFFLAGS, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
-
-	err = 0;
-
-done:
-	close(sk);
+	if (ioctl(sk, SIOCSIFFLAGS, &ifr) < 0)
+		return -errno;
 
-	return err;
+	return 0;
 }
 
 int connman_inet_ifdown(int index)
@@ -315,22 +438,16 @@ int connman_inet_ifdown(int index)
 	struct sockaddr_in *addr;
 	int sk, err;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
-		return -errno;
-
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
+		return sk;
 
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
+		return err;
 
-	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0)
+		return -errno;
 
 	memset(&addr_ifr, 0, sizeof(addr_ifr));
 	memcpy(&addr_ifr.ifr_name, &ifr.ifr_name, sizeof(ifr.ifr_name));
@@ -339,22 +456,15 @@ int connman_inet_ifdown(int index)
 	if (ioctl(sk, SIOCSIFADDR, &addr_ifr) < 0)
 		connman_warn("Could not clear IPv4 address index %d", index);
 
-	if (!(ifr.ifr_flags & IFF_UP)) {
-		err = -EALREADY;
-		goto done;
-	}
+	if (!(ifr.ifr_flags & IFF_UP))
+		return -EALREADY;
 
 	ifr.ifr_flags = (ifr.ifr_flags & ~IFF_UP) | IFF_DYNAMIC;
 
 	if (ioctl(sk, SIOCSIFFLAGS, &ifr) < 0)
-		err = -errno;
-	else
-		err = 0;
-
-done:
-	close(sk);
+		return -errno;
 
-	return err;
+	return 0;
 }
 
 connman_bool_t connman_inet_is_cfg80211(int index)
@@ -363,27 +473,16 @@ connman_bool_t connman_inet_is_cfg80211(int index)
 	char phy80211_path[PATH_MAX];
 	struct stat st;
 	struct ifreq ifr;
-	int sk;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-	if (sk < 0)
+	if (inet_ifreq(&ifr, index) < 0)
 		return FALSE;
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0)
-		goto done;
-
 	snprintf(phy80211_path, PATH_MAX,
 				"/sys/class/net/%s/phy80211", ifr.ifr_name);
 
 	if (stat(phy80211_path, &st) == 0 && (st.st_mode & S_IFDIR))
 		result = TRUE;
 
-done:
-	close(sk);
-
 	return result;
 }
 
@@ -509,20 +608,15 @@ int connman_inet_add_network_route(int index, const char *host,
 	DBG("index %d host %s gateway %s netmask %s", index,
 		host, gateway, netmask);
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -560,8 +654,6 @@ int connman_inet_add_network_route(int index, const char *host,
 	if (ioctl(sk, SIOCADDRT, &rt) < 0 && errno != EEXIST)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Adding host route failed (%s)",
@@ -579,20 +671,15 @@ int connman_inet_del_network_route(int index, const char *host)
 
 	DBG("index %d host %s", index, host);
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -609,8 +696,6 @@ int connman_inet_del_network_route(int index, const char *host)
 	if (ioctl(sk, SIOCDELRT, &rt) < 0 && errno != ESRCH)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Deleting host route failed (%s)",
@@ -644,17 +729,15 @@ int connman_inet_del_ipv6_network_route(int index, const char *host,
 	rt.rtmsg_metric = 1;
 	rt.rtmsg_ifindex = index;
 
-	sk = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET6);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
 	if (ioctl(sk, SIOCDELRT, &rt) < 0 && errno != ESRCH)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Del IPv6 host route error (%s)",
@@ -699,17 +782,15 @@ int connman_inet_add_ipv6_network_route(int index, const char *host,
 	rt.rtmsg_metric = 1;
 	rt.rtmsg_ifindex = index;
 
-	sk = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET6);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
 	if (ioctl(sk, SIOCADDRT, &rt) < 0 && errno != EEXIST)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Set IPv6 host route error (%s)",
@@ -746,17 +827,15 @@ int connman_inet_set_ipv6_gateway_address(int index, const char *gateway)
 	rt.rtmsg_dst_len = 0;
 	rt.rtmsg_ifindex = index;
 
-	sk = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET6);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
 	if (ioctl(sk, SIOCADDRT, &rt) < 0 && errno != EEXIST)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Set default IPv6 gateway error (%s)",
@@ -787,17 +866,15 @@ int connman_inet_clear_ipv6_gateway_address(int index, const char *gateway)
 	rt.rtmsg_dst_len = 0;
 	rt.rtmsg_ifindex = index;
 
-	sk = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET6);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
 	if (ioctl(sk, SIOCDELRT, &rt) < 0 && errno != ESRCH)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Clear default IPv6 gateway error (%s)",
@@ -815,20 +892,15 @@ int connman_inet_set_gateway_address(int index, const char *gateway)
 
 	DBG("index %d gateway %s", index, gateway);
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -853,8 +925,6 @@ int connman_inet_set_gateway_address(int index, const char *gateway)
 	if (ioctl(sk, SIOCADDRT, &rt) < 0 && errno != EEXIST)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Setting default gateway route failed (%s)",
@@ -872,20 +942,15 @@ int connman_inet_set_gateway_interface(int index)
 
 	DBG("index %d", index);
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -905,8 +970,6 @@ int connman_inet_set_gateway_interface(int index)
 	if (ioctl(sk, SIOCADDRT, &rt) < 0 && errno != EEXIST)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Setting default interface route failed (%s)",
@@ -925,20 +988,15 @@ int connman_inet_set_ipv6_gateway_interface(int index)
 
 	DBG("index %d", index);
 
-	sk = socket(PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET6);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -958,8 +1016,6 @@ int connman_inet_set_ipv6_gateway_interface(int index)
 	if (ioctl(sk, SIOCADDRT, &rt) < 0 && errno != EEXIST)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Setting default interface route failed (%s)",
@@ -977,20 +1033,15 @@ int connman_inet_clear_gateway_address(int index, const char *gateway)
 
 	DBG("index %d gateway %s", index, gateway);
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -1015,8 +1066,6 @@ int connman_inet_clear_gateway_address(int index, const char *gateway)
 	if (ioctl(sk, SIOCDELRT, &rt) < 0 && errno != ESRCH)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Removing default gateway route failed (%s)",
@@ -1034,20 +1083,15 @@ int connman_inet_clear_gateway_interface(int index)
 
 	DBG("index %d", index);
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -1067,8 +1111,6 @@ int connman_inet_clear_gateway_interface(int index)
 	if (ioctl(sk, SIOCDELRT, &rt) < 0 && errno != ESRCH)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Removing default interface route failed (%s)",
@@ -1087,20 +1129,15 @@ int connman_inet_clear_ipv6_gateway_interface(int index)
 
 	DBG("index %d", index);
 
-	sk = socket(PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET6);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
+	err = inet_ifreq(&ifr, index);
+	if (err < 0)
 		goto out;
-	}
 
 	DBG("ifname %s", ifr.ifr_name);
 
@@ -1120,8 +1157,6 @@ int connman_inet_clear_ipv6_gateway_interface(int index)
 	if (ioctl(sk, SIOCDELRT, &rt) < 0 && errno != ESRCH)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Removing default interface route failed (%s)",
@@ -1147,32 +1182,21 @@ connman_bool_t connman_inet_compare_subnet(int index, const char *host)
 		return -1;
 	host_addr = _host_addr.s_addr;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
 		return FALSE;
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		close(sk);
+	if (inet_ifreq(&ifr, index) < 0)
 		return FALSE;
-	}
 
-	if (ioctl(sk, SIOCGIFNETMASK, &ifr) < 0) {
-		close(sk);
+	if (ioctl(sk, SIOCGIFNETMASK, &ifr) < 0)
 		return FALSE;
-	}
 
 	netmask = (struct sockaddr_in *)&ifr.ifr_netmask;
 	netmask_addr = netmask->sin_addr.s_addr;
 
-	if (ioctl(sk, SIOCGIFADDR, &ifr) < 0) {
-		close(sk);
+	if (ioctl(sk, SIOCGIFADDR, &ifr) < 0)
 		return FALSE;
-	}
-
-	close(sk);
 
 	addr = (struct sockaddr_in *)&ifr.ifr_addr;
 	if_addr = addr->sin_addr.s_addr;
@@ -1188,9 +1212,9 @@ int connman_inet_remove_from_bridge(int index, const char *bridge)
 	if (bridge == NULL)
 		return -EINVAL;
 
-	sk = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
@@ -1201,8 +1225,6 @@ int connman_inet_remove_from_bridge(int index, const char *bridge)
 	if (ioctl(sk, SIOCBRDELIF, &ifr) < 0)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Remove interface from bridge error %s",
@@ -1219,9 +1241,9 @@ int connman_inet_add_to_bridge(int index, const char *bridge)
 	if (bridge == NULL)
 		return -EINVAL;
 
-	sk = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0) {
-		err = -errno;
+		err = sk;
 		goto out;
 	}
 
@@ -1232,8 +1254,6 @@ int connman_inet_add_to_bridge(int index, const char *bridge)
 	if (ioctl(sk, SIOCBRADDIF, &ifr) < 0)
 		err = -errno;
 
-	close(sk);
-
 out:
 	if (err < 0)
 		connman_error("Add interface to bridge error %s",
@@ -1247,20 +1267,16 @@ int connman_inet_set_mtu(int index, int mtu)
 	struct ifreq ifr;
 	int sk, err;
 
-	sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
 		return sk;
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	err = ioctl(sk, SIOCGIFNAME, &ifr);
+	err = inet_ifreq(&ifr, index);
 	if (err == 0) {
 		ifr.ifr_mtu = mtu;
 		err = ioctl(sk, SIOCSIFMTU, &ifr);
 	}
 
-	close(sk);
 	return err;
 }
 
@@ -1274,7 +1290,7 @@ int connman_inet_setup_tunnel(char *tunnel, int mtu)
 	if (tunnel == NULL)
 		return -EINVAL;
 
-	sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
 		return sk;
 
@@ -1282,13 +1298,13 @@ int connman_inet_setup_tunnel(char *tunnel, int mtu)
 
 	err = connman_inet_set_mtu(index, mtu);
 	if (err != 0)
-		goto done;
+		return err;
 
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, tunnel, IFNAMSIZ);
 	err = ioctl(sk, SIOCGIFFLAGS, &ifr);
 	if (err)
-		goto done;
+		return err;
 
 	mask = IFF_UP;
 	flags = IFF_UP;
@@ -1302,8 +1318,6 @@ int connman_inet_setup_tunnel(char *tunnel, int mtu)
 							strerror(errno));
 	}
 
-done:
-	close(sk);
 	return err;
 }
 
@@ -1708,29 +1722,24 @@ static int get_dest_addr(int family, int index, char *buf, int len)
 {
 	struct ifreq ifr;
 	void *addr;
-	int sk;
+	int sk, err;
 
-	sk = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_socket(family);
 	if (sk < 0)
-		return -errno;
-
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
+		return sk;
 
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		DBG("SIOCGIFNAME (%d/%s)", errno, strerror(errno));
-		close(sk);
-		return -errno;
+	err = inet_ifreq(&ifr, index);
+	if (err < 0) {
+		DBG("SIOCGIFNAME (%d/%s)", -err, strerror(-err));
+		return err;
 	}
 
 	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0) {
 		DBG("SIOCGIFFLAGS (%d/%s)", errno, strerror(errno));
-		close(sk);
 		return -errno;
 	}
 
 	if ((ifr.ifr_flags & IFF_POINTOPOINT) == 0) {
-		close(sk);
 		errno = EINVAL;
 		return -errno;
 	}
@@ -1740,12 +1749,9 @@ static int get_dest_addr(int family, int index, char *buf, int len)
 	if (ioctl(sk, SIOCGIFDSTADDR, &ifr) < 0) {
 		connman_error("Get destination address failed (%s)",
 							strerror(errno));
-		close(sk);
 		return -errno;
 	}
 
-	close(sk);
-
 	switch (family) {
 	case AF_INET:
 		addr = &((struct sockaddr_in *)&ifr.ifr_dstaddr)->sin_addr;
@@ -2222,6 +2228,445 @@ fail:
 	return err;
 }
 
+/*
+ * Route and address changes collected into netlink transactions. The
+ * requests are packed into datagrams of INET_BATCH_CHUNK messages, and
+ * the acknowledgements are collected from the main loop. Only one chunk
+ * is in flight at a time so that its acknowledgements always fit into
+ * the socket receive buffer. The callback of every item is called
+ * exactly once with the result of that item, also when the batch fails
+ * or is freed.
+ */
+#define INET_BATCH_CHUNK	64
+#define INET_BATCH_TIMEOUT	5
+
+struct inet_batch_item {
+	union {
+		struct nlmsghdr hdr;
+		uint8_t buf[INET_REQUEST_SIZE];
+	} req;
+	connman_bool_t done;
+	__connman_inet_batch_cb_t callback;
+	void *user_data;
+};
+
+struct __connman_inet_batch {
+	GPtrArray *items;
+	GIOChannel *channel;
+	guint watch;
+	guint timeout;
+	guint32 seq;
+	unsigned int sent;
+	unsigned int outstanding;
+};
+
+struct __connman_inet_batch *__connman_inet_batch_new(void)
+{
+	struct __connman_inet_batch *batch;
+
+	batch = g_try_new0(struct __connman_inet_batch, 1);
+	if (batch == NULL)
+		return NULL;
+
+	batch->items = g_ptr_array_new_with_free_func(g_free);
+
+	return batch;
+}
+
+static void batch_item_done(struct __connman_inet_batch *batch,
+				struct inet_batch_item *item, int err)
+{
+	struct nlmsghdr *hdr = &item->req.hdr;
+
+	if (item->done == TRUE)
+		return;
+
+	item->done = TRUE;
+
+	/* The same errors the ioctl based helpers ignore */
+	if ((err == -EEXIST && hdr->nlmsg_type == RTM_NEWROUTE) ||
+			(err == -ESRCH && hdr->nlmsg_type == RTM_DELROUTE))
+		err = 0;
+
+	if (err < 0 && err != -ECANCELED)
+		connman_error("Netlink request type %d seq %u failed (%s)",
+				hdr->nlmsg_type, hdr->nlmsg_seq,
+				strerror(-err));
+
+	if (item->callback != NULL)
+		item->callback(err, item->user_data);
+}
+
+void __connman_inet_batch_free(struct __connman_inet_batch *batch)
+{
+	unsigned int i;
+
+	if (batch == NULL)
+		return;
+
+	batch_list = g_slist_remove(batch_list, batch);
+
+	if (batch->timeout > 0)
+		g_source_remove(batch->timeout);
+
+	if (batch->watch > 0)
+		g_source_remove(batch->watch);
+
+	if (batch->channel != NULL) {
+		g_io_channel_shutdown(batch->channel, TRUE, NULL);
+		g_io_channel_unref(batch->channel);
+	}
+
+	for (i = 0; i < batch->items->len; i++)
+		batch_item_done(batch, g_ptr_array_index(batch->items, i),
+								-ECANCELED);
+
+	g_ptr_array_free(batch->items, TRUE);
+	g_free(batch);
+}
+
+static struct inet_batch_item *batch_item_new(
+				struct __connman_inet_batch *batch,
+				__connman_inet_batch_cb_t callback,
+				void *user_data)
+{
+	struct inet_batch_item *item;
+
+	if (batch == NULL || batch->channel != NULL)
+		return NULL;
+
+	item = g_try_new0(struct inet_batch_item, 1);
+	if (item == NULL)
+		return NULL;
+
+	item->callback = callback;
+	item->user_data = user_data;
+
+	return item;
+}
+
+int __connman_inet_batch_add_route(struct __connman_inet_batch *batch,
+				int cmd, int index, int family,
+				const char *host, const char *gateway,
+				unsigned char prefixlen,
+				__connman_inet_batch_cb_t callback,
+				void *user_data)
+{
+	struct inet_batch_item *item;
+	struct nlmsghdr *hdr;
+	struct rtmsg *rt;
+	unsigned char dst[sizeof(struct in6_addr)];
+	unsigned char gw[sizeof(struct in6_addr)];
+	size_t len;
+	int err;
+
+	DBG("cmd %d index %d host %s gateway %s prefixlen %u", cmd, index,
+					host, gateway, prefixlen);
+
+	if (cmd != RTM_NEWROUTE && cmd != RTM_DELROUTE)
+		return -EINVAL;
+
+	if (family == AF_INET)
+		len = sizeof(struct in_addr);
+	else if (family == AF_INET6)
+		len = sizeof(struct in6_addr);
+	else
+		return -EINVAL;
+
+	if (host == NULL || inet_pton(family, host, dst) != 1 ||
+					prefixlen > len * 8)
+		return -EINVAL;
+
+	if (gateway != NULL && inet_pton(family, gateway, gw) != 1)
+		return -EINVAL;
+
+	item = batch_item_new(batch, callback, user_data);
+	if (item == NULL)
+		return -ENOMEM;
+
+	hdr = &item->req.hdr;
+	hdr->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	hdr->nlmsg_type = cmd;
+	hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (cmd == RTM_NEWROUTE)
+		hdr->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+
+	/* Same attributes as the routes set up with SIOCADDRT */
+	rt = NLMSG_DATA(hdr);
+	rt->rtm_family = family;
+	rt->rtm_dst_len = prefixlen;
+	rt->rtm_table = RT_TABLE_MAIN;
+	rt->rtm_type = RTN_UNICAST;
+	if (cmd == RTM_DELROUTE) {
+		rt->rtm_scope = RT_SCOPE_NOWHERE;
+	} else {
+		rt->rtm_protocol = RTPROT_BOOT;
+		if (gateway != NULL)
+			rt->rtm_scope = RT_SCOPE_UNIVERSE;
+		else
+			rt->rtm_scope = RT_SCOPE_LINK;
+	}
+
+	err = __connman_inet_rtnl_addattr_l(hdr, sizeof(item->req), RTA_DST,
+								dst, len);
+	if (err == 0 && gateway != NULL)
+		err = __connman_inet_rtnl_addattr_l(hdr, sizeof(item->req),
+							RTA_GATEWAY, gw, len);
+	if (err == 0)
+		err = __connman_inet_rtnl_addattr32(hdr, sizeof(item->req),
+							RTA_OIF, index);
+	if (err == 0 && family == AF_INET6)
+		err = __connman_inet_rtnl_addattr32(hdr, sizeof(item->req),
+							RTA_PRIORITY, 1);
+	if (err < 0) {
+		g_free(item);
+		return err;
+	}
+
+	g_ptr_array_add(batch->items, item);
+
+	return 0;
+}
+
+int __connman_inet_batch_modify_address(struct __connman_inet_batch *batch,
+				int cmd, int flags, int index, int family,
+				const char *address, const char *peer,
+				unsigned char prefixlen, const char *broadcast,
+				__connman_inet_batch_cb_t callback,
+				void *user_data)
+{
+	struct inet_batch_item *item;
+	int err;
+
+	DBG("cmd %#x flags %#x index %d family %d address %s peer %s "
+		"prefixlen %hhu broadcast %s", cmd, flags, index, family,
+		address, peer, prefixlen, broadcast);
+
+	item = batch_item_new(batch, callback, user_data);
+	if (item == NULL)
+		return -ENOMEM;
+
+	err = build_address_request(&item->req.hdr, sizeof(item->req), cmd,
+				flags | NLM_F_ACK, index, family, address,
+				peer, prefixlen, broadcast);
+	if (err < 0) {
+		g_free(item);
+		return err;
+	}
+
+	g_ptr_array_add(batch->items, item);
+
+	return 0;
+}
+
+static gboolean batch_timeout(gpointer user_data);
+
+static int batch_send_chunk(struct __connman_inet_batch *batch)
+{
+	struct sockaddr_nl addr;
+	uint8_t *buf;
+	size_t len = 0;
+	unsigned int first = batch->sent;
+	int sk, err = 0;
+
+	buf = g_try_malloc(INET_BATCH_CHUNK * INET_REQUEST_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	while (batch->sent < batch->items->len) {
+		struct inet_batch_item *item;
+		struct nlmsghdr *hdr;
+
+		if (batch->sent - first == INET_BATCH_CHUNK)
+			break;
+
+		item = g_ptr_array_index(batch->items, batch->sent);
+		hdr = &item->req.hdr;
+
+		hdr->nlmsg_seq = batch->seq + batch->sent;
+		memcpy(buf + len, hdr, hdr->nlmsg_len);
+		len += NLMSG_ALIGN(hdr->nlmsg_len);
+
+		batch->sent++;
+	}
+
+	DBG("batch %p items %u..%u len %zu", batch, first, batch->sent, len);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	sk = g_io_channel_unix_get_fd(batch->channel);
+
+	if (sendto(sk, buf, len, 0, (struct sockaddr *) &addr,
+							sizeof(addr)) < 0)
+		err = -errno;
+	else
+		batch->outstanding = batch->sent - first;
+
+	g_free(buf);
+
+	if (batch->timeout > 0)
+		g_source_remove(batch->timeout);
+
+	batch->timeout = g_timeout_add_seconds(INET_BATCH_TIMEOUT,
+						batch_timeout, batch);
+
+	return err;
+}
+
+static void batch_finish(struct __connman_inet_batch *batch, int err)
+{
+	unsigned int i;
+
+	for (i = 0; err < 0 && i < batch->items->len; i++)
+		batch_item_done(batch, g_ptr_array_index(batch->items, i),
+									err);
+
+	__connman_inet_batch_free(batch);
+}
+
+static void batch_ack(struct __connman_inet_batch *batch,
+				struct nlmsghdr *hdr)
+{
+	struct nlmsgerr *nlerr = NLMSG_DATA(hdr);
+	guint32 i = hdr->nlmsg_seq - batch->seq;
+
+	if (hdr->nlmsg_type != NLMSG_ERROR || i >= batch->sent)
+		return;
+
+	if (hdr->nlmsg_len < NLMSG_LENGTH(sizeof(*nlerr)))
+		return;
+
+	if (((struct inet_batch_item *)
+			g_ptr_array_index(batch->items, i))->done == TRUE)
+		return;
+
+	batch_item_done(batch, g_ptr_array_index(batch->items, i),
+								nlerr->error);
+	batch->outstanding--;
+}
+
+static gboolean batch_event(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
+{
+	struct __connman_inet_batch *batch = user_data;
+	unsigned char buf[4096];
+	int sk, err;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP)) {
+		batch->watch = 0;
+		batch_finish(batch, -EIO);
+		return FALSE;
+	}
+
+	sk = g_io_channel_unix_get_fd(chan);
+
+	for (;;) {
+		struct nlmsghdr *hdr = (struct nlmsghdr *) buf;
+		ssize_t len;
+
+		len = recv(sk, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			batch->watch = 0;
+			batch_finish(batch, -errno);
+			return FALSE;
+		}
+
+		for (; NLMSG_OK(hdr, (size_t) len);
+					hdr = NLMSG_NEXT(hdr, len))
+			batch_ack(batch, hdr);
+	}
+
+	if (batch->outstanding > 0)
+		return TRUE;
+
+	if (batch->sent < batch->items->len) {
+		err = batch_send_chunk(batch);
+		if (err == 0)
+			return TRUE;
+	} else
+		err = 0;
+
+	batch->watch = 0;
+	batch_finish(batch, err);
+
+	return FALSE;
+}
+
+static gboolean batch_timeout(gpointer user_data)
+{
+	struct __connman_inet_batch *batch = user_data;
+
+	batch->timeout = 0;
+	batch_finish(batch, -ETIMEDOUT);
+
+	return FALSE;
+}
+
+/*
+ * Send the collected requests. The batch is freed once every item has
+ * been acknowledged or the transaction has failed.
+ */
+int __connman_inet_batch_commit(struct __connman_inet_batch *batch)
+{
+	struct sockaddr_nl addr;
+	int sk, err;
+
+	if (batch == NULL)
+		return -EINVAL;
+
+	DBG("batch %p items %u", batch, batch->items->len);
+
+	if (batch->items->len == 0) {
+		__connman_inet_batch_free(batch);
+		return 0;
+	}
+
+	sk = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sk < 0) {
+		err = -errno;
+		goto error;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		err = -errno;
+		close(sk);
+		goto error;
+	}
+
+	batch->channel = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(batch->channel, TRUE);
+	g_io_channel_set_encoding(batch->channel, NULL, NULL);
+	g_io_channel_set_buffered(batch->channel, FALSE);
+
+	batch->seq = time(NULL);
+
+	err = batch_send_chunk(batch);
+	if (err < 0)
+		goto error;
+
+	batch->watch = g_io_add_watch(batch->channel,
+				G_IO_IN | G_IO_NVAL | G_IO_HUP | G_IO_ERR,
+				batch_event, batch);
+
+	batch_list = g_slist_prepend(batch_list, batch);
+
+	return 0;
+
+error:
+	batch_finish(batch, err);
+
+	return err;
+}
+
 int connman_inet_check_ipaddress(const char *host)
 {
 	struct addrinfo hints;
@@ -2296,7 +2741,7 @@ char **__connman_inet_get_running_interfaces(void)
 
 	memset(&ifc, 0, sizeof(ifc));
 
-	sk = socket(AF_INET, SOCK_DGRAM, 0);
+	sk = inet_socket(AF_INET);
 	if (sk < 0)
 		return NULL;
 
@@ -2323,8 +2768,6 @@ char **__connman_inet_get_running_interfaces(void)
 	if (result == NULL)
 		goto error;
 
-	close(sk);
-
 	for (i = 0; i < numif; i++) {
 		struct ifreq *r = &ifr[i];
 		struct in6_addr *addr6;
@@ -2360,19 +2803,14 @@ char **__connman_inet_get_running_interfaces(void)
 	return result;
 
 error:
-	close(sk);
 	g_free(ifr);
 	return NULL;
 }
 
 connman_bool_t connman_inet_is_ipv6_supported()
 {
-	int sk;
-
-	sk = socket(PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-	if (sk < 0)
+	if (inet_socket(AF_INET6) < 0)
 		return FALSE;
 
-	close(sk);
 	return TRUE;
 }
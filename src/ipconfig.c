@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <linux/if_link.h>
@@ -66,14 +67,14 @@ struct connman_ipdevice {
 	unsigned int flags;
 	char *address;
 	uint16_t mtu;
-	uint32_t rx_packets;
-	uint32_t tx_packets;
-	uint32_t rx_bytes;
-	uint32_t tx_bytes;
-	uint32_t rx_errors;
-	uint32_t tx_errors;
-	uint32_t rx_dropped;
-	uint32_t tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 
 	GSList *address_list;
 	char *ipv4_gateway;
@@ -408,19 +409,29 @@ static void __connman_ipconfig_lower_down(struct connman_ipdevice *ipdevice)
 				ipdevice->config_ipv6->address->prefixlen);
 }
 
+static void print_stats(struct connman_ipdevice *ipdevice,
+					struct rtnl_link_stats64 *stats)
+{
+	if (stats->rx_packets == 0 && stats->tx_packets == 0)
+		return;
+
+	connman_info("%s {RX} %" PRIu64 " packets %" PRIu64 " bytes",
+			ipdevice->ifname, (uint64_t) stats->rx_packets,
+			(uint64_t) stats->rx_bytes);
+	connman_info("%s {TX} %" PRIu64 " packets %" PRIu64 " bytes",
+			ipdevice->ifname, (uint64_t) stats->tx_packets,
+			(uint64_t) stats->tx_bytes);
+}
+
 static void update_stats(struct connman_ipdevice *ipdevice,
-						struct rtnl_link_stats *stats)
+					struct rtnl_link_stats64 *stats,
+					connman_bool_t sample)
 {
 	struct connman_service *service;
 
 	if (stats->rx_packets == 0 && stats->tx_packets == 0)
 		return;
 
-	connman_info("%s {RX} %u packets %u bytes", ipdevice->ifname,
-					stats->rx_packets, stats->rx_bytes);
-	connman_info("%s {TX} %u packets %u bytes", ipdevice->ifname,
-					stats->tx_packets, stats->tx_bytes);
-
 	if (ipdevice->config_ipv4 == NULL && ipdevice->config_ipv6 == NULL)
 		return;
 
@@ -443,6 +454,15 @@ static void update_stats(struct connman_ipdevice *ipdevice,
 	ipdevice->rx_dropped = stats->rx_dropped;
 	ipdevice->tx_dropped = stats->tx_dropped;
 
+	if (sample == TRUE) {
+		__connman_service_sample(service,
+				ipdevice->rx_packets, ipdevice->tx_packets,
+				ipdevice->rx_bytes, ipdevice->tx_bytes,
+				ipdevice->rx_errors, ipdevice->tx_errors,
+				ipdevice->rx_dropped, ipdevice->tx_dropped);
+		return;
+	}
+
 	__connman_service_notify(service,
 				ipdevice->rx_packets, ipdevice->tx_packets,
 				ipdevice->rx_bytes, ipdevice->tx_bytes,
@@ -453,7 +473,7 @@ static void update_stats(struct connman_ipdevice *ipdevice,
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats)
+						struct rtnl_link_stats64 *stats)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list;
@@ -502,7 +522,8 @@ void __connman_ipconfig_newlink(int index, unsigned short type,
 update:
 	ipdevice->mtu = mtu;
 
-	update_stats(ipdevice, stats);
+	print_stats(ipdevice, stats);
+	update_stats(ipdevice, stats, FALSE);
 
 	if (flags == ipdevice->flags)
 		return;
@@ -572,7 +593,18 @@ update:
 		__connman_ipconfig_lower_down(ipdevice);
 }
 
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
+void __connman_ipconfig_stats(int index, struct rtnl_link_stats64 *stats)
+{
+	struct connman_ipdevice *ipdevice;
+
+	ipdevice = g_hash_table_lookup(ipdevice_hash, GINT_TO_POINTER(index));
+	if (ipdevice == NULL)
+		return;
+
+	update_stats(ipdevice, stats, TRUE);
+}
+
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list;
@@ -583,7 +615,8 @@ void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
 	if (ipdevice == NULL)
 		return;
 
-	update_stats(ipdevice, stats);
+	print_stats(ipdevice, stats);
+	update_stats(ipdevice, stats, FALSE);
 
 	for (list = g_list_first(ipconfig_list); list;
 						list = g_list_next(list)) {
@@ -1323,6 +1356,8 @@ enum connman_ipconfig_method __connman_ipconfig_get_method(struct connman_ipconf
 
 int __connman_ipconfig_address_add(struct connman_ipconfig *ipconfig)
 {
+	int err;
+
 	DBG("");
 
 	switch (ipconfig->method) {
@@ -1333,10 +1368,17 @@ int __connman_ipconfig_address_add(struct connman_ipconfig *ipconfig)
 	case CONNMAN_IPCONFIG_METHOD_FIXED:
 	case CONNMAN_IPCONFIG_METHOD_DHCP:
 	case CONNMAN_IPCONFIG_METHOD_MANUAL:
-		if (ipconfig->type == CONNMAN_IPCONFIG_TYPE_IPV4)
-			return connman_inet_set_address(ipconfig->index,
+		if (ipconfig->type == CONNMAN_IPCONFIG_TYPE_IPV4) {
+			err = connman_inet_set_address(ipconfig->index,
 							ipconfig->address);
-		else if (ipconfig->type == CONNMAN_IPCONFIG_TYPE_IPV6)
+			if (err < 0)
+				return err;
+
+			__connman_rtnl_address_added(ipconfig->index, AF_INET,
+						ipconfig->address->local,
+						ipconfig->address->prefixlen);
+			return 0;
+		} else if (ipconfig->type == CONNMAN_IPCONFIG_TYPE_IPV6)
 			return connman_inet_set_ipv6_address(
 					ipconfig->index, ipconfig->address);
 	}
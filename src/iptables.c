@@ -24,6 +24,7 @@
 #endif
 
 #include <getopt.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -89,11 +90,29 @@ struct error_target {
 	char error[IPT_TABLE_MAXNAMELEN];
 };
 
+struct connman_iptables_chain;
+
 struct connman_iptables_entry {
 	int offset;
 	int builtin;
 
 	struct ipt_entry *entry;
+
+	struct connman_iptables_chain *chain;
+};
+
+/*
+ * Chains are indexed by name and kept in table order, so finding where
+ * a chain starts and ends does not walk the entry list.
+ */
+struct connman_iptables_chain {
+	char *name;
+
+	/* Link of the first entry of the chain in table->entries */
+	GList *head;
+
+	/* Our own link in table->chains */
+	GList *link;
 };
 
 struct connman_iptables {
@@ -110,6 +129,22 @@ struct connman_iptables {
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 
 	GList *entries;
+	GList *last;
+
+	GHashTable *chain_hash;
+	GList *chains;
+
+	/* Entry key -> list of entry links, for rule lookups */
+	GHashTable *rule_hash;
+
+	/* Entries jumping to a user defined chain */
+	GHashTable *jumps;
+
+	/* Entry offsets are recomputed only when somebody needs them */
+	gboolean offsets_dirty;
+
+	/* Edits applied to the shadow but not yet committed */
+	gboolean dirty;
 };
 
 static GHashTable *table_hash = NULL;
@@ -196,73 +231,170 @@ static gboolean is_jump(struct connman_iptables_entry *e)
 	return false;
 }
 
-static gboolean is_chain(struct connman_iptables *table,
-				struct connman_iptables_entry *e)
+static const char *entry_chain_name(struct connman_iptables_entry *e)
 {
-	struct ipt_entry *entry;
 	struct xt_entry_target *target;
 
-	entry = e->entry;
 	if (e->builtin >= 0)
-		return TRUE;
+		return hooknames[e->builtin];
 
-	target = ipt_get_target(entry);
+	target = ipt_get_target(e->entry);
 	if (!strcmp(target->u.user.name, IPT_ERROR_TARGET))
-		return TRUE;
+		return (char *)target->data;
 
-	return FALSE;
+	return NULL;
 }
 
-static GList *find_chain_head(struct connman_iptables *table,
-				char *chain_name)
+static struct connman_iptables_chain *chain_new(
+				struct connman_iptables *table,
+				const char *name, GList *head)
 {
-	GList *list;
-	struct connman_iptables_entry *head;
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
-	int builtin;
+	struct connman_iptables_chain *chain, *prev_chain = NULL;
+	struct connman_iptables_entry *prev;
 
-	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-		entry = head->entry;
+	chain = g_try_new0(struct connman_iptables_chain, 1);
+	if (chain == NULL)
+		return NULL;
 
-		/* Buit-in chain */
-		builtin = head->builtin;
-		if (builtin >= 0 && !strcmp(hooknames[builtin], chain_name))
-			break;
+	chain->name = g_strdup(name);
+	chain->head = head;
 
-		/* User defined chain */
-		target = ipt_get_target(entry);
-		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET) &&
-		    !strcmp((char *)target->data, chain_name))
-			break;
+	if (head->prev != NULL) {
+		prev = head->prev->data;
+		prev_chain = prev->chain;
 	}
 
-	return list;
+	if (prev_chain != NULL) {
+		table->chains = g_list_insert_before(table->chains,
+						prev_chain->link->next, chain);
+		chain->link = prev_chain->link->next;
+	} else {
+		table->chains = g_list_prepend(table->chains, chain);
+		chain->link = table->chains;
+	}
+
+	if (g_hash_table_lookup(table->chain_hash, name) == NULL)
+		g_hash_table_insert(table->chain_hash, chain->name, chain);
+
+	return chain;
 }
 
-static GList *find_chain_tail(struct connman_iptables *table,
+static void chain_free(struct connman_iptables *table,
+				struct connman_iptables_chain *chain)
+{
+	if (g_hash_table_lookup(table->chain_hash, chain->name) == chain)
+		g_hash_table_remove(table->chain_hash, chain->name);
+
+	table->chains = g_list_delete_link(table->chains, chain->link);
+
+	g_free(chain->name);
+	g_free(chain);
+}
+
+static GList *find_chain_head(struct connman_iptables *table,
 				char *chain_name)
 {
-	struct connman_iptables_entry *tail;
-	GList *chain_head, *list;
+	struct connman_iptables_chain *chain;
 
-	chain_head = find_chain_head(table, chain_name);
-	if (chain_head == NULL)
+	chain = g_hash_table_lookup(table->chain_hash, chain_name);
+	if (chain == NULL)
 		return NULL;
 
-	/* Then we look for the next chain */
-	for (list = chain_head->next; list; list = list->next) {
-		tail = list->data;
+	return chain->head;
+}
+
+static GList *find_chain_tail(struct connman_iptables *table,
+				char *chain_name)
+{
+	struct connman_iptables_chain *chain, *next;
+
+	chain = g_hash_table_lookup(table->chain_hash, chain_name);
+	if (chain == NULL)
+		return NULL;
 
-		if (is_chain(table, tail))
-			return list;
+	/* The tail is where the next chain starts */
+	if (chain->link->next != NULL) {
+		next = chain->link->next->data;
+		return next->head;
 	}
 
 	/* Nothing found, we return the table end */
-	return g_list_last(table->entries);
+	return table->last;
 }
 
+/*
+ * Moves the hook entry and underflow of every builtin chain that
+ * comes after chain by delta bytes.
+ */
+static void update_later_hooks(struct connman_iptables *table,
+				struct connman_iptables_chain *chain,
+				int delta)
+{
+	struct connman_iptables_chain *next;
+	struct connman_iptables_entry *e;
+	GList *list;
+
+	for (list = chain->link->next; list; list = list->next) {
+		next = list->data;
+		e = next->head->data;
+
+		if (e->builtin < 0)
+			continue;
+
+		table->hook_entry[e->builtin] += delta;
+		table->underflow[e->builtin] += delta;
+	}
+}
+
+static guint entry_key(struct ipt_entry *entry)
+{
+	const unsigned char *p = (const unsigned char *)&entry->ip;
+	guint key = 5381;
+	size_t i;
+
+	/* Covers what is_same_ipt_entry() compares */
+	for (i = 0; i < sizeof(struct ipt_ip); i++)
+		key = (key << 5) + key + p[i];
+
+	key = (key << 5) + key + entry->target_offset;
+	key = (key << 5) + key + entry->next_offset;
+
+	return key;
+}
+
+static void index_entry(struct connman_iptables *table, GList *link)
+{
+	struct connman_iptables_entry *e = link->data;
+	gpointer key = GUINT_TO_POINTER(entry_key(e->entry));
+	GList *bucket;
+
+	bucket = g_hash_table_lookup(table->rule_hash, key);
+	if (bucket != NULL)
+		g_list_insert(bucket, link, 1);
+	else
+		g_hash_table_insert(table->rule_hash, key,
+					g_list_prepend(NULL, link));
+
+	if (is_jump(e))
+		g_hash_table_insert(table->jumps, e, e);
+}
+
+static void unindex_entry(struct connman_iptables *table, GList *link)
+{
+	struct connman_iptables_entry *e = link->data;
+	gpointer key = GUINT_TO_POINTER(entry_key(e->entry));
+	GList *bucket, *update;
+
+	bucket = g_hash_table_lookup(table->rule_hash, key);
+	update = g_list_remove(bucket, link);
+
+	if (update == NULL)
+		g_hash_table_remove(table->rule_hash, key);
+	else if (update != bucket)
+		g_hash_table_insert(table->rule_hash, key, update);
+
+	g_hash_table_remove(table->jumps, e);
+}
 
 static void update_offsets(struct connman_iptables *table)
 {
@@ -284,6 +416,14 @@ static void update_offsets(struct connman_iptables *table)
 		entry->offset = prev_entry->offset +
 					prev_entry->entry->next_offset;
 	}
+
+	table->offsets_dirty = FALSE;
+}
+
+static void refresh_offsets(struct connman_iptables *table)
+{
+	if (table->offsets_dirty == TRUE)
+		update_offsets(table);
 }
 
 static void update_targets_reference(struct connman_iptables *table,
@@ -293,16 +433,21 @@ static void update_targets_reference(struct connman_iptables *table,
 {
 	struct connman_iptables_entry *tmp;
 	struct xt_standard_target *t;
-	GList *list;
+	GHashTableIter iter;
+	gpointer key;
 	int offset;
 
+	if (g_hash_table_size(table->jumps) == 0)
+		return;
+
+	refresh_offsets(table);
+
 	offset = modified_entry->entry->next_offset;
 
-	for (list = table->entries; list; list = list->next) {
-		tmp = list->data;
+	g_hash_table_iter_init(&iter, table->jumps);
 
-		if (!is_jump(tmp))
-			continue;
+	while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE) {
+		tmp = key;
 
 		t = (struct xt_standard_target *)ipt_get_target(tmp->entry);
 
@@ -321,6 +466,9 @@ static int iptables_add_entry(struct connman_iptables *table,
 					int builtin)
 {
 	struct connman_iptables_entry *e, *entry_before;
+	struct connman_iptables_chain *chain;
+	const char *chain_name;
+	GList *link;
 
 	if (table == NULL)
 		return -1;
@@ -332,15 +480,54 @@ static int iptables_add_entry(struct connman_iptables *table,
 	e->entry = entry;
 	e->builtin = builtin;
 
-	table->entries = g_list_insert_before(table->entries, before, e);
+	if (before == NULL) {
+		/* Appending only happens while loading, keep it O(1) */
+		e->offset = table->size;
+
+		link = g_list_append(NULL, e);
+		if (table->last == NULL)
+			table->entries = link;
+		else {
+			table->last->next = link;
+			link->prev = table->last;
+		}
+		table->last = link;
+	} else {
+		/*
+		 * Reference updates need the offsets from before the
+		 * insertion.
+		 */
+		if (g_hash_table_size(table->jumps) > 0 || is_jump(e))
+			refresh_offsets(table);
+
+		table->entries = g_list_insert_before(table->entries,
+								before, e);
+		link = before->prev;
+	}
+
 	table->num_entries++;
 	table->size += entry->next_offset;
 
-	if (before == NULL) {
-		e->offset = table->size - entry->next_offset;
-
+	chain_name = entry_chain_name(e);
+	if (chain_name != NULL) {
+		chain = g_hash_table_lookup(table->chain_hash, chain_name);
+		if (chain != NULL && builtin >= 0)
+			/* The entry becomes the head of a builtin chain */
+			chain->head = link;
+		else
+			chain = chain_new(table, chain_name, link);
+	} else if (link->prev != NULL) {
+		entry_before = link->prev->data;
+		chain = entry_before->chain;
+	} else
+		chain = NULL;
+
+	e->chain = chain;
+
+	index_entry(table, link);
+
+	if (before == NULL)
 		return 0;
-	}
 
 	entry_before = before->data;
 
@@ -350,23 +537,33 @@ static int iptables_add_entry(struct connman_iptables *table,
 	 */
 	update_targets_reference(table, entry_before, e, FALSE);
 
-	update_offsets(table);
+	table->offsets_dirty = TRUE;
 
 	return 0;
 }
 
-static int remove_table_entry(struct connman_iptables *table,
-				struct connman_iptables_entry *entry)
+static int remove_table_entry(struct connman_iptables *table, GList *link)
 {
+	struct connman_iptables_entry *entry = link->data;
 	int removed = 0;
 
 	table->num_entries--;
 	table->size -= entry->entry->next_offset;
 	removed = entry->entry->next_offset;
 
-	g_free(entry->entry);
+	if (entry->chain != NULL && entry->chain->head == link)
+		entry->chain->head = link->next;
+
+	unindex_entry(table, link);
 
-	table->entries = g_list_remove(table->entries, entry);
+	if (table->last == link)
+		table->last = link->prev;
+
+	table->entries = g_list_delete_link(table->entries, link);
+	table->offsets_dirty = TRUE;
+
+	g_free(entry->entry);
+	g_free(entry);
 
 	return removed;
 }
@@ -376,6 +573,7 @@ static int iptables_flush_chain(struct connman_iptables *table,
 {
 	GList *chain_head, *chain_tail, *list, *next;
 	struct connman_iptables_entry *entry;
+	struct connman_iptables_chain *chain;
 	int builtin, removed = 0;
 
 	chain_head = find_chain_head(table, name);
@@ -397,38 +595,26 @@ static int iptables_flush_chain(struct connman_iptables *table,
 	if (list == chain_tail->prev)
 		return 0;
 
+	chain = entry->chain;
+
 	while (list != chain_tail->prev) {
-		entry = list->data;
 		next = g_list_next(list);
 
-		removed += remove_table_entry(table, entry);
+		removed += remove_table_entry(table, list);
 
 		list = next;
 	}
 
 	if (builtin >= 0) {
-		struct connman_iptables_entry *e;
-
 		entry = list->data;
 
 		entry->builtin = builtin;
 
 		table->underflow[builtin] -= removed;
 
-		for (list = chain_tail; list; list = list->next) {
-			e = list->data;
-
-			builtin = e->builtin;
-			if (builtin < 0)
-				continue;
-
-			table->hook_entry[builtin] -= removed;
-			table->underflow[builtin] -= removed;
-		}
+		update_later_hooks(table, chain, -removed);
 	}
 
-	update_offsets(table);
-
 	return 0;
 }
 
@@ -442,7 +628,7 @@ static int iptables_add_chain(struct connman_iptables *table,
 	struct ipt_standard_target *standard;
 	u_int16_t entry_head_size, entry_return_size;
 
-	last = g_list_last(table->entries);
+	last = table->last;
 
 	/*
 	 * An empty chain is composed of:
@@ -506,6 +692,7 @@ err_head:
 static int iptables_delete_chain(struct connman_iptables *table, char *name)
 {
 	struct connman_iptables_entry *entry;
+	struct connman_iptables_chain *chain;
 	GList *chain_head, *chain_tail;
 
 	chain_head = find_chain_head(table, name);
@@ -526,12 +713,13 @@ static int iptables_delete_chain(struct connman_iptables *table, char *name)
 	if (chain_head->next != chain_tail->prev)
 		return -EINVAL;
 
-	remove_table_entry(table, entry);
+	chain = entry->chain;
 
-	entry = chain_tail->prev->data;
-	remove_table_entry(table, entry);
+	remove_table_entry(table, chain_head);
+	remove_table_entry(table, chain_tail->prev);
 
-	update_offsets(table);
+	if (chain != NULL)
+		chain_free(table, chain);
 
 	return 0;
 }
@@ -585,8 +773,7 @@ static struct ipt_entry *new_rule(struct ipt_ip *ip,
 static void update_hooks(struct connman_iptables *table, GList *chain_head,
 				struct ipt_entry *entry)
 {
-	GList *list;
-	struct connman_iptables_entry *head, *e;
+	struct connman_iptables_entry *head;
 	int builtin;
 
 	if (chain_head == NULL)
@@ -600,38 +787,23 @@ static void update_hooks(struct connman_iptables *table, GList *chain_head,
 
 	table->underflow[builtin] += entry->next_offset;
 
-	for (list = chain_head->next; list; list = list->next) {
-		e = list->data;
-
-		builtin = e->builtin;
-		if (builtin < 0)
-			continue;
-
-		table->hook_entry[builtin] += entry->next_offset;
-		table->underflow[builtin] += entry->next_offset;
-	}
+	update_later_hooks(table, head->chain, entry->next_offset);
 }
 
-static struct ipt_entry *prepare_rule_inclusion(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				int *builtin, struct xtables_rule_match *xt_rm)
+static int prepare_rule_inclusion(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *new_entry,
+				int *builtin)
 {
 	GList *chain_tail, *chain_head;
-	struct ipt_entry *new_entry;
 	struct connman_iptables_entry *head;
 
 	chain_head = find_chain_head(table, chain_name);
 	if (chain_head == NULL)
-		return NULL;
+		return -EINVAL;
 
 	chain_tail = find_chain_tail(table, chain_name);
 	if (chain_tail == NULL)
-		return NULL;
-
-	new_entry = new_rule(ip, target_name, xt_t, xt_rm);
-	if (new_entry == NULL)
-		return NULL;
+		return -EINVAL;
 
 	update_hooks(table, chain_head, new_entry);
 
@@ -648,28 +820,29 @@ static struct ipt_entry *prepare_rule_inclusion(struct connman_iptables *table,
 		head->builtin = -1;
 	}
 
-	return new_entry;
+	return 0;
 }
 
-static int iptables_append_rule(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				struct xtables_rule_match *xt_rm)
+/* Takes ownership of new_entry */
+static int iptables_append_entry(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *new_entry)
 {
 	GList *chain_tail;
-	struct ipt_entry *new_entry;
 	int builtin = -1, ret;
 
 	DBG("");
 
 	chain_tail = find_chain_tail(table, chain_name);
-	if (chain_tail == NULL)
+	if (chain_tail == NULL) {
+		g_free(new_entry);
 		return -EINVAL;
+	}
 
-	new_entry = prepare_rule_inclusion(table, ip, chain_name,
-					target_name, xt_t, &builtin, xt_rm);
-	if (new_entry == NULL)
-		return -EINVAL;
+	ret = prepare_rule_inclusion(table, chain_name, new_entry, &builtin);
+	if (ret < 0) {
+		g_free(new_entry);
+		return ret;
+	}
 
 	ret = iptables_add_entry(table, new_entry, chain_tail->prev, builtin);
 	if (ret < 0)
@@ -678,23 +851,24 @@ static int iptables_append_rule(struct connman_iptables *table,
 	return ret;
 }
 
-static int iptables_insert_rule(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				struct xtables_rule_match *xt_rm)
+/* Takes ownership of new_entry */
+static int iptables_insert_entry(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *new_entry)
 {
-	struct ipt_entry *new_entry;
-	int builtin = -1, ret;
 	GList *chain_head;
+	int builtin = -1, ret;
 
 	chain_head = find_chain_head(table, chain_name);
-	if (chain_head == NULL)
+	if (chain_head == NULL) {
+		g_free(new_entry);
 		return -EINVAL;
+	}
 
-	new_entry = prepare_rule_inclusion(table, ip, chain_name,
-					target_name, xt_t, &builtin, xt_rm);
-	if (new_entry == NULL)
-		return -EINVAL;
+	ret = prepare_rule_inclusion(table, chain_name, new_entry, &builtin);
+	if (ret < 0) {
+		g_free(new_entry);
+		return ret;
+	}
 
 	if (builtin == -1)
 		chain_head = chain_head->next;
@@ -706,6 +880,34 @@ static int iptables_insert_rule(struct connman_iptables *table,
 	return ret;
 }
 
+static int iptables_append_rule(struct connman_iptables *table,
+				struct ipt_ip *ip, char *chain_name,
+				char *target_name, struct xtables_target *xt_t,
+				struct xtables_rule_match *xt_rm)
+{
+	struct ipt_entry *new_entry;
+
+	new_entry = new_rule(ip, target_name, xt_t, xt_rm);
+	if (new_entry == NULL)
+		return -EINVAL;
+
+	return iptables_append_entry(table, chain_name, new_entry);
+}
+
+static int iptables_insert_rule(struct connman_iptables *table,
+				struct ipt_ip *ip, char *chain_name,
+				char *target_name, struct xtables_target *xt_t,
+				struct xtables_rule_match *xt_rm)
+{
+	struct ipt_entry *new_entry;
+
+	new_entry = new_rule(ip, target_name, xt_t, xt_rm);
+	if (new_entry == NULL)
+		return -EINVAL;
+
+	return iptables_insert_entry(table, chain_name, new_entry);
+}
+
 static gboolean is_same_ipt_entry(struct ipt_entry *i_e1,
 					struct ipt_entry *i_e2)
 {
@@ -765,18 +967,33 @@ static gboolean is_same_match(struct xt_entry_match *xt_e_m1,
 	return TRUE;
 }
 
-static GList *find_existing_rule(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				struct xtables_match *xt_m,
-				struct xtables_rule_match *xt_rm)
+static gboolean is_same_entry(struct ipt_entry *entry_test,
+				struct ipt_entry *tmp_e,
+				gboolean match_target, gboolean match_match)
 {
-	GList *chain_tail, *chain_head, *list;
-	struct xt_entry_target *xt_e_t = NULL;
-	struct xt_entry_match *xt_e_m = NULL;
-	struct connman_iptables_entry *entry;
-	struct ipt_entry *entry_test;
-	int builtin;
+	if (is_same_ipt_entry(entry_test, tmp_e) == FALSE)
+		return FALSE;
+
+	if (match_target == TRUE &&
+			!is_same_target(ipt_get_target(tmp_e),
+					ipt_get_target(entry_test)))
+		return FALSE;
+
+	if (match_match == TRUE &&
+			!is_same_match((struct xt_entry_match *)tmp_e->elems,
+				(struct xt_entry_match *)entry_test->elems))
+		return FALSE;
+
+	return TRUE;
+}
+
+static GList *find_existing_entry(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *entry_test,
+				gboolean match_target, gboolean match_match)
+{
+	GList *chain_tail, *chain_head, *list, *found;
+	struct connman_iptables_entry *entry, *tmp;
+	gpointer key;
 
 	chain_head = find_chain_head(table, chain_name);
 	if (chain_head == NULL)
@@ -786,73 +1003,78 @@ static GList *find_existing_rule(struct connman_iptables *table,
 	if (chain_tail == NULL)
 		return NULL;
 
-	if (!xt_t && !xt_m)
-		return NULL;
-
-	entry_test = new_rule(ip, target_name, xt_t, xt_rm);
-	if (entry_test == NULL)
-		return NULL;
-
-	if (xt_t != NULL)
-		xt_e_t = ipt_get_target(entry_test);
-	if (xt_m != NULL)
-		xt_e_m = (struct xt_entry_match *)entry_test->elems;
-
 	entry = chain_head->data;
-	builtin = entry->builtin;
 
-	if (builtin >= 0)
-		list = chain_head;
-	else
-		list = chain_head->next;
+	/* Only entries that look alike share a bucket */
+	key = GUINT_TO_POINTER(entry_key(entry_test));
 
-	for (; list != chain_tail->prev; list = list->next) {
-		struct connman_iptables_entry *tmp;
-		struct ipt_entry *tmp_e;
+	found = NULL;
+	for (list = g_hash_table_lookup(table->rule_hash, key); list;
+							list = list->next) {
+		GList *link = list->data;
 
-		tmp = list->data;
-		tmp_e = tmp->entry;
+		tmp = link->data;
 
-		if (is_same_ipt_entry(entry_test, tmp_e) == FALSE)
+		if (tmp->chain != entry->chain)
 			continue;
 
-		if (xt_t != NULL) {
-			struct xt_entry_target *tmp_xt_e_t;
+		/* Neither the chain policy nor a user chain head is a rule */
+		if (link == chain_tail->prev)
+			continue;
 
-			tmp_xt_e_t = ipt_get_target(tmp_e);
+		if (link == chain_head && entry->builtin < 0)
+			continue;
 
-			if (!is_same_target(tmp_xt_e_t, xt_e_t))
-				continue;
-		}
+		if (is_same_entry(entry_test, tmp->entry, match_target,
+						match_match) == FALSE)
+			continue;
 
-		if (xt_m != NULL) {
-			struct xt_entry_match *tmp_xt_e_m;
+		/* Duplicates resolve to the first one in the chain */
+		if (found != NULL) {
+			struct connman_iptables_entry *first = found->data;
 
-			tmp_xt_e_m = (struct xt_entry_match *)tmp_e->elems;
+			refresh_offsets(table);
 
-			if (!is_same_match(tmp_xt_e_m, xt_e_m))
+			if (first->offset < tmp->offset)
 				continue;
 		}
 
-		break;
+		found = link;
 	}
 
-	g_free(entry_test);
-
-	if (list != chain_tail->prev)
-		return list;
-
-	return NULL;
+	return found;
 }
 
-static int iptables_delete_rule(struct connman_iptables *table,
+static GList *find_existing_rule(struct connman_iptables *table,
 				struct ipt_ip *ip, char *chain_name,
 				char *target_name, struct xtables_target *xt_t,
 				struct xtables_match *xt_m,
 				struct xtables_rule_match *xt_rm)
+{
+	struct ipt_entry *entry_test;
+	GList *list;
+
+	if (!xt_t && !xt_m)
+		return NULL;
+
+	entry_test = new_rule(ip, target_name, xt_t, xt_rm);
+	if (entry_test == NULL)
+		return NULL;
+
+	list = find_existing_entry(table, chain_name, entry_test,
+					xt_t != NULL, xt_m != NULL);
+
+	g_free(entry_test);
+
+	return list;
+}
+
+static int iptables_delete_entry(struct connman_iptables *table,
+					char *chain_name, GList *list)
 {
 	struct connman_iptables_entry *entry;
-	GList *chain_tail, *list;
+	struct connman_iptables_chain *chain;
+	GList *chain_tail, *next;
 	int builtin, removed;
 
 	removed = 0;
@@ -861,50 +1083,52 @@ static int iptables_delete_rule(struct connman_iptables *table,
 	if (chain_tail == NULL)
 		return -EINVAL;
 
-	list = find_existing_rule(table, ip, chain_name, target_name,
-							xt_t, xt_m, xt_rm);
-	if (list == NULL)
-		return -EINVAL;
-
 	entry = list->data;
 	if (entry == NULL)
 		return -EINVAL;
 
 	builtin = entry->builtin;
+	chain = entry->chain;
+	next = list->next;
 
 	/* We have deleted a rule,
 	 * all references should be bumped accordingly */
-	if (list->next != NULL)
-		update_targets_reference(table, list->next->data,
+	if (next != NULL)
+		update_targets_reference(table, next->data,
 						list->data, TRUE);
 
-	removed += remove_table_entry(table, entry);
+	removed += remove_table_entry(table, list);
 
 	if (builtin >= 0) {
-		list = list->next;
-		if (list) {
-			entry = list->data;
+		if (next) {
+			entry = next->data;
 			entry->builtin = builtin;
 		}
 
 		table->underflow[builtin] -= removed;
-		for (list = chain_tail; list; list = list->next) {
-			entry = list->data;
 
-			builtin = entry->builtin;
-			if (builtin < 0)
-				continue;
-
-			table->hook_entry[builtin] -= removed;
-			table->underflow[builtin] -= removed;
-		}
+		update_later_hooks(table, chain, -removed);
 	}
 
-	update_offsets(table);
-
 	return 0;
 }
 
+static int iptables_delete_rule(struct connman_iptables *table,
+				struct ipt_ip *ip, char *chain_name,
+				char *target_name, struct xtables_target *xt_t,
+				struct xtables_match *xt_m,
+				struct xtables_rule_match *xt_rm)
+{
+	GList *list;
+
+	list = find_existing_rule(table, ip, chain_name, target_name,
+							xt_t, xt_m, xt_rm);
+	if (list == NULL)
+		return -EINVAL;
+
+	return iptables_delete_entry(table, chain_name, list);
+}
+
 static int iptables_compare_rule(struct connman_iptables *table,
 				struct ipt_ip *ip, char *chain_name,
 				char *target_name, struct xtables_target *xt_t,
@@ -1170,17 +1394,142 @@ static int iptables_get_entries(struct connman_iptables *table)
 {
 	socklen_t entry_size;
 
-	entry_size = sizeof(struct ipt_get_entries) + table->info->size;
+	entry_size = sizeof(struct ipt_get_entries) + table->info->size;
+
+	return getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_ENTRIES,
+				table->blob_entries, &entry_size);
+}
+
+static int iptables_replace(struct connman_iptables *table,
+					struct ipt_replace *r)
+{
+	if (setsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_SET_REPLACE, r,
+			 sizeof(*r) + r->size) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Compares two entry blobs of the same size. The packet counters and
+ * the comefrom marks the kernel uses for loop detection are left out,
+ * they change without the rules changing.
+ */
+static gboolean iptables_same_entries(const char *a, const char *b,
+							unsigned int size)
+{
+	const struct ipt_entry *e1, *e2;
+	unsigned int offset = 0;
+
+	while (offset < size) {
+		e1 = (const struct ipt_entry *) (a + offset);
+		e2 = (const struct ipt_entry *) (b + offset);
+
+		if (e1->next_offset != e2->next_offset ||
+				e1->next_offset < sizeof(struct ipt_entry) ||
+				e1->next_offset > size - offset)
+			return FALSE;
+
+		if (memcmp(e1, e2, offsetof(struct ipt_entry, comefrom)) != 0)
+			return FALSE;
+
+		if (memcmp(e1->elems, e2->elems, e1->next_offset -
+					sizeof(struct ipt_entry)) != 0)
+			return FALSE;
+
+		offset += e1->next_offset;
+	}
+
+	return TRUE;
+}
+
+/*
+ * The kernel does not expose a generation number for legacy tables, so
+ * the shadow is considered current as long as the table info and the
+ * rules themselves still match what we last loaded or committed.
+ * Anything else means somebody else touched the table.
+ */
+static gboolean iptables_is_current(struct connman_iptables *table)
+{
+	struct ipt_get_entries *entries;
+	struct ipt_getinfo info;
+	gboolean current;
+	socklen_t s;
+
+	memset(&info, 0, sizeof(info));
+	strcpy(info.name, table->info->name);
+
+	s = sizeof(info);
+	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_INFO,
+							&info, &s) < 0)
+		return FALSE;
+
+	if (info.num_entries != table->info->num_entries ||
+			info.size != table->info->size)
+		return FALSE;
+
+	if (memcmp(info.hook_entry, table->info->hook_entry,
+					sizeof(info.hook_entry)) != 0)
+		return FALSE;
+
+	if (memcmp(info.underflow, table->info->underflow,
+					sizeof(info.underflow)) != 0)
+		return FALSE;
+
+	entries = g_try_malloc0(sizeof(struct ipt_get_entries) + info.size);
+	if (entries == NULL)
+		return FALSE;
+
+	strcpy(entries->name, info.name);
+	entries->size = info.size;
+
+	s = sizeof(struct ipt_get_entries) + info.size;
+	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_ENTRIES,
+							entries, &s) < 0)
+		current = FALSE;
+	else
+		current = iptables_same_entries(
+				(const char *) entries->entrytable,
+				(const char *) table->blob_entries->entrytable,
+				info.size);
+
+	g_free(entries);
+
+	return current;
+}
+
+/*
+ * After a successful replace the blob we handed to the kernel is what
+ * the kernel now holds, so adopt it as the new baseline instead of
+ * reading the table back.
+ */
+static int iptables_replaced(struct connman_iptables *table,
+					struct ipt_replace *r)
+{
+	struct ipt_get_entries *blob_entries;
+
+	blob_entries = g_try_malloc0(sizeof(struct ipt_get_entries) + r->size);
+	if (blob_entries == NULL)
+		return -ENOMEM;
+
+	strcpy(blob_entries->name, r->name);
+	blob_entries->size = r->size;
+	memcpy(blob_entries->entrytable, r->entries, r->size);
 
-	return getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_ENTRIES,
-				table->blob_entries, &entry_size);
-}
+	g_free(table->blob_entries);
+	table->blob_entries = blob_entries;
 
-static int iptables_replace(struct connman_iptables *table,
-					struct ipt_replace *r)
-{
-	return setsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_SET_REPLACE, r,
-			 sizeof(*r) + r->size);
+	table->info->num_entries = r->num_entries;
+	table->info->size = r->size;
+	memcpy(table->info->hook_entry, r->hook_entry,
+				sizeof(table->info->hook_entry));
+	memcpy(table->info->underflow, r->underflow,
+				sizeof(table->info->underflow));
+
+	table->old_entries = r->num_entries;
+	table->dirty = FALSE;
+
+	return 0;
 }
 
 static int add_entry(struct ipt_entry *entry, struct connman_iptables *table)
@@ -1199,10 +1548,16 @@ static int add_entry(struct ipt_entry *entry, struct connman_iptables *table)
 	return iptables_add_entry(table, new_entry, NULL, builtin);
 }
 
+static void free_bucket(gpointer key, gpointer value, gpointer user_data)
+{
+	g_list_free(value);
+}
+
 static void table_cleanup(struct connman_iptables *table)
 {
 	GList *list;
 	struct connman_iptables_entry *entry;
+	struct connman_iptables_chain *chain;
 
 	if (table == NULL)
 		return;
@@ -1218,6 +1573,27 @@ static void table_cleanup(struct connman_iptables *table)
 	}
 
 	g_list_free(table->entries);
+
+	for (list = table->chains; list; list = list->next) {
+		chain = list->data;
+
+		g_free(chain->name);
+		g_free(chain);
+	}
+
+	g_list_free(table->chains);
+
+	if (table->chain_hash != NULL)
+		g_hash_table_destroy(table->chain_hash);
+
+	if (table->rule_hash != NULL) {
+		g_hash_table_foreach(table->rule_hash, free_bucket, NULL);
+		g_hash_table_destroy(table->rule_hash);
+	}
+
+	if (table->jumps != NULL)
+		g_hash_table_destroy(table->jumps);
+
 	g_free(table->info);
 	g_free(table->blob_entries);
 	g_free(table);
@@ -1234,6 +1610,20 @@ static struct connman_iptables *iptables_init(char *table_name)
 
 	DBG("%s", table_name);
 
+	table = g_hash_table_lookup(table_hash, table_name);
+	if (table != NULL) {
+		/*
+		 * Pending edits were validated when the first of them was
+		 * made, and the table is checked once more on commit.
+		 */
+		if (table->dirty == TRUE || iptables_is_current(table) == TRUE)
+			return table;
+
+		DBG("%s changed outside of us, reloading", table_name);
+
+		g_hash_table_remove(table_hash, table_name);
+	}
+
 	if (xtables_insmod("ip_tables", NULL, TRUE) != 0)
 		DBG("ip_tables module loading gives error but trying anyway");
 
@@ -1246,10 +1636,6 @@ static struct connman_iptables *iptables_init(char *table_name)
 
 	g_free(module);
 
-	table = g_hash_table_lookup(table_hash, table_name);
-	if (table != NULL)
-		return table;
-
 	table = g_try_new0(struct connman_iptables, 1);
 	if (table == NULL)
 		return NULL;
@@ -1258,6 +1644,10 @@ static struct connman_iptables *iptables_init(char *table_name)
 	if (table->info == NULL)
 		goto err;
 
+	table->chain_hash = g_hash_table_new(g_str_hash, g_str_equal);
+	table->rule_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+	table->jumps = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	table->ipt_sock = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
 	if (table->ipt_sock < 0)
 		goto err;
@@ -1383,6 +1773,8 @@ static struct xtables_target *prepare_target(struct connman_iptables *table,
 				return NULL;
 			}
 
+			refresh_offsets(table);
+
 			target_rule = chain_head->next->data;
 			target->verdict = target_rule->offset;
 		}
@@ -1798,6 +2190,7 @@ static int iptables_command(int argc, char *argv[])
 		printf("Delete chain %s\n", delete_chain);
 
 		iptables_delete_chain(table, delete_chain);
+		table->dirty = TRUE;
 
 		goto out;
 	}
@@ -1812,6 +2205,7 @@ static int iptables_command(int argc, char *argv[])
 		DBG("Flush chain %s", flush_chain);
 
 		iptables_flush_chain(table, flush_chain);
+		table->dirty = TRUE;
 
 		goto out;
 	}
@@ -1825,6 +2219,9 @@ static int iptables_command(int argc, char *argv[])
 		DBG("New chain %s", new_chain);
 
 		ret = iptables_add_chain(table, new_chain);
+		if (ret == 0)
+			table->dirty = TRUE;
+
 		goto out;
 	}
 
@@ -1833,6 +2230,7 @@ static int iptables_command(int argc, char *argv[])
 			printf("Changing policy of %s to %s\n", chain, policy);
 
 			iptables_change_policy(table, chain, policy);
+			table->dirty = TRUE;
 
 			goto out;
 		}
@@ -1852,6 +2250,8 @@ static int iptables_command(int argc, char *argv[])
 
 			ret = iptables_delete_rule(table, &ip, chain,
 					target_name, xt_t, xt_m, xt_rm);
+			if (ret == 0)
+				table->dirty = TRUE;
 
 			goto out;
 		}
@@ -1862,6 +2262,8 @@ static int iptables_command(int argc, char *argv[])
 
 			ret = iptables_insert_rule(table, &ip, chain,
 						target_name, xt_t, xt_rm);
+			if (ret == 0)
+				table->dirty = TRUE;
 
 			goto out;
 		} else {
@@ -1870,6 +2272,8 @@ static int iptables_command(int argc, char *argv[])
 
 			ret = iptables_append_rule(table, &ip, chain,
 						target_name, xt_t, xt_rm);
+			if (ret == 0)
+				table->dirty = TRUE;
 
 			goto out;
 		}
@@ -1931,6 +2335,362 @@ int __connman_iptables_command(const char *format, ...)
 }
 
 
+struct connman_iptables_rule {
+	char *table_name;
+	char *chain_name;
+	struct ipt_ip ip;
+	char *target_name;
+	gboolean jump;
+	struct ipt_entry *entry;
+};
+
+struct connman_iptables_rule *__connman_iptables_rule_new(
+					const char *table_name,
+					const char *chain_name)
+{
+	struct connman_iptables_rule *rule;
+
+	if (chain_name == NULL)
+		return NULL;
+
+	rule = g_try_new0(struct connman_iptables_rule, 1);
+	if (rule == NULL)
+		return NULL;
+
+	rule->table_name = g_strdup(table_name != NULL ?
+						table_name : "filter");
+	rule->chain_name = g_strdup(chain_name);
+
+	return rule;
+}
+
+void __connman_iptables_rule_free(struct connman_iptables_rule *rule)
+{
+	if (rule == NULL)
+		return;
+
+	g_free(rule->entry);
+	g_free(rule->target_name);
+	g_free(rule->chain_name);
+	g_free(rule->table_name);
+	g_free(rule);
+}
+
+static void rule_invalidate(struct connman_iptables_rule *rule)
+{
+	g_free(rule->entry);
+	rule->entry = NULL;
+}
+
+static int rule_set_address(const char *address, unsigned char prefixlen,
+				struct in_addr *addr, struct in_addr *mask)
+{
+	uint32_t tmp;
+
+	if (address == NULL || prefixlen > 32)
+		return -EINVAL;
+
+	if (inet_pton(AF_INET, address, addr) != 1)
+		return -EINVAL;
+
+	if (prefixlen == 0)
+		tmp = 0;
+	else
+		tmp = ~(0xffffffff >> prefixlen);
+
+	mask->s_addr = htonl(tmp);
+	addr->s_addr = addr->s_addr & mask->s_addr;
+
+	return 0;
+}
+
+int __connman_iptables_rule_set_source(struct connman_iptables_rule *rule,
+				const char *address, unsigned char prefixlen)
+{
+	rule_invalidate(rule);
+
+	return rule_set_address(address, prefixlen,
+				&rule->ip.src, &rule->ip.smsk);
+}
+
+int __connman_iptables_rule_set_destination(
+				struct connman_iptables_rule *rule,
+				const char *address, unsigned char prefixlen)
+{
+	rule_invalidate(rule);
+
+	return rule_set_address(address, prefixlen,
+				&rule->ip.dst, &rule->ip.dmsk);
+}
+
+static int rule_set_interface(const char *ifname, char *iface,
+						unsigned char *mask)
+{
+	size_t len;
+
+	if (ifname == NULL)
+		return -EINVAL;
+
+	len = strlen(ifname);
+	if (len + 1 > IFNAMSIZ)
+		return -EINVAL;
+
+	memset(iface, 0, IFNAMSIZ);
+	memset(mask, 0, IFNAMSIZ);
+
+	strcpy(iface, ifname);
+	memset(mask, 0xff, len + 1);
+
+	return 0;
+}
+
+int __connman_iptables_rule_set_in_interface(
+				struct connman_iptables_rule *rule,
+				const char *ifname)
+{
+	rule_invalidate(rule);
+
+	return rule_set_interface(ifname, rule->ip.iniface,
+						rule->ip.iniface_mask);
+}
+
+int __connman_iptables_rule_set_out_interface(
+				struct connman_iptables_rule *rule,
+				const char *ifname)
+{
+	rule_invalidate(rule);
+
+	return rule_set_interface(ifname, rule->ip.outiface,
+						rule->ip.outiface_mask);
+}
+
+int __connman_iptables_rule_set_target(struct connman_iptables_rule *rule,
+						const char *target_name)
+{
+	if (target_name == NULL)
+		return -EINVAL;
+
+	rule_invalidate(rule);
+
+	g_free(rule->target_name);
+	rule->target_name = g_strdup(target_name);
+
+	return 0;
+}
+
+/*
+ * Builds the ipt_entry for the rule once; later edits only copy it. The
+ * only table dependent bit is the verdict of a jump to a user defined
+ * chain, which is filled in when the rule is added.
+ */
+static struct ipt_entry *rule_compile(struct connman_iptables_rule *rule)
+{
+	struct xtables_target *xt_t;
+	struct xt_entry_target *target;
+	struct ipt_entry *entry;
+	gboolean standard;
+	size_t target_size;
+
+	if (rule->entry != NULL)
+		return rule->entry;
+
+	if (rule->target_name == NULL)
+		return NULL;
+
+	standard = TRUE;
+	rule->jump = FALSE;
+
+	if (is_builtin_target(rule->target_name) == TRUE)
+		xt_t = xtables_find_target(IPT_STANDARD_TARGET,
+						XTF_LOAD_MUST_SUCCEED);
+	else {
+		xt_t = xtables_find_target(rule->target_name, XTF_TRY_LOAD);
+		if (xt_t != NULL)
+			standard = FALSE;
+		else {
+			rule->jump = TRUE;
+			xt_t = xtables_find_target(IPT_STANDARD_TARGET,
+						XTF_LOAD_MUST_SUCCEED);
+		}
+	}
+
+	if (xt_t == NULL)
+		return NULL;
+
+	target_size = ALIGN(sizeof(struct ipt_entry_target)) + xt_t->size;
+
+	entry = g_try_malloc0(sizeof(struct ipt_entry) + target_size);
+	if (entry == NULL)
+		return NULL;
+
+	memcpy(&entry->ip, &rule->ip, sizeof(struct ipt_ip));
+	entry->target_offset = sizeof(struct ipt_entry);
+	entry->next_offset = sizeof(struct ipt_entry) + target_size;
+
+	target = ipt_get_target(entry);
+	target->u.target_size = target_size;
+
+	if (standard == TRUE) {
+		struct xt_standard_target *t;
+
+		t = (struct xt_standard_target *)target;
+		strcpy(t->target.u.user.name, IPT_STANDARD_TARGET);
+
+		if (rule->jump == FALSE)
+			t->verdict = target_to_verdict(rule->target_name);
+	} else {
+		strcpy(target->u.user.name, rule->target_name);
+		target->u.user.revision = xt_t->revision;
+		if (xt_t->init != NULL)
+			xt_t->init(target);
+	}
+
+	rule->entry = entry;
+
+	return entry;
+}
+
+static struct ipt_entry *rule_instantiate(struct connman_iptables *table,
+					struct connman_iptables_rule *rule)
+{
+	struct ipt_entry *template, *entry;
+
+	template = rule_compile(rule);
+	if (template == NULL)
+		return NULL;
+
+	entry = g_try_malloc(template->next_offset);
+	if (entry == NULL)
+		return NULL;
+
+	memcpy(entry, template, template->next_offset);
+
+	if (rule->jump == TRUE) {
+		struct xt_standard_target *t;
+		struct connman_iptables_entry *target_rule;
+		GList *chain_head;
+
+		chain_head = find_chain_head(table, rule->target_name);
+		if (chain_head == NULL || chain_head->next == NULL) {
+			g_free(entry);
+			return NULL;
+		}
+
+		refresh_offsets(table);
+
+		target_rule = chain_head->next->data;
+
+		t = (struct xt_standard_target *)ipt_get_target(entry);
+		t->verdict = target_rule->offset;
+	}
+
+	return entry;
+}
+
+int __connman_iptables_rule_append(struct connman_iptables_rule *rule)
+{
+	struct connman_iptables *table;
+	struct ipt_entry *entry;
+	int err;
+
+	DBG("%s %s -> %s", rule->table_name, rule->chain_name,
+						rule->target_name);
+
+	table = iptables_init(rule->table_name);
+	if (table == NULL)
+		return -EINVAL;
+
+	entry = rule_instantiate(table, rule);
+	if (entry == NULL)
+		return -EINVAL;
+
+	err = iptables_append_entry(table, rule->chain_name, entry);
+	if (err == 0)
+		table->dirty = TRUE;
+
+	return err;
+}
+
+int __connman_iptables_rule_insert(struct connman_iptables_rule *rule)
+{
+	struct connman_iptables *table;
+	struct ipt_entry *entry;
+	int err;
+
+	DBG("%s %s -> %s", rule->table_name, rule->chain_name,
+						rule->target_name);
+
+	table = iptables_init(rule->table_name);
+	if (table == NULL)
+		return -EINVAL;
+
+	entry = rule_instantiate(table, rule);
+	if (entry == NULL)
+		return -EINVAL;
+
+	err = iptables_insert_entry(table, rule->chain_name, entry);
+	if (err == 0)
+		table->dirty = TRUE;
+
+	return err;
+}
+
+static GList *rule_find(struct connman_iptables *table,
+					struct connman_iptables_rule *rule)
+{
+	struct ipt_entry *entry;
+	GList *list;
+
+	entry = rule_instantiate(table, rule);
+	if (entry == NULL)
+		return NULL;
+
+	list = find_existing_entry(table, rule->chain_name, entry,
+								TRUE, FALSE);
+
+	g_free(entry);
+
+	return list;
+}
+
+int __connman_iptables_rule_delete(struct connman_iptables_rule *rule)
+{
+	struct connman_iptables *table;
+	GList *list;
+	int err;
+
+	DBG("%s %s -> %s", rule->table_name, rule->chain_name,
+						rule->target_name);
+
+	table = iptables_init(rule->table_name);
+	if (table == NULL)
+		return -EINVAL;
+
+	list = rule_find(table, rule);
+	if (list == NULL)
+		return -ENOENT;
+
+	err = iptables_delete_entry(table, rule->chain_name, list);
+	if (err == 0)
+		table->dirty = TRUE;
+
+	return err;
+}
+
+int __connman_iptables_rule_compare(struct connman_iptables_rule *rule)
+{
+	struct connman_iptables *table;
+
+	table = iptables_init(rule->table_name);
+	if (table == NULL)
+		return -EINVAL;
+
+	if (rule_find(table, rule) == NULL)
+		return -EINVAL;
+
+	return 0;
+}
+
 int __connman_iptables_commit(const char *table_name)
 {
 	struct connman_iptables *table;
@@ -1943,19 +2703,53 @@ int __connman_iptables_commit(const char *table_name)
 	if (table == NULL)
 		return -EINVAL;
 
+	if (table->dirty == FALSE)
+		return 0;
+
+	/*
+	 * The kernel only refuses a replace when the number of rules
+	 * changed, so make sure that nobody else edited the table since
+	 * it was loaded. Otherwise their changes would be overwritten.
+	 */
+	if (iptables_is_current(table) == FALSE) {
+		connman_error("%s table changed outside of us, not committing",
+								table_name);
+		g_hash_table_remove(table_hash, table_name);
+		return -EAGAIN;
+	}
+
 	repl = iptables_blob(table);
+	if (repl == NULL) {
+		g_hash_table_remove(table_hash, table_name);
+		return -ENOMEM;
+	}
 
 	err = iptables_replace(table, repl);
+	if (err < 0) {
+		connman_error("Committing %s table failed (%s)", table_name,
+							strerror(-err));
+		/* The shadow no longer matches the kernel, drop it */
+		g_hash_table_remove(table_hash, table_name);
+	} else if (iptables_replaced(table, repl) < 0)
+		g_hash_table_remove(table_hash, table_name);
 
 	g_free(repl->counters);
 	g_free(repl);
 
-	if (err < 0)
-	    return err;
+	return err;
+}
 
-	g_hash_table_remove(table_hash, table_name);
+void __connman_iptables_abort(const char *table_name)
+{
+	struct connman_iptables *table;
 
-	return 0;
+	DBG("%s", table_name);
+
+	table = g_hash_table_lookup(table_hash, table_name);
+	if (table == NULL || table->dirty == FALSE)
+		return;
+
+	g_hash_table_remove(table_hash, table_name);
 }
 
 static void remove_table(gpointer user_data)
@@ -25,19 +25,358 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <execinfo.h>
 #include <dlfcn.h>
+#include <sys/time.h>
 
 #include "connman.h"
 
+#ifdef TEMP_FAILURE_RETRY
+#define TFR TEMP_FAILURE_RETRY
+#else
+#define TFR
+#endif
+
+/*
+ * Programs which never call __connman_log_init(), like some of the
+ * unit tests, need not link libpthread for the drainer.
+ */
+#pragma weak pthread_create
+#pragma weak pthread_join
+
+#define LOG_RING_SIZE		512	/* entries, a power of two */
+#define LOG_MESSAGE_MAX		256
+#define LOG_DEBUG_RATE		200	/* per second and category */
+#define LOG_IDLE_TIMEOUT	1000	/* ms */
+#define LOG_BUSY_TIMEOUT	10	/* ms */
+#define LOG_FLUSH_TIMEOUT	1000	/* ms */
+
+/*
+ * Messages are formatted by the caller into a ring of LOG_RING_SIZE
+ * entries and handed to syslog by a drainer thread, so logging never
+ * blocks on the syslog socket. Writers claim a ticket with an atomic
+ * increment and publish the entry by storing ticket + 1 in its seq
+ * once it is complete. The drainer and the dump copy an entry and
+ * only use it if seq did not change meanwhile. When the drainer
+ * falls behind by more than the ring, the oldest entries are lost
+ * and their number is logged.
+ *
+ * The drainer sleeps while the ring is empty, a writer only wakes it
+ * through the pipe when it was idle.
+ */
+struct log_entry {
+	unsigned long seq;
+	struct timeval time;
+	int priority;
+	const char *category;
+	char message[LOG_MESSAGE_MAX];
+};
+
+/* Debug messages of a category within the current second */
+struct log_category {
+	char *name;
+	int window;
+	int budget;
+	int suppressed;
+};
+
 static const char *program_exec;
 static const char *program_path;
 
+static struct log_entry *log_ring = NULL;
+static unsigned long log_head = 0;
+static unsigned long log_tail = 0;
+static int log_idle = 0;
+static int log_running = 0;
+static int log_direct = 0;
+static int log_notify[2] = { -1, -1 };
+static pthread_t log_thread;
+
+/*
+ * Categories by name, and by the source file whose DBG() messages
+ * they limit. The public debug descriptor has no room for them.
+ */
+static GHashTable *log_categories = NULL;
+static GHashTable *log_files = NULL;
+static pthread_mutex_t log_category_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void log_wakeup(void)
+{
+	char wake = 1;
+
+	if (TFR(write(log_notify[1], &wake, 1)) < 0)
+		return;
+}
+
+static void log_write(int priority, const char *category,
+					const char *format, va_list ap)
+{
+	struct log_entry *entry;
+	unsigned long ticket;
+
+	if (log_ring == NULL || log_direct != 0) {
+		vsyslog(priority, format, ap);
+		return;
+	}
+
+	ticket = __sync_fetch_and_add(&log_head, 1);
+	entry = &log_ring[ticket & (LOG_RING_SIZE - 1)];
+
+	__sync_lock_test_and_set(&entry->seq, 0);
+	__sync_synchronize();
+
+	gettimeofday(&entry->time, NULL);
+	entry->priority = priority;
+	entry->category = category;
+	vsnprintf(entry->message, sizeof(entry->message), format, ap);
+
+	__sync_synchronize();
+	__sync_lock_test_and_set(&entry->seq, ticket + 1);
+
+	if (__sync_bool_compare_and_swap(&log_idle, 1, 0) == TRUE)
+		log_wakeup();
+}
+
+static void log_printf(int priority, const char *category,
+						const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_write(priority, category, format, ap);
+	va_end(ap);
+}
+
+/* Returns 1 if copied, 0 if not written yet, -1 if overwritten */
+static int log_read(unsigned long ticket, struct log_entry *copy)
+{
+	struct log_entry *entry = &log_ring[ticket & (LOG_RING_SIZE - 1)];
+	unsigned long seq;
+
+	seq = __sync_fetch_and_add(&entry->seq, 0);
+
+	if (seq == 0 || seq < ticket + 1)
+		return 0;
+
+	if (seq > ticket + 1)
+		return -1;
+
+	memcpy(copy, entry, sizeof(*copy));
+
+	if (__sync_fetch_and_add(&entry->seq, 0) != seq)
+		return -1;
+
+	copy->message[LOG_MESSAGE_MAX - 1] = '\0';
+
+	return 1;
+}
+
+/* Prints what is in the ring, returns FALSE if a writer is not done */
+static gboolean log_drain(void)
+{
+	struct log_entry entry;
+	unsigned long head, dropped = 0;
+	gboolean done = TRUE;
+	int ret;
+
+	head = __sync_fetch_and_add(&log_head, 0);
+
+	while (log_tail != head) {
+		if (head - log_tail > LOG_RING_SIZE) {
+			dropped += head - log_tail - LOG_RING_SIZE;
+			log_tail = head - LOG_RING_SIZE;
+		}
+
+		ret = log_read(log_tail, &entry);
+		if (ret == 0) {
+			done = FALSE;
+			break;
+		}
+
+		if (ret < 0)
+			dropped++;
+		else
+			syslog(entry.priority, "%s", entry.message);
+
+		log_tail++;
+	}
+
+	if (dropped > 0)
+		syslog(LOG_WARNING, "%lu log messages dropped", dropped);
+
+	return done;
+}
+
+static void *log_drain_thread(void *data)
+{
+	struct pollfd pfd;
+	char buf[64];
+
+	pfd.fd = log_notify[0];
+	pfd.events = POLLIN;
+
+	while (1) {
+		gboolean done = log_drain();
+
+		if (__sync_fetch_and_add(&log_running, 0) == 0 &&
+				done == TRUE &&
+				log_tail == __sync_fetch_and_add(&log_head, 0))
+			break;
+
+		if (done == FALSE) {
+			poll(NULL, 0, LOG_BUSY_TIMEOUT);
+			continue;
+		}
+
+		__sync_lock_test_and_set(&log_idle, 1);
+
+		/* A writer may have missed the idle flag */
+		if (log_tail != __sync_fetch_and_add(&log_head, 0)) {
+			__sync_bool_compare_and_swap(&log_idle, 1, 0);
+			continue;
+		}
+
+		if (poll(&pfd, 1, LOG_IDLE_TIMEOUT) > 0)
+			while (read(log_notify[0], buf, sizeof(buf)) > 0);
+	}
+
+	return NULL;
+}
+
+static int log_ring_start(void)
+{
+	if (pthread_create == NULL)
+		return -ENOSYS;
+
+	log_ring = g_try_new0(struct log_entry, LOG_RING_SIZE);
+	if (log_ring == NULL)
+		return -ENOMEM;
+
+	if (pipe2(log_notify, O_CLOEXEC | O_NONBLOCK) < 0)
+		goto err;
+
+	log_running = 1;
+
+	if (pthread_create(&log_thread, NULL, log_drain_thread, NULL) != 0) {
+		TFR(close(log_notify[0]));
+		TFR(close(log_notify[1]));
+		goto err;
+	}
+
+	return 0;
+
+err:
+	log_notify[0] = log_notify[1] = -1;
+	log_running = 0;
+	g_free(log_ring);
+	log_ring = NULL;
+
+	return -EIO;
+}
+
+static void log_ring_stop(void)
+{
+	struct log_entry *ring = log_ring;
+
+	if (ring == NULL)
+		return;
+
+	__sync_lock_test_and_set(&log_running, 0);
+	log_wakeup();
+
+	/* The drainer prints everything left before it exits */
+	pthread_join(log_thread, NULL);
+
+	log_ring = NULL;
+	__sync_synchronize();
+
+	TFR(close(log_notify[0]));
+	TFR(close(log_notify[1]));
+	log_notify[0] = log_notify[1] = -1;
+
+	g_free(ring);
+}
+
+static const char *priority2string(int priority)
+{
+	switch (priority) {
+	case LOG_ERR:
+		return "error";
+	case LOG_WARNING:
+		return "warning";
+	case LOG_INFO:
+		return "info";
+	case LOG_DEBUG:
+		return "debug";
+	}
+
+	return "unknown";
+}
+
+/*
+ * Appends up to count of the latest ring entries, oldest first, as
+ * dictionaries to array.
+ */
+void __connman_log_dump(DBusMessageIter *array, unsigned int count)
+{
+	struct log_entry entry;
+	unsigned long head, ticket;
+
+	if (log_ring == NULL)
+		return;
+
+	head = __sync_fetch_and_add(&log_head, 0);
+
+	if (count > LOG_RING_SIZE)
+		count = LOG_RING_SIZE;
+
+	ticket = head > count ? head - count : 0;
+
+	for (; ticket != head; ticket++) {
+		DBusMessageIter dict;
+		dbus_uint64_t value;
+		const char *str;
+
+		if (log_read(ticket, &entry) != 1)
+			continue;
+
+		connman_dbus_dict_open(array, &dict);
+
+		value = ticket;
+		connman_dbus_dict_append_basic(&dict, "Sequence",
+						DBUS_TYPE_UINT64, &value);
+
+		value = (dbus_uint64_t) entry.time.tv_sec * 1000000 +
+							entry.time.tv_usec;
+		connman_dbus_dict_append_basic(&dict, "Time",
+						DBUS_TYPE_UINT64, &value);
+
+		str = priority2string(entry.priority);
+		connman_dbus_dict_append_basic(&dict, "Priority",
+						DBUS_TYPE_STRING, &str);
+
+		if (entry.category != NULL)
+			connman_dbus_dict_append_basic(&dict, "Category",
+					DBUS_TYPE_STRING, &entry.category);
+
+		str = entry.message;
+		connman_dbus_dict_append_basic(&dict, "Message",
+						DBUS_TYPE_STRING, &str);
+
+		connman_dbus_dict_close(array, &dict);
+	}
+}
+
 /**
  * connman_info:
  * @format: format string
@@ -51,7 +390,7 @@ void connman_info(const char *format, ...)
 
 	va_start(ap, format);
 
-	vsyslog(LOG_INFO, format, ap);
+	log_write(LOG_INFO, NULL, format, ap);
 
 	va_end(ap);
 }
@@ -69,7 +408,7 @@ void connman_warn(const char *format, ...)
 
 	va_start(ap, format);
 
-	vsyslog(LOG_WARNING, format, ap);
+	log_write(LOG_WARNING, NULL, format, ap);
 
 	va_end(ap);
 }
@@ -87,11 +426,67 @@ void connman_error(const char *format, ...)
 
 	va_start(ap, format);
 
-	vsyslog(LOG_ERR, format, ap);
+	log_write(LOG_ERR, NULL, format, ap);
 
 	va_end(ap);
 }
 
+/* Returns TRUE if the category used up its debug messages */
+static connman_bool_t log_ratelimit(struct log_category *category)
+{
+	struct timespec ts;
+	int window, suppressed;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	window = category->window;
+	if (window != (int) ts.tv_sec && __sync_bool_compare_and_swap(
+				&category->window, window, ts.tv_sec)) {
+		__sync_lock_test_and_set(&category->budget, LOG_DEBUG_RATE);
+
+		suppressed = __sync_lock_test_and_set(&category->suppressed,
+									0);
+		if (suppressed > 0)
+			log_printf(LOG_DEBUG, category->name,
+				"%s: %d debug messages suppressed",
+				category->name, suppressed);
+	}
+
+	if (__sync_fetch_and_sub(&category->budget, 1) > 0)
+		return FALSE;
+
+	__sync_fetch_and_add(&category->suppressed, 1);
+
+	return TRUE;
+}
+
+/*
+ * DBG() passes __FILE__ as the first argument, which selects the
+ * category. Other debug messages are not rate limited.
+ */
+static struct log_category *log_category_lookup(const char *format,
+								va_list ap)
+{
+	struct log_category *category;
+	const char *file;
+
+	if (strncmp(format, "%s:", 3) != 0)
+		return NULL;
+
+	file = va_arg(ap, const char *);
+	if (file == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&log_category_lock);
+
+	category = log_files != NULL ?
+			g_hash_table_lookup(log_files, file) : NULL;
+
+	pthread_mutex_unlock(&log_category_lock);
+
+	return category;
+}
+
 /**
  * connman_debug:
  * @format: format string
@@ -101,11 +496,20 @@ void connman_error(const char *format, ...)
  */
 void connman_debug(const char *format, ...)
 {
+	struct log_category *category;
 	va_list ap;
 
+	va_start(ap, format);
+	category = log_category_lookup(format, ap);
+	va_end(ap);
+
+	if (category != NULL && log_ratelimit(category) == TRUE)
+		return;
+
 	va_start(ap, format);
 
-	vsyslog(LOG_DEBUG, format, ap);
+	log_write(LOG_DEBUG, category != NULL ? category->name : NULL,
+							format, ap);
 
 	va_end(ap);
 }
@@ -212,8 +616,32 @@ static void print_backtrace(unsigned int offset)
 	close(infd[0]);
 }
 
+/*
+ * Lets the drainer print what is still in the ring. Only waits for a
+ * while, the drainer itself may be the thread which crashed.
+ */
+static void log_flush(void)
+{
+	int i;
+
+	for (i = 0; i < LOG_FLUSH_TIMEOUT / LOG_BUSY_TIMEOUT; i++) {
+		if (__sync_fetch_and_add(&log_tail, 0) ==
+				__sync_fetch_and_add(&log_head, 0))
+			break;
+
+		log_wakeup();
+		poll(NULL, 0, LOG_BUSY_TIMEOUT);
+	}
+}
+
 static void signal_handler(int signo)
 {
+	/* Whatever is still in the ring, then log directly */
+	if (log_ring != NULL && log_direct == 0) {
+		log_flush();
+		log_direct = 1;
+	}
+
 	connman_error("Aborting (signal %d) [%s]", signo, program_exec);
 
 	print_backtrace(2);
@@ -262,6 +690,48 @@ static connman_bool_t is_enabled(struct connman_debug_desc *desc)
 	return FALSE;
 }
 
+static void free_category(gpointer data)
+{
+	struct log_category *category = data;
+
+	g_free(category->name);
+	g_free(category);
+}
+
+/* Debug messages are rate limited per alias name or else per file */
+static void log_category_add(struct connman_debug_desc *desc)
+{
+	struct log_category *category;
+	const char *name;
+
+	if (log_categories == NULL || desc->file == NULL)
+		return;
+
+	name = desc->name != NULL ? desc->name : desc->file;
+
+	pthread_mutex_lock(&log_category_lock);
+
+	if (g_hash_table_lookup(log_files, desc->file) != NULL)
+		goto out;
+
+	category = g_hash_table_lookup(log_categories, name);
+	if (category == NULL) {
+		category = g_try_new0(struct log_category, 1);
+		if (category == NULL)
+			goto out;
+
+		category->name = g_strdup(name);
+		category->budget = LOG_DEBUG_RATE;
+
+		g_hash_table_insert(log_categories, category->name, category);
+	}
+
+	g_hash_table_insert(log_files, g_strdup(desc->file), category);
+
+out:
+	pthread_mutex_unlock(&log_category_lock);
+}
+
 void __connman_log_enable(struct connman_debug_desc *start,
 					struct connman_debug_desc *stop)
 {
@@ -286,8 +756,10 @@ void __connman_log_enable(struct connman_debug_desc *start,
 				file = NULL;
 		}
 
-		if (is_enabled(desc) == TRUE)
+		if (is_enabled(desc) == TRUE) {
 			desc->flags |= CONNMAN_DEBUG_FLAG_PRINT;
+			log_category_add(desc);
+		}
 	}
 }
 
@@ -304,6 +776,11 @@ int __connman_log_init(const char *program, const char *debug,
 	if (debug != NULL)
 		enabled = g_strsplit_set(debug, ":, ", 0);
 
+	log_categories = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, free_category);
+	log_files = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
+
 	__connman_log_enable(__start___debug, __stop___debug);
 
 	if (detach == FALSE)
@@ -316,11 +793,16 @@ int __connman_log_init(const char *program, const char *debug,
 
 	syslog(LOG_INFO, "%s version %s", program_name, program_version);
 
+	if (log_ring_start() < 0)
+		syslog(LOG_WARNING, "Logging synchronously");
+
 	return 0;
 }
 
 void __connman_log_cleanup(connman_bool_t backtrace)
 {
+	log_ring_stop();
+
 	syslog(LOG_INFO, "Exit");
 
 	closelog();
@@ -328,5 +810,15 @@ void __connman_log_cleanup(connman_bool_t backtrace)
 	if (backtrace == TRUE)
 		signal_setup(SIG_DFL);
 
+	pthread_mutex_lock(&log_category_lock);
+
+	g_hash_table_destroy(log_files);
+	log_files = NULL;
+
+	g_hash_table_destroy(log_categories);
+	log_categories = NULL;
+
+	pthread_mutex_unlock(&log_category_lock);
+
 	g_strfreev(enabled);
 }
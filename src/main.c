@@ -24,6 +24,7 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -41,6 +42,12 @@
 
 #define DEFAULT_INPUT_REQUEST_TIMEOUT 120 * 1000
 #define DEFAULT_BROWSER_LAUNCH_TIMEOUT 300 * 1000
+#define DEFAULT_DNS_CACHE_SIZE (128 * 1024)
+#define DEFAULT_DNS_CACHE_ENTRIES 1024
+#define DEFAULT_DNS_CACHE_PREFETCH 80
+#define DEFAULT_DNS_CACHE_STALE_TIME 3600
+#define DEFAULT_DNS_NEGATIVE_CACHE_SIZE (32 * 1024)
+#define DEFAULT_STORAGE_WRITE_DELAY 2000
 
 #define MAINFILE "main.conf"
 #define CONFIGMAINFILE CONFIGDIR "/" MAINFILE
@@ -72,6 +79,14 @@ static struct {
 	char **blacklisted_interfaces;
 	connman_bool_t allow_hostname_updates;
 	connman_bool_t single_tech;
+	unsigned int dns_cache_size;
+	unsigned int dns_cache_entries;
+	unsigned int dns_cache_prefetch;
+	unsigned int dns_cache_stale_time;
+	unsigned int dns_negative_cache_size;
+	connman_bool_t dns_cache_snapshot;
+	unsigned int stats_sample_interval;
+	unsigned int storage_write_delay;
 } connman_settings  = {
 	.bg_scan = TRUE,
 	.pref_timeservers = NULL,
@@ -83,6 +98,14 @@ static struct {
 	.blacklisted_interfaces = NULL,
 	.allow_hostname_updates = TRUE,
 	.single_tech = FALSE,
+	.dns_cache_size = DEFAULT_DNS_CACHE_SIZE,
+	.dns_cache_entries = DEFAULT_DNS_CACHE_ENTRIES,
+	.dns_cache_prefetch = DEFAULT_DNS_CACHE_PREFETCH,
+	.dns_cache_stale_time = DEFAULT_DNS_CACHE_STALE_TIME,
+	.dns_negative_cache_size = DEFAULT_DNS_NEGATIVE_CACHE_SIZE,
+	.dns_cache_snapshot = FALSE,
+	.stats_sample_interval = 0,
+	.storage_write_delay = DEFAULT_STORAGE_WRITE_DELAY,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -95,6 +118,14 @@ static struct {
 #define CONF_BLACKLISTED_INTERFACES     "NetworkInterfaceBlacklist"
 #define CONF_ALLOW_HOSTNAME_UPDATES     "AllowHostnameUpdates"
 #define CONF_SINGLE_TECH                "SingleConnectedTechnology"
+#define CONF_DNS_CACHE_SIZE             "DNSCacheSize"
+#define CONF_DNS_CACHE_ENTRIES          "DNSCacheEntries"
+#define CONF_DNS_CACHE_PREFETCH         "DNSCachePrefetch"
+#define CONF_DNS_CACHE_STALE_TIME       "DNSCacheStaleTime"
+#define CONF_DNS_NEGATIVE_CACHE_SIZE    "DNSNegativeCacheSize"
+#define CONF_DNS_CACHE_SNAPSHOT         "DNSCacheSnapshot"
+#define CONF_STATS_SAMPLE_INTERVAL      "StatisticsSampleInterval"
+#define CONF_STORAGE_WRITE_DELAY        "StorageWriteDelay"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -107,6 +138,14 @@ static const char *supported_options[] = {
 	CONF_BLACKLISTED_INTERFACES,
 	CONF_ALLOW_HOSTNAME_UPDATES,
 	CONF_SINGLE_TECH,
+	CONF_DNS_CACHE_SIZE,
+	CONF_DNS_CACHE_ENTRIES,
+	CONF_DNS_CACHE_PREFETCH,
+	CONF_DNS_CACHE_STALE_TIME,
+	CONF_DNS_NEGATIVE_CACHE_SIZE,
+	CONF_DNS_CACHE_SNAPSHOT,
+	CONF_STATS_SAMPLE_INTERVAL,
+	CONF_STORAGE_WRITE_DELAY,
 	NULL
 };
 
@@ -229,6 +268,7 @@ static void parse_config(GKeyFile *config)
 	char **str_list;
 	gsize len;
 	int timeout;
+	int size;
 
 	if (config == NULL) {
 		connman_settings.auto_connect =
@@ -329,6 +369,64 @@ static void parse_config(GKeyFile *config)
 		connman_settings.single_tech = boolean;
 
 	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_SIZE, &error);
+	if (error == NULL && size >= 0 &&
+			(unsigned int) size <= UINT_MAX / 1024)
+		connman_settings.dns_cache_size = size * 1024U;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_ENTRIES, &error);
+	if (error == NULL && size >= 0)
+		connman_settings.dns_cache_entries = size;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_PREFETCH, &error);
+	if (error == NULL && size >= 0 && size <= 100)
+		connman_settings.dns_cache_prefetch = size;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_STALE_TIME, &error);
+	if (error == NULL && timeout >= 0)
+		connman_settings.dns_cache_stale_time = timeout;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNS_NEGATIVE_CACHE_SIZE, &error);
+	if (error == NULL && size >= 0 &&
+			(unsigned int) size <= UINT_MAX / 1024)
+		connman_settings.dns_negative_cache_size = size * 1024U;
+
+	g_clear_error(&error);
+
+	boolean = g_key_file_get_boolean(config, "General",
+			CONF_DNS_CACHE_SNAPSHOT, &error);
+	if (error == NULL)
+		connman_settings.dns_cache_snapshot = boolean;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_STATS_SAMPLE_INTERVAL, &error);
+	if (error == NULL && timeout >= 0)
+		connman_settings.stats_sample_interval = timeout;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_STORAGE_WRITE_DELAY, &error);
+	if (error == NULL && timeout >= 0)
+		connman_settings.storage_write_delay = timeout;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -500,6 +598,9 @@ connman_bool_t connman_setting_get_bool(const char *key)
 	if (g_str_equal(key, CONF_SINGLE_TECH) == TRUE)
 		return connman_settings.single_tech;
 
+	if (g_str_equal(key, CONF_DNS_CACHE_SNAPSHOT) == TRUE)
+		return connman_settings.dns_cache_snapshot;
+
 	return FALSE;
 }
 
@@ -528,6 +629,32 @@ unsigned int *connman_setting_get_uint_list(const char *key)
 	return NULL;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, CONF_DNS_CACHE_SIZE) == TRUE)
+		return connman_settings.dns_cache_size;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_ENTRIES) == TRUE)
+		return connman_settings.dns_cache_entries;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_PREFETCH) == TRUE)
+		return connman_settings.dns_cache_prefetch;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_STALE_TIME) == TRUE)
+		return connman_settings.dns_cache_stale_time;
+
+	if (g_str_equal(key, CONF_DNS_NEGATIVE_CACHE_SIZE) == TRUE)
+		return connman_settings.dns_negative_cache_size;
+
+	if (g_str_equal(key, CONF_STATS_SAMPLE_INTERVAL) == TRUE)
+		return connman_settings.stats_sample_interval;
+
+	if (g_str_equal(key, CONF_STORAGE_WRITE_DELAY) == TRUE)
+		return connman_settings.storage_write_delay;
+
+	return 0;
+}
+
 unsigned int connman_timeout_input_request(void) {
 	return connman_settings.timeout_inputreq;
 }
@@ -624,6 +751,7 @@ int main(int argc, char *argv[])
 	else
 		config_init(option_config);
 
+	__connman_storage_init(connman_settings.storage_write_delay);
 	__connman_inotify_init();
 	__connman_technology_init();
 	__connman_notifier_init();
@@ -634,7 +762,7 @@ int main(int argc, char *argv[])
 	__connman_device_init(option_device, option_nodevice);
 
 	__connman_ippool_init();
-	__connman_iptables_init();
+	__connman_firewall_init();
 	__connman_nat_init();
 	__connman_tethering_init();
 	__connman_counter_init();
@@ -644,6 +772,7 @@ int main(int argc, char *argv[])
 	__connman_clock_init();
 
 	__connman_resolver_init(option_dnsproxy);
+	__connman_inet_init();
 	__connman_ipconfig_init();
 	__connman_rtnl_init();
 	__connman_task_init();
@@ -695,16 +824,18 @@ int main(int argc, char *argv[])
 	__connman_counter_cleanup();
 	__connman_tethering_cleanup();
 	__connman_nat_cleanup();
-	__connman_iptables_cleanup();
+	__connman_firewall_cleanup();
 	__connman_ippool_cleanup();
 	__connman_device_cleanup();
 	__connman_network_cleanup();
 	__connman_service_cleanup();
 	__connman_agent_cleanup();
 	__connman_ipconfig_cleanup();
+	__connman_inet_cleanup();
 	__connman_notifier_cleanup();
 	__connman_technology_cleanup();
 	__connman_inotify_cleanup();
+	__connman_storage_cleanup();
 
 	__connman_dbus_cleanup();
 
@@ -36,7 +36,7 @@ struct connman_nat {
 	char *address;
 	unsigned char prefixlen;
 
-	char *interface;
+	struct connman_firewall_nat *fw;
 };
 
 static int enable_ip_forward(connman_bool_t enable)
@@ -61,77 +61,64 @@ static void flush_nat(void)
 {
 	int err;
 
-	err = __connman_iptables_command("-t nat -F POSTROUTING");
+	err = __connman_firewall_flush_nat();
 	if (err < 0) {
 		DBG("Flushing the nat table failed");
+		__connman_firewall_abort();
 
 		return;
 	}
 
-	__connman_iptables_commit("nat");
+	__connman_firewall_commit();
 }
 
-static int enable_nat(struct connman_nat *nat)
+static int add_nat_rule(struct connman_nat *nat)
 {
-	int err;
+	if (default_interface == NULL)
+		return 0;
 
-	g_free(nat->interface);
-	nat->interface = g_strdup(default_interface);
+	if (nat->fw == NULL) {
+		nat->fw = __connman_firewall_nat_new(nat->address,
+							nat->prefixlen);
+		if (nat->fw == NULL)
+			return -ENOMEM;
+	}
+
+	return __connman_firewall_nat_enable(nat->fw, default_interface);
+}
 
-	if (nat->interface == NULL)
+static int remove_nat_rule(struct connman_nat *nat)
+{
+	if (nat->fw == NULL)
 		return 0;
 
-	/* Enable masquerading */
-	if(nat->address) {
+	return __connman_firewall_nat_disable(nat->fw);
+}
 
-		err = __connman_iptables_command("-t nat -A POSTROUTING "
-					"-s %s/%d -o %s -j MASQUERADE",
-					nat->address,
-					nat->prefixlen,
-					nat->interface);
-		if (err < 0)
-			return err;
-	}
-	else {
+static int enable_nat(struct connman_nat *nat)
+{
+	int err;
 
-		err = __connman_iptables_command("-t nat -A POSTROUTING "
-					"-o %s -j MASQUERADE",
-					nat->interface);
-		if (err < 0)
-			return err;
+	err = add_nat_rule(nat);
+	if (err < 0) {
+		__connman_firewall_abort();
+		return err;
 	}
 
-	return __connman_iptables_commit("nat");
+	return __connman_firewall_commit();
 }
 
 static void disable_nat(struct connman_nat *nat)
 {
 	int err;
 
-	if (nat->interface == NULL)
+	err = remove_nat_rule(nat);
+	if (err < 0) {
+		__connman_firewall_abort();
 		return;
-
-	/* Disable masquerading */
-	if(nat->address) {
-
-		err = __connman_iptables_command("-t nat -D POSTROUTING "
-						"-s %s/%d -o %s -j MASQUERADE",
-						nat->address,
-						nat->prefixlen,
-						nat->interface);
-		if (err < 0)
-			return;
 	}
-	else {
 
-		err = __connman_iptables_command("-t nat -D POSTROUTING "
-						"-o %s -j MASQUERADE",
-						nat->interface);
-		if (err < 0)
-			return;
-	}
-
-	__connman_iptables_commit("nat");
+	__connman_firewall_commit();
 }
 
 int __connman_nat_enable(const char *name, const char *address,
@@ -196,17 +183,22 @@ static void update_default_interface(struct connman_service *service)
 	g_free(default_interface);
 	default_interface = interface;
 
+	/* Move every masquerading rule over in a single table commit */
 	g_hash_table_iter_init(&iter, nat_hash);
 
 	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
 		const char *name = key;
 		struct connman_nat *nat = value;
 
-		disable_nat(nat);
-		err = enable_nat(nat);
+		remove_nat_rule(nat);
+		err = add_nat_rule(nat);
 		if (err < 0)
 			DBG("Failed to enable nat for %s", name);
 	}
+
+	err = __connman_firewall_commit();
+	if (err < 0)
+		DBG("Failed to update nat rules");
 }
 
 static void shutdown_nat(gpointer key, gpointer value, gpointer user_data)
@@ -220,8 +212,8 @@ static void cleanup_nat(gpointer data)
 {
 	struct connman_nat *nat = data;
 
+	__connman_firewall_nat_free(nat->fw);
 	g_free(nat->address);
-	g_free(nat->interface);
 	g_free(nat);
 }
 
@@ -49,6 +49,9 @@
 #define print(arg...) do { if (0) connman_info(arg); } while (0)
 //#define print(arg...) connman_info(arg)
 
+#define RTNL_BUFFER_SIZE	16384
+#define RTNL_RECV_BATCH		32
+
 struct watch_data {
 	unsigned int id;
 	int index;
@@ -63,20 +66,32 @@ static GSList *update_list = NULL;
 static guint update_interval = G_MAXUINT;
 static guint update_timeout = 0;
 
+static guint sample_timeout = 0;
+static guint32 sample_seq = 0;
+static connman_bool_t sample_pending = FALSE;
+
 struct interface_data {
 	int index;
 	char *name;
 	char *ident;
 	enum connman_service_type service_type;
 	enum connman_device_type device_type;
+	GSList *addresses;
+	GSList *routes;
 };
 
 static GHashTable *interface_list = NULL;
 
+static void flush_addresses(struct interface_data *interface);
+static void flush_routes(struct interface_data *interface);
+
 static void free_interface(gpointer data)
 {
 	struct interface_data *interface = data;
 
+	flush_routes(interface);
+	flush_addresses(interface);
+
 	__connman_technology_remove_interface(interface->service_type,
 			interface->index, interface->name, interface->ident);
 
@@ -418,11 +433,27 @@ static const char *operstate2str(unsigned char operstate)
 	return "";
 }
 
+static void convert_stats(struct rtnl_link_stats64 *stats64,
+				const struct rtnl_link_stats *stats)
+{
+	stats64->rx_packets = stats->rx_packets;
+	stats64->tx_packets = stats->tx_packets;
+	stats64->rx_bytes = stats->rx_bytes;
+	stats64->tx_bytes = stats->tx_bytes;
+	stats64->rx_errors = stats->rx_errors;
+	stats64->tx_errors = stats->tx_errors;
+	stats64->rx_dropped = stats->rx_dropped;
+	stats64->tx_dropped = stats->tx_dropped;
+	stats64->multicast = stats->multicast;
+	stats64->collisions = stats->collisions;
+}
+
 static connman_bool_t extract_link(struct ifinfomsg *msg, int bytes,
 				struct ether_addr *address, const char **ifname,
 				unsigned int *mtu, unsigned char *operstate,
-				struct rtnl_link_stats *stats)
+				struct rtnl_link_stats64 *stats)
 {
+	connman_bool_t have_stats64 = FALSE;
 	struct rtattr *attr;
 
 	for (attr = IFLA_RTA(msg); RTA_OK(attr, bytes);
@@ -441,9 +472,23 @@ static connman_bool_t extract_link(struct ifinfomsg *msg, int bytes,
 				*mtu = *((unsigned int *) RTA_DATA(attr));
 			break;
 		case IFLA_STATS:
-			if (stats != NULL)
+			/*
+			 * The 32 bit counters wrap after 4 GiB, so they
+			 * are only used if the kernel does not send the
+			 * 64 bit version as well.
+			 */
+			if (stats != NULL && have_stats64 == FALSE &&
+					RTA_PAYLOAD(attr) >=
+					sizeof(struct rtnl_link_stats))
+				convert_stats(stats, RTA_DATA(attr));
+			break;
+		case IFLA_STATS64:
+			if (stats != NULL) {
+				memset(stats, 0, sizeof(*stats));
 				memcpy(stats, RTA_DATA(attr),
-					sizeof(struct rtnl_link_stats));
+					MIN(RTA_PAYLOAD(attr), sizeof(*stats)));
+				have_stats64 = TRUE;
+			}
 			break;
 		case IFLA_OPERSTATE:
 			if (operstate != NULL)
@@ -464,7 +509,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 {
 	struct ether_addr address = {{ 0, 0, 0, 0, 0, 0 }};
 	struct ether_addr compare = {{ 0, 0, 0, 0, 0, 0 }};
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	struct interface_data *interface;
 	const char *ifname = NULL;
@@ -513,6 +558,8 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 						ifname, index, operstate,
 						operstate2str(operstate));
 
+	__connman_inet_update_ifname(index, ifname);
+
 	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
 	if (interface == NULL) {
 		interface = g_new0(struct interface_data, 1);
@@ -533,6 +580,10 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 			interface->index, interface->name, interface->ident);
 	}
 
+	/* The kernel drops the routes of a link going down silently */
+	if (!(flags & IFF_UP))
+		flush_routes(interface);
+
 	for (list = rtnl_list; list; list = list->next) {
 		struct connman_rtnl *rtnl = list->data;
 
@@ -554,7 +605,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 static void process_dellink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	const char *ifname = NULL;
 	GSList *list;
@@ -585,6 +636,8 @@ static void process_dellink(unsigned short type, int index, unsigned flags,
 	}
 
 	g_hash_table_remove(interface_list, GINT_TO_POINTER(index));
+
+	__connman_inet_update_ifname(index, NULL);
 }
 
 static void extract_ipv4_addr(struct ifaddrmsg *msg, int bytes,
@@ -762,6 +815,529 @@ static void extract_ipv6_route(struct rtmsg *msg, int bytes, int *index,
 	}
 }
 
+/*
+ * Mirror of the kernel addresses and main table routes, kept up to
+ * date from the netlink events so that lookups do not need a socket
+ * round trip. Addresses are indexed by interface index and string form
+ * and hang off the interface they are configured on. Routes are stored
+ * in a binary prefix tree per family for longest prefix matching, and
+ * are also linked to their interface so they can be flushed along with
+ * it.
+ */
+struct rtnl_address {
+	int index;
+	unsigned char family;
+	unsigned char prefixlen;
+	unsigned char address[16];
+	char *string;
+	char *key;
+	unsigned int generation;
+};
+
+struct route_node {
+	struct route_node *parent;
+	struct route_node *child[2];
+	GSList *routes;
+};
+
+struct rtnl_route {
+	int index;
+	unsigned char family;
+	unsigned char prefixlen;
+	unsigned char scope;
+	guint32 metric;
+	connman_bool_t has_gateway;
+	unsigned char gateway[16];
+	struct route_node *node;
+	unsigned int generation;
+};
+
+static GHashTable *address_hash = NULL;
+static struct route_node *route_tree[2] = { NULL, NULL };
+static unsigned int mirror_generation = 0;
+
+static int family_bits(unsigned char family)
+{
+	switch (family) {
+	case AF_INET:
+		return 32;
+	case AF_INET6:
+		return 128;
+	}
+
+	return -1;
+}
+
+static struct route_node **route_root(unsigned char family)
+{
+	return family == AF_INET ? &route_tree[0] : &route_tree[1];
+}
+
+static inline int prefix_bit(const unsigned char *addr, int bit)
+{
+	return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+static struct route_node *route_node_get(unsigned char family,
+				const unsigned char *dst,
+				unsigned char prefixlen, connman_bool_t create)
+{
+	struct route_node **link = route_root(family);
+	struct route_node *parent = NULL;
+	int i;
+
+	for (i = 0; ; i++) {
+		if (*link == NULL) {
+			if (create == FALSE)
+				return NULL;
+
+			*link = g_try_new0(struct route_node, 1);
+			if (*link == NULL)
+				return NULL;
+
+			(*link)->parent = parent;
+		}
+
+		if (i == prefixlen)
+			return *link;
+
+		parent = *link;
+		link = &parent->child[prefix_bit(dst, i)];
+	}
+}
+
+static void route_node_prune(unsigned char family, struct route_node *node)
+{
+	while (node != NULL && node->routes == NULL &&
+			node->child[0] == NULL && node->child[1] == NULL) {
+		struct route_node *parent = node->parent;
+
+		if (parent == NULL)
+			*route_root(family) = NULL;
+		else if (parent->child[0] == node)
+			parent->child[0] = NULL;
+		else
+			parent->child[1] = NULL;
+
+		g_free(node);
+		node = parent;
+	}
+}
+
+static void route_free(struct rtnl_route *route)
+{
+	struct route_node *node = route->node;
+
+	node->routes = g_slist_remove(node->routes, route);
+	route_node_prune(route->family, node);
+
+	g_free(route);
+}
+
+static void free_address(gpointer data)
+{
+	struct rtnl_address *entry = data;
+
+	g_free(entry->key);
+	g_free(entry->string);
+	g_free(entry);
+}
+
+static void flush_routes(struct interface_data *interface)
+{
+	GSList *list;
+
+	for (list = interface->routes; list; list = list->next)
+		route_free(list->data);
+
+	g_slist_free(interface->routes);
+	interface->routes = NULL;
+}
+
+static void flush_addresses(struct interface_data *interface)
+{
+	GSList *list;
+
+	for (list = interface->addresses; list; list = list->next) {
+		struct rtnl_address *entry = list->data;
+
+		g_hash_table_remove(address_hash, entry->key);
+	}
+
+	g_slist_free(interface->addresses);
+	interface->addresses = NULL;
+}
+
+static void remove_address(struct rtnl_address *entry)
+{
+	struct interface_data *interface;
+
+	interface = g_hash_table_lookup(interface_list,
+					GINT_TO_POINTER(entry->index));
+	if (interface != NULL)
+		interface->addresses = g_slist_remove(interface->addresses,
+								entry);
+
+	g_hash_table_remove(address_hash, entry->key);
+}
+
+static void remove_route(struct rtnl_route *route)
+{
+	struct interface_data *interface;
+
+	interface = g_hash_table_lookup(interface_list,
+					GINT_TO_POINTER(route->index));
+	if (interface != NULL)
+		interface->routes = g_slist_remove(interface->routes, route);
+
+	route_free(route);
+}
+
+static void mirror_address_update(int index, unsigned char family,
+				const unsigned char *address,
+				unsigned char prefixlen, connman_bool_t add)
+{
+	struct interface_data *interface;
+	struct rtnl_address *entry;
+	char str[INET6_ADDRSTRLEN];
+	char *key;
+
+	if (inet_ntop(family, address, str, sizeof(str)) == NULL)
+		return;
+
+	key = g_strdup_printf("%d/%s", index, str);
+	entry = g_hash_table_lookup(address_hash, key);
+
+	if (add == FALSE) {
+		if (entry != NULL)
+			remove_address(entry);
+		g_free(key);
+		return;
+	}
+
+	interface = g_hash_table_lookup(interface_list,
+						GINT_TO_POINTER(index));
+	if (interface == NULL) {
+		g_free(key);
+		return;
+	}
+
+	if (entry == NULL) {
+		entry = g_try_new0(struct rtnl_address, 1);
+		if (entry == NULL) {
+			g_free(key);
+			return;
+		}
+
+		entry->index = index;
+		entry->family = family;
+		entry->string = g_strdup(str);
+		entry->key = key;
+		memcpy(entry->address, address, sizeof(entry->address));
+
+		g_hash_table_replace(address_hash, entry->key, entry);
+		interface->addresses = g_slist_prepend(interface->addresses,
+									entry);
+	} else
+		g_free(key);
+
+	entry->prefixlen = prefixlen;
+	entry->generation = mirror_generation;
+}
+
+static void mirror_address(struct ifaddrmsg *msg, int bytes,
+							connman_bool_t add)
+{
+	unsigned char address[16];
+
+	memset(address, 0, sizeof(address));
+
+	if (msg->ifa_family == AF_INET)
+		extract_ipv4_addr(msg, bytes, NULL,
+					(struct in_addr *) address, NULL, NULL);
+	else if (msg->ifa_family == AF_INET6)
+		extract_ipv6_addr(msg, bytes,
+					(struct in6_addr *) address, NULL);
+	else
+		return;
+
+	mirror_address_update(msg->ifa_index, msg->ifa_family, address,
+						msg->ifa_prefixlen, add);
+}
+
+/*
+ * ConnMan reports the addresses it configured itself right away, so
+ * that lookups made before the RTM_NEWADDR event is read already see
+ * them. The event then only refreshes the entry.
+ */
+void __connman_rtnl_address_added(int index, int family,
+				const char *address, unsigned char prefixlen)
+{
+	unsigned char addr[16];
+
+	DBG("index %d address %s prefixlen %d", index, address, prefixlen);
+
+	memset(addr, 0, sizeof(addr));
+
+	if (address == NULL || inet_pton(family, address, addr) != 1)
+		return;
+
+	mirror_address_update(index, family, addr, prefixlen, TRUE);
+}
+
+static void mirror_route(struct rtmsg *msg, int bytes, connman_bool_t add)
+{
+	struct interface_data *interface;
+	struct route_node *node;
+	struct rtnl_route *route = NULL;
+	unsigned char dst[16], gateway[16];
+	connman_bool_t has_gateway = FALSE;
+	struct rtattr *attr;
+	guint32 metric = 0;
+	int index = -1;
+	GSList *list;
+
+	if (msg->rtm_table != RT_TABLE_MAIN || msg->rtm_type != RTN_UNICAST)
+		return;
+
+	if (family_bits(msg->rtm_family) < msg->rtm_dst_len)
+		return;
+
+	memset(dst, 0, sizeof(dst));
+	memset(gateway, 0, sizeof(gateway));
+
+	for (attr = RTM_RTA(msg); RTA_OK(attr, bytes);
+					attr = RTA_NEXT(attr, bytes)) {
+		switch (attr->rta_type) {
+		case RTA_DST:
+			memcpy(dst, RTA_DATA(attr),
+				MIN(RTA_PAYLOAD(attr), sizeof(dst)));
+			break;
+		case RTA_GATEWAY:
+			memcpy(gateway, RTA_DATA(attr),
+				MIN(RTA_PAYLOAD(attr), sizeof(gateway)));
+			has_gateway = TRUE;
+			break;
+		case RTA_OIF:
+			index = *((int *) RTA_DATA(attr));
+			break;
+		case RTA_PRIORITY:
+			metric = *((guint32 *) RTA_DATA(attr));
+			break;
+		}
+	}
+
+	/* Multipath routes carry no output interface, skip them */
+	interface = g_hash_table_lookup(interface_list,
+						GINT_TO_POINTER(index));
+	if (interface == NULL)
+		return;
+
+	node = route_node_get(msg->rtm_family, dst, msg->rtm_dst_len, add);
+	if (node == NULL)
+		return;
+
+	for (list = node->routes; list; list = list->next) {
+		struct rtnl_route *entry = list->data;
+
+		if (entry->index == index && entry->metric == metric) {
+			route = entry;
+			break;
+		}
+	}
+
+	if (add == FALSE) {
+		if (route != NULL)
+			remove_route(route);
+		return;
+	}
+
+	if (route == NULL) {
+		route = g_try_new0(struct rtnl_route, 1);
+		if (route == NULL) {
+			route_node_prune(msg->rtm_family, node);
+			return;
+		}
+
+		route->index = index;
+		route->family = msg->rtm_family;
+		route->prefixlen = msg->rtm_dst_len;
+		route->metric = metric;
+		route->node = node;
+
+		node->routes = g_slist_prepend(node->routes, route);
+		interface->routes = g_slist_prepend(interface->routes, route);
+	}
+
+	route->scope = msg->rtm_scope;
+	route->has_gateway = has_gateway;
+	memcpy(route->gateway, gateway, sizeof(gateway));
+	route->generation = mirror_generation;
+}
+
+/*
+ * After a resync dump has completed, drop whatever it did not report.
+ * The dumps only cover IPv4, IPv6 entries are left alone.
+ */
+static void mirror_sweep(connman_bool_t routes)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, interface_list);
+
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct interface_data *interface = value;
+		GSList *list, *next;
+
+		list = routes == TRUE ? interface->routes :
+						interface->addresses;
+
+		for (; list; list = next) {
+			next = list->next;
+
+			if (routes == TRUE) {
+				struct rtnl_route *route = list->data;
+
+				if (route->family != AF_INET ||
+					route->generation == mirror_generation)
+					continue;
+
+				DBG("index %d stale route", route->index);
+				remove_route(route);
+			} else {
+				struct rtnl_address *entry = list->data;
+
+				if (entry->family != AF_INET ||
+					entry->generation == mirror_generation)
+					continue;
+
+				DBG("index %d stale address %s", entry->index,
+								entry->string);
+				remove_address(entry);
+			}
+		}
+	}
+}
+
+static struct rtnl_route *route_lookup(unsigned char family,
+						const unsigned char *addr)
+{
+	struct route_node *node, *best = NULL;
+	struct rtnl_route *route = NULL;
+	int bits = family_bits(family);
+	GSList *list;
+	int i;
+
+	node = *route_root(family);
+
+	for (i = 0; node != NULL; i++) {
+		if (node->routes != NULL)
+			best = node;
+
+		if (i == bits)
+			break;
+
+		node = node->child[prefix_bit(addr, i)];
+	}
+
+	if (best == NULL)
+		return NULL;
+
+	for (list = best->routes; list; list = list->next) {
+		struct rtnl_route *entry = list->data;
+
+		if (route == NULL || entry->metric < route->metric)
+			route = entry;
+	}
+
+	return route;
+}
+
+connman_bool_t __connman_rtnl_compare_subnet(int index, const char *host)
+{
+	struct interface_data *interface;
+	struct in_addr host_addr;
+	GSList *list;
+
+	DBG("index %d host %s", index, host);
+
+	if (host == NULL || inet_pton(AF_INET, host, &host_addr) != 1)
+		return FALSE;
+
+	interface = g_hash_table_lookup(interface_list,
+						GINT_TO_POINTER(index));
+	if (interface == NULL)
+		return FALSE;
+
+	for (list = interface->addresses; list; list = list->next) {
+		struct rtnl_address *entry = list->data;
+		in_addr_t if_addr, netmask;
+
+		if (entry->family != AF_INET || entry->prefixlen > 32)
+			continue;
+
+		memcpy(&if_addr, entry->address, sizeof(if_addr));
+
+		if (entry->prefixlen == 0)
+			netmask = 0;
+		else
+			netmask = htonl(0xffffffff << (32 - entry->prefixlen));
+
+		if ((host_addr.s_addr & netmask) == (if_addr & netmask))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Look up the main table route to dst_address. On success the index
+ * of the output interface is returned and the gateway is set to the
+ * next hop, or to NULL for a directly reachable destination.
+ *
+ * Only IPv4 routes are dumped, so the IPv6 tree lacks the routes that
+ * existed before startup and may hold a less specific match than the
+ * kernel would use. IPv6 lookups return -ENOENT to let the caller ask
+ * the kernel instead.
+ */
+int __connman_rtnl_get_route(const char *dst_address, int *index,
+							char **gateway)
+{
+	struct rtnl_route *route;
+	unsigned char addr[16];
+	char str[INET6_ADDRSTRLEN];
+	unsigned char family;
+
+	if (dst_address == NULL)
+		return -EINVAL;
+
+	if (inet_pton(AF_INET, dst_address, addr) == 1)
+		family = AF_INET;
+	else if (inet_pton(AF_INET6, dst_address, addr) == 1)
+		return -ENOENT;
+	else
+		return -EINVAL;
+
+	route = route_lookup(family, addr);
+	if (route == NULL) {
+		DBG("dst %s no route", dst_address);
+		return -ENOENT;
+	}
+
+	*index = route->index;
+	*gateway = NULL;
+
+	if (route->has_gateway == TRUE &&
+			inet_ntop(family, route->gateway, str,
+						sizeof(str)) != NULL)
+		*gateway = g_strdup(str);
+
+	DBG("dst %s index %d gateway %s", dst_address, *index, *gateway);
+
+	return 0;
+}
+
 static void process_newroute(unsigned char family, unsigned char scope,
 						struct rtmsg *msg, int bytes)
 {
@@ -964,6 +1540,9 @@ static void rtnl_link(struct nlmsghdr *hdr)
 		case IFLA_STATS:
 			print_attr(attr, "stats");
 			break;
+		case IFLA_STATS64:
+			print_attr(attr, "stats64");
+			break;
 		case IFLA_COST:
 			print_attr(attr, "cost");
 			break;
@@ -1021,6 +1600,32 @@ static void rtnl_dellink(struct nlmsghdr *hdr)
 				msg->ifi_change, msg, IFA_PAYLOAD(hdr));
 }
 
+/*
+ * Replies to the statistics sampling dump only carry new counter
+ * values for links we already know about. They skip the newlink
+ * processing and logging, which is far too heavy to run several
+ * times per second.
+ */
+static void rtnl_stats(struct nlmsghdr *hdr)
+{
+	struct ifinfomsg *msg = (struct ifinfomsg *) NLMSG_DATA(hdr);
+	struct rtnl_link_stats64 stats;
+
+	memset(&stats, 0, sizeof(stats));
+	if (extract_link(msg, IFLA_PAYLOAD(hdr), NULL, NULL, NULL, NULL,
+						&stats) == FALSE)
+		return;
+
+	switch (msg->ifi_type) {
+	case ARPHRD_ETHER:
+	case ARPHDR_PHONET_PIPE:
+	case ARPHRD_PPP:
+	case ARPHRD_NONE:
+		__connman_ipconfig_stats(msg->ifi_index, &stats);
+		break;
+	}
+}
+
 static void rtnl_addr(struct nlmsghdr *hdr)
 {
 	struct ifaddrmsg *msg;
@@ -1069,6 +1674,8 @@ static void rtnl_newaddr(struct nlmsghdr *hdr)
 
 	rtnl_addr(hdr);
 
+	mirror_address(msg, IFA_PAYLOAD(hdr), TRUE);
+
 	process_newaddr(msg->ifa_family, msg->ifa_prefixlen, msg->ifa_index,
 						msg, IFA_PAYLOAD(hdr));
 }
@@ -1079,6 +1686,8 @@ static void rtnl_deladdr(struct nlmsghdr *hdr)
 
 	rtnl_addr(hdr);
 
+	mirror_address(msg, IFA_PAYLOAD(hdr), FALSE);
+
 	process_deladdr(msg->ifa_family, msg->ifa_prefixlen, msg->ifa_index,
 						msg, IFA_PAYLOAD(hdr));
 }
@@ -1156,6 +1765,8 @@ static void rtnl_newroute(struct nlmsghdr *hdr)
 
 	rtnl_route(hdr);
 
+	mirror_route(msg, RTM_PAYLOAD(hdr), TRUE);
+
 	if (is_route_rtmsg(msg))
 		process_newroute(msg->rtm_family, msg->rtm_scope,
 						msg, RTM_PAYLOAD(hdr));
@@ -1167,6 +1778,8 @@ static void rtnl_delroute(struct nlmsghdr *hdr)
 
 	rtnl_route(hdr);
 
+	mirror_route(msg, RTM_PAYLOAD(hdr), FALSE);
+
 	if (is_route_rtmsg(msg))
 		process_delroute(msg->rtm_family, msg->rtm_scope,
 						msg, RTM_PAYLOAD(hdr));
@@ -1345,6 +1958,24 @@ static const char *type2string(uint16_t type)
 
 static GIOChannel *channel = NULL;
 
+static unsigned char *rtnl_buffer = NULL;
+static size_t rtnl_buffer_size = 0;
+
+static connman_bool_t resync_pending = FALSE;
+static connman_bool_t resync_again = FALSE;
+static guint32 resync_seq = 0;
+static guint32 resync_addr_seq = 0;
+
+static struct {
+	unsigned long datagrams;
+	unsigned long long bytes;
+	unsigned long messages[RTM_NR_MSGTYPES];
+	unsigned long control;
+	unsigned long overruns;
+	unsigned long truncated;
+	unsigned long resyncs;
+} rtnl_counters;
+
 struct rtnl_request {
 	struct nlmsghdr hdr;
 	struct rtgenmsg msg;
@@ -1397,16 +2028,42 @@ static int queue_request(struct rtnl_request *req)
 	return send_request(req);
 }
 
-static int process_response(guint32 seq)
+static void rtnl_resync(void);
+
+/*
+ * Completes the request with the given seq and sends the next one. A
+ * dump which failed reported nothing, so the resync does not sweep
+ * the mirror after it.
+ */
+static int process_response(guint32 seq, connman_bool_t success)
 {
 	struct rtnl_request *req;
 
-	DBG("seq %d", seq);
+	DBG("seq %d success %d", seq, success);
 
 	req = find_request(seq);
-	if (req != NULL) {
-		request_list = g_slist_remove(request_list, req);
-		g_free(req);
+	if (req == NULL)
+		return 0;
+
+	if (sample_pending == TRUE && seq == sample_seq)
+		sample_pending = FALSE;
+
+	if (resync_pending == TRUE && seq == resync_addr_seq &&
+							success == TRUE)
+		mirror_sweep(FALSE);
+
+	if (resync_pending == TRUE && seq == resync_seq) {
+		if (success == TRUE)
+			mirror_sweep(TRUE);
+		resync_pending = FALSE;
+	}
+
+	request_list = g_slist_remove(request_list, req);
+	g_free(req);
+
+	if (resync_pending == FALSE && resync_again == TRUE) {
+		resync_again = FALSE;
+		rtnl_resync();
 	}
 
 	req = g_slist_nth_data(request_list, 0);
@@ -1433,20 +2090,33 @@ static void rtnl_message(void *buf, size_t len)
 					hdr->nlmsg_flags, hdr->nlmsg_seq,
 					hdr->nlmsg_pid);
 
+		if (hdr->nlmsg_type >= RTM_BASE && hdr->nlmsg_type <= RTM_MAX)
+			rtnl_counters.messages[hdr->nlmsg_type - RTM_BASE]++;
+		else
+			rtnl_counters.control++;
+
 		switch (hdr->nlmsg_type) {
 		case NLMSG_NOOP:
 		case NLMSG_OVERRUN:
 			return;
 		case NLMSG_DONE:
-			process_response(hdr->nlmsg_seq);
+			process_response(hdr->nlmsg_seq, TRUE);
 			return;
 		case NLMSG_ERROR:
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+
+			/* A failed dump ends without NLMSG_DONE */
+			if (err->error != 0)
+				process_response(hdr->nlmsg_seq, FALSE);
 			return;
 		case RTM_NEWLINK:
-			rtnl_newlink(hdr);
+			if (sample_pending == TRUE &&
+					hdr->nlmsg_seq == sample_seq)
+				rtnl_stats(hdr);
+			else
+				rtnl_newlink(hdr);
 			break;
 		case RTM_DELLINK:
 			rtnl_dellink(hdr);
@@ -1473,41 +2143,149 @@ static void rtnl_message(void *buf, size_t len)
 	}
 }
 
-static gboolean netlink_event(GIOChannel *chan,
-				GIOCondition cond, gpointer data)
+static int send_getlink(void);
+static int send_getaddr(void);
+static int send_getroute(void);
+
+/*
+ * The kernel dropped notifications because the socket buffer was full.
+ * Dump replies are flow controlled and not lost, so the dump in flight
+ * is left to finish and the links, addresses and routes are dumped once
+ * more behind it to catch up with the changes which were lost. Losses
+ * during a resync call for another one once it is done.
+ */
+static void rtnl_resync(void)
+{
+	if (resync_pending == TRUE) {
+		resync_again = TRUE;
+		return;
+	}
+
+	connman_warn("Netlink messages lost, requesting a full dump");
+
+	rtnl_counters.resyncs++;
+	resync_pending = TRUE;
+
+	/* Entries not refreshed by the dumps are swept once they are done */
+	mirror_generation++;
+
+	send_getlink();
+	resync_addr_seq = request_seq;
+	send_getaddr();
+	send_getroute();
+
+	resync_seq = request_seq - 1;
+}
+
+static int rtnl_buffer_grow(size_t len)
+{
+	unsigned char *buf;
+	size_t size;
+
+	size = rtnl_buffer_size > 0 ? rtnl_buffer_size : RTNL_BUFFER_SIZE;
+	while (size < len)
+		size *= 2;
+
+	if (size == rtnl_buffer_size)
+		return 0;
+
+	buf = g_try_realloc(rtnl_buffer, size);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	DBG("buffer size %zu", size);
+
+	rtnl_buffer = buf;
+	rtnl_buffer_size = size;
+
+	return 0;
+}
+
+static int rtnl_recv(int fd)
 {
-	unsigned char buf[4096];
 	struct sockaddr_nl nladdr;
-	socklen_t addr_len = sizeof(nladdr);
-	ssize_t status;
-	int fd;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t len;
 
-	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
-		return FALSE;
+	/* The length of the next datagram, without reading it */
+	len = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+	if (len < 0)
+		return -errno;
+
+	if ((size_t) len > rtnl_buffer_size && rtnl_buffer_grow(len) < 0)
+		connman_error("Failed to grow netlink buffer to %zd", len);
 
-	memset(buf, 0, sizeof(buf));
 	memset(&nladdr, 0, sizeof(nladdr));
+	memset(&msg, 0, sizeof(msg));
 
-	fd = g_io_channel_unix_get_fd(chan);
+	iov.iov_base = rtnl_buffer;
+	iov.iov_len = rtnl_buffer_size;
 
-	status = recvfrom(fd, buf, sizeof(buf), 0,
-                       (struct sockaddr *) &nladdr, &addr_len);
-	if (status < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			return TRUE;
+	msg.msg_name = &nladdr;
+	msg.msg_namelen = sizeof(nladdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
 
-		return FALSE;
-	}
+	len = recvmsg(fd, &msg, MSG_DONTWAIT);
+	if (len < 0)
+		return -errno;
 
-	if (status == 0)
-		return FALSE;
+	if (len == 0)
+		return -EPIPE;
+
+	rtnl_counters.datagrams++;
+	rtnl_counters.bytes += len;
+
+	if (msg.msg_flags & MSG_TRUNC) {
+		connman_warn("Truncated netlink message of %zd bytes", len);
+		rtnl_counters.truncated++;
+		return -EMSGSIZE;
+	}
 
 	if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
 		DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
-		return TRUE;
+		return 0;
 	}
 
-	rtnl_message(buf, status);
+	rtnl_message(rtnl_buffer, len);
+
+	return 0;
+}
+
+static gboolean netlink_event(GIOChannel *chan,
+				GIOCondition cond, gpointer data)
+{
+	int fd, i, err;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
+		return FALSE;
+
+	fd = g_io_channel_unix_get_fd(chan);
+
+	/* A dump arrives as many datagrams, handle a batch per wakeup */
+	for (i = 0; i < RTNL_RECV_BATCH; i++) {
+		err = rtnl_recv(fd);
+		if (err == -EAGAIN || err == -EWOULDBLOCK)
+			break;
+
+		if (err == -EINTR)
+			continue;
+
+		if (err == -ENOBUFS || err == -EMSGSIZE) {
+			if (err == -ENOBUFS)
+				rtnl_counters.overruns++;
+
+			rtnl_resync();
+			continue;
+		}
+
+		if (err < 0) {
+			connman_error("Netlink receive error %s",
+							strerror(-err));
+			return FALSE;
+		}
+	}
 
 	return TRUE;
 }
@@ -1572,6 +2350,41 @@ static int send_getroute(void)
 	return queue_request(req);
 }
 
+static int send_getstats(void)
+{
+	struct rtnl_request *req;
+
+	/*
+	 * A slow dump must not pile up further requests behind it, the
+	 * next sample will pick up the counters anyway.
+	 */
+	if (sample_pending == TRUE)
+		return -EINPROGRESS;
+
+	req = g_try_malloc0(RTNL_REQUEST_SIZE);
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->hdr.nlmsg_len = RTNL_REQUEST_SIZE;
+	req->hdr.nlmsg_type = RTM_GETLINK;
+	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req->hdr.nlmsg_pid = 0;
+	req->hdr.nlmsg_seq = request_seq++;
+	req->msg.rtgen_family = AF_INET;
+
+	sample_seq = req->hdr.nlmsg_seq;
+	sample_pending = TRUE;
+
+	return queue_request(req);
+}
+
+static gboolean sample_timeout_cb(gpointer user_data)
+{
+	send_getstats();
+
+	return TRUE;
+}
+
 static gboolean update_timeout_cb(gpointer user_data)
 {
 	__connman_rtnl_request_update();
@@ -1654,6 +2467,9 @@ int __connman_rtnl_init(void)
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
 
+	address_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, free_address);
+
 	sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
 	if (sk < 0)
 		return -1;
@@ -1669,6 +2485,11 @@ int __connman_rtnl_init(void)
 		return -1;
 	}
 
+	if (rtnl_buffer_grow(RTNL_BUFFER_SIZE) < 0) {
+		close(sk);
+		return -ENOMEM;
+	}
+
 	channel = g_io_channel_unix_new(sk);
 	g_io_channel_set_close_on_unref(channel, TRUE);
 
@@ -1683,16 +2504,24 @@ int __connman_rtnl_init(void)
 
 void __connman_rtnl_start(void)
 {
+	unsigned int interval;
+
 	DBG("");
 
 	send_getlink();
 	send_getaddr();
 	send_getroute();
+
+	interval = connman_setting_get_uint("StatisticsSampleInterval");
+	if (interval > 0)
+		sample_timeout = g_timeout_add(interval,
+						sample_timeout_cb, NULL);
 }
 
 void __connman_rtnl_cleanup(void)
 {
 	GSList *list;
+	int i;
 
 	DBG("");
 
@@ -1711,6 +2540,30 @@ void __connman_rtnl_cleanup(void)
 	g_slist_free(update_list);
 	update_list = NULL;
 
+	if (sample_timeout > 0) {
+		g_source_remove(sample_timeout);
+		sample_timeout = 0;
+	}
+
+	sample_pending = FALSE;
+	resync_pending = FALSE;
+	resync_again = FALSE;
+
+	DBG("datagrams %lu bytes %llu overruns %lu truncated %lu resyncs %lu",
+			rtnl_counters.datagrams, rtnl_counters.bytes,
+			rtnl_counters.overruns, rtnl_counters.truncated,
+			rtnl_counters.resyncs);
+
+	for (i = 0; i < RTM_NR_MSGTYPES; i++) {
+		if (rtnl_counters.messages[i] == 0)
+			continue;
+
+		DBG("%s %lu", type2string(i + RTM_BASE),
+					rtnl_counters.messages[i]);
+	}
+
+	DBG("control %lu", rtnl_counters.control);
+
 	for (list = request_list; list; list = list->next) {
 		struct rtnl_request *req = list->data;
 
@@ -1731,5 +2584,10 @@ void __connman_rtnl_cleanup(void)
 
 	channel = NULL;
 
+	g_free(rtnl_buffer);
+	rtnl_buffer = NULL;
+	rtnl_buffer_size = 0;
+
 	g_hash_table_destroy(interface_list);
+	g_hash_table_destroy(address_hash);
 }
@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <netdb.h>
 #include <gdbus.h>
@@ -47,10 +48,22 @@ static unsigned int autoconnect_timeout = 0;
 static struct connman_service *current_default = NULL;
 static connman_bool_t services_dirty = FALSE;
 
+struct stats_counters {
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
+};
+
 struct connman_stats {
 	connman_bool_t valid;
 	connman_bool_t enabled;
-	struct connman_stats_data data_last;
+	struct stats_counters counters_last;
+	unsigned int time_last;
 	struct connman_stats_data data;
 	GTimer *timer;
 };
@@ -1127,47 +1140,95 @@ void __connman_service_nameserver_clear(struct connman_service *service)
 	update_nameservers(service);
 }
 
-static void add_nameserver_route(int family, int index, char *nameserver,
+struct nameserver_route {
+	int index;
+	int family;
+	char *nameserver;
+};
+
+static void nameserver_route_cb(int err, void *user_data)
+{
+	struct nameserver_route *route = user_data;
+
+	/* For P-t-P link the route via the gateway will fail */
+	if (err < 0) {
+		if (route->family == AF_INET)
+			connman_inet_add_host_route(route->index,
+						route->nameserver, NULL);
+		else
+			connman_inet_add_ipv6_host_route(route->index,
+						route->nameserver, NULL);
+	}
+
+	g_free(route->nameserver);
+	g_free(route);
+}
+
+static void add_nameserver_route(struct __connman_inet_batch *batch,
+				int family, int index, char *nameserver,
 				const char *gw)
 {
-	switch (family) {
-	case AF_INET:
-		if (connman_inet_compare_subnet(index, nameserver) == TRUE)
-			break;
+	struct nameserver_route *route = NULL;
 
-		if (connman_inet_add_host_route(index, nameserver, gw) < 0)
-			/* For P-t-P link the above route add will fail */
-			connman_inet_add_host_route(index, nameserver, NULL);
-		break;
+	if (family == AF_INET &&
+		__connman_rtnl_compare_subnet(index, nameserver) == TRUE)
+		return;
 
-	case AF_INET6:
-		if (connman_inet_add_ipv6_host_route(index, nameserver,
-								gw) < 0)
-			connman_inet_add_ipv6_host_route(index, nameserver,
-							NULL);
-		break;
+	if (gw != NULL && connman_inet_check_ipaddress(gw) != family)
+		gw = NULL;
+
+	if (gw != NULL) {
+		route = g_try_new0(struct nameserver_route, 1);
+		if (route == NULL)
+			return;
+
+		route->index = index;
+		route->family = family;
+		route->nameserver = g_strdup(nameserver);
+	}
+
+	if (__connman_inet_batch_add_route(batch, RTM_NEWROUTE, index,
+				family, nameserver, gw,
+				family == AF_INET ? 32 : 128,
+				route != NULL ? nameserver_route_cb : NULL,
+				route) < 0 && route != NULL) {
+		g_free(route->nameserver);
+		g_free(route);
 	}
 }
 
 static void nameserver_add_routes(int index, char **nameservers,
 					const char *gw)
 {
+	struct __connman_inet_batch *batch;
 	int i, family;
 
+	batch = __connman_inet_batch_new();
+	if (batch == NULL)
+		return;
+
 	for (i = 0; nameservers[i] != NULL; i++) {
 		family = connman_inet_check_ipaddress(nameservers[i]);
 		if (family < 0)
 			continue;
 
-		add_nameserver_route(family, index, nameservers[i], gw);
+		add_nameserver_route(batch, family, index, nameservers[i],
+									gw);
 	}
+
+	__connman_inet_batch_commit(batch);
 }
 
 static void nameserver_del_routes(int index, char **nameservers,
 				enum connman_ipconfig_type type)
 {
+	struct __connman_inet_batch *batch;
 	int i, family;
 
+	batch = __connman_inet_batch_new();
+	if (batch == NULL)
+		return;
+
 	for (i = 0; nameservers[i] != NULL; i++) {
 		family = connman_inet_check_ipaddress(nameservers[i]);
 		if (family < 0)
@@ -1176,16 +1237,22 @@ static void nameserver_del_routes(int index, char **nameservers,
 		switch (family) {
 		case AF_INET:
 			if (type != CONNMAN_IPCONFIG_TYPE_IPV6)
-				connman_inet_del_host_route(index,
-							nameservers[i]);
+				__connman_inet_batch_add_route(batch,
+						RTM_DELROUTE, index, family,
+						nameservers[i], NULL, 32,
+						NULL, NULL);
 			break;
 		case AF_INET6:
 			if (type != CONNMAN_IPCONFIG_TYPE_IPV4)
-				connman_inet_del_ipv6_host_route(index,
-							nameservers[i]);
+				__connman_inet_batch_add_route(batch,
+						RTM_DELROUTE, index, family,
+						nameservers[i], NULL, 128,
+						NULL, NULL);
 			break;
 		}
 	}
+
+	__connman_inet_batch_commit(batch);
 }
 
 void __connman_service_nameserver_add_routes(struct connman_service *service,
@@ -1264,7 +1331,7 @@ static void stats_start(struct connman_service *service)
 		return;
 
 	stats->enabled = TRUE;
-	stats->data_last.time = stats->data.time;
+	stats->time_last = stats->data.time;
 
 	g_timer_start(stats->timer);
 }
@@ -1285,7 +1352,7 @@ static void stats_stop(struct connman_service *service)
 	g_timer_stop(stats->timer);
 
 	seconds = g_timer_elapsed(stats->timer, NULL);
-	stats->data.time = stats->data_last.time + seconds;
+	stats->data.time = stats->time_last + seconds;
 
 	stats->enabled = FALSE;
 }
@@ -1306,7 +1373,7 @@ static void reset_stats(struct connman_service *service)
 	service->stats.data.rx_dropped = 0;
 	service->stats.data.tx_dropped = 0;
 	service->stats.data.time = 0;
-	service->stats.data_last.time = 0;
+	service->stats.time_last = 0;
 
 	g_timer_reset(service->stats.timer);
 
@@ -1322,7 +1389,7 @@ static void reset_stats(struct connman_service *service)
 	service->stats_roaming.data.rx_dropped = 0;
 	service->stats_roaming.data.tx_dropped = 0;
 	service->stats_roaming.data.time = 0;
-	service->stats_roaming.data_last.time = 0;
+	service->stats_roaming.time_last = 0;
 
 	g_timer_reset(service->stats_roaming.timer);
 }
@@ -1904,49 +1971,49 @@ static void stats_append_counters(DBusMessageIter *dict,
 	if (counters->rx_packets != stats->rx_packets || append_all) {
 		counters->rx_packets = stats->rx_packets;
 		connman_dbus_dict_append_basic(dict, "RX.Packets",
-					DBUS_TYPE_UINT32, &stats->rx_packets);
+					DBUS_TYPE_UINT64, &stats->rx_packets);
 	}
 
 	if (counters->tx_packets != stats->tx_packets || append_all) {
 		counters->tx_packets = stats->tx_packets;
 		connman_dbus_dict_append_basic(dict, "TX.Packets",
-					DBUS_TYPE_UINT32, &stats->tx_packets);
+					DBUS_TYPE_UINT64, &stats->tx_packets);
 	}
 
 	if (counters->rx_bytes != stats->rx_bytes || append_all) {
 		counters->rx_bytes = stats->rx_bytes;
 		connman_dbus_dict_append_basic(dict, "RX.Bytes",
-					DBUS_TYPE_UINT32, &stats->rx_bytes);
+					DBUS_TYPE_UINT64, &stats->rx_bytes);
 	}
 
 	if (counters->tx_bytes != stats->tx_bytes || append_all) {
 		counters->tx_bytes = stats->tx_bytes;
 		connman_dbus_dict_append_basic(dict, "TX.Bytes",
-					DBUS_TYPE_UINT32, &stats->tx_bytes);
+					DBUS_TYPE_UINT64, &stats->tx_bytes);
 	}
 
 	if (counters->rx_errors != stats->rx_errors || append_all) {
 		counters->rx_errors = stats->rx_errors;
 		connman_dbus_dict_append_basic(dict, "RX.Errors",
-					DBUS_TYPE_UINT32, &stats->rx_errors);
+					DBUS_TYPE_UINT64, &stats->rx_errors);
 	}
 
 	if (counters->tx_errors != stats->tx_errors || append_all) {
 		counters->tx_errors = stats->tx_errors;
 		connman_dbus_dict_append_basic(dict, "TX.Errors",
-					DBUS_TYPE_UINT32, &stats->tx_errors);
+					DBUS_TYPE_UINT64, &stats->tx_errors);
 	}
 
 	if (counters->rx_dropped != stats->rx_dropped || append_all) {
 		counters->rx_dropped = stats->rx_dropped;
 		connman_dbus_dict_append_basic(dict, "RX.Dropped",
-					DBUS_TYPE_UINT32, &stats->rx_dropped);
+					DBUS_TYPE_UINT64, &stats->rx_dropped);
 	}
 
 	if (counters->tx_dropped != stats->tx_dropped || append_all) {
 		counters->tx_dropped = stats->tx_dropped;
 		connman_dbus_dict_append_basic(dict, "TX.Dropped",
-					DBUS_TYPE_UINT32, &stats->tx_dropped);
+					DBUS_TYPE_UINT64, &stats->tx_dropped);
 	}
 
 	if (counters->time != stats->time || append_all) {
@@ -1994,71 +2061,76 @@ static void stats_append(struct connman_service *service,
 	__connman_counter_send_usage(counter, msg);
 }
 
+/*
+ * The kernel counters are 64 bit wide unless the driver only keeps 32
+ * bit statistics. A smaller value than last time is only taken as a 32
+ * bit wrap around if both values are near the wrap point. Otherwise the
+ * interface has been recreated and counts from zero again.
+ */
+#define STATS_WRAP_WINDOW	(1ULL << 30)
+
+static uint64_t stats_delta(uint64_t cur, uint64_t last)
+{
+	if (cur >= last)
+		return cur - last;
+
+	if (last <= UINT32_MAX && UINT32_MAX - last < STATS_WRAP_WINDOW &&
+						cur < STATS_WRAP_WINDOW)
+		return (uint32_t) (cur - last);
+
+	return cur;
+}
+
 static void stats_update(struct connman_service *service,
-				unsigned int rx_packets, unsigned int tx_packets,
-				unsigned int rx_bytes, unsigned int tx_bytes,
-				unsigned int rx_errors, unsigned int tx_errors,
-				unsigned int rx_dropped, unsigned int tx_dropped)
+				uint64_t rx_packets, uint64_t tx_packets,
+				uint64_t rx_bytes, uint64_t tx_bytes,
+				uint64_t rx_errors, uint64_t tx_errors,
+				uint64_t rx_dropped, uint64_t tx_dropped)
 {
 	struct connman_stats *stats = stats_get(service);
-	struct connman_stats_data *data_last = &stats->data_last;
+	struct stats_counters *last = &stats->counters_last;
 	struct connman_stats_data *data = &stats->data;
 	unsigned int seconds;
 
-	DBG("service %p", service);
-
 	if (stats->valid == TRUE) {
-		data->rx_packets +=
-			rx_packets - data_last->rx_packets;
-		data->tx_packets +=
-			tx_packets - data_last->tx_packets;
-		data->rx_bytes +=
-			rx_bytes - data_last->rx_bytes;
-		data->tx_bytes +=
-			tx_bytes - data_last->tx_bytes;
-		data->rx_errors +=
-			rx_errors - data_last->rx_errors;
-		data->tx_errors +=
-			tx_errors - data_last->tx_errors;
-		data->rx_dropped +=
-			rx_dropped - data_last->rx_dropped;
-		data->tx_dropped +=
-			tx_dropped - data_last->tx_dropped;
+		data->rx_packets += stats_delta(rx_packets, last->rx_packets);
+		data->tx_packets += stats_delta(tx_packets, last->tx_packets);
+		data->rx_bytes += stats_delta(rx_bytes, last->rx_bytes);
+		data->tx_bytes += stats_delta(tx_bytes, last->tx_bytes);
+		data->rx_errors += stats_delta(rx_errors, last->rx_errors);
+		data->tx_errors += stats_delta(tx_errors, last->tx_errors);
+		data->rx_dropped += stats_delta(rx_dropped, last->rx_dropped);
+		data->tx_dropped += stats_delta(tx_dropped, last->tx_dropped);
 	} else {
 		stats->valid = TRUE;
 	}
 
-	data_last->rx_packets = rx_packets;
-	data_last->tx_packets = tx_packets;
-	data_last->rx_bytes = rx_bytes;
-	data_last->tx_bytes = tx_bytes;
-	data_last->rx_errors = rx_errors;
-	data_last->tx_errors = tx_errors;
-	data_last->rx_dropped = rx_dropped;
-	data_last->tx_dropped = tx_dropped;
+	last->rx_packets = rx_packets;
+	last->tx_packets = tx_packets;
+	last->rx_bytes = rx_bytes;
+	last->tx_bytes = tx_bytes;
+	last->rx_errors = rx_errors;
+	last->tx_errors = tx_errors;
+	last->rx_dropped = rx_dropped;
+	last->tx_dropped = tx_dropped;
 
 	seconds = g_timer_elapsed(stats->timer, NULL);
-	stats->data.time = stats->data_last.time + seconds;
+	stats->data.time = stats->time_last + seconds;
 }
 
-void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_errors, unsigned int tx_errors,
-			unsigned int rx_dropped, unsigned int tx_dropped)
+static connman_bool_t stats_sample(struct connman_service *service,
+				uint64_t rx_packets, uint64_t tx_packets,
+				uint64_t rx_bytes, uint64_t tx_bytes,
+				uint64_t rx_errors, uint64_t tx_errors,
+				uint64_t rx_dropped, uint64_t tx_dropped)
 {
-	GHashTableIter iter;
-	gpointer key, value;
-	const char *counter;
-	struct connman_stats_counter *counters;
-	struct connman_stats_data *data;
 	int err;
 
 	if (service == NULL)
-		return;
+		return FALSE;
 
 	if (is_connected(service) == FALSE)
-		return;
+		return FALSE;
 
 	stats_update(service,
 		rx_packets, tx_packets,
@@ -2066,12 +2138,48 @@ void __connman_service_notify(struct connman_service *service,
 		rx_errors, tx_errors,
 		rx_dropped, tx_dropped);
 
-	data = &stats_get(service)->data;
-	err = __connman_stats_update(service, service->roaming, data);
+	err = __connman_stats_update(service, service->roaming,
+						&stats_get(service)->data);
 	if (err < 0)
 		connman_error("Failed to store statistics for %s",
 				service->identifier);
 
+	return TRUE;
+}
+
+void __connman_service_sample(struct connman_service *service,
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_errors, uint64_t tx_errors,
+			uint64_t rx_dropped, uint64_t tx_dropped)
+{
+	stats_sample(service,
+		rx_packets, tx_packets,
+		rx_bytes, tx_bytes,
+		rx_errors, tx_errors,
+		rx_dropped, tx_dropped);
+}
+
+void __connman_service_notify(struct connman_service *service,
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_errors, uint64_t tx_errors,
+			uint64_t rx_dropped, uint64_t tx_dropped)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	const char *counter;
+	struct connman_stats_counter *counters;
+
+	DBG("service %p", service);
+
+	if (stats_sample(service,
+			rx_packets, tx_packets,
+			rx_bytes, tx_bytes,
+			rx_errors, tx_errors,
+			rx_dropped, tx_dropped) == FALSE)
+		return;
+
 	g_hash_table_iter_init(&iter, service->counter_table);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
 		counter = key;
@@ -4038,6 +4146,83 @@ static DBusMessage *reset_counters(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static DBusMessage *get_counter_history(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct connman_service *service = user_data;
+	struct connman_stats_bucket *buckets;
+	struct connman_stats_data counters;
+	DBusMessageIter iter, array, entry, dict;
+	dbus_uint32_t start, end, interval, ts;
+	DBusMessage *reply;
+	unsigned int i, count;
+	int err;
+
+	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT32, &start,
+					DBUS_TYPE_UINT32, &end,
+					DBUS_TYPE_UINT32, &interval,
+					DBUS_TYPE_INVALID) == FALSE)
+		return __connman_error_invalid_arguments(msg);
+
+	DBG("service %p start %u end %u interval %u", service, start, end,
+								interval);
+
+	err = __connman_stats_query(service, start, end, interval,
+							&buckets, &count);
+	if (err == -EINVAL || err == -E2BIG)
+		return __connman_error_invalid_arguments(msg);
+	else if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		g_free(buckets);
+		return NULL;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_UINT32_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	for (i = 0; i < count; i++) {
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+
+		ts = buckets[i].start;
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &ts);
+
+		connman_dbus_dict_open(&entry, &dict);
+		stats_append_counters(&dict, &buckets[i].home, &counters,
+									TRUE);
+		connman_dbus_dict_close(&entry, &dict);
+
+		connman_dbus_dict_open(&entry, &dict);
+		stats_append_counters(&dict, &buckets[i].roaming, &counters,
+									TRUE);
+		connman_dbus_dict_close(&entry, &dict);
+
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	g_free(buckets);
+
+	return reply;
+}
+
 static struct _services_notify {
 	int id;
 	GHashTable *add;
@@ -4183,6 +4368,11 @@ static const GDBusMethodTable service_methods[] = {
 			GDBUS_ARGS({ "service", "o" }), NULL,
 			move_after) },
 	{ GDBUS_METHOD("ResetCounters", NULL, NULL, reset_counters) },
+	{ GDBUS_METHOD("GetCounterHistory",
+			GDBUS_ARGS({ "start", "u" }, { "end", "u" },
+					{ "interval", "u" }),
+			GDBUS_ARGS({ "history", "a(ua{sv}a{sv})" }),
+			get_counter_history) },
 	{ },
 };
 
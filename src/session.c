@@ -34,6 +34,7 @@
 
 static DBusConnection *connection;
 static GHashTable *session_hash;
+static GHashTable *service_session_hash;
 static connman_bool_t sessionmode;
 static struct connman_session *ecall_session;
 static GSList *policy_list;
@@ -47,6 +48,11 @@ enum connman_session_trigger {
 	CONNMAN_SESSION_TRIGGER_ECALL		= 5,
 };
 
+#define CONNMAN_SESSION_TRIGGER_MAX	(CONNMAN_SESSION_TRIGGER_ECALL + 1)
+
+/* Number of session_changed() evaluations per trigger */
+static unsigned long trigger_evaluations[CONNMAN_SESSION_TRIGGER_MAX];
+
 enum connman_session_reason {
 	CONNMAN_SESSION_REASON_UNKNOWN		= 0,
 	CONNMAN_SESSION_REASON_CONNECT		= 1,
@@ -269,6 +275,54 @@ static void free_session(struct connman_session *session)
 	g_free(session);
 }
 
+/*
+ * service_session_hash maps every service to the set of sessions whose
+ * service_hash holds it, so that service events only reach the sessions
+ * which matched the service.
+ */
+static void index_session(struct connman_session *session,
+				struct connman_service *service)
+{
+	GHashTable *sessions;
+
+	sessions = g_hash_table_lookup(service_session_hash, service);
+	if (sessions == NULL) {
+		sessions = g_hash_table_new(g_direct_hash, g_direct_equal);
+		g_hash_table_replace(service_session_hash, service, sessions);
+	}
+
+	g_hash_table_replace(sessions, session, session);
+}
+
+static void unindex_session(struct connman_session *session,
+				struct connman_service *service)
+{
+	GHashTable *sessions;
+
+	sessions = g_hash_table_lookup(service_session_hash, service);
+	if (sessions == NULL)
+		return;
+
+	g_hash_table_remove(sessions, session);
+
+	if (g_hash_table_size(sessions) == 0)
+		g_hash_table_remove(service_session_hash, service);
+}
+
+static void unindex_session_all(struct connman_session *session)
+{
+	GHashTableIter iter;
+	gpointer key;
+
+	if (session->service_hash == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, session->service_hash);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE)
+		unindex_session(session, key);
+}
+
 static void cleanup_session(gpointer user_data)
 {
 	struct connman_session *session = user_data;
@@ -277,6 +331,7 @@ static void cleanup_session(gpointer user_data)
 	DBG("remove %s", session->session_path);
 
 	g_slist_free(session->user_allowed_bearers);
+	unindex_session_all(session);
 	g_hash_table_destroy(session->service_hash);
 	g_sequence_free(session->service_list);
 
@@ -1268,6 +1323,9 @@ static void populate_service_list(struct connman_session *session)
 	struct service_entry *entry;
 	GSequenceIter *iter;
 
+	/* The caller still owns the previous service_hash, if any */
+	unindex_session_all(session);
+
 	session->service_hash =
 		g_hash_table_new_full(g_direct_hash, g_direct_equal,
 					NULL, NULL);
@@ -1289,6 +1347,7 @@ static void populate_service_list(struct connman_session *session)
 
 		g_hash_table_replace(session->service_hash,
 					entry->service, iter);
+		index_session(session, entry->service);
 
 		iter = g_sequence_iter_next(iter);
 	}
@@ -1308,8 +1367,12 @@ static void session_changed(struct connman_session *session,
 	 * play a bit around. So we are going to improve it step by step.
 	 */
 
-	DBG("session %p trigger %s reason %s", session, trigger2string(trigger),
-						reason2string(info->reason));
+	trigger_evaluations[trigger]++;
+
+	DBG("session %p trigger %s reason %s evaluations %lu", session,
+					trigger2string(trigger),
+					reason2string(info->reason),
+					trigger_evaluations[trigger]);
 
 	if (info->entry != NULL) {
 		enum connman_session_state state;
@@ -1967,6 +2030,7 @@ static void service_add(struct connman_service *service,
 
 		g_hash_table_replace(session->service_hash, service,
 					iter_service_list);
+		index_session(session, service);
 
 		session_changed(session, CONNMAN_SESSION_TRIGGER_SERVICE);
 	}
@@ -1974,45 +2038,59 @@ static void service_add(struct connman_service *service,
 
 static void service_remove(struct connman_service *service)
 {
-
+	GHashTable *sessions;
 	GHashTableIter iter;
-	gpointer key, value;
+	gpointer key;
 	struct connman_session *session;
 	struct session_info *info;
 
 	DBG("service %p", service);
 
-	g_hash_table_iter_init(&iter, session_hash);
+	sessions = g_hash_table_lookup(service_session_hash, service);
+	if (sessions == NULL)
+		return;
 
-	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+	g_hash_table_steal(service_session_hash, service);
+
+	g_hash_table_iter_init(&iter, sessions);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE) {
 		GSequenceIter *seq_iter;
-		session = value;
+		session = key;
 		info = session->info;
 
 		seq_iter = g_hash_table_lookup(session->service_hash, service);
 		if (seq_iter == NULL)
 			continue;
 
+		g_hash_table_remove(session->service_hash, service);
 		g_sequence_remove(seq_iter);
 
 		if (info->entry != NULL && info->entry->service == service)
 			info->entry = NULL;
 		session_changed(session, CONNMAN_SESSION_TRIGGER_SERVICE);
 	}
+
+	g_hash_table_destroy(sessions);
 }
 
 static void service_state_changed(struct connman_service *service,
 					enum connman_service_state state)
 {
+	GHashTable *sessions;
 	GHashTableIter iter;
-	gpointer key, value;
+	gpointer key;
 
 	DBG("service %p state %d", service, state);
 
-	g_hash_table_iter_init(&iter, session_hash);
+	sessions = g_hash_table_lookup(service_session_hash, service);
+	if (sessions == NULL)
+		return;
 
-	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
-		struct connman_session *session = value;
+	g_hash_table_iter_init(&iter, sessions);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE) {
+		struct connman_session *session = key;
 		GSequenceIter *service_iter;
 
 		service_iter = g_hash_table_lookup(session->service_hash, service);
@@ -2031,20 +2109,25 @@ static void service_state_changed(struct connman_service *service,
 static void ipconfig_changed(struct connman_service *service,
 				struct connman_ipconfig *ipconfig)
 {
+	GHashTable *sessions;
 	GHashTableIter iter;
-	gpointer key, value;
+	gpointer key;
 	struct connman_session *session;
 	struct session_info *info;
 	enum connman_ipconfig_type type;
 
 	DBG("service %p ipconfig %p", service, ipconfig);
 
+	sessions = g_hash_table_lookup(service_session_hash, service);
+	if (sessions == NULL)
+		return;
+
 	type = __connman_ipconfig_get_config_type(ipconfig);
 
-	g_hash_table_iter_init(&iter, session_hash);
+	g_hash_table_iter_init(&iter, sessions);
 
-	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
-		session = value;
+	while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE) {
+		session = key;
 		info = session->info;
 
 		if (info->state == CONNMAN_SESSION_STATE_DISCONNECTED)
@@ -2085,6 +2168,9 @@ int __connman_session_init(void)
 
 	session_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 						NULL, cleanup_session);
+	service_session_hash = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL,
+					(GDestroyNotify) g_hash_table_destroy);
 
 	sessionmode = FALSE;
 	return 0;
@@ -2092,6 +2178,8 @@ int __connman_session_init(void)
 
 void __connman_session_cleanup(void)
 {
+	int i;
+
 	DBG("");
 
 	if (connection == NULL)
@@ -2102,6 +2190,17 @@ void __connman_session_cleanup(void)
 	g_hash_table_foreach(session_hash, release_session, NULL);
 	g_hash_table_destroy(session_hash);
 	session_hash = NULL;
+	g_hash_table_destroy(service_session_hash);
+	service_session_hash = NULL;
+
+	for (i = CONNMAN_SESSION_TRIGGER_SETTING;
+			i < CONNMAN_SESSION_TRIGGER_MAX; i++) {
+		if (trigger_evaluations[i] == 0)
+			continue;
+
+		DBG("trigger %s evaluations %lu", trigger2string(i),
+						trigger_evaluations[i]);
+	}
 
 	dbus_connection_unref(connection);
 }
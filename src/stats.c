@@ -25,6 +25,8 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -33,6 +35,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "connman.h"
@@ -46,7 +49,16 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC		0xFA01B916
+#define MAGIC_V1	0xFA00B916
+
+#define STATS_BLOCK_SIZE	4096
+#define STATS_RECORD_MAX	(1 + 10 * 10)
+
+#define STATS_PENDING_MAX	16
+#define STATS_FLUSH_INTERVAL	5	/* seconds */
+
+#define STATS_QUERY_MAX_BUCKETS	4096
 
 /*
  * Statistics counters are stored into a ring buffer which is stored
@@ -56,37 +68,101 @@
  *   The ring buffer is mmap to a file
  *   Initialy only the smallest possible amount of disk space is allocated
  *   The files grow to the configured maximal size
- *   The grows by _SC_PAGESIZE step size
+ *   The file is divided into blocks of STATS_BLOCK_SIZE bytes
+ *   The grows by STATS_BLOCK_SIZE step size
  *   For each service a file is created
- *   Each file has a header where the indexes are stored
+ *   Each file has a header where the indexes and the newest home and
+ *   roaming records are stored, it lives at the start of block 0
  *
  * Entries properties:
  *   Each entry has a timestamp
  *   A flag to mark if the entry is either home (0) or roaming (1) entry
- *   The entries are fixed sized (stats_record)
+ *   Entries are encoded as the difference to the previous entry of the
+ *   same kind in the same block, every value as a zigzag varint
+ *   The first entry of a block is encoded against zero, so every block
+ *   can be decoded on its own
+ *   An entry never spans two blocks
+ *
+ * Block properties:
+ *   Each block has a small header with the timestamps of its first and
+ *   last entry, the number of entries and the number of bytes used
  *
  * Ring buffer properties:
- *   There are to indexes 'begin', 'end', 'home' and 'roaming'
- *   'begin' points to the oldest entry
- *   'end' points to the newest/current entry
- *   'home' points to the current home entry
- *   'roaming' points to the current roaming entry
- *   If 'begin' == 'end' then the buffer is empty
- *   If 'end' + 1 == 'begin then it's full
- *   The ring buffer is valid in the range (begin, end]
- *   If 'home' has the value UINT_MAX', 'home' is invalid
- *   if 'roaming' has the value UINT_MAX', 'roaming' is invalid
- *   'first' points to the first entry in the ring buffer
- *   'last' points to the last entry in the ring buffer
+ *   There are two indexes 'begin' and 'end'
+ *   'begin' is the index of the block with the oldest entries
+ *   'end' is the index of the block new entries are appended to
+ *   If 'begin' == 'end' and that block has no entries, the buffer is empty
+ *   If the block after 'end' is 'begin' then it's full, the oldest
+ *   block is then dropped
  *
  * History file:
  *   Same format as the ring buffer file
  *   For a period of at least 2 months dayly records are keept
  *   If older, then only a monthly record is keept
+ *   The last home and roaming entry of every day are rolled up while
+ *   they are written to the ring buffer, so it never has to be read
+ *   again to update the history
+ *   Closed days are handed to a worker thread which compacts the
+ *   history into a temporary file, syncs it and renames it over the
+ *   old one
+ *   On startup the rollup is rebuilt from the ring buffer entries
+ *   newer than the last history entry
+ *
+ * Pending records:
+ *   Updates are first collected in a small per file queue
+ *   An update within the same second as the previous one replaces it
+ *   The queue is written to the ring buffer when it is full, every
+ *   STATS_FLUSH_INTERVAL seconds and when the file is closed
+ *
+ * Range queries:
+ *   The blocks are in timestamp order, a binary search over their
+ *   first timestamps finds where a range starts without decoding
+ *   any entry
+ *   The history file answers the part of a range which is older than
+ *   the ring buffer, with one entry per day or month
+ *
+ * Version 1 files (MAGIC_V1) stored fixed sized 32 bit records, they
+ * are converted in place when they are opened.
  */
 
+struct stats_record {
+	int64_t ts;
+	uint32_t roaming;
+	uint32_t reserved;
+	struct connman_stats_data data;
+};
+
+#define STATS_HAS_HOME		0x01
+#define STATS_HAS_ROAMING	0x02
 
 struct stats_file_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t begin;
+	uint32_t end;
+	uint32_t flags;
+	uint32_t reserved;
+	struct stats_record home;
+	struct stats_record roaming;
+};
+
+struct stats_block {
+	int64_t first_ts;
+	int64_t last_ts;
+	uint16_t used;
+	uint16_t count;
+	uint32_t reserved;
+	uint8_t data[0];
+};
+
+#define STATS_RECORD_ROAMING	0x01
+
+struct stats_codec {
+	int64_t ts;
+	struct connman_stats_data last[2];
+};
+
+struct stats_file_header_v1 {
 	unsigned int magic;
 	unsigned int begin;
 	unsigned int end;
@@ -94,10 +170,20 @@ struct stats_file_header {
 	unsigned int roaming;
 };
 
-struct stats_record {
+struct stats_record_v1 {
 	time_t ts;
 	unsigned int roaming;
-	struct connman_stats_data data;
+	struct {
+		unsigned int rx_packets;
+		unsigned int tx_packets;
+		unsigned int rx_bytes;
+		unsigned int tx_bytes;
+		unsigned int rx_errors;
+		unsigned int tx_errors;
+		unsigned int rx_dropped;
+		unsigned int tx_dropped;
+		unsigned int time;
+	} data;
 };
 
 struct stats_file {
@@ -108,113 +194,308 @@ struct stats_file {
 	size_t max_len;
 
 	/* cached values */
-	struct stats_record *first;
-	struct stats_record *last;
-	struct stats_record *home;
-	struct stats_record *roaming;
+	unsigned int blocks;
+
+	/* encoder state after the last record of the end block */
+	struct stats_codec codec;
 
 	/* history */
 	char *history_name;
 	int account_period_offset;
+
+	/* records not yet written to the ring buffer */
+	struct stats_record pending[STATS_PENDING_MAX];
+	unsigned int pending_count;
+
+	/* last home and roaming record of the current day */
+	struct stats_record rollup[2];
+	connman_bool_t rollup_valid[2];
+	int64_t rollup_ts;
+
+	/* records of closed days not yet in the history file */
+	GArray *history_queue;
+	struct stats_history_job *history_job;
+};
+
+struct stats_history_job {
+	struct stats_file *file;
+	char *history_name;
+	int account_period_offset;
+	struct stats_record *records;
+	unsigned int count;
+	int err;
+
+	pthread_t thread;
+	int notify_fd;
+	guint watch;
 };
 
 struct stats_iter {
 	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
+	unsigned int block;
+	unsigned int offset;
+	unsigned int count;
+	struct stats_codec codec;
+	struct stats_record rec;
 };
 
 GHashTable *stats_hash = NULL;
+static guint flush_timeout = 0;
 
 static struct stats_file_header *get_hdr(struct stats_file *file)
 {
 	return (struct stats_file_header *)file->addr;
 }
 
-static struct stats_record *get_begin(struct stats_file *file)
+static size_t get_block_offset(unsigned int index)
 {
-	unsigned int off = get_hdr(file)->begin;
+	if (index == 0)
+		return sizeof(struct stats_file_header);
 
-	return (struct stats_record *)(file->addr + off);
+	return (size_t)index * STATS_BLOCK_SIZE;
 }
 
-static struct stats_record *get_end(struct stats_file *file)
+static unsigned int get_block_capacity(unsigned int index)
 {
-	unsigned int off = get_hdr(file)->end;
+	unsigned int capacity = STATS_BLOCK_SIZE - sizeof(struct stats_block);
+
+	if (index == 0)
+		capacity -= sizeof(struct stats_file_header);
 
-	return (struct stats_record *)(file->addr + off);
+	return capacity;
 }
 
-static struct stats_record *get_home(struct stats_file *file)
+static struct stats_block *get_block(struct stats_file *file,
+					unsigned int index)
 {
-	struct stats_file_header *hdr;
+	return (struct stats_block *)(file->addr + get_block_offset(index));
+}
 
-	hdr = get_hdr(file);
+static unsigned int get_next_block(struct stats_file *file,
+					unsigned int index)
+{
+	index++;
 
-	if (hdr->home == UINT_MAX)
-		return NULL;
+	if (index >= file->blocks)
+		index = 0;
 
-	return (struct stats_record *)(file->addr + hdr->home);
+	return index;
 }
 
-static struct stats_record *get_roaming(struct stats_file *file)
+static unsigned int put_varint(uint8_t *buf, uint64_t val)
 {
-	struct stats_file_header *hdr;
+	unsigned int len = 0;
 
-	hdr = get_hdr(file);
+	while (val >= 0x80) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
 
-	if (hdr->roaming == UINT_MAX)
-		return NULL;
+	buf[len++] = val;
 
-	return (struct stats_record *)(file->addr + hdr->roaming);
+	return len;
 }
 
-static void set_end(struct stats_file *file, struct stats_record *end)
+static int get_varint(const uint8_t *buf, unsigned int len,
+						uint64_t *val)
 {
-	struct stats_file_header *hdr;
+	unsigned int i, shift = 0;
 
-	hdr = get_hdr(file);
-	hdr->end = (char *)end - file->addr;
+	*val = 0;
+
+	for (i = 0; i < len && shift < 64; i++, shift += 7) {
+		*val |= (uint64_t)(buf[i] & 0x7f) << shift;
+
+		if ((buf[i] & 0x80) == 0)
+			return i + 1;
+	}
+
+	return -EINVAL;
 }
 
-static void set_home(struct stats_file *file, struct stats_record *home)
+/*
+ * Counters can go back to zero when they are reset, so the deltas are
+ * signed. Zigzag encoding keeps small negative values short as well.
+ */
+static unsigned int put_delta(uint8_t *buf, uint64_t cur, uint64_t last)
 {
-	struct stats_file_header *hdr;
+	int64_t delta = (int64_t)(cur - last);
+	uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
 
-	hdr = get_hdr(file);
-	hdr->home = (char *)home - file->addr;
+	return put_varint(buf, zigzag);
 }
 
-static void set_roaming(struct stats_file *file, struct stats_record *roaming)
+static int get_delta(const uint8_t *buf, unsigned int len,
+					unsigned int *offset, uint64_t *val)
 {
-	struct stats_file_header *hdr;
+	uint64_t raw;
+	int n;
 
-	hdr = get_hdr(file);
-	hdr->roaming = (char *)roaming - file->addr;
+	n = get_varint(buf + *offset, len - *offset, &raw);
+	if (n < 0)
+		return n;
+
+	*offset += n;
+	*val += (uint64_t)((int64_t)(raw >> 1) ^ -(int64_t)(raw & 1));
+
+	return 0;
 }
 
-static struct stats_record *get_next(struct stats_file *file,
-					struct stats_record *cur)
+static unsigned int encode_record(const struct stats_codec *codec,
+				const struct stats_record *rec, uint8_t *buf)
 {
-	cur++;
+	const struct connman_stats_data *last;
+	const struct connman_stats_data *data = &rec->data;
+	unsigned int len = 0;
+
+	last = &codec->last[rec->roaming == TRUE ? 1 : 0];
+
+	buf[len++] = rec->roaming == TRUE ? STATS_RECORD_ROAMING : 0;
+
+	len += put_delta(buf + len, rec->ts, codec->ts);
+	len += put_delta(buf + len, data->time, last->time);
+	len += put_delta(buf + len, data->rx_packets, last->rx_packets);
+	len += put_delta(buf + len, data->tx_packets, last->tx_packets);
+	len += put_delta(buf + len, data->rx_bytes, last->rx_bytes);
+	len += put_delta(buf + len, data->tx_bytes, last->tx_bytes);
+	len += put_delta(buf + len, data->rx_errors, last->rx_errors);
+	len += put_delta(buf + len, data->tx_errors, last->tx_errors);
+	len += put_delta(buf + len, data->rx_dropped, last->rx_dropped);
+	len += put_delta(buf + len, data->tx_dropped, last->tx_dropped);
+
+	return len;
+}
+
+static void codec_update(struct stats_codec *codec,
+				const struct stats_record *rec)
+{
+	codec->ts = rec->ts;
+	memcpy(&codec->last[rec->roaming == TRUE ? 1 : 0], &rec->data,
+				sizeof(struct connman_stats_data));
+}
+
+static int decode_record(struct stats_codec *codec, const uint8_t *buf,
+				unsigned int len, struct stats_record *rec)
+{
+	struct connman_stats_data *data = &rec->data;
+	unsigned int offset = 1;
+	uint64_t ts, time;
+
+	if (len < 1 || (buf[0] & ~STATS_RECORD_ROAMING) != 0)
+		return -EINVAL;
+
+	memset(rec, 0, sizeof(struct stats_record));
+	rec->roaming = (buf[0] & STATS_RECORD_ROAMING) ? TRUE : FALSE;
+	memcpy(data, &codec->last[rec->roaming == TRUE ? 1 : 0],
+				sizeof(struct connman_stats_data));
+
+	ts = codec->ts;
+	time = data->time;
+
+	if (get_delta(buf, len, &offset, &ts) < 0 ||
+			get_delta(buf, len, &offset, &time) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_packets) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_packets) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_bytes) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_bytes) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_errors) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_errors) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_dropped) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_dropped) < 0)
+		return -EINVAL;
+
+	rec->ts = (int64_t)ts;
+	data->time = time;
+
+	codec_update(codec, rec);
+
+	return offset;
+}
 
-	if (cur > file->last)
-		cur = file->first;
+static void stats_iter_init(struct stats_iter *iter,
+				struct stats_file *file)
+{
+	memset(iter, 0, sizeof(struct stats_iter));
 
-	return cur;
+	iter->file = file;
+	iter->block = get_hdr(file)->begin;
+	iter->count = get_block(file, iter->block)->count;
 }
 
-static struct stats_record *get_iterator_begin(struct stats_file *file)
+static struct stats_record *get_next_record(struct stats_iter *iter)
 {
-	return get_next(file, get_begin(file));
+	struct stats_file *file = iter->file;
+	struct stats_block *block;
+	int n;
+
+	while (iter->count == 0) {
+		if (iter->block == get_hdr(file)->end)
+			return NULL;
+
+		iter->block = get_next_block(file, iter->block);
+		iter->offset = 0;
+		iter->count = get_block(file, iter->block)->count;
+		memset(&iter->codec, 0, sizeof(struct stats_codec));
+	}
+
+	block = get_block(file, iter->block);
+
+	if (block->used > get_block_capacity(iter->block))
+		n = -EINVAL;
+	else
+		n = decode_record(&iter->codec, block->data + iter->offset,
+				block->used - iter->offset, &iter->rec);
+	if (n < 0) {
+		connman_warn("corrupted statistics block %u in %s",
+						iter->block, file->name);
+		return NULL;
+	}
+
+	iter->offset += n;
+	iter->count--;
+
+	return &iter->rec;
 }
 
-static struct stats_record *get_iterator_end(struct stats_file *file)
+/*
+ * Positions the iterator one block before the last block which starts
+ * at or before 'ts', so the records preceding 'ts' of both kinds are
+ * seen as well.
+ */
+static void stats_iter_seek(struct stats_iter *iter,
+				struct stats_file *file, int64_t ts)
 {
-	return get_next(file, get_end(file));
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block;
+	unsigned int low, high, mid;
+
+	stats_iter_init(iter, file);
+
+	low = 0;
+	high = (hdr->end + file->blocks - hdr->begin) % file->blocks + 1;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		block = get_block(file, (hdr->begin + mid) % file->blocks);
+
+		if (block->count > 0 && block->first_ts <= ts)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < 2)
+		return;
+
+	iter->block = (hdr->begin + low - 2) % file->blocks;
+	iter->count = get_block(file, iter->block)->count;
 }
 
+static int stats_file_flush(struct stats_file *file);
+static void history_job_finish(struct stats_history_job *job);
+static void history_update_start(struct stats_file *file,
+					connman_bool_t async);
+
 static void stats_free(gpointer user_data)
 {
 	struct stats_file *file = user_data;
@@ -222,6 +503,22 @@ static void stats_free(gpointer user_data)
 	if (file == NULL)
 		return;
 
+	stats_file_flush(file);
+
+	if (file->history_job != NULL) {
+		guint watch = file->history_job->watch;
+
+		/* Joins the worker before its notification pipe is closed */
+		history_job_finish(file->history_job);
+		g_source_remove(watch);
+	}
+
+	if (file->history_queue != NULL) {
+		history_update_start(file, FALSE);
+		g_array_free(file->history_queue, TRUE);
+		file->history_queue = NULL;
+	}
+
 	msync(file->addr, file->len, MS_SYNC);
 
 	munmap(file->addr, file->len);
@@ -243,50 +540,16 @@ static void stats_free(gpointer user_data)
 	g_free(file);
 }
 
-static void update_first(struct stats_file *file)
-{
-	file->first = (struct stats_record *)
-			(file->addr + sizeof(struct stats_file_header));
-}
-
-static void update_last(struct stats_file *file)
-{
-	unsigned int max_entries;
-
-	max_entries = (file->len - sizeof(struct stats_file_header)) /
-			sizeof(struct stats_record);
-	file->last = file->first + max_entries - 1;
-}
-
-static void update_home(struct stats_file *file)
-{
-	file->home = get_home(file);
-}
-
-static void update_roaming(struct stats_file *file)
-{
-	file->roaming = get_roaming(file);
-}
-
-static void stats_file_update_cache(struct stats_file *file)
-{
-	update_first(file);
-	update_last(file);
-	update_home(file);
-	update_roaming(file);
-}
-
 static int stats_file_remap(struct stats_file *file, size_t size)
 {
-	size_t page_size, new_size;
+	size_t new_size;
 	void *addr;
 	int err;
 
 	DBG("file %p size %zu addr %p len %zu", file, size, file->addr,
 		file->len);
 
-	page_size = sysconf(_SC_PAGESIZE);
-	new_size = (size + page_size - 1) & ~(page_size - 1);
+	new_size = (size + STATS_BLOCK_SIZE - 1) & ~(STATS_BLOCK_SIZE - 1);
 
 	err = ftruncate(file->fd, new_size);
 	if (err < 0) {
@@ -322,8 +585,7 @@ static int stats_file_remap(struct stats_file *file, size_t size)
 
 	file->addr = addr;
 	file->len = new_size;
-
-	stats_file_update_cache(file);
+	file->blocks = new_size / STATS_BLOCK_SIZE;
 
 	return 0;
 }
@@ -347,10 +609,9 @@ static int stats_open(struct stats_file *file,
 	return 0;
 }
 
-static int stats_open_temp(struct stats_file *file)
+static int stats_open_temp(struct stats_file *file, const char *name)
 {
-	file->name = g_strdup_printf("%s/stats.XXXXXX.tmp",
-					STORAGEDIR);
+	file->name = g_strdup_printf("%s.XXXXXX.tmp", name);
 	file->fd = g_mkstemp_full(file->name, O_RDWR | O_CREAT, 0644);
 	if (file->fd < 0) {
 		connman_error("create tempory file error %s for %s",
@@ -363,9 +624,199 @@ static int stats_open_temp(struct stats_file *file)
 	return 0;
 }
 
-static int stats_file_setup(struct stats_file *file)
+/*
+ * Maps a file for reading only, it is neither created nor repaired.
+ * Used to query the history while the worker thread may replace it.
+ */
+static int stats_open_readonly(struct stats_file *file, const char *name)
 {
 	struct stats_file_header *hdr;
+	struct stat st;
+	void *addr;
+	int err;
+
+	file->fd = TFR(open(name, O_RDONLY | O_CLOEXEC));
+	if (file->fd < 0)
+		return -errno;
+
+	if (fstat(file->fd, &st) < 0) {
+		err = -errno;
+		goto err;
+	}
+
+	if (st.st_size < STATS_BLOCK_SIZE) {
+		err = -ENODATA;
+		goto err;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+	if (addr == MAP_FAILED) {
+		err = -errno;
+		goto err;
+	}
+
+	file->addr = addr;
+	file->len = st.st_size;
+	file->blocks = st.st_size / STATS_BLOCK_SIZE;
+
+	hdr = get_hdr(file);
+	if (hdr->magic != MAGIC || hdr->block_size != STATS_BLOCK_SIZE ||
+			hdr->begin >= file->blocks ||
+			hdr->end >= file->blocks) {
+		munmap(file->addr, file->len);
+		file->addr = NULL;
+		err = -EINVAL;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	TFR(close(file->fd));
+	file->fd = -1;
+
+	return err;
+}
+
+static void stats_file_reset(struct stats_file *file)
+{
+	struct stats_file_header *hdr;
+
+	memset(file->addr, 0, sizeof(struct stats_file_header) +
+					sizeof(struct stats_block));
+
+	hdr = get_hdr(file);
+	hdr->magic = MAGIC;
+	hdr->block_size = STATS_BLOCK_SIZE;
+	hdr->begin = 0;
+	hdr->end = 0;
+
+	memset(&file->codec, 0, sizeof(struct stats_codec));
+}
+
+/*
+ * Check the indexes and decode the block new records go to, which
+ * also brings the encoder state up to date.
+ */
+static connman_bool_t stats_file_check(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block;
+	struct stats_record rec;
+	unsigned int i, offset;
+	int n;
+
+	if (hdr->magic != MAGIC || hdr->block_size != STATS_BLOCK_SIZE ||
+			hdr->begin >= file->blocks ||
+			hdr->end >= file->blocks)
+		return FALSE;
+
+	block = get_block(file, hdr->end);
+	if (block->used > get_block_capacity(hdr->end))
+		return FALSE;
+
+	memset(&file->codec, 0, sizeof(struct stats_codec));
+
+	for (i = 0, offset = 0; i < block->count; i++) {
+		n = decode_record(&file->codec, block->data + offset,
+						block->used - offset, &rec);
+		if (n < 0)
+			return FALSE;
+
+		offset += n;
+	}
+
+	return TRUE;
+}
+
+static int stats_file_write(struct stats_file *file,
+				struct stats_record *rec);
+
+/*
+ * Version 1 files hold at most STATS_MAX_FILE_SIZE bytes of records,
+ * so they are read into memory and written back in the new format.
+ */
+static int stats_file_migrate(struct stats_file *file)
+{
+	struct stats_file_header_v1 *hdr;
+	struct stats_record_v1 *first, *last, *it, *end;
+	struct stats_record *records;
+	unsigned int max_entries, count = 0, i;
+	int err = 0;
+
+	hdr = (struct stats_file_header_v1 *)file->addr;
+
+	if (file->len < sizeof(struct stats_file_header_v1) +
+					sizeof(struct stats_record_v1))
+		return -EINVAL;
+
+	max_entries = (file->len - sizeof(struct stats_file_header_v1)) /
+					sizeof(struct stats_record_v1);
+
+	if (hdr->begin < sizeof(struct stats_file_header_v1) ||
+			hdr->end < sizeof(struct stats_file_header_v1) ||
+			hdr->begin > file->len -
+					sizeof(struct stats_record_v1) ||
+			hdr->end > file->len - sizeof(struct stats_record_v1) ||
+			(hdr->begin - sizeof(struct stats_file_header_v1)) %
+					sizeof(struct stats_record_v1) != 0 ||
+			(hdr->end - sizeof(struct stats_file_header_v1)) %
+					sizeof(struct stats_record_v1) != 0)
+		return -EINVAL;
+
+	records = g_try_new0(struct stats_record, max_entries);
+	if (records == NULL)
+		return -ENOMEM;
+
+	first = (struct stats_record_v1 *)(file->addr +
+				sizeof(struct stats_file_header_v1));
+	last = first + max_entries - 1;
+
+	it = (struct stats_record_v1 *)(file->addr + hdr->begin);
+	end = (struct stats_record_v1 *)(file->addr + hdr->end);
+
+	while (it != end && count < max_entries) {
+		struct stats_record *rec = &records[count++];
+
+		it = it == last ? first : it + 1;
+
+		rec->ts = it->ts;
+		rec->roaming = it->roaming == TRUE ? TRUE : FALSE;
+		rec->data.rx_packets = it->data.rx_packets;
+		rec->data.tx_packets = it->data.tx_packets;
+		rec->data.rx_bytes = it->data.rx_bytes;
+		rec->data.tx_bytes = it->data.tx_bytes;
+		rec->data.rx_errors = it->data.rx_errors;
+		rec->data.tx_errors = it->data.tx_errors;
+		rec->data.rx_dropped = it->data.rx_dropped;
+		rec->data.tx_dropped = it->data.tx_dropped;
+		rec->data.time = it->data.time;
+	}
+
+	/* Old history files are not size limited, keep all of it */
+	if (file->max_len < file->len)
+		file->max_len = file->len;
+
+	stats_file_reset(file);
+
+	for (i = 0; i < count; i++) {
+		err = stats_file_write(file, &records[i]);
+		if (err < 0)
+			break;
+	}
+
+	g_free(records);
+
+	msync(file->addr, file->len, MS_SYNC);
+
+	connman_info("Converted %u statistics records in %s", count,
+							file->name);
+
+	return err;
+}
+
+static int stats_file_setup(struct stats_file *file)
+{
 	struct stat st;
 	size_t size = 0;
 	int err;
@@ -387,8 +838,11 @@ static int stats_file_setup(struct stats_file *file)
 	size = (size_t)st.st_size;
 	file->max_len = STATS_MAX_FILE_SIZE;
 
-	if (size < (size_t)sysconf(_SC_PAGESIZE))
-		size = sysconf(_SC_PAGESIZE);
+	if (file->max_len < STATS_BLOCK_SIZE)
+		file->max_len = STATS_BLOCK_SIZE;
+
+	if (size < STATS_BLOCK_SIZE)
+		size = STATS_BLOCK_SIZE;
 
 	err = stats_file_remap(file, size);
 	if (err < 0) {
@@ -399,81 +853,136 @@ static int stats_file_setup(struct stats_file *file)
 		return err;
 	}
 
-	hdr = get_hdr(file);
-
-	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
-		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
+	if (get_hdr(file)->magic == MAGIC_V1 &&
+				stats_file_migrate(file) < 0)
+		connman_warn("Failed to convert statistics in %s",
+							file->name);
 
-		stats_file_update_cache(file);
-	}
+	if (stats_file_check(file) == FALSE)
+		stats_file_reset(file);
 
 	return 0;
 }
 
-
-static struct stats_record *get_next_record(struct stats_iter *iter)
+/*
+ * Moves 'end' to a fresh block. The file grows until it reaches
+ * its maximal size, after that the ring wraps and the oldest block
+ * is overwritten. Its records are already part of the daily rollup.
+ */
+static int stats_file_next_block(struct stats_file *file)
 {
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
+	struct stats_file_header *hdr = get_hdr(file);
+	unsigned int next;
+	int err;
+
+	next = hdr->end + 1;
 
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
+	if (next == file->blocks && file->len < file->max_len) {
+		DBG("grow file %s", file->name);
+
+		err = stats_file_remap(file, file->len + STATS_BLOCK_SIZE);
+		if (err < 0)
+			return err;
 
-		return tmp;
+		hdr = get_hdr(file);
 	}
 
-	return NULL;
+	if (next >= file->blocks)
+		next = 0;
+
+	if (next == hdr->begin)
+		hdr->begin = get_next_block(file, next);
+
+	memset(get_block(file, next), 0, sizeof(struct stats_block));
+	hdr->end = next;
+
+	memset(&file->codec, 0, sizeof(struct stats_codec));
+
+	return 0;
 }
 
-static int append_record(struct stats_file *file,
+static int stats_file_write(struct stats_file *file,
 				struct stats_record *rec)
 {
-	struct stats_record *cur, *next;
+	struct stats_file_header *hdr;
+	struct stats_block *block;
+	uint8_t buf[STATS_RECORD_MAX];
+	unsigned int len;
 	int err;
 
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
+	len = encode_record(&file->codec, rec, buf);
+
+	hdr = get_hdr(file);
+	block = get_block(file, hdr->end);
+
+	if (block->used + len > get_block_capacity(hdr->end)) {
+		err = stats_file_next_block(file);
 		if (err < 0)
 			return err;
 
-		stats_file_update_cache(file);
+		/* The first record of a block is encoded against zero */
+		len = encode_record(&file->codec, rec, buf);
+
+		hdr = get_hdr(file);
+		block = get_block(file, hdr->end);
 	}
 
-	cur = get_end(file);
-	next = get_next(file, cur);
+	memcpy(block->data + block->used, buf, len);
+	block->used += len;
+
+	if (block->count == 0)
+		block->first_ts = rec->ts;
+	block->last_ts = rec->ts;
+	block->count++;
 
-	memcpy(next, rec, sizeof(struct stats_record));
+	codec_update(&file->codec, rec);
 
-	set_end(file, next);
+	if (rec->roaming != TRUE) {
+		memcpy(&hdr->home, rec, sizeof(struct stats_record));
+		hdr->flags |= STATS_HAS_HOME;
+	} else {
+		memcpy(&hdr->roaming, rec, sizeof(struct stats_record));
+		hdr->flags |= STATS_HAS_ROAMING;
+	}
 
 	return 0;
 }
 
-static struct stats_record *process_file(struct stats_iter *iter,
+/*
+ * Number of the accounting period a date belongs to, a period starts
+ * on day 'account_period_offset' of a month.
+ */
+static int get_account_period(GDate *date, int account_period_offset)
+{
+	int period;
+
+	period = g_date_get_year(date) * 12 + g_date_get_month(date);
+
+	if (g_date_get_day(date) < account_period_offset)
+		period--;
+
+	return period;
+}
+
+static connman_bool_t process_file(struct stats_iter *iter,
 					struct stats_file *temp_file,
 					struct stats_record *cur,
+					connman_bool_t valid,
 					GDate *date_change_step_size,
 					int account_period_offset)
 {
-	struct stats_record *home, *roaming;
+	struct stats_record home, roaming;
+	connman_bool_t have_home = FALSE, have_roaming = FALSE;
 	struct stats_record *next;
 
-	home = NULL;
-	roaming = NULL;
+	if (valid == FALSE) {
+		next = get_next_record(iter);
+		if (next == NULL)
+			return FALSE;
+
+		memcpy(cur, next, sizeof(struct stats_record));
+	}
 
-	if (cur == NULL)
-		cur = get_next_record(iter);
 	next = get_next_record(iter);
 
 	while (next != NULL) {
@@ -483,31 +992,24 @@ static struct stats_record *process_file(struct stats_iter *iter,
 
 		append = FALSE;
 
-		if (cur->roaming == TRUE)
-			roaming = cur;
-		else
-			home = cur;
+		if (cur->roaming == TRUE) {
+			memcpy(&roaming, cur, sizeof(struct stats_record));
+			have_roaming = TRUE;
+		} else {
+			memcpy(&home, cur, sizeof(struct stats_record));
+			have_home = TRUE;
+		}
 
 		g_date_set_time_t(&date_cur, cur->ts);
 		g_date_set_time_t(&date_next, next->ts);
 
 		if (g_date_compare(&date_cur, date_change_step_size) < 0) {
 			/* month period size */
-			GDateDay day_cur, day_next;
-			GDateMonth month_cur, month_next;
-
-			month_cur = g_date_get_month(&date_cur);
-			month_next = g_date_get_month(&date_next);
-
-			day_cur = g_date_get_day(&date_cur);
-			day_next = g_date_get_day(&date_next);
-
-			if (day_cur == day_next && month_cur != month_next) {
-				append = TRUE;
-			} else if (day_cur < account_period_offset &&
-					day_next >= account_period_offset) {
+			if (get_account_period(&date_cur,
+						account_period_offset) !=
+					get_account_period(&date_next,
+						account_period_offset))
 				append = TRUE;
-			}
 		} else {
 			/* day period size */
 			if (g_date_days_between(&date_cur, &date_next) > 0)
@@ -515,31 +1017,43 @@ static struct stats_record *process_file(struct stats_iter *iter,
 		}
 
 		if (append == TRUE) {
-			if (home != NULL) {
-				append_record(temp_file, home);
-				home = NULL;
+			if (have_home == TRUE) {
+				stats_file_write(temp_file, &home);
+				have_home = FALSE;
 			}
 
-			if (roaming != NULL) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
+			if (have_roaming == TRUE) {
+				stats_file_write(temp_file, &roaming);
+				have_roaming = FALSE;
 			}
 		}
 
-		cur = next;
+		memcpy(cur, next, sizeof(struct stats_record));
 		next = get_next_record(iter);
 	}
 
-	return cur;
+	/*
+	 * The caller writes 'cur' as the last record, the other kind
+	 * of the same period has to be kept as well.
+	 */
+	if (cur->roaming == TRUE && have_home == TRUE)
+		stats_file_write(temp_file, &home);
+	else if (cur->roaming != TRUE && have_roaming == TRUE)
+		stats_file_write(temp_file, &roaming);
+
+	return TRUE;
 }
 
-static int summarize(struct stats_file *data_file,
-			struct stats_file *history_file,
-			struct stats_file *temp_file)
+static int summarize(struct stats_file *history_file,
+			struct stats_file *temp_file,
+			struct stats_record *records,
+			unsigned int count,
+			int account_period_offset)
 {
-	struct stats_iter data_iter;
 	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
+	struct stats_record cur;
+	connman_bool_t valid;
+	unsigned int i;
 
 	GDate today, date_change_step_size;
 
@@ -550,51 +1064,33 @@ static int summarize(struct stats_file *data_file,
 	g_date_set_time_t(&today, time(NULL));
 
 	date_change_step_size = today;
-	if (g_date_get_day(&today) - data_file->account_period_offset >= 0)
+	if (g_date_get_day(&today) - account_period_offset >= 0)
 		g_date_subtract_months(&date_change_step_size, 2);
 	else
 		g_date_subtract_months(&date_change_step_size, 3);
 
-	g_date_set_day(&date_change_step_size,
-			data_file->account_period_offset);
-
+	g_date_set_day(&date_change_step_size, account_period_offset);
 
 	/* Now process history file */
-	cur = NULL;
+	stats_iter_init(&history_iter, history_file);
 
-	if (history_file != NULL) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
-
-		cur = process_file(&history_iter, temp_file, NULL,
-					&date_change_step_size,
-					data_file->account_period_offset);
-	}
+	valid = process_file(&history_iter, temp_file, &cur, FALSE,
+				&date_change_step_size,
+				account_period_offset);
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
+	if (valid == TRUE)
+		stats_file_write(temp_file, &cur);
 
 	/*
-	 * Ensure date_file records are newer than the history_file
-	 * record
+	 * And finally append the closed days, ensure they are newer
+	 * than the last history record
 	 */
-	if (cur != NULL) {
-		next = get_next_record(&data_iter);
-		while (next != NULL && cur->ts > next->ts)
-			next = get_next_record(&data_iter);
-	}
+	for (i = 0; i < count; i++) {
+		if (valid == TRUE && records[i].ts <= cur.ts)
+			continue;
 
-	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
-				&date_change_step_size,
-				data_file->account_period_offset);
-
-	if (cur != NULL)
-		append_record(temp_file, cur);
+		stats_file_write(temp_file, &records[i]);
+	}
 
 	return 0;
 }
@@ -606,41 +1102,81 @@ static void stats_file_unmap(struct stats_file *file)
 	file->addr = NULL;
 }
 
-static void stats_file_cleanup(struct stats_file *file)
+static void stats_file_close(struct stats_file *file)
 {
+	stats_file_unmap(file);
+
+	TFR(close(file->fd));
 	file->fd = -1;
+
 	g_free(file->name);
 	file->name = NULL;
 }
 
-static int stats_file_close_swap(struct stats_file *history_file,
-					struct stats_file *temp_file)
+static int sync_dir(const char *name)
 {
-	int err;
+	char *dir;
+	int fd, err = 0;
+
+	dir = g_path_get_dirname(name);
+
+	fd = TFR(open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+	if (fd < 0) {
+		err = -errno;
+	} else {
+		if (fsync(fd) < 0)
+			err = -errno;
+		TFR(close(fd));
+	}
+
+	g_free(dir);
+
+	return err;
+}
+
+/*
+ * The new history is completely written and synced before it replaces
+ * the old one, so after a crash either of them is found, never a
+ * partial file.
+ */
+static int stats_file_swap(struct stats_file *history_file,
+				struct stats_file *temp_file)
+{
+	int err = 0;
 
-	stats_file_unmap(history_file);
 	stats_file_unmap(temp_file);
 
-	TFR(close(temp_file->fd));
+	if (fsync(temp_file->fd) < 0)
+		err = -errno;
 
-	unlink(history_file->name);
+	TFR(close(temp_file->fd));
+	temp_file->fd = -1;
 
-	err = link(temp_file->name, history_file->name);
+	if (err == 0 && rename(temp_file->name, history_file->name) < 0)
+		err = -errno;
 
-	unlink(temp_file->name);
+	if (err < 0) {
+		connman_error("history file swap error %s for %s",
+				strerror(-err), history_file->name);
+		unlink(temp_file->name);
+	} else {
+		sync_dir(history_file->name);
+	}
 
-	TFR(close(history_file->fd));
+	g_free(temp_file->name);
+	temp_file->name = NULL;
 
-	stats_file_cleanup(history_file);
-	stats_file_cleanup(temp_file);
+	stats_file_close(history_file);
 
 	return err;
 }
 
-static int stats_file_history_update(struct stats_file *data_file)
+/* Runs on the worker thread, it must not touch the data file */
+static int stats_file_history_update(struct stats_history_job *job)
 {
 	struct stats_file _history_file, *history_file;
 	struct stats_file _temp_file, *temp_file;
+	char *temp_name;
 	int err;
 
 	history_file = &_history_file;
@@ -649,23 +1185,239 @@ static int stats_file_history_update(struct stats_file *data_file)
 	bzero(history_file, sizeof(struct stats_file));
 	bzero(temp_file, sizeof(struct stats_file));
 
-	err = stats_open(history_file, data_file->history_name);
+	err = stats_open(history_file, job->history_name);
+	if (err < 0)
+		return err;
+
+	err = stats_file_setup(history_file);
 	if (err < 0)
 		return err;
-	stats_file_setup(history_file);
 
-	err = stats_open_temp(temp_file);
+	err = stats_open_temp(temp_file, job->history_name);
 	if (err < 0) {
-		stats_free(history_file);
+		stats_file_close(history_file);
 		return err;
 	}
-	stats_file_setup(temp_file);
 
-	summarize(data_file, history_file, temp_file);
+	temp_name = g_strdup(temp_file->name);
 
-	err = stats_file_close_swap(history_file, temp_file);
+	err = stats_file_setup(temp_file);
+	if (err < 0) {
+		unlink(temp_name);
+		g_free(temp_name);
+		stats_file_close(history_file);
+		return err;
+	}
 
-	return err;
+	g_free(temp_name);
+
+	/* The history is not a ring buffer, it grows as needed */
+	temp_file->max_len = G_MAXSIZE;
+
+	summarize(history_file, temp_file, job->records, job->count,
+			job->account_period_offset);
+
+	return stats_file_swap(history_file, temp_file);
+}
+
+static void *history_update_thread(void *data)
+{
+	struct stats_history_job *job = data;
+	char done = 1;
+
+	job->err = stats_file_history_update(job);
+
+	if (TFR(write(job->notify_fd, &done, 1)) < 0)
+		connman_error("history update notify error %s",
+							strerror(errno));
+
+	return NULL;
+}
+
+static void history_job_finish(struct stats_history_job *job)
+{
+	struct stats_file *file = job->file;
+
+	if (job->notify_fd >= 0) {
+		pthread_join(job->thread, NULL);
+		TFR(close(job->notify_fd));
+	}
+
+	DBG("file %p history %s records %u err %d", file,
+			job->history_name, job->count, job->err);
+
+	if (job->err < 0) {
+		connman_warn("history file update failed %s",
+				job->history_name);
+
+		/* Keep the closed days for the next attempt */
+		g_array_prepend_vals(file->history_queue, job->records,
+						job->count);
+	}
+
+	file->history_job = NULL;
+
+	g_free(job->records);
+	g_free(job->history_name);
+	g_free(job);
+}
+
+static gboolean history_update_done(GIOChannel *channel,
+				GIOCondition cond, gpointer user_data)
+{
+	struct stats_history_job *job = user_data;
+	struct stats_file *file = job->file;
+	connman_bool_t again;
+
+	again = job->err == 0 ? TRUE : FALSE;
+
+	history_job_finish(job);
+
+	/* Days which closed while the worker was busy */
+	if (again == TRUE && file->history_queue->len > 0)
+		history_update_start(file, TRUE);
+
+	return FALSE;
+}
+
+static void history_update_start(struct stats_file *file,
+					connman_bool_t async)
+{
+	struct stats_history_job *job;
+	GIOChannel *channel;
+	int fd[2];
+
+	if (file->history_job != NULL || file->history_queue->len == 0)
+		return;
+
+	job = g_try_new0(struct stats_history_job, 1);
+	if (job == NULL)
+		return;
+
+	job->file = file;
+	job->history_name = g_strdup(file->history_name);
+	job->account_period_offset = file->account_period_offset;
+	job->count = file->history_queue->len;
+	job->records = (struct stats_record *)
+			g_array_free(file->history_queue, FALSE);
+	job->notify_fd = -1;
+
+	file->history_queue = g_array_new(FALSE, FALSE,
+					sizeof(struct stats_record));
+	file->history_job = job;
+
+	if (async == TRUE && pipe2(fd, O_CLOEXEC) == 0) {
+		job->notify_fd = fd[1];
+
+		if (pthread_create(&job->thread, NULL,
+					history_update_thread, job) == 0) {
+			channel = g_io_channel_unix_new(fd[0]);
+			g_io_channel_set_close_on_unref(channel, TRUE);
+
+			job->watch = g_io_add_watch(channel,
+					G_IO_IN | G_IO_HUP | G_IO_ERR,
+					history_update_done, job);
+
+			g_io_channel_unref(channel);
+
+			return;
+		}
+
+		connman_warn("Failed to start history update thread");
+
+		TFR(close(fd[0]));
+		TFR(close(fd[1]));
+		job->notify_fd = -1;
+	}
+
+	job->err = stats_file_history_update(job);
+
+	history_job_finish(job);
+}
+
+/*
+ * Keeps the last home and roaming record of the current day. When
+ * a record of a later day arrives, those close the day and are
+ * queued for the history file.
+ */
+static void stats_rollup(struct stats_file *file,
+				const struct stats_record *rec)
+{
+	int i, index = rec->roaming == TRUE ? 1 : 0;
+
+	if (file->rollup_ts != 0) {
+		GDate date_cur, date_next;
+
+		g_date_set_time_t(&date_cur, file->rollup_ts);
+		g_date_set_time_t(&date_next, rec->ts);
+
+		if (g_date_days_between(&date_cur, &date_next) > 0) {
+			for (i = 0; i < 2; i++) {
+				if (file->rollup_valid[i] == FALSE)
+					continue;
+
+				g_array_append_val(file->history_queue,
+							file->rollup[i]);
+				file->rollup_valid[i] = FALSE;
+			}
+		}
+	}
+
+	memcpy(&file->rollup[index], rec, sizeof(struct stats_record));
+	file->rollup_valid[index] = TRUE;
+	file->rollup_ts = rec->ts;
+}
+
+static int64_t history_get_last_ts(const char *name)
+{
+	struct stats_file_header hdr;
+	int64_t ts = 0;
+	ssize_t len;
+	int fd;
+
+	fd = TFR(open(name, O_RDONLY | O_CLOEXEC));
+	if (fd < 0)
+		return 0;
+
+	len = TFR(read(fd, &hdr, sizeof(hdr)));
+	TFR(close(fd));
+
+	if (len != sizeof(hdr) || hdr.magic != MAGIC)
+		return 0;
+
+	if ((hdr.flags & STATS_HAS_HOME) && hdr.home.ts > ts)
+		ts = hdr.home.ts;
+
+	if ((hdr.flags & STATS_HAS_ROAMING) && hdr.roaming.ts > ts)
+		ts = hdr.roaming.ts;
+
+	return ts;
+}
+
+/*
+ * Replays the records which are not yet part of the history, either
+ * because their day is still open or because connmand stopped before
+ * the history was updated.
+ */
+static void stats_rollup_restore(struct stats_file *file)
+{
+	struct stats_iter iter;
+	struct stats_record *rec;
+	int64_t last_ts;
+
+	last_ts = history_get_last_ts(file->history_name);
+
+	stats_iter_init(&iter, file);
+
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (rec->ts <= last_ts)
+			continue;
+
+		stats_rollup(file, rec);
+	}
+
+	DBG("file %p last history %" PRId64 " queued %u", file, last_ts,
+					file->history_queue->len);
 }
 
 int __connman_stats_service_register(struct connman_service *service)
@@ -708,6 +1460,8 @@ int __connman_stats_service_register(struct connman_service *service)
 				__connman_service_get_ident(service));
 	file->history_name = g_strdup_printf("%s/%s/history", STORAGEDIR,
 				__connman_service_get_ident(service));
+	file->history_queue = g_array_new(FALSE, FALSE,
+					sizeof(struct stats_record));
 
 	/* TODO: Use a global config file instead of hard coded value. */
 	file->account_period_offset = 1;
@@ -721,6 +1475,9 @@ int __connman_stats_service_register(struct connman_service *service)
 	if (err < 0)
 		goto err;
 
+	stats_rollup_restore(file);
+	history_update_start(file, TRUE);
+
 	return 0;
 
 err:
@@ -736,48 +1493,91 @@ void __connman_stats_service_unregister(struct connman_service *service)
 	g_hash_table_remove(stats_hash, service);
 }
 
+static int stats_file_flush(struct stats_file *file)
+{
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < file->pending_count; i++) {
+		err = stats_file_write(file, &file->pending[i]);
+		if (err < 0)
+			break;
+
+		stats_rollup(file, &file->pending[i]);
+	}
+
+	file->pending_count = 0;
+
+	return err;
+}
+
+static gboolean flush_timeout_cb(gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	flush_timeout = 0;
+
+	g_hash_table_iter_init(&iter, stats_hash);
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct stats_file *file = value;
+
+		if (stats_file_flush(file) < 0)
+			connman_error("Failed to write statistics to %s",
+					file->name);
+
+		history_update_start(file, TRUE);
+	}
+
+	return FALSE;
+}
+
 int  __connman_stats_update(struct connman_service *service,
 				connman_bool_t roaming,
 				struct connman_stats_data *data)
 {
 	struct stats_file *file;
-	struct stats_record *next;
+	struct stats_record *rec;
+	time_t ts;
 	int err;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
-	if (file->len < file->max_len &&
-			file->last == get_end(file)) {
-		DBG("grow file %s", file->name);
+	ts = time(NULL);
 
-		err = stats_file_remap(file, file->len + sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
-	}
-
-	next = get_next(file, get_end(file));
-
-	if (next == get_begin(file)) {
-		DBG("ring buffer is full, update history file");
+	/*
+	 * The counters only ever grow, so a newer sample within the
+	 * same second supersedes the previous one.
+	 */
+	if (file->pending_count > 0) {
+		rec = &file->pending[file->pending_count - 1];
 
-		if (stats_file_history_update(file) < 0) {
-			connman_warn("history file update failed %s",
-					file->history_name);
+		if (rec->ts == ts && rec->roaming == (unsigned int) roaming) {
+			memcpy(&rec->data, data,
+				sizeof(struct connman_stats_data));
+			return 0;
 		}
 	}
 
-	next->ts = time(NULL);
-	next->roaming = roaming;
-	memcpy(&next->data, data, sizeof(struct connman_stats_data));
+	if (file->pending_count == STATS_PENDING_MAX) {
+		err = stats_file_flush(file);
+		if (err < 0)
+			return err;
 
-	if (roaming != TRUE)
-		set_home(file, next);
-	else
-		set_roaming(file, next);
+		history_update_start(file, TRUE);
+	}
+
+	rec = &file->pending[file->pending_count++];
+	memset(rec, 0, sizeof(struct stats_record));
+	rec->ts = ts;
+	rec->roaming = roaming;
+	memcpy(&rec->data, data, sizeof(struct connman_stats_data));
 
-	set_end(file, next);
+	if (flush_timeout == 0)
+		flush_timeout = g_timeout_add_seconds(STATS_FLUSH_INTERVAL,
+						flush_timeout_cb, NULL);
 
 	return 0;
 }
@@ -786,17 +1586,33 @@ int __connman_stats_get(struct connman_service *service,
 				connman_bool_t roaming,
 				struct connman_stats_data *data)
 {
+	struct stats_file_header *hdr;
 	struct stats_file *file;
 	struct stats_record *rec;
+	unsigned int i;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
-	if (roaming != TRUE)
-		rec = file->home;
+	for (i = file->pending_count; i > 0; i--) {
+		rec = &file->pending[i - 1];
+
+		if (rec->roaming == (unsigned int) roaming) {
+			memcpy(data, &rec->data,
+				sizeof(struct connman_stats_data));
+			return 0;
+		}
+	}
+
+	hdr = get_hdr(file);
+
+	if (roaming != TRUE && (hdr->flags & STATS_HAS_HOME))
+		rec = &hdr->home;
+	else if (roaming == TRUE && (hdr->flags & STATS_HAS_ROAMING))
+		rec = &hdr->roaming;
 	else
-		rec = file->roaming;
+		rec = NULL;
 
 	if (rec != NULL) {
 		memcpy(data, &rec->data,
@@ -806,6 +1622,149 @@ int __connman_stats_get(struct connman_service *service,
 	return 0;
 }
 
+struct stats_query {
+	int64_t start;
+	int64_t end;
+	unsigned int interval;
+	struct connman_stats_bucket *buckets;
+	struct stats_record last[2];
+	connman_bool_t valid[2];
+};
+
+static uint64_t query_delta(uint64_t cur, uint64_t last)
+{
+	/* The counters have been reset in between */
+	if (cur < last)
+		return cur;
+
+	return cur - last;
+}
+
+/*
+ * The records hold the counter values, so the traffic between two
+ * records of the same kind goes to the bucket of the later one.
+ */
+static void query_add(struct stats_query *query,
+				const struct stats_record *rec)
+{
+	int index = rec->roaming == TRUE ? 1 : 0;
+	const struct connman_stats_data *last = &query->last[index].data;
+	const struct connman_stats_data *cur = &rec->data;
+	struct connman_stats_bucket *bucket;
+	struct connman_stats_data *sum;
+
+	if (query->valid[index] == TRUE && rec->ts >= query->start &&
+						rec->ts < query->end) {
+		bucket = &query->buckets[(rec->ts - query->start) /
+							query->interval];
+		sum = index == 1 ? &bucket->roaming : &bucket->home;
+
+		sum->rx_packets += query_delta(cur->rx_packets,
+							last->rx_packets);
+		sum->tx_packets += query_delta(cur->tx_packets,
+							last->tx_packets);
+		sum->rx_bytes += query_delta(cur->rx_bytes, last->rx_bytes);
+		sum->tx_bytes += query_delta(cur->tx_bytes, last->tx_bytes);
+		sum->rx_errors += query_delta(cur->rx_errors,
+							last->rx_errors);
+		sum->tx_errors += query_delta(cur->tx_errors,
+							last->tx_errors);
+		sum->rx_dropped += query_delta(cur->rx_dropped,
+							last->rx_dropped);
+		sum->tx_dropped += query_delta(cur->tx_dropped,
+							last->tx_dropped);
+		sum->time += query_delta(cur->time, last->time);
+	}
+
+	memcpy(&query->last[index], rec, sizeof(struct stats_record));
+	query->valid[index] = TRUE;
+}
+
+static void query_file(struct stats_query *query, struct stats_file *file,
+						int64_t until)
+{
+	struct stats_iter iter;
+	struct stats_record *rec;
+
+	stats_iter_seek(&iter, file, query->start);
+
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (rec->ts >= until)
+			break;
+
+		query_add(query, rec);
+	}
+}
+
+int __connman_stats_query(struct connman_service *service,
+				time_t start, time_t end,
+				unsigned int interval,
+				struct connman_stats_bucket **buckets,
+				unsigned int *count)
+{
+	struct stats_file _history_file, *history_file;
+	struct stats_file *file;
+	struct stats_query query;
+	struct stats_block *block;
+	int64_t ring_ts;
+	unsigned int i, n;
+
+	file = g_hash_table_lookup(stats_hash, service);
+	if (file == NULL)
+		return -EEXIST;
+
+	if (interval == 0 || end <= start)
+		return -EINVAL;
+
+	n = (end - start + interval - 1) / interval;
+	if (n > STATS_QUERY_MAX_BUCKETS)
+		return -E2BIG;
+
+	memset(&query, 0, sizeof(struct stats_query));
+	query.start = start;
+	query.end = end;
+	query.interval = interval;
+
+	query.buckets = g_try_new0(struct connman_stats_bucket, n);
+	if (query.buckets == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++)
+		query.buckets[i].start = start + (time_t)i * interval;
+
+	block = get_block(file, get_hdr(file)->begin);
+	ring_ts = block->count > 0 ? block->first_ts : end;
+
+	/* Only the history knows about the time before the ring buffer */
+	history_file = &_history_file;
+	memset(history_file, 0, sizeof(struct stats_file));
+
+	if (start < ring_ts && stats_open_readonly(history_file,
+					file->history_name) == 0) {
+		query_file(&query, history_file, MIN(ring_ts, end));
+
+		munmap(history_file->addr, history_file->len);
+		TFR(close(history_file->fd));
+	}
+
+	query_file(&query, file, end);
+
+	for (i = 0; i < file->pending_count; i++) {
+		if (file->pending[i].ts >= end)
+			break;
+
+		query_add(&query, &file->pending[i]);
+	}
+
+	DBG("service %p start %ld end %ld interval %u buckets %u", service,
+			(long)start, (long)end, interval, n);
+
+	*buckets = query.buckets;
+	*count = n;
+
+	return 0;
+}
+
 int __connman_stats_init(void)
 {
 	DBG("");
@@ -820,6 +1779,11 @@ void __connman_stats_cleanup(void)
 {
 	DBG("");
 
+	if (flush_timeout > 0) {
+		g_source_remove(flush_timeout);
+		flush_timeout = 0;
+	}
+
 	g_hash_table_destroy(stats_hash);
 	stats_hash = NULL;
 }
@@ -24,7 +24,12 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <dirent.h>
 
@@ -34,10 +39,94 @@
 
 #define SETTINGS	"settings"
 #define DEFAULT		"default.profile"
+#define CATALOG		"services.index"
+
+#define CATALOG_MAGIC	0x53434331
+#define CATALOG_VERSION	1
 
 #define MODE		(S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | \
 			S_IXGRP | S_IROTH | S_IXOTH)
 
+#ifdef TEMP_FAILURE_RETRY
+#define TFR TEMP_FAILURE_RETRY
+#else
+#define TFR
+#endif
+
+/*
+ * Service settings are written behind. A save only serializes the
+ * key file and marks the service dirty, a later save of the same
+ * service replaces the pending data. The first dirty service arms
+ * a timer of StorageWriteDelay milliseconds, when it fires all
+ * dirty services are handed to a worker thread which writes them
+ * to disk. Only one flush is in flight at a time, so the writes of
+ * a service reach the disk in order. Loads see the pending data
+ * before the file, and the cleanup writes whatever is left.
+ *
+ * Without __connman_storage_init(), or with a delay of 0, services
+ * are written synchronously as before.
+ */
+struct storage_write {
+	char *service_id;
+	gchar *data;
+	gsize length;
+	int err;
+};
+
+struct storage_flush_job {
+	GHashTable *writes;
+	gchar *catalog;
+	gsize catalog_length;
+	int catalog_err;
+	pthread_t thread;
+	int notify_fd;
+	guint watch;
+};
+
+/*
+ * The catalog keeps the frequently queried settings of all saved
+ * services in memory, so that listing the services or looking for
+ * favorite wifi networks does not parse every settings file. It is
+ * persisted to STORAGEDIR/services.index:
+ *
+ *	struct catalog_header
+ *	struct catalog_record[count], sorted by identifier
+ *	string pool of pool bytes, starting with an empty string
+ *
+ * Strings are referenced by their offset in the pool, offset 0 is
+ * an unset string. The index always describes the settings files
+ * on disk: it is unlinked before they are modified and written
+ * again once they are. A missing or broken index is rebuilt from
+ * the settings files on startup, as is one which does not list
+ * exactly the service directories found in STORAGEDIR. Edits of
+ * existing settings files done while the daemon is stopped must
+ * remove the index.
+ */
+struct catalog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t pool;
+};
+
+struct catalog_record {
+	uint32_t identifier;
+	uint32_t name;
+	uint32_t ssid;
+	uint32_t flags;
+	int32_t frequency;
+	int32_t modified_usec;
+	int64_t modified_sec;
+};
+
+static GHashTable *dirty_hash = NULL;
+static struct storage_flush_job *flush_job = NULL;
+static guint flush_timeout = 0;
+static unsigned int write_delay = 0;
+
+static GHashTable *catalog = NULL;
+static gboolean catalog_synced = FALSE;
+
 static GKeyFile *storage_load(const char *pathname)
 {
 	GKeyFile *keyfile = NULL;
@@ -58,26 +147,677 @@ static GKeyFile *storage_load(const char *pathname)
 	return keyfile;
 }
 
-static int storage_save(GKeyFile *keyfile, char *pathname)
+static int storage_write(const char *pathname, const gchar *data,
+							gsize length)
 {
-	gchar *data = NULL;
-	gsize length = 0;
 	GError *error = NULL;
-	int ret = 0;
-
-	data = g_key_file_to_data(keyfile, &length, NULL);
 
 	if (!g_file_set_contents(pathname, data, length, &error)) {
 		DBG("Failed to store information: %s", error->message);
 		g_error_free(error);
-		ret = -EIO;
+		return -EIO;
 	}
 
+	return 0;
+}
+
+static int storage_save(GKeyFile *keyfile, char *pathname)
+{
+	gchar *data = NULL;
+	gsize length = 0;
+	int ret;
+
+	data = g_key_file_to_data(keyfile, &length, NULL);
+
+	ret = storage_write(pathname, data, length);
+
 	g_free(data);
 
 	return ret;
 }
 
+/* Also runs on the flush worker thread */
+static int storage_write_service(const char *service_id,
+					const gchar *data, gsize length)
+{
+	int ret = 0;
+	gchar *pathname, *dirname;
+
+	dirname = g_strdup_printf("%s/%s", STORAGEDIR, service_id);
+	if(dirname == NULL)
+		return -ENOMEM;
+
+	/* If the dir doesn't exist, create it */
+	if (!g_file_test(dirname, G_FILE_TEST_IS_DIR)) {
+		if(mkdir(dirname, MODE) < 0) {
+			if (errno != EEXIST) {
+				ret = -errno;
+				g_free(dirname);
+				return ret;
+			}
+		}
+	}
+
+	pathname = g_strdup_printf("%s/%s", dirname, SETTINGS);
+
+	g_free(dirname);
+
+	ret = storage_write(pathname, data, length);
+
+	g_free(pathname);
+
+	return ret;
+}
+
+static void free_write(gpointer data)
+{
+	struct storage_write *entry = data;
+
+	g_free(entry->service_id);
+	g_free(entry->data);
+	g_free(entry);
+}
+
+static GHashTable *new_write_table(void)
+{
+	return g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, free_write);
+}
+
+static void free_catalog_entry(gpointer data)
+{
+	struct connman_storage_service *entry = data;
+
+	g_free(entry->identifier);
+	g_free(entry->name);
+	g_free(entry->ssid);
+	g_free(entry);
+}
+
+static void catalog_entry_fill(struct connman_storage_service *entry,
+				GKeyFile *keyfile, const char *service_id)
+{
+	gchar *str;
+
+	entry->name = g_key_file_get_string(keyfile, service_id,
+							"Name", NULL);
+	entry->ssid = g_key_file_get_string(keyfile, service_id,
+							"SSID", NULL);
+	entry->frequency = g_key_file_get_integer(keyfile, service_id,
+							"Frequency", NULL);
+
+	entry->flags = 0;
+
+	if (g_key_file_get_boolean(keyfile, service_id,
+					"Favorite", NULL) == TRUE)
+		entry->flags |= CONNMAN_STORAGE_FAVORITE;
+
+	if (g_key_file_get_boolean(keyfile, service_id,
+					"AutoConnect", NULL) == TRUE)
+		entry->flags |= CONNMAN_STORAGE_AUTOCONNECT;
+
+	if (g_key_file_get_boolean(keyfile, service_id,
+					"Hidden", NULL) == TRUE)
+		entry->flags |= CONNMAN_STORAGE_HIDDEN;
+
+	entry->modified.tv_sec = 0;
+	entry->modified.tv_usec = 0;
+
+	str = g_key_file_get_string(keyfile, service_id, "Modified", NULL);
+	if (str != NULL) {
+		g_time_val_from_iso8601(str, &entry->modified);
+		g_free(str);
+	}
+}
+
+static void catalog_update(GKeyFile *keyfile, const char *service_id)
+{
+	struct connman_storage_service *entry;
+
+	if (catalog == NULL)
+		return;
+
+	entry = g_try_new0(struct connman_storage_service, 1);
+	if (entry == NULL) {
+		/* Better no entry than a stale one */
+		g_hash_table_remove(catalog, service_id);
+		return;
+	}
+
+	entry->identifier = g_strdup(service_id);
+	catalog_entry_fill(entry, keyfile, service_id);
+
+	g_hash_table_replace(catalog, entry->identifier, entry);
+}
+
+static gint compare_identifier(gconstpointer a, gconstpointer b)
+{
+	const struct connman_storage_service *entry_a = *(void **) a;
+	const struct connman_storage_service *entry_b = *(void **) b;
+
+	return strcmp(entry_a->identifier, entry_b->identifier);
+}
+
+static uint32_t catalog_pool_add(GString *pool, const char *str)
+{
+	uint32_t offset;
+
+	if (str == NULL || str[0] == '\0')
+		return 0;
+
+	offset = pool->len;
+	g_string_append_len(pool, str, strlen(str) + 1);
+
+	return offset;
+}
+
+static gchar *catalog_serialize(gsize *length)
+{
+	struct catalog_header header;
+	struct catalog_record *records;
+	GPtrArray *entries;
+	GHashTableIter iter;
+	gpointer value;
+	GString *pool, *data;
+	unsigned int i;
+
+	entries = g_ptr_array_sized_new(g_hash_table_size(catalog));
+
+	g_hash_table_iter_init(&iter, catalog);
+	while (g_hash_table_iter_next(&iter, NULL, &value) == TRUE)
+		g_ptr_array_add(entries, value);
+
+	g_ptr_array_sort(entries, compare_identifier);
+
+	records = g_new0(struct catalog_record, entries->len);
+
+	pool = g_string_sized_new(entries->len * 32 + 1);
+	g_string_append_c(pool, '\0');
+
+	for (i = 0; i < entries->len; i++) {
+		struct connman_storage_service *entry = entries->pdata[i];
+
+		records[i].identifier = catalog_pool_add(pool,
+							entry->identifier);
+		records[i].name = catalog_pool_add(pool, entry->name);
+		records[i].ssid = catalog_pool_add(pool, entry->ssid);
+		records[i].flags = entry->flags;
+		records[i].frequency = entry->frequency;
+		records[i].modified_sec = entry->modified.tv_sec;
+		records[i].modified_usec = entry->modified.tv_usec;
+	}
+
+	header.magic = CATALOG_MAGIC;
+	header.version = CATALOG_VERSION;
+	header.count = entries->len;
+	header.pool = pool->len;
+
+	data = g_string_sized_new(sizeof(header) +
+			entries->len * sizeof(*records) + pool->len);
+	g_string_append_len(data, (gchar *) &header, sizeof(header));
+	g_string_append_len(data, (gchar *) records,
+				entries->len * sizeof(*records));
+	g_string_append_len(data, pool->str, pool->len);
+
+	g_string_free(pool, TRUE);
+	g_free(records);
+	g_ptr_array_free(entries, TRUE);
+
+	*length = data->len;
+
+	return g_string_free(data, FALSE);
+}
+
+static int catalog_save(void)
+{
+	gchar *pathname, *data;
+	gsize length;
+	int err;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, CATALOG);
+	data = catalog_serialize(&length);
+
+	err = storage_write(pathname, data, length);
+	if (err == 0)
+		catalog_synced = TRUE;
+
+	g_free(data);
+	g_free(pathname);
+
+	return err;
+}
+
+/* Also runs on the flush worker thread */
+static void catalog_unlink(void)
+{
+	gchar *pathname;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, CATALOG);
+	unlink(pathname);
+	g_free(pathname);
+}
+
+/* Called before the settings files are changed synchronously */
+static void catalog_invalidate(void)
+{
+	if (catalog_synced == FALSE)
+		return;
+
+	catalog_unlink();
+	catalog_synced = FALSE;
+}
+
+static const char *catalog_string(const char *pool, uint32_t size,
+							uint32_t offset)
+{
+	if (offset == 0 || offset >= size)
+		return NULL;
+
+	return pool + offset;
+}
+
+static int catalog_parse(const char *data, size_t length)
+{
+	const struct catalog_header *header = (const void *) data;
+	const struct catalog_record *records;
+	const char *pool, *identifier;
+	uint32_t i;
+
+	if (length < sizeof(*header))
+		return -EINVAL;
+
+	if (header->magic != CATALOG_MAGIC ||
+			header->version != CATALOG_VERSION)
+		return -EINVAL;
+
+	if (header->count > (length - sizeof(*header)) / sizeof(*records) ||
+			header->pool == 0 ||
+			length != sizeof(*header) +
+				header->count * sizeof(*records) +
+				header->pool)
+		return -EINVAL;
+
+	records = (const void *) (data + sizeof(*header));
+	pool = (const char *) (records + header->count);
+
+	if (pool[header->pool - 1] != '\0')
+		return -EINVAL;
+
+	for (i = 0; i < header->count; i++) {
+		struct connman_storage_service *entry;
+
+		identifier = catalog_string(pool, header->pool,
+						records[i].identifier);
+		if (identifier == NULL)
+			return -EINVAL;
+
+		entry = g_try_new0(struct connman_storage_service, 1);
+		if (entry == NULL)
+			return -ENOMEM;
+
+		entry->identifier = g_strdup(identifier);
+		entry->name = g_strdup(catalog_string(pool, header->pool,
+							records[i].name));
+		entry->ssid = g_strdup(catalog_string(pool, header->pool,
+							records[i].ssid));
+		entry->flags = records[i].flags;
+		entry->frequency = records[i].frequency;
+		entry->modified.tv_sec = records[i].modified_sec;
+		entry->modified.tv_usec = records[i].modified_usec;
+
+		g_hash_table_replace(catalog, entry->identifier, entry);
+	}
+
+	return 0;
+}
+
+static int catalog_load(void)
+{
+	gchar *pathname;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, CATALOG);
+	fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	g_free(pathname);
+
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		TFR(close(fd));
+		return err;
+	}
+
+	if (st.st_size == 0) {
+		TFR(close(fd));
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	TFR(close(fd));
+
+	if (map == MAP_FAILED)
+		return -errno;
+
+	err = catalog_parse(map, st.st_size);
+
+	munmap(map, st.st_size);
+
+	if (err < 0)
+		g_hash_table_remove_all(catalog);
+
+	return err;
+}
+
+static gchar **scan_services(void);
+
+static void catalog_rebuild(void)
+{
+	GKeyFile *keyfile;
+	gchar **services;
+	int i;
+
+	services = scan_services();
+
+	for (i = 0; services && services[i]; i++) {
+		keyfile = connman_storage_load_service(services[i]);
+		if (keyfile == NULL)
+			continue;
+
+		catalog_update(keyfile, services[i]);
+
+		g_key_file_free(keyfile);
+	}
+
+	g_strfreev(services);
+
+	connman_info("Rebuilt service catalog of %d services",
+					g_hash_table_size(catalog));
+}
+
+/*
+ * Service directories may have been added or removed while the daemon
+ * was stopped, so a loaded catalog is only trusted if it names exactly
+ * the services found on disk.
+ */
+static gboolean catalog_matches_disk(void)
+{
+	gchar **services;
+	gboolean match = TRUE;
+	unsigned int count = 0;
+	int i;
+
+	services = scan_services();
+
+	for (i = 0; services && services[i]; i++) {
+		if (g_hash_table_lookup(catalog, services[i]) == NULL) {
+			DBG("service %s missing from the catalog",
+								services[i]);
+			match = FALSE;
+			break;
+		}
+
+		count++;
+	}
+
+	if (match == TRUE && count != g_hash_table_size(catalog)) {
+		DBG("catalog lists %d services, found %u",
+					g_hash_table_size(catalog), count);
+		match = FALSE;
+	}
+
+	g_strfreev(services);
+
+	return match;
+}
+
+static void *flush_thread(void *data)
+{
+	struct storage_flush_job *job = data;
+	GHashTableIter iter;
+	gpointer value;
+	char done = 1;
+
+	/* The index must not outlive the files it describes */
+	if (job->catalog != NULL)
+		catalog_unlink();
+
+	g_hash_table_iter_init(&iter, job->writes);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value) == TRUE) {
+		struct storage_write *entry = value;
+
+		entry->err = storage_write_service(entry->service_id,
+						entry->data, entry->length);
+	}
+
+	if (job->catalog != NULL) {
+		gchar *pathname;
+
+		pathname = g_strdup_printf("%s/%s", STORAGEDIR, CATALOG);
+		job->catalog_err = storage_write(pathname, job->catalog,
+							job->catalog_length);
+		g_free(pathname);
+	}
+
+	if (TFR(write(job->notify_fd, &done, 1)) < 0)
+		connman_error("storage flush notify error %s",
+							strerror(errno));
+
+	return NULL;
+}
+
+static void flush_job_finish(struct storage_flush_job *job)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	pthread_join(job->thread, NULL);
+	TFR(close(job->notify_fd));
+
+	DBG("flushed %d services", g_hash_table_size(job->writes));
+
+	g_hash_table_iter_init(&iter, job->writes);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value) == TRUE) {
+		struct storage_write *entry = value;
+
+		if (entry->err < 0)
+			connman_error("Failed to save service %s: %s",
+					entry->service_id,
+					strerror(-entry->err));
+	}
+
+	if (job->catalog != NULL)
+		catalog_synced = job->catalog_err == 0 ? TRUE : FALSE;
+
+	flush_job = NULL;
+
+	g_hash_table_destroy(job->writes);
+	g_free(job->catalog);
+	g_free(job);
+}
+
+/* Waits for the flush in flight, if any */
+static void flush_job_wait(void)
+{
+	guint watch;
+
+	if (flush_job == NULL)
+		return;
+
+	watch = flush_job->watch;
+
+	/* Joins the worker before its notification pipe is closed */
+	flush_job_finish(flush_job);
+	g_source_remove(watch);
+}
+
+static gboolean flush_done(GIOChannel *channel,
+				GIOCondition cond, gpointer user_data)
+{
+	struct storage_flush_job *job = user_data;
+
+	flush_job_finish(job);
+
+	return FALSE;
+}
+
+static void flush_dirty_sync(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (g_hash_table_size(dirty_hash) > 0)
+		catalog_invalidate();
+
+	g_hash_table_iter_init(&iter, dirty_hash);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value) == TRUE) {
+		struct storage_write *entry = value;
+		int err;
+
+		err = storage_write_service(entry->service_id,
+						entry->data, entry->length);
+		if (err < 0)
+			connman_error("Failed to save service %s: %s",
+					entry->service_id, strerror(-err));
+	}
+
+	g_hash_table_remove_all(dirty_hash);
+}
+
+static gboolean flush_timeout_cb(gpointer user_data)
+{
+	struct storage_flush_job *job;
+	GIOChannel *channel;
+	int fd[2];
+
+	/* Try again after the next window */
+	if (flush_job != NULL)
+		return TRUE;
+
+	flush_timeout = 0;
+
+	if (g_hash_table_size(dirty_hash) == 0)
+		return FALSE;
+
+	job = g_try_new0(struct storage_flush_job, 1);
+	if (job == NULL)
+		goto sync;
+
+	if (pipe2(fd, O_CLOEXEC) < 0) {
+		g_free(job);
+		goto sync;
+	}
+
+	job->writes = dirty_hash;
+	job->notify_fd = fd[1];
+
+	/* The catalog already matches the disk after this flush */
+	if (catalog != NULL)
+		job->catalog = catalog_serialize(&job->catalog_length);
+
+	if (pthread_create(&job->thread, NULL, flush_thread, job) != 0) {
+		connman_warn("Failed to start storage flush thread");
+
+		TFR(close(fd[0]));
+		TFR(close(fd[1]));
+		g_free(job->catalog);
+		g_free(job);
+		goto sync;
+	}
+
+	catalog_synced = FALSE;
+
+	dirty_hash = new_write_table();
+	flush_job = job;
+
+	channel = g_io_channel_unix_new(fd[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+
+	job->watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+							flush_done, job);
+
+	g_io_channel_unref(channel);
+
+	return FALSE;
+
+sync:
+	flush_dirty_sync();
+
+	return FALSE;
+}
+
+static int storage_mark_dirty(GKeyFile *keyfile, const char *service_id)
+{
+	struct storage_write *entry;
+
+	entry = g_try_new0(struct storage_write, 1);
+	if (entry == NULL)
+		return -ENOMEM;
+
+	entry->service_id = g_strdup(service_id);
+	entry->data = g_key_file_to_data(keyfile, &entry->length, NULL);
+
+	/* Replaces, and so coalesces, an earlier pending save */
+	g_hash_table_replace(dirty_hash, entry->service_id, entry);
+
+	if (flush_timeout == 0)
+		flush_timeout = g_timeout_add(write_delay,
+						flush_timeout_cb, NULL);
+
+	return 0;
+}
+
+/* The most recent data of a service which is not yet on disk */
+static struct storage_write *storage_lookup_pending(const char *service_id)
+{
+	struct storage_write *entry;
+
+	if (dirty_hash == NULL)
+		return NULL;
+
+	entry = g_hash_table_lookup(dirty_hash, service_id);
+	if (entry != NULL)
+		return entry;
+
+	if (flush_job != NULL)
+		return g_hash_table_lookup(flush_job->writes, service_id);
+
+	return NULL;
+}
+
+static GKeyFile *storage_load_pending(const char *service_id)
+{
+	struct storage_write *entry;
+	GKeyFile *keyfile;
+	GError *error = NULL;
+
+	entry = storage_lookup_pending(service_id);
+	if (entry == NULL)
+		return NULL;
+
+	DBG("Loading pending %s", service_id);
+
+	keyfile = g_key_file_new();
+
+	if (!g_key_file_load_from_data(keyfile, entry->data, entry->length,
+							0, &error)) {
+		DBG("Unable to load pending %s: %s", service_id,
+							error->message);
+		g_clear_error(&error);
+
+		g_key_file_free(keyfile);
+		keyfile = NULL;
+	}
+
+	return keyfile;
+}
+
 static void storage_delete(const char *pathname)
 {
 	DBG("file path %s", pathname);
@@ -152,6 +892,10 @@ GKeyFile *__connman_storage_open_service(const char *service_id)
 	gchar *pathname;
 	GKeyFile *keyfile = NULL;
 
+	keyfile = storage_load_pending(service_id);
+	if (keyfile != NULL)
+		return keyfile;
+
 	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id, SETTINGS);
 	if(pathname == NULL)
 		return NULL;
@@ -169,7 +913,7 @@ GKeyFile *__connman_storage_open_service(const char *service_id)
 	return keyfile;
 }
 
-gchar **connman_storage_get_services(void)
+static gchar **scan_services(void)
 {
 	struct dirent *d;
 	gchar *str;
@@ -226,11 +970,104 @@ gchar **connman_storage_get_services(void)
 	return services;
 }
 
+gchar **connman_storage_get_services(void)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gchar **services;
+	int i = 0;
+
+	if (catalog == NULL)
+		return scan_services();
+
+	if (g_hash_table_size(catalog) == 0)
+		return NULL;
+
+	services = g_new0(gchar *, g_hash_table_size(catalog) + 1);
+
+	g_hash_table_iter_init(&iter, catalog);
+	while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE)
+		services[i++] = g_strdup(key);
+
+	return services;
+}
+
+static void foreach_scanned(const char *prefix, unsigned int flags,
+			connman_storage_service_cb_t func, void *user_data)
+{
+	struct connman_storage_service entry;
+	GKeyFile *keyfile;
+	gchar **services;
+	int i;
+
+	services = scan_services();
+
+	for (i = 0; services && services[i]; i++) {
+		if (prefix != NULL &&
+				g_str_has_prefix(services[i], prefix) == FALSE)
+			continue;
+
+		keyfile = connman_storage_load_service(services[i]);
+		if (keyfile == NULL)
+			continue;
+
+		entry.identifier = services[i];
+		catalog_entry_fill(&entry, keyfile, services[i]);
+
+		if ((entry.flags & flags) == flags)
+			func(&entry, user_data);
+
+		g_free(entry.name);
+		g_free(entry.ssid);
+		g_key_file_free(keyfile);
+	}
+
+	g_strfreev(services);
+}
+
+/*
+ * Calls func for every saved service whose identifier starts with
+ * prefix, if not NULL, and which has all of the given flags. The
+ * callback must not save or remove services.
+ */
+int connman_storage_foreach_service(const char *prefix, unsigned int flags,
+			connman_storage_service_cb_t func, void *user_data)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (func == NULL)
+		return -EINVAL;
+
+	if (catalog == NULL) {
+		foreach_scanned(prefix, flags, func, user_data);
+		return 0;
+	}
+
+	g_hash_table_iter_init(&iter, catalog);
+	while (g_hash_table_iter_next(&iter, NULL, &value) == TRUE) {
+		struct connman_storage_service *entry = value;
+
+		if (prefix != NULL && g_str_has_prefix(entry->identifier,
+							prefix) == FALSE)
+			continue;
+
+		if ((entry->flags & flags) == flags)
+			func(entry, user_data);
+	}
+
+	return 0;
+}
+
 GKeyFile *connman_storage_load_service(const char *service_id)
 {
 	gchar *pathname;
 	GKeyFile *keyfile = NULL;
 
+	keyfile = storage_load_pending(service_id);
+	if (keyfile != NULL)
+		return keyfile;
+
 	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id, SETTINGS);
 	if(pathname == NULL)
 		return NULL;
@@ -241,32 +1078,29 @@ GKeyFile *connman_storage_load_service(const char *service_id)
 	return keyfile;
 }
 
+/*
+ * Without a write delay the settings are written right away and write
+ * errors are returned. Otherwise the save is queued and only errors
+ * in queueing it are returned.
+ */
 int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 {
-	int ret = 0;
-	gchar *pathname, *dirname;
+	gchar *data;
+	gsize length = 0;
+	int ret;
 
-	dirname = g_strdup_printf("%s/%s", STORAGEDIR, service_id);
-	if(dirname == NULL)
-		return -ENOMEM;
+	catalog_update(keyfile, service_id);
 
-	/* If the dir doesn't exist, create it */
-	if (!g_file_test(dirname, G_FILE_TEST_IS_DIR)) {
-		if(mkdir(dirname, MODE) < 0) {
-			if (errno != EEXIST) {
-				g_free(dirname);
-				return -errno;
-			}
-		}
-	}
+	if (dirty_hash != NULL)
+		return storage_mark_dirty(keyfile, service_id);
 
-	pathname = g_strdup_printf("%s/%s", dirname, SETTINGS);
+	catalog_invalidate();
 
-	g_free(dirname);
+	data = g_key_file_to_data(keyfile, &length, NULL);
 
-	ret = storage_save(keyfile, pathname);
+	ret = storage_write_service(service_id, data, length);
 
-	g_free(pathname);
+	g_free(data);
 
 	return ret;
 }
@@ -315,6 +1149,20 @@ gboolean __connman_storage_remove_service(const char *service_id)
 {
 	gboolean removed;
 
+	/*
+	 * A pending save must not bring the settings back, nor may
+	 * an index written by the flush in flight list the service.
+	 */
+	if (dirty_hash != NULL) {
+		g_hash_table_remove(dirty_hash, service_id);
+		flush_job_wait();
+	}
+
+	if (catalog != NULL) {
+		g_hash_table_remove(catalog, service_id);
+		catalog_invalidate();
+	}
+
 	/* Remove service configuration file */
 	removed = remove_file(service_id, SETTINGS);
 	if (removed == FALSE)
@@ -460,3 +1308,66 @@ gchar **__connman_storage_get_providers(void)
 
 	return providers;
 }
+
+int __connman_storage_init(unsigned int delay)
+{
+	int err;
+
+	DBG("delay %u", delay);
+
+	catalog = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, free_catalog_entry);
+
+	err = catalog_load();
+	if (err == 0 && catalog_matches_disk() == FALSE) {
+		g_hash_table_remove_all(catalog);
+		err = -ESTALE;
+	}
+
+	if (err == 0) {
+		catalog_synced = TRUE;
+	} else {
+		DBG("No usable service catalog: %s", strerror(-err));
+
+		catalog_rebuild();
+		catalog_save();
+	}
+
+	write_delay = delay;
+	if (write_delay == 0)
+		return 0;
+
+	dirty_hash = new_write_table();
+
+	return 0;
+}
+
+void __connman_storage_cleanup(void)
+{
+	DBG("");
+
+	if (dirty_hash != NULL) {
+		if (flush_timeout != 0) {
+			g_source_remove(flush_timeout);
+			flush_timeout = 0;
+		}
+
+		flush_job_wait();
+
+		/* Nothing may be lost on shutdown */
+		flush_dirty_sync();
+
+		g_hash_table_destroy(dirty_hash);
+		dirty_hash = NULL;
+	}
+
+	if (catalog == NULL)
+		return;
+
+	if (catalog_synced == FALSE)
+		catalog_save();
+
+	g_hash_table_destroy(catalog);
+	catalog = NULL;
+	catalog_synced = FALSE;
+}
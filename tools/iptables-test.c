@@ -85,11 +85,29 @@ struct error_target {
 	char error[IPT_TABLE_MAXNAMELEN];
 };
 
+struct connman_iptables_chain;
+
 struct connman_iptables_entry {
 	int offset;
 	int builtin;
 
 	struct ipt_entry *entry;
+
+	struct connman_iptables_chain *chain;
+};
+
+/*
+ * Chains are indexed by name and kept in table order, so finding where
+ * a chain starts and ends does not walk the entry list.
+ */
+struct connman_iptables_chain {
+	char *name;
+
+	/* Link of the first entry of the chain in table->entries */
+	GList *head;
+
+	/* Our own link in table->chains */
+	GList *link;
 };
 
 struct connman_iptables {
@@ -106,6 +124,19 @@ struct connman_iptables {
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 
 	GList *entries;
+	GList *last;
+
+	GHashTable *chain_hash;
+	GList *chains;
+
+	/* Entry key -> list of entry links, for rule lookups */
+	GHashTable *rule_hash;
+
+	/* Entries jumping to a user defined chain */
+	GHashTable *jumps;
+
+	/* Entry offsets are recomputed only when somebody needs them */
+	gboolean offsets_dirty;
 };
 
 
@@ -191,71 +222,169 @@ static gboolean is_jump(struct connman_iptables_entry *e)
 	return false;
 }
 
-static gboolean is_chain(struct connman_iptables *table,
-				struct connman_iptables_entry *e)
+static const char *entry_chain_name(struct connman_iptables_entry *e)
 {
-	struct ipt_entry *entry;
 	struct xt_entry_target *target;
 
-	entry = e->entry;
 	if (e->builtin >= 0)
-		return TRUE;
+		return hooknames[e->builtin];
 
-	target = ipt_get_target(entry);
+	target = ipt_get_target(e->entry);
 	if (!strcmp(target->u.user.name, IPT_ERROR_TARGET))
-		return TRUE;
+		return (char *)target->data;
 
-	return FALSE;
+	return NULL;
 }
 
-static GList *find_chain_head(struct connman_iptables *table,
-				char *chain_name)
+static struct connman_iptables_chain *chain_new(
+				struct connman_iptables *table,
+				const char *name, GList *head)
 {
-	GList *list;
-	struct connman_iptables_entry *head;
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
-	int builtin;
+	struct connman_iptables_chain *chain, *prev_chain = NULL;
+	struct connman_iptables_entry *prev;
 
-	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-		entry = head->entry;
+	chain = g_try_new0(struct connman_iptables_chain, 1);
+	if (chain == NULL)
+		return NULL;
 
-		/* Buit-in chain */
-		builtin = head->builtin;
-		if (builtin >= 0 && !strcmp(hooknames[builtin], chain_name))
-			break;
+	chain->name = g_strdup(name);
+	chain->head = head;
 
-		/* User defined chain */
-		target = ipt_get_target(entry);
-		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET) &&
-		    !strcmp((char *)target->data, chain_name))
-			break;
+	if (head->prev != NULL) {
+		prev = head->prev->data;
+		prev_chain = prev->chain;
 	}
 
-	return list;
+	if (prev_chain != NULL) {
+		table->chains = g_list_insert_before(table->chains,
+						prev_chain->link->next, chain);
+		chain->link = prev_chain->link->next;
+	} else {
+		table->chains = g_list_prepend(table->chains, chain);
+		chain->link = table->chains;
+	}
+
+	if (g_hash_table_lookup(table->chain_hash, name) == NULL)
+		g_hash_table_insert(table->chain_hash, chain->name, chain);
+
+	return chain;
 }
 
-static GList *find_chain_tail(struct connman_iptables *table,
+static void chain_free(struct connman_iptables *table,
+				struct connman_iptables_chain *chain)
+{
+	if (g_hash_table_lookup(table->chain_hash, chain->name) == chain)
+		g_hash_table_remove(table->chain_hash, chain->name);
+
+	table->chains = g_list_delete_link(table->chains, chain->link);
+
+	g_free(chain->name);
+	g_free(chain);
+}
+
+static GList *find_chain_head(struct connman_iptables *table,
 				char *chain_name)
 {
-	GList *chain_head, *list;
-	struct connman_iptables_entry *tail;
+	struct connman_iptables_chain *chain;
 
-	chain_head = find_chain_head(table, chain_name);
-	if (chain_head == NULL)
+	chain = g_hash_table_lookup(table->chain_hash, chain_name);
+	if (chain == NULL)
 		return NULL;
 
-	/* Then we look for the next chain */
-	for (list = chain_head->next; list; list = list->next) {
-		tail = list->data;
+	return chain->head;
+}
+
+static GList *find_chain_tail(struct connman_iptables *table,
+				char *chain_name)
+{
+	struct connman_iptables_chain *chain, *next;
 
-		if (is_chain(table, tail))
-			return list;
+	chain = g_hash_table_lookup(table->chain_hash, chain_name);
+	if (chain == NULL)
+		return NULL;
+
+	/* The tail is where the next chain starts */
+	if (chain->link->next != NULL) {
+		next = chain->link->next->data;
+		return next->head;
 	}
 
 	/* Nothing found, we return the table end */
-	return g_list_last(table->entries);
+	return table->last;
+}
+
+/*
+ * Moves the hook entry and underflow of every builtin chain that
+ * comes after chain by delta bytes.
+ */
+static void update_later_hooks(struct connman_iptables *table,
+				struct connman_iptables_chain *chain,
+				int delta)
+{
+	struct connman_iptables_chain *next;
+	struct connman_iptables_entry *e;
+	GList *list;
+
+	for (list = chain->link->next; list; list = list->next) {
+		next = list->data;
+		e = next->head->data;
+
+		if (e->builtin < 0)
+			continue;
+
+		table->hook_entry[e->builtin] += delta;
+		table->underflow[e->builtin] += delta;
+	}
+}
+
+static guint entry_key(struct ipt_entry *entry)
+{
+	const unsigned char *p = (const unsigned char *)&entry->ip;
+	guint key = 5381;
+	size_t i;
+
+	/* Covers what is_same_ipt_entry() compares */
+	for (i = 0; i < sizeof(struct ipt_ip); i++)
+		key = (key << 5) + key + p[i];
+
+	key = (key << 5) + key + entry->target_offset;
+	key = (key << 5) + key + entry->next_offset;
+
+	return key;
+}
+
+static void index_entry(struct connman_iptables *table, GList *link)
+{
+	struct connman_iptables_entry *e = link->data;
+	gpointer key = GUINT_TO_POINTER(entry_key(e->entry));
+	GList *bucket;
+
+	bucket = g_hash_table_lookup(table->rule_hash, key);
+	if (bucket != NULL)
+		g_list_insert(bucket, link, 1);
+	else
+		g_hash_table_insert(table->rule_hash, key,
+					g_list_prepend(NULL, link));
+
+	if (is_jump(e))
+		g_hash_table_insert(table->jumps, e, e);
+}
+
+static void unindex_entry(struct connman_iptables *table, GList *link)
+{
+	struct connman_iptables_entry *e = link->data;
+	gpointer key = GUINT_TO_POINTER(entry_key(e->entry));
+	GList *bucket, *update;
+
+	bucket = g_hash_table_lookup(table->rule_hash, key);
+	update = g_list_remove(bucket, link);
+
+	if (update == NULL)
+		g_hash_table_remove(table->rule_hash, key);
+	else if (update != bucket)
+		g_hash_table_insert(table->rule_hash, key, update);
+
+	g_hash_table_remove(table->jumps, e);
 }
 
 static void update_offsets(struct connman_iptables *table)
@@ -278,6 +407,14 @@ static void update_offsets(struct connman_iptables *table)
 		entry->offset = prev_entry->offset +
 					prev_entry->entry->next_offset;
 	}
+
+	table->offsets_dirty = FALSE;
+}
+
+static void refresh_offsets(struct connman_iptables *table)
+{
+	if (table->offsets_dirty == TRUE)
+		update_offsets(table);
 }
 
 static void update_targets_reference(struct connman_iptables *table,
@@ -287,16 +424,21 @@ static void update_targets_reference(struct connman_iptables *table,
 {
 	struct connman_iptables_entry *tmp;
 	struct xt_standard_target *t;
-	GList *list;
+	GHashTableIter iter;
+	gpointer key;
 	int offset;
 
+	if (g_hash_table_size(table->jumps) == 0)
+		return;
+
+	refresh_offsets(table);
+
 	offset = modified_entry->entry->next_offset;
 
-	for (list = table->entries; list; list = list->next) {
-		tmp = list->data;
+	g_hash_table_iter_init(&iter, table->jumps);
 
-		if (!is_jump(tmp))
-			continue;
+	while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE) {
+		tmp = key;
 
 		t = (struct xt_standard_target *)ipt_get_target(tmp->entry);
 
@@ -315,6 +457,9 @@ static int connman_add_entry(struct connman_iptables *table,
 					int builtin)
 {
 	struct connman_iptables_entry *e, *entry_before;
+	struct connman_iptables_chain *chain;
+	const char *chain_name;
+	GList *link;
 
 	if (table == NULL)
 		return -1;
@@ -326,15 +471,54 @@ static int connman_add_entry(struct connman_iptables *table,
 	e->entry = entry;
 	e->builtin = builtin;
 
-	table->entries = g_list_insert_before(table->entries, before, e);
+	if (before == NULL) {
+		/* Appending only happens while loading, keep it O(1) */
+		e->offset = table->size;
+
+		link = g_list_append(NULL, e);
+		if (table->last == NULL)
+			table->entries = link;
+		else {
+			table->last->next = link;
+			link->prev = table->last;
+		}
+		table->last = link;
+	} else {
+		/*
+		 * Reference updates need the offsets from before the
+		 * insertion.
+		 */
+		if (g_hash_table_size(table->jumps) > 0 || is_jump(e))
+			refresh_offsets(table);
+
+		table->entries = g_list_insert_before(table->entries,
+								before, e);
+		link = before->prev;
+	}
+
 	table->num_entries++;
 	table->size += entry->next_offset;
 
-	if (before == NULL) {
-		e->offset = table->size - entry->next_offset;
-
+	chain_name = entry_chain_name(e);
+	if (chain_name != NULL) {
+		chain = g_hash_table_lookup(table->chain_hash, chain_name);
+		if (chain != NULL && builtin >= 0)
+			/* The entry becomes the head of a builtin chain */
+			chain->head = link;
+		else
+			chain = chain_new(table, chain_name, link);
+	} else if (link->prev != NULL) {
+		entry_before = link->prev->data;
+		chain = entry_before->chain;
+	} else
+		chain = NULL;
+
+	e->chain = chain;
+
+	index_entry(table, link);
+
+	if (before == NULL)
 		return 0;
-	}
 
 	entry_before = before->data;
 
@@ -344,23 +528,33 @@ static int connman_add_entry(struct connman_iptables *table,
 	 */
 	update_targets_reference(table, entry_before, e, FALSE);
 
-	update_offsets(table);
+	table->offsets_dirty = TRUE;
 
 	return 0;
 }
 
-static int remove_table_entry(struct connman_iptables *table,
-					struct connman_iptables_entry *entry)
+static int remove_table_entry(struct connman_iptables *table, GList *link)
 {
+	struct connman_iptables_entry *entry = link->data;
 	int removed = 0;
 
 	table->num_entries--;
 	table->size -= entry->entry->next_offset;
 	removed = entry->entry->next_offset;
 
-	g_free(entry->entry);
+	if (entry->chain != NULL && entry->chain->head == link)
+		entry->chain->head = link->next;
 
-	table->entries = g_list_remove(table->entries, entry);
+	unindex_entry(table, link);
+
+	if (table->last == link)
+		table->last = link->prev;
+
+	table->entries = g_list_delete_link(table->entries, link);
+	table->offsets_dirty = TRUE;
+
+	g_free(entry->entry);
+	g_free(entry);
 
 	return removed;
 }
@@ -370,6 +564,7 @@ static int connman_iptables_flush_chain(struct connman_iptables *table,
 {
 	GList *chain_head, *chain_tail, *list, *next;
 	struct connman_iptables_entry *entry;
+	struct connman_iptables_chain *chain;
 	int builtin, removed = 0;
 
 	chain_head = find_chain_head(table, name);
@@ -391,38 +586,26 @@ static int connman_iptables_flush_chain(struct connman_iptables *table,
 	if (list == chain_tail->prev)
 		return 0;
 
+	chain = entry->chain;
+
 	while (list != chain_tail->prev) {
-		entry = list->data;
 		next = g_list_next(list);
 
-		removed += remove_table_entry(table, entry);
+		removed += remove_table_entry(table, list);
 
 		list = next;
 	}
 
 	if (builtin >= 0) {
-		struct connman_iptables_entry *e;
-
 		entry = list->data;
 
 		entry->builtin = builtin;
 
 		table->underflow[builtin] -= removed;
 
-		for (list = chain_tail; list; list = list->next) {
-			e = list->data;
-
-			builtin = e->builtin;
-			if (builtin < 0)
-				continue;
-
-			table->hook_entry[builtin] -= removed;
-			table->underflow[builtin] -= removed;
-		}
+		update_later_hooks(table, chain, -removed);
 	}
 
-	update_offsets(table);
-
 	return 0;
 }
 
@@ -431,6 +614,7 @@ static int connman_iptables_delete_chain(struct connman_iptables *table,
 {
 	GList *chain_head, *chain_tail;
 	struct connman_iptables_entry *entry;
+	struct connman_iptables_chain *chain;
 
 	chain_head = find_chain_head(table, name);
 	if (chain_head == NULL)
@@ -450,12 +634,13 @@ static int connman_iptables_delete_chain(struct connman_iptables *table,
 	if (chain_head->next != chain_tail->prev)
 		return -EINVAL;
 
-	remove_table_entry(table, entry);
+	chain = entry->chain;
 
-	entry = chain_tail->prev->data;
-	remove_table_entry(table, entry);
+	remove_table_entry(table, chain_head);
+	remove_table_entry(table, chain_tail->prev);
 
-	update_offsets(table);
+	if (chain != NULL)
+		chain_free(table, chain);
 
 	return 0;
 }
@@ -470,7 +655,7 @@ static int connman_iptables_add_chain(struct connman_iptables *table,
 	struct ipt_standard_target *standard;
 	u_int16_t entry_head_size, entry_return_size;
 
-	last = g_list_last(table->entries);
+	last = table->last;
 
 	/*
 	 * An empty chain is composed of:
@@ -580,8 +765,7 @@ static struct ipt_entry *new_rule(struct ipt_ip *ip,
 static void update_hooks(struct connman_iptables *table, GList *chain_head,
 				struct ipt_entry *entry)
 {
-	GList *list;
-	struct connman_iptables_entry *head, *e;
+	struct connman_iptables_entry *head;
 	int builtin;
 
 	if (chain_head == NULL)
@@ -595,38 +779,23 @@ static void update_hooks(struct connman_iptables *table, GList *chain_head,
 
 	table->underflow[builtin] += entry->next_offset;
 
-	for (list = chain_head->next; list; list = list->next) {
-		e = list->data;
-
-		builtin = e->builtin;
-		if (builtin < 0)
-			continue;
-
-		table->hook_entry[builtin] += entry->next_offset;
-		table->underflow[builtin] += entry->next_offset;
-	}
+	update_later_hooks(table, head->chain, entry->next_offset);
 }
 
-static struct ipt_entry *prepare_rule_inclusion(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				int *builtin, struct xtables_rule_match *xt_rm)
+static int prepare_rule_inclusion(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *new_entry,
+				int *builtin)
 {
 	GList *chain_tail, *chain_head;
-	struct ipt_entry *new_entry;
 	struct connman_iptables_entry *head;
 
 	chain_head = find_chain_head(table, chain_name);
 	if (chain_head == NULL)
-		return NULL;
+		return -EINVAL;
 
 	chain_tail = find_chain_tail(table, chain_name);
 	if (chain_tail == NULL)
-		return NULL;
-
-	new_entry = new_rule(ip, target_name, xt_t, xt_rm);
-	if (new_entry == NULL)
-		return NULL;
+		return -EINVAL;
 
 	update_hooks(table, chain_head, new_entry);
 
@@ -643,26 +812,27 @@ static struct ipt_entry *prepare_rule_inclusion(struct connman_iptables *table,
 		head->builtin = -1;
 	}
 
-	return new_entry;
+	return 0;
 }
 
-static int connman_iptables_append_rule(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				struct xtables_rule_match *xt_rm)
+/* Takes ownership of new_entry */
+static int connman_iptables_append_entry(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *new_entry)
 {
 	GList *chain_tail;
-	struct ipt_entry *new_entry;
 	int builtin = -1, ret;
 
 	chain_tail = find_chain_tail(table, chain_name);
-	if (chain_tail == NULL)
+	if (chain_tail == NULL) {
+		g_free(new_entry);
 		return -EINVAL;
+	}
 
-	new_entry = prepare_rule_inclusion(table, ip, chain_name,
-					target_name, xt_t, &builtin, xt_rm);
-	if (new_entry == NULL)
-		return -EINVAL;
+	ret = prepare_rule_inclusion(table, chain_name, new_entry, &builtin);
+	if (ret < 0) {
+		g_free(new_entry);
+		return ret;
+	}
 
 	ret = connman_add_entry(table, new_entry, chain_tail->prev, builtin);
 	if (ret < 0)
@@ -671,23 +841,24 @@ static int connman_iptables_append_rule(struct connman_iptables *table,
 	return ret;
 }
 
-static int connman_iptables_insert_rule(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				struct xtables_rule_match *xt_rm)
+/* Takes ownership of new_entry */
+static int connman_iptables_insert_entry(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *new_entry)
 {
 	GList *chain_head;
-	struct ipt_entry *new_entry;
 	int builtin = -1, ret;
 
 	chain_head = find_chain_head(table, chain_name);
-	if (chain_head == NULL)
+	if (chain_head == NULL) {
+		g_free(new_entry);
 		return -EINVAL;
+	}
 
-	new_entry = prepare_rule_inclusion(table, ip, chain_name,
-					target_name, xt_t, &builtin, xt_rm);
-	if (new_entry == NULL)
-		return -EINVAL;
+	ret = prepare_rule_inclusion(table, chain_name, new_entry, &builtin);
+	if (ret < 0) {
+		g_free(new_entry);
+		return ret;
+	}
 
 	if (builtin == -1)
 		chain_head = chain_head->next;
@@ -699,6 +870,34 @@ static int connman_iptables_insert_rule(struct connman_iptables *table,
 	return ret;
 }
 
+static int connman_iptables_append_rule(struct connman_iptables *table,
+				struct ipt_ip *ip, char *chain_name,
+				char *target_name, struct xtables_target *xt_t,
+				struct xtables_rule_match *xt_rm)
+{
+	struct ipt_entry *new_entry;
+
+	new_entry = new_rule(ip, target_name, xt_t, xt_rm);
+	if (new_entry == NULL)
+		return -EINVAL;
+
+	return connman_iptables_append_entry(table, chain_name, new_entry);
+}
+
+static int connman_iptables_insert_rule(struct connman_iptables *table,
+				struct ipt_ip *ip, char *chain_name,
+				char *target_name, struct xtables_target *xt_t,
+				struct xtables_rule_match *xt_rm)
+{
+	struct ipt_entry *new_entry;
+
+	new_entry = new_rule(ip, target_name, xt_t, xt_rm);
+	if (new_entry == NULL)
+		return -EINVAL;
+
+	return connman_iptables_insert_entry(table, chain_name, new_entry);
+}
+
 static gboolean is_same_ipt_entry(struct ipt_entry *i_e1,
 					struct ipt_entry *i_e2)
 {
@@ -758,18 +957,33 @@ static gboolean is_same_match(struct xt_entry_match *xt_e_m1,
 	return TRUE;
 }
 
-static GList *find_existing_rule(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				struct xtables_match *xt_m,
-				struct xtables_rule_match *xt_rm)
+static gboolean is_same_entry(struct ipt_entry *entry_test,
+				struct ipt_entry *tmp_e,
+				gboolean match_target, gboolean match_match)
 {
-	GList *chain_tail, *chain_head, *list;
-	struct xt_entry_target *xt_e_t = NULL;
-	struct xt_entry_match *xt_e_m = NULL;
-	struct connman_iptables_entry *entry;
-	struct ipt_entry *entry_test;
-	int builtin;
+	if (is_same_ipt_entry(entry_test, tmp_e) == FALSE)
+		return FALSE;
+
+	if (match_target == TRUE &&
+			!is_same_target(ipt_get_target(tmp_e),
+					ipt_get_target(entry_test)))
+		return FALSE;
+
+	if (match_match == TRUE &&
+			!is_same_match((struct xt_entry_match *)tmp_e->elems,
+				(struct xt_entry_match *)entry_test->elems))
+		return FALSE;
+
+	return TRUE;
+}
+
+static GList *find_existing_entry(struct connman_iptables *table,
+				char *chain_name, struct ipt_entry *entry_test,
+				gboolean match_target, gboolean match_match)
+{
+	GList *chain_tail, *chain_head, *list, *found;
+	struct connman_iptables_entry *entry, *tmp;
+	gpointer key;
 
 	chain_head = find_chain_head(table, chain_name);
 	if (chain_head == NULL)
@@ -779,73 +993,78 @@ static GList *find_existing_rule(struct connman_iptables *table,
 	if (chain_tail == NULL)
 		return NULL;
 
-	if (!xt_t && !xt_m)
-		return NULL;
-
-	entry_test = new_rule(ip, target_name, xt_t, xt_rm);
-	if (entry_test == NULL)
-		return NULL;
-
-	if (xt_t != NULL)
-		xt_e_t = ipt_get_target(entry_test);
-	if (xt_m != NULL)
-		xt_e_m = (struct xt_entry_match *)entry_test->elems;
-
 	entry = chain_head->data;
-	builtin = entry->builtin;
 
-	if (builtin >= 0)
-		list = chain_head;
-	else
-		list = chain_head->next;
+	/* Only entries that look alike share a bucket */
+	key = GUINT_TO_POINTER(entry_key(entry_test));
 
-	for (; list != chain_tail->prev; list = list->next) {
-		struct connman_iptables_entry *tmp;
-		struct ipt_entry *tmp_e;
+	found = NULL;
+	for (list = g_hash_table_lookup(table->rule_hash, key); list;
+							list = list->next) {
+		GList *link = list->data;
 
-		tmp = list->data;
-		tmp_e = tmp->entry;
+		tmp = link->data;
 
-		if (is_same_ipt_entry(entry_test, tmp_e) == FALSE)
+		if (tmp->chain != entry->chain)
 			continue;
 
-		if (xt_t != NULL) {
-			struct xt_entry_target *tmp_xt_e_t;
+		/* Neither the chain policy nor a user chain head is a rule */
+		if (link == chain_tail->prev)
+			continue;
 
-			tmp_xt_e_t = ipt_get_target(tmp_e);
+		if (link == chain_head && entry->builtin < 0)
+			continue;
 
-			if (!is_same_target(tmp_xt_e_t, xt_e_t))
-				continue;
-		}
+		if (is_same_entry(entry_test, tmp->entry, match_target,
+						match_match) == FALSE)
+			continue;
 
-		if (xt_m != NULL) {
-			struct xt_entry_match *tmp_xt_e_m;
+		/* Duplicates resolve to the first one in the chain */
+		if (found != NULL) {
+			struct connman_iptables_entry *first = found->data;
 
-			tmp_xt_e_m = (struct xt_entry_match *)tmp_e->elems;
+			refresh_offsets(table);
 
-			if (!is_same_match(tmp_xt_e_m, xt_e_m))
+			if (first->offset < tmp->offset)
 				continue;
 		}
 
-		break;
+		found = link;
 	}
 
-	g_free(entry_test);
-
-	if (list != chain_tail->prev)
-		return list;
-
-	return NULL;
+	return found;
 }
 
-static int connman_iptables_delete_rule(struct connman_iptables *table,
+static GList *find_existing_rule(struct connman_iptables *table,
 				struct ipt_ip *ip, char *chain_name,
 				char *target_name, struct xtables_target *xt_t,
 				struct xtables_match *xt_m,
 				struct xtables_rule_match *xt_rm)
+{
+	struct ipt_entry *entry_test;
+	GList *list;
+
+	if (!xt_t && !xt_m)
+		return NULL;
+
+	entry_test = new_rule(ip, target_name, xt_t, xt_rm);
+	if (entry_test == NULL)
+		return NULL;
+
+	list = find_existing_entry(table, chain_name, entry_test,
+					xt_t != NULL, xt_m != NULL);
+
+	g_free(entry_test);
+
+	return list;
+}
+
+static int connman_iptables_delete_entry(struct connman_iptables *table,
+					char *chain_name, GList *list)
 {
 	struct connman_iptables_entry *entry;
-	GList *chain_tail, *list;
+	struct connman_iptables_chain *chain;
+	GList *chain_tail, *next;
 	int builtin, removed;
 
 	removed = 0;
@@ -854,51 +1073,52 @@ static int connman_iptables_delete_rule(struct connman_iptables *table,
 	if (chain_tail == NULL)
 		return -EINVAL;
 
-	list = find_existing_rule(table, ip, chain_name, target_name,
-							xt_t, xt_m, xt_rm);
-	if (list == NULL)
-		return -EINVAL;
-
 	entry = list->data;
-
 	if (entry == NULL)
 		return -EINVAL;
 
 	builtin = entry->builtin;
+	chain = entry->chain;
+	next = list->next;
 
 	/* We have deleted a rule,
 	 * all references should be bumped accordingly */
-	if (list->next != NULL)
-		update_targets_reference(table, list->next->data,
+	if (next != NULL)
+		update_targets_reference(table, next->data,
 						list->data, TRUE);
 
-	removed += remove_table_entry(table, entry);
+	removed += remove_table_entry(table, list);
 
 	if (builtin >= 0) {
-		list = list->next;
-		if (list) {
-			entry = list->data;
+		if (next) {
+			entry = next->data;
 			entry->builtin = builtin;
 		}
 
 		table->underflow[builtin] -= removed;
-		for (list = chain_tail; list; list = list->next) {
-			entry = list->data;
-
-			builtin = entry->builtin;
-			if (builtin < 0)
-				continue;
 
-			table->hook_entry[builtin] -= removed;
-			table->underflow[builtin] -= removed;
-		}
+		update_later_hooks(table, chain, -removed);
 	}
 
-	update_offsets(table);
-
 	return 0;
 }
 
+static int connman_iptables_delete_rule(struct connman_iptables *table,
+				struct ipt_ip *ip, char *chain_name,
+				char *target_name, struct xtables_target *xt_t,
+				struct xtables_match *xt_m,
+				struct xtables_rule_match *xt_rm)
+{
+	GList *list;
+
+	list = find_existing_rule(table, ip, chain_name, target_name,
+							xt_t, xt_m, xt_rm);
+	if (list == NULL)
+		return -EINVAL;
+
+	return connman_iptables_delete_entry(table, chain_name, list);
+}
+
 static int connman_iptables_compare_rule(struct connman_iptables *table,
 				struct ipt_ip *ip, char *chain_name,
 				char *target_name, struct xtables_target *xt_t,
@@ -1173,10 +1393,16 @@ static int connman_iptables_replace(struct connman_iptables *table,
 			 sizeof(*r) + r->size);
 }
 
+static void free_bucket(gpointer key, gpointer value, gpointer user_data)
+{
+	g_list_free(value);
+}
+
 static void connman_iptables_cleanup(struct connman_iptables *table)
 {
 	GList *list;
 	struct connman_iptables_entry *entry;
+	struct connman_iptables_chain *chain;
 
 	close(table->ipt_sock);
 
@@ -1184,8 +1410,31 @@ static void connman_iptables_cleanup(struct connman_iptables *table)
 		entry = list->data;
 
 		g_free(entry->entry);
+		g_free(entry);
+	}
+
+	g_list_free(table->entries);
+
+	for (list = table->chains; list; list = list->next) {
+		chain = list->data;
+
+		g_free(chain->name);
+		g_free(chain);
 	}
 
+	g_list_free(table->chains);
+
+	if (table->chain_hash != NULL)
+		g_hash_table_destroy(table->chain_hash);
+
+	if (table->rule_hash != NULL) {
+		g_hash_table_foreach(table->rule_hash, free_bucket, NULL);
+		g_hash_table_destroy(table->rule_hash);
+	}
+
+	if (table->jumps != NULL)
+		g_hash_table_destroy(table->jumps);
+
 	g_free(table->info);
 	g_free(table->blob_entries);
 	g_free(table);
@@ -1248,6 +1497,10 @@ static struct connman_iptables *connman_iptables_init(const char *table_name)
 	if (table->info == NULL)
 		goto err;
 
+	table->chain_hash = g_hash_table_new(g_str_hash, g_str_equal);
+	table->rule_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+	table->jumps = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	table->ipt_sock = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
 	if (table->ipt_sock < 0)
 		goto err;
@@ -1309,6 +1562,7 @@ static struct option connman_iptables_opts[] = {
 	{.name = "out-interface", .has_arg = 1, .val = 'o'},
 	{.name = "source",        .has_arg = 1, .val = 's'},
 	{.name = "table",         .has_arg = 1, .val = 't'},
+	{.name = "benchmark",     .has_arg = 1, .val = 'B'},
 	{NULL},
 };
 
@@ -1370,6 +1624,8 @@ static struct xtables_target *prepare_target(struct connman_iptables *table,
 				return NULL;
 			}
 
+			refresh_offsets(table);
+
 			target_rule = chain_head->next->data;
 			target->verdict = target_rule->offset;
 		}
@@ -1508,6 +1764,136 @@ static struct connman_iptables *pre_load_table(char *table_name,
 	return connman_iptables_init(table_name);
 }
 
+static void report_rate(const char *what, int count, gdouble elapsed)
+{
+	printf("%-24s %6d rules in %8.3f ms", what, count, elapsed * 1000);
+
+	if (elapsed > 0)
+		printf(" (%.0f rules/s)", count / elapsed);
+
+	printf("\n");
+}
+
+static void set_benchmark_destination(struct ipt_ip *ip, int i)
+{
+	/* Keep the rules distinct, like per client rules would be */
+	ip->dst.s_addr = htonl(0x0a000000 + i);
+	ip->dmsk.s_addr = 0xffffffff;
+}
+
+/*
+ * Compares building every rule from its parsed description, which is
+ * what a command string costs (target lookup, target blob and entry
+ * construction per rule), with copying an entry compiled once, then
+ * looks up and deletes every rule again. Each run starts from a freshly
+ * loaded table and nothing is committed.
+ */
+static void benchmark_rules(char *table_name, struct ipt_ip *ip,
+			char *chain, char *target_name,
+			struct xtables_target *xt_t,
+			struct xtables_rule_match *xt_rm, int count)
+{
+	struct connman_iptables *table;
+	struct xt_entry_target *parsed;
+	struct ipt_entry *template, *entry;
+	struct ipt_ip rule_ip;
+	GTimer *timer;
+	GList *list;
+	int i, n;
+
+	template = new_rule(ip, target_name, xt_t, xt_rm);
+	if (template == NULL)
+		return;
+
+	timer = g_timer_new();
+
+	table = connman_iptables_init(table_name);
+	if (table == NULL)
+		goto done;
+
+	parsed = xt_t->t;
+	rule_ip = *ip;
+
+	g_timer_start(timer);
+	for (i = 0, n = 0; i < count; i++) {
+		if (prepare_target(table, target_name) == NULL)
+			break;
+
+		set_benchmark_destination(&rule_ip, i);
+
+		if (connman_iptables_append_rule(table, &rule_ip, chain,
+					target_name, xt_t, xt_rm) == 0)
+			n++;
+
+		g_free(xt_t->t);
+	}
+	g_timer_stop(timer);
+
+	xt_t->t = parsed;
+
+	report_rate("per-rule lookup:", n, g_timer_elapsed(timer, NULL));
+
+	connman_iptables_cleanup(table);
+
+	table = connman_iptables_init(table_name);
+	if (table == NULL)
+		goto done;
+
+	g_timer_start(timer);
+	for (i = 0, n = 0; i < count; i++) {
+		entry = g_memdup(template, template->next_offset);
+		set_benchmark_destination(&entry->ip, i);
+
+		if (connman_iptables_append_entry(table, chain, entry) == 0)
+			n++;
+	}
+	g_timer_stop(timer);
+
+	report_rate("compiled template:", n, g_timer_elapsed(timer, NULL));
+
+	g_timer_start(timer);
+	for (i = 0, n = 0; i < count; i++) {
+		set_benchmark_destination(&template->ip, i);
+
+		list = find_existing_entry(table, chain, template,
+							TRUE, FALSE);
+		if (list == NULL)
+			continue;
+
+		if (connman_iptables_delete_entry(table, chain, list) == 0)
+			n++;
+	}
+	g_timer_stop(timer);
+
+	report_rate("lookup and delete:", n, g_timer_elapsed(timer, NULL));
+
+	connman_iptables_cleanup(table);
+
+done:
+	g_timer_destroy(timer);
+	g_free(template);
+}
+
+/* Doubles the rule count up to count to show how edits scale */
+static void benchmark_scaling(char *table_name, struct ipt_ip *ip,
+			char *chain, char *target_name,
+			struct xtables_target *xt_t,
+			struct xtables_rule_match *xt_rm, int count)
+{
+	int n;
+
+	n = count / 8;
+	if (n == 0)
+		n = count;
+
+	for (; n <= count; n *= 2) {
+		printf("%d rules\n", n);
+
+		benchmark_rules(table_name, ip, chain, target_name,
+						xt_t, xt_rm, n);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct connman_iptables *table;
@@ -1517,7 +1903,7 @@ int main(int argc, char *argv[])
 	struct ipt_ip ip;
 	char *table_name, *chain, *new_chain, *match_name, *target_name;
 	char *delete_chain, *flush_chain, *policy;
-	int c, in_len, out_len;
+	int c, in_len, out_len, benchmark;
 	gboolean dump, invert, delete, insert, delete_rule, compare_rule;
 
 	xtables_init_all(&connman_iptables_globals, NFPROTO_IPV4);
@@ -1528,6 +1914,7 @@ int main(int argc, char *argv[])
 	insert = FALSE;
 	delete_rule = FALSE;
 	compare_rule = FALSE;
+	benchmark = 0;
 	chain = new_chain = match_name = target_name = NULL;
 	delete_chain = flush_chain = policy = table_name = NULL;
 	memset(&ip, 0, sizeof(struct ipt_ip));
@@ -1540,7 +1927,7 @@ int main(int argc, char *argv[])
 	opterr = 0;
 
 	while ((c = getopt_long(argc, argv,
-				"-A:C:D:F:I:L::N:P:X:d:i:j:m:o:s:t:",
+				"-A:B:C:D:F:I:L::N:P:X:d:i:j:m:o:s:t:",
 				connman_iptables_globals.opts, NULL)) != -1) {
 		switch (c) {
 		case 'A':
@@ -1551,6 +1938,10 @@ int main(int argc, char *argv[])
 			chain = optarg;
 			break;
 
+		case 'B':
+			benchmark = atoi(optarg);
+			break;
+
 		case 'C':
 			/* It is either -A, -C, -D or -I at once */
 			if (chain)
@@ -1817,6 +2208,16 @@ int main(int argc, char *argv[])
 	}
 
 	if (chain) {
+		if (benchmark > 0) {
+			if (xt_t == NULL)
+				goto out;
+
+			benchmark_scaling(table_name, &ip, chain, target_name,
+						xt_t, xt_rm, benchmark);
+
+			goto out;
+		}
+
 		if (policy != NULL) {
 			printf("Changing policy of %s to %s\n", chain, policy);
 
@@ -30,6 +30,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #include <sys/time.h>
 #include <time.h>
@@ -46,21 +48,69 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#ifndef STATS_MAX_FILE_SIZE
+#define STATS_MAX_FILE_SIZE (16 * 8 * 128)
+#endif
+
+#define MAGIC		0xFA01B916
+#define MAGIC_V1	0xFA00B916
+
+#define STATS_BLOCK_SIZE	4096
+#define STATS_RECORD_MAX	(1 + 10 * 10)
+
+#define STATS_HAS_HOME		0x01
+#define STATS_HAS_ROAMING	0x02
+
+#define STATS_RECORD_ROAMING	0x01
+
+#define STATS_QUERY_INTERVAL	3600
+#define STATS_QUERY_MAX_LEN	(7 * 24 * 3600)
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
+struct stats_record {
+	int64_t ts;
+	uint32_t roaming;
+	uint32_t reserved;
+	struct connman_stats_data data;
+};
+
 struct stats_file_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t begin;
+	uint32_t end;
+	uint32_t flags;
+	uint32_t reserved;
+	struct stats_record home;
+	struct stats_record roaming;
+};
+
+struct stats_block {
+	int64_t first_ts;
+	int64_t last_ts;
+	uint16_t used;
+	uint16_t count;
+	uint32_t reserved;
+	uint8_t data[0];
+};
+
+struct stats_codec {
+	int64_t ts;
+	struct connman_stats_data last[2];
+};
+
+struct stats_file_header_v1 {
 	unsigned int magic;
 	unsigned int begin;
 	unsigned int end;
@@ -68,10 +118,20 @@ struct stats_file_header {
 	unsigned int roaming;
 };
 
-struct stats_record {
+struct stats_record_v1 {
 	time_t ts;
 	unsigned int roaming;
-	struct connman_stats_data data;
+	struct {
+		unsigned int rx_packets;
+		unsigned int tx_packets;
+		unsigned int rx_bytes;
+		unsigned int tx_bytes;
+		unsigned int rx_errors;
+		unsigned int tx_errors;
+		unsigned int rx_dropped;
+		unsigned int tx_dropped;
+		unsigned int time;
+	} data;
 };
 
 struct stats_file {
@@ -79,22 +139,35 @@ struct stats_file {
 	char *name;
 	char *addr;
 	size_t len;
-	size_t max_len;
 
 	/* cached values */
-	int max_nr;
-	int nr;
-	struct stats_record *first;
-	struct stats_record *last;
-	struct stats_record *home_first;
-	struct stats_record *roaming_first;
+	unsigned int blocks;
+	struct stats_codec codec;
 };
 
 struct stats_iter {
 	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
+	unsigned int block;
+	unsigned int offset;
+	unsigned int count;
+	struct stats_codec codec;
+	struct stats_record rec;
+};
+
+struct stats_bucket {
+	int64_t start;
+	struct connman_stats_data home;
+	struct connman_stats_data roaming;
+};
+
+struct stats_query {
+	int64_t start;
+	int64_t end;
+	unsigned int interval;
+	struct stats_bucket *buckets;
+	struct stats_record last[2];
+	gboolean valid[2];
+	unsigned int decoded;
 };
 
 static gint option_create = 0;
@@ -104,6 +177,8 @@ static gboolean option_summary = FALSE;
 static char *option_info_file_name = NULL;
 static time_t option_start_ts = -1;
 static char *option_last_file_name = NULL;
+static gint option_benchmark = 0;
+static gint option_query = 0;
 
 static gboolean parse_start_ts(const char *key, const char *value,
 					gpointer user_data, GError **error)
@@ -134,6 +209,12 @@ static GOptionEntry options[] = {
 			"(example 2010-11-05T23:00:12Z)", "TS"},
 	{ "last", 'l', 0, G_OPTION_ARG_FILENAME, &option_last_file_name,
 			  "Start values from last .data file" },
+	{ "benchmark", 'b', 0, G_OPTION_ARG_INT, &option_benchmark,
+			"Compare record density and append cost of the "
+			"old and the new file format with NR entries", "NR" },
+	{ "query", 'q', 0, G_OPTION_ARG_INT, &option_query,
+			"Measure the latency of NR random range queries "
+			"with hourly buckets on the file", "NR" },
 	{ NULL },
 };
 
@@ -142,85 +223,246 @@ static struct stats_file_header *get_hdr(struct stats_file *file)
 	return (struct stats_file_header *)file->addr;
 }
 
-static struct stats_record *get_begin(struct stats_file *file)
+static size_t get_block_offset(unsigned int index)
 {
-	unsigned int off = get_hdr(file)->begin;
+	if (index == 0)
+		return sizeof(struct stats_file_header);
 
-	return (struct stats_record *)(file->addr + off);
+	return (size_t)index * STATS_BLOCK_SIZE;
 }
 
-static struct stats_record *get_end(struct stats_file *file)
+static unsigned int get_block_capacity(unsigned int index)
 {
-	unsigned int off = get_hdr(file)->end;
+	unsigned int capacity = STATS_BLOCK_SIZE - sizeof(struct stats_block);
+
+	if (index == 0)
+		capacity -= sizeof(struct stats_file_header);
 
-	return (struct stats_record *)(file->addr + off);
+	return capacity;
 }
 
-static struct stats_record *get_home(struct stats_file *file)
+static struct stats_block *get_block(struct stats_file *file,
+					unsigned int index)
 {
-	struct stats_file_header *hdr;
+	return (struct stats_block *)(file->addr + get_block_offset(index));
+}
 
-	hdr = get_hdr(file);
+static unsigned int get_next_block(struct stats_file *file,
+					unsigned int index)
+{
+	index++;
 
-	if (hdr->home == UINT_MAX)
-		return NULL;
+	if (index >= file->blocks)
+		index = 0;
 
-	return (struct stats_record *)(file->addr + hdr->home);
+	return index;
 }
 
-static struct stats_record *get_roaming(struct stats_file *file)
+static unsigned int put_varint(uint8_t *buf, uint64_t val)
 {
-	struct stats_file_header *hdr;
+	unsigned int len = 0;
 
-	hdr = get_hdr(file);
+	while (val >= 0x80) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
 
-	if (hdr->roaming == UINT_MAX)
-		return NULL;
+	buf[len++] = val;
 
-	return (struct stats_record *)(file->addr + hdr->roaming);
+	return len;
 }
 
-static void set_end(struct stats_file *file, struct stats_record *end)
+static int get_varint(const uint8_t *buf, unsigned int len,
+						uint64_t *val)
 {
-	struct stats_file_header *hdr;
+	unsigned int i, shift = 0;
 
-	hdr = get_hdr(file);
-	hdr->end = (char *)end - file->addr;
+	*val = 0;
+
+	for (i = 0; i < len && shift < 64; i++, shift += 7) {
+		*val |= (uint64_t)(buf[i] & 0x7f) << shift;
+
+		if ((buf[i] & 0x80) == 0)
+			return i + 1;
+	}
+
+	return -EINVAL;
 }
 
-static int get_index(struct stats_file *file, struct stats_record *rec)
+static unsigned int put_delta(uint8_t *buf, uint64_t cur, uint64_t last)
 {
-	return rec - file->first;
+	int64_t delta = (int64_t)(cur - last);
+	uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+
+	return put_varint(buf, zigzag);
 }
 
-static struct stats_record *get_next(struct stats_file *file,
-					struct stats_record *cur)
+static int get_delta(const uint8_t *buf, unsigned int len,
+					unsigned int *offset, uint64_t *val)
 {
-	cur++;
+	uint64_t raw;
+	int n;
+
+	n = get_varint(buf + *offset, len - *offset, &raw);
+	if (n < 0)
+		return n;
 
-	if (cur > file->last)
-		cur = file->first;
+	*offset += n;
+	*val += (uint64_t)((int64_t)(raw >> 1) ^ -(int64_t)(raw & 1));
 
-	return cur;
+	return 0;
+}
+
+static unsigned int encode_record(const struct stats_codec *codec,
+				const struct stats_record *rec, uint8_t *buf)
+{
+	const struct connman_stats_data *last;
+	const struct connman_stats_data *data = &rec->data;
+	unsigned int len = 0;
+
+	last = &codec->last[rec->roaming == TRUE ? 1 : 0];
+
+	buf[len++] = rec->roaming == TRUE ? STATS_RECORD_ROAMING : 0;
+
+	len += put_delta(buf + len, rec->ts, codec->ts);
+	len += put_delta(buf + len, data->time, last->time);
+	len += put_delta(buf + len, data->rx_packets, last->rx_packets);
+	len += put_delta(buf + len, data->tx_packets, last->tx_packets);
+	len += put_delta(buf + len, data->rx_bytes, last->rx_bytes);
+	len += put_delta(buf + len, data->tx_bytes, last->tx_bytes);
+	len += put_delta(buf + len, data->rx_errors, last->rx_errors);
+	len += put_delta(buf + len, data->tx_errors, last->tx_errors);
+	len += put_delta(buf + len, data->rx_dropped, last->rx_dropped);
+	len += put_delta(buf + len, data->tx_dropped, last->tx_dropped);
+
+	return len;
+}
+
+static void codec_update(struct stats_codec *codec,
+				const struct stats_record *rec)
+{
+	codec->ts = rec->ts;
+	memcpy(&codec->last[rec->roaming == TRUE ? 1 : 0], &rec->data,
+				sizeof(struct connman_stats_data));
+}
+
+static int decode_record(struct stats_codec *codec, const uint8_t *buf,
+				unsigned int len, struct stats_record *rec)
+{
+	struct connman_stats_data *data = &rec->data;
+	unsigned int offset = 1;
+	uint64_t ts, time;
+
+	if (len < 1 || (buf[0] & ~STATS_RECORD_ROAMING) != 0)
+		return -EINVAL;
+
+	memset(rec, 0, sizeof(struct stats_record));
+	rec->roaming = (buf[0] & STATS_RECORD_ROAMING) ? TRUE : FALSE;
+	memcpy(data, &codec->last[rec->roaming == TRUE ? 1 : 0],
+				sizeof(struct connman_stats_data));
+
+	ts = codec->ts;
+	time = data->time;
+
+	if (get_delta(buf, len, &offset, &ts) < 0 ||
+			get_delta(buf, len, &offset, &time) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_packets) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_packets) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_bytes) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_bytes) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_errors) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_errors) < 0 ||
+			get_delta(buf, len, &offset, &data->rx_dropped) < 0 ||
+			get_delta(buf, len, &offset, &data->tx_dropped) < 0)
+		return -EINVAL;
+
+	rec->ts = (int64_t)ts;
+	data->time = time;
+
+	codec_update(codec, rec);
+
+	return offset;
 }
 
-static struct stats_record *get_iterator_begin(struct stats_file *file)
+static void stats_iter_init(struct stats_iter *iter,
+				struct stats_file *file)
 {
-	return get_next(file, get_begin(file));
+	memset(iter, 0, sizeof(struct stats_iter));
+
+	iter->file = file;
+	iter->block = get_hdr(file)->begin;
+	iter->count = get_block(file, iter->block)->count;
 }
 
-static struct stats_record *get_iterator_end(struct stats_file *file)
+static struct stats_record *get_next_record(struct stats_iter *iter)
 {
-	return get_next(file, get_end(file));
+	struct stats_file *file = iter->file;
+	struct stats_block *block;
+	int n;
+
+	while (iter->count == 0) {
+		if (iter->block == get_hdr(file)->end)
+			return NULL;
+
+		iter->block = get_next_block(file, iter->block);
+		iter->offset = 0;
+		iter->count = get_block(file, iter->block)->count;
+		memset(&iter->codec, 0, sizeof(struct stats_codec));
+	}
+
+	block = get_block(file, iter->block);
+
+	n = decode_record(&iter->codec, block->data + iter->offset,
+				block->used - iter->offset, &iter->rec);
+	if (n < 0) {
+		fprintf(stderr, "corrupted block %u\n", iter->block);
+		return NULL;
+	}
+
+	iter->offset += n;
+	iter->count--;
+
+	return &iter->rec;
+}
+
+static void stats_iter_seek(struct stats_iter *iter,
+				struct stats_file *file, int64_t ts)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block;
+	unsigned int low, high, mid;
+
+	stats_iter_init(iter, file);
+
+	low = 0;
+	high = (hdr->end + file->blocks - hdr->begin) % file->blocks + 1;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		block = get_block(file, (hdr->begin + mid) % file->blocks);
+
+		if (block->count > 0 && block->first_ts <= ts)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < 2)
+		return;
+
+	iter->block = (hdr->begin + low - 2) % file->blocks;
+	iter->count = get_block(file, iter->block)->count;
 }
 
 static void stats_print_record(struct stats_record *rec)
 {
 	char buffer[30];
+	time_t ts = rec->ts;
 
-	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&rec->ts));
-	printf("%p %lld %s %01d %d %d %d %d %d %d %d %d %d\n",
-		rec, (long long int)rec->ts, buffer,
+	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&ts));
+	printf("%lld %s %01d %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %u\n",
+		(long long int)rec->ts, buffer,
 		rec->roaming,
 		rec->data.rx_packets,
 		rec->data.tx_packets,
@@ -233,234 +475,364 @@ static void stats_print_record(struct stats_record *rec)
 		rec->data.time);
 }
 
+static unsigned int stats_count_records(struct stats_file *file)
+{
+	unsigned int index, nr = 0;
+
+	index = get_hdr(file)->begin;
+
+	while (1) {
+		nr += get_block(file, index)->count;
+
+		if (index == get_hdr(file)->end)
+			break;
+
+		index = get_next_block(file, index);
+	}
+
+	return nr;
+}
+
 static void stats_hdr_info(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
-	struct stats_record *begin, *end, *home, *roaming;
-	unsigned int home_idx, roaming_idx;
+	unsigned int i, nr;
 
 	hdr = get_hdr(file);
-	begin = get_begin(file);
-	end = get_end(file);
-
-	home = get_home(file);
-	if (home == NULL)
-		home_idx = UINT_MAX;
-	else
-		home_idx = get_index(file, home);
-
-	roaming = get_roaming(file);
-	if (roaming == NULL)
-		roaming_idx = UINT_MAX;
-	else
-		roaming_idx = get_index(file, roaming);
+	nr = stats_count_records(file);
 
 	printf("Data Structure Sizes\n");
 	printf("  sizeof header   %zd/0x%02zx\n",
 		sizeof(struct stats_file_header),
 		sizeof(struct stats_file_header));
-	printf("  sizeof entry    %zd/0%02zx\n\n",
-		sizeof(struct stats_record),
-		sizeof(struct stats_record));
+	printf("  sizeof block    %zd/0x%02zx\n",
+		sizeof(struct stats_block),
+		sizeof(struct stats_block));
+	printf("  block size      %d\n\n", STATS_BLOCK_SIZE);
 
 	printf("File\n");
 	printf("  addr            %p\n",  file->addr);
 	printf("  len             %zd\n", file->len);
-
-	printf("  max nr entries  %d\n", file->max_nr);
-	printf("  nr entries      %d\n\n", file->nr);
+	printf("  blocks          %u\n", file->blocks);
+	printf("  nr entries      %u\n", nr);
+	if (nr > 0)
+		printf("  bytes per entry %.1f\n\n", (double)file->len / nr);
+	else
+		printf("\n");
 
 	printf("Header\n");
 	printf("  magic           0x%08x\n", hdr->magic);
-	printf("  begin           [%d] 0x%08x\n",
-		get_index(file, begin), hdr->begin);
-	printf("  end             [%d] 0x%08x\n",
-		get_index(file, end), hdr->end);
-	printf("  home            [%d] 0x%08x\n",
-		home_idx, hdr->home);
-	printf("  roaming         [%d] 0x%08x\n\n",
-		roaming_idx, hdr->roaming);
-
-
-	printf("Pointers\n");
-	printf("  hdr             %p\n", hdr);
-	printf("  begin           %p\n", begin);
-	printf("  end             %p\n", end);
-	printf("  home            %p\n", home);
-	printf("  romaing         %p\n", roaming);
-	printf("  first           %p\n", file->first);
-	printf("  last            %p\n\n", file->last);
+	printf("  begin           [%u]\n", hdr->begin);
+	printf("  end             [%u]\n", hdr->end);
+	printf("  home            %s\n",
+		hdr->flags & STATS_HAS_HOME ? "valid" : "invalid");
+	printf("  roaming         %s\n\n",
+		hdr->flags & STATS_HAS_ROAMING ? "valid" : "invalid");
+
+	printf("Blocks\n");
+	for (i = 0; i < file->blocks; i++) {
+		struct stats_block *block = get_block(file, i);
+
+		printf("  [%04u] used %4u/%u count %4u ts %lld..%lld\n", i,
+			block->used, get_block_capacity(i), block->count,
+			(long long int)block->first_ts,
+			(long long int)block->last_ts);
+	}
+	printf("\n");
 }
 
 static void stats_print_entries(struct stats_file *file)
 {
-	struct stats_record *it;
+	struct stats_iter iter;
+	struct stats_record *rec;
 	int i;
 
-	printf("[ idx] ptr ts ts rx_packets tx_packets rx_bytes "
+	printf("[ idx] block ts ts roaming rx_packets tx_packets rx_bytes "
 		"tx_bytes rx_errors tx_errors rx_dropped tx_dropped time\n\n");
 
-	for (i = 0, it = file->first; it <= file->last; it++, i++) {
-		printf("[%04d] ", i);
-		stats_print_record(it);
+	stats_iter_init(&iter, file);
+
+	for (i = 0; (rec = get_next_record(&iter)) != NULL; i++) {
+		printf("[%04d] %u ", i, iter.block);
+		stats_print_record(rec);
 	}
 }
 
 static void stats_print_rec_diff(struct stats_record *begin,
 					struct stats_record *end)
 {
-	printf("\trx_packets: %d\n",
-		end->data.rx_packets - begin->data.rx_packets);
-	printf("\ttx_packets: %d\n",
-		end->data.tx_packets - begin->data.tx_packets);
-	printf("\trx_bytes:   %d\n",
-		end->data.rx_bytes - begin->data.rx_bytes);
-	printf("\ttx_bytes:   %d\n",
-		end->data.tx_bytes - begin->data.tx_bytes);
-	printf("\trx_errors:  %d\n",
-		end->data.rx_errors - begin->data.rx_errors);
-	printf("\ttx_errors:  %d\n",
-		end->data.tx_errors - begin->data.tx_errors);
-	printf("\trx_dropped: %d\n",
-		end->data.rx_dropped - begin->data.rx_dropped);
-	printf("\ttx_dropped: %d\n",
-		end->data.tx_dropped - begin->data.tx_dropped);
+	printf("\trx_packets: %" PRId64 "\n",
+		(int64_t)(end->data.rx_packets - begin->data.rx_packets));
+	printf("\ttx_packets: %" PRId64 "\n",
+		(int64_t)(end->data.tx_packets - begin->data.tx_packets));
+	printf("\trx_bytes:   %" PRId64 "\n",
+		(int64_t)(end->data.rx_bytes - begin->data.rx_bytes));
+	printf("\ttx_bytes:   %" PRId64 "\n",
+		(int64_t)(end->data.tx_bytes - begin->data.tx_bytes));
+	printf("\trx_errors:  %" PRId64 "\n",
+		(int64_t)(end->data.rx_errors - begin->data.rx_errors));
+	printf("\ttx_errors:  %" PRId64 "\n",
+		(int64_t)(end->data.tx_errors - begin->data.tx_errors));
+	printf("\trx_dropped: %" PRId64 "\n",
+		(int64_t)(end->data.rx_dropped - begin->data.rx_dropped));
+	printf("\ttx_dropped: %" PRId64 "\n",
+		(int64_t)(end->data.tx_dropped - begin->data.tx_dropped));
 	printf("\ttime:       %d\n",
 		end->data.time - begin->data.time);
 }
 
 static void stats_print_diff(struct stats_file *file)
 {
-	struct stats_record *begin, *end;
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_record home_first, roaming_first, first;
+	gboolean have_home = FALSE, have_roaming = FALSE;
+	struct stats_iter iter;
+	struct stats_record *rec;
+
+	stats_iter_init(&iter, file);
+
+	rec = get_next_record(&iter);
+	if (rec == NULL)
+		return;
+
+	memcpy(&first, rec, sizeof(struct stats_record));
+
+	for (; rec != NULL; rec = get_next_record(&iter)) {
+		if (have_home == FALSE && rec->roaming == FALSE) {
+			memcpy(&home_first, rec, sizeof(struct stats_record));
+			have_home = TRUE;
+		}
+
+		if (have_roaming == FALSE && rec->roaming == TRUE) {
+			memcpy(&roaming_first, rec,
+					sizeof(struct stats_record));
+			have_roaming = TRUE;
+		}
 
-	begin = get_begin(file);
-	begin = get_next(file, begin);
-	end = get_end(file);
+		if (have_home == TRUE && have_roaming == TRUE)
+			break;
+	}
 
-	printf("\n(begin + 1)\n");
-	printf("\t[%04d] ", get_index(file, begin));
-	stats_print_record(begin);
-	printf("end\n");
-	printf("\t[%04d] ", get_index(file, end));
-	stats_print_record(end);
+	printf("\nbegin\n");
+	printf("\t");
+	stats_print_record(&first);
 
-	if (file->home_first != NULL && get_home(file) != NULL) {
+	if (have_home == TRUE && (hdr->flags & STATS_HAS_HOME)) {
 		printf("\nhome\n");
-		stats_print_rec_diff(file->home_first, get_home(file));
+		stats_print_rec_diff(&home_first, &hdr->home);
 	}
 
-	if (file->roaming_first != NULL && get_roaming(file) != NULL) {
-		printf("\roaming\n");
-		stats_print_rec_diff(file->roaming_first, get_roaming(file));
+	if (have_roaming == TRUE && (hdr->flags & STATS_HAS_ROAMING)) {
+		printf("\nroaming\n");
+		stats_print_rec_diff(&roaming_first, &hdr->roaming);
 	}
 }
 
-static void update_max_nr_entries(struct stats_file *file)
+static int stats_file_remap(struct stats_file *file, size_t size)
 {
-	file->max_nr = (file->len - sizeof(struct stats_file_header)) /
-		sizeof(struct stats_record);
-}
+	size_t new_size;
+	void *addr;
+	int err;
 
-static void update_nr_entries(struct stats_file *file)
-{
-	struct stats_record *begin, *end;
-	int nr;
+	new_size = (size + STATS_BLOCK_SIZE - 1) & ~(STATS_BLOCK_SIZE - 1);
 
-	begin = get_begin(file);
-	end = get_end(file);
+	err = ftruncate(file->fd, new_size);
+	if (err < 0) {
+		fprintf(stderr, "ftrunctate error %s for %s",
+				strerror(errno), file->name);
+		return -errno;
+	}
 
-	nr = get_index(file, end) - get_index(file, begin);
+	if (file->addr == NULL) {
+		addr = mmap(NULL, new_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, file->fd, 0);
+	} else {
+		addr = mremap(file->addr, file->len, new_size, MREMAP_MAYMOVE);
+	}
 
-	if (nr < 0)
-		nr += file->max_nr;
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "mmap error %s for %s\n",
+			strerror(errno), file->name);
+		return -errno;
+	}
 
-	file->nr = nr;
-}
+	file->addr = addr;
+	file->len = new_size;
+	file->blocks = new_size / STATS_BLOCK_SIZE;
 
-static void update_first(struct stats_file *file)
-{
-	file->first = (struct stats_record *)(file->addr +
-					sizeof(struct stats_file_header));
+	return 0;
 }
 
-static void update_last(struct stats_file *file)
+static void stats_file_reset(struct stats_file *file)
 {
-	struct stats_record *last;
+	struct stats_file_header *hdr;
 
-	last = file->first;
-	last += file->max_nr - 1;
+	memset(file->addr, 0, sizeof(struct stats_file_header) +
+					sizeof(struct stats_block));
 
-	file->last = last;
+	hdr = get_hdr(file);
+	hdr->magic = MAGIC;
+	hdr->block_size = STATS_BLOCK_SIZE;
+
+	memset(&file->codec, 0, sizeof(struct stats_codec));
 }
 
-static int stats_file_update_cache(struct stats_file *file)
+static gboolean stats_file_check(struct stats_file *file)
 {
-	struct stats_record *it, *end;
-
-	update_max_nr_entries(file);
-	update_nr_entries(file);
-	update_first(file);
-	update_last(file);
-	file->home_first = NULL;
-	file->roaming_first = NULL;
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_block *block;
+	struct stats_record rec;
+	unsigned int i, offset;
+	int n;
+
+	if (hdr->magic != MAGIC || hdr->block_size != STATS_BLOCK_SIZE ||
+			hdr->begin >= file->blocks ||
+			hdr->end >= file->blocks)
+		return FALSE;
 
-	end = get_iterator_end(file);
-	for (it = get_iterator_begin(file);
-			it != end;
-			it = get_next(file, it)) {
+	block = get_block(file, hdr->end);
+	if (block->used > get_block_capacity(hdr->end))
+		return FALSE;
 
-		if (file->home_first == NULL && it->roaming == 0)
-			file->home_first = it;
+	memset(&file->codec, 0, sizeof(struct stats_codec));
 
-		if (file->roaming_first == NULL && it->roaming == 1)
-			file->roaming_first = it;
+	for (i = 0, offset = 0; i < block->count; i++) {
+		n = decode_record(&file->codec, block->data + offset,
+						block->used - offset, &rec);
+		if (n < 0)
+			return FALSE;
 
-		if (file->home_first != NULL && file->roaming_first != NULL)
-			break;
+		offset += n;
 	}
 
-	return 0;
+	return TRUE;
 }
 
-static int stats_file_remap(struct stats_file *file, size_t size)
+/*
+ * The files created by this tool are not ring buffers, they grow
+ * until all records fit.
+ */
+static int append_record(struct stats_file *file,
+				struct stats_record *rec)
 {
-	size_t page_size, new_size;
-	void *addr;
+	struct stats_file_header *hdr;
+	struct stats_block *block;
+	uint8_t buf[STATS_RECORD_MAX];
+	unsigned int len;
 	int err;
 
-	page_size = sysconf(_SC_PAGESIZE);
-	new_size = (size + page_size - 1) & ~(page_size - 1);
+	len = encode_record(&file->codec, rec, buf);
 
-	err = ftruncate(file->fd, new_size);
-	if (err < 0) {
-		fprintf(stderr, "ftrunctate error %s for %s",
-				strerror(errno), file->name);
-		return -errno;
+	hdr = get_hdr(file);
+	block = get_block(file, hdr->end);
+
+	if (block->used + len > get_block_capacity(hdr->end)) {
+		if (hdr->end + 1 == file->blocks) {
+			err = stats_file_remap(file, file->len +
+						STATS_BLOCK_SIZE);
+			if (err < 0)
+				return err;
+
+			hdr = get_hdr(file);
+		}
+
+		hdr->end = get_next_block(file, hdr->end);
+
+		block = get_block(file, hdr->end);
+		memset(block, 0, sizeof(struct stats_block));
+
+		memset(&file->codec, 0, sizeof(struct stats_codec));
+		len = encode_record(&file->codec, rec, buf);
 	}
 
-	if (file->addr == NULL) {
-		addr = mmap(NULL, new_size, PROT_READ | PROT_WRITE,
-				MAP_SHARED, file->fd, 0);
+	memcpy(block->data + block->used, buf, len);
+	block->used += len;
+
+	if (block->count == 0)
+		block->first_ts = rec->ts;
+	block->last_ts = rec->ts;
+	block->count++;
+
+	codec_update(&file->codec, rec);
+
+	if (rec->roaming != TRUE) {
+		memcpy(&hdr->home, rec, sizeof(struct stats_record));
+		hdr->flags |= STATS_HAS_HOME;
 	} else {
-		addr = mremap(file->addr, file->len, new_size, MREMAP_MAYMOVE);
+		memcpy(&hdr->roaming, rec, sizeof(struct stats_record));
+		hdr->flags |= STATS_HAS_ROAMING;
 	}
 
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "mmap error %s for %s\n",
-			strerror(errno), file->name);
-		return -errno;
+	return 0;
+}
+
+static int stats_file_migrate(struct stats_file *file)
+{
+	struct stats_file_header_v1 *hdr;
+	struct stats_record_v1 *first, *last, *it, *end;
+	struct stats_record *records;
+	unsigned int max_entries, count = 0, i;
+
+	hdr = (struct stats_file_header_v1 *)file->addr;
+
+	if (file->len < sizeof(struct stats_file_header_v1) +
+					sizeof(struct stats_record_v1))
+		return -EINVAL;
+
+	max_entries = (file->len - sizeof(struct stats_file_header_v1)) /
+					sizeof(struct stats_record_v1);
+
+	if (hdr->begin < sizeof(struct stats_file_header_v1) ||
+			hdr->end < sizeof(struct stats_file_header_v1) ||
+			hdr->begin > file->len - sizeof(struct stats_record_v1) ||
+			hdr->end > file->len - sizeof(struct stats_record_v1) ||
+			(hdr->begin - sizeof(struct stats_file_header_v1)) %
+					sizeof(struct stats_record_v1) != 0 ||
+			(hdr->end - sizeof(struct stats_file_header_v1)) %
+					sizeof(struct stats_record_v1) != 0)
+		return -EINVAL;
+
+	records = g_new0(struct stats_record, max_entries);
+
+	first = (struct stats_record_v1 *)(file->addr +
+				sizeof(struct stats_file_header_v1));
+	last = first + max_entries - 1;
+
+	it = (struct stats_record_v1 *)(file->addr + hdr->begin);
+	end = (struct stats_record_v1 *)(file->addr + hdr->end);
+
+	while (it != end && count < max_entries) {
+		struct stats_record *rec = &records[count++];
+
+		it = it == last ? first : it + 1;
+
+		rec->ts = it->ts;
+		rec->roaming = it->roaming == TRUE ? TRUE : FALSE;
+		rec->data.rx_packets = it->data.rx_packets;
+		rec->data.tx_packets = it->data.tx_packets;
+		rec->data.rx_bytes = it->data.rx_bytes;
+		rec->data.tx_bytes = it->data.tx_bytes;
+		rec->data.rx_errors = it->data.rx_errors;
+		rec->data.tx_errors = it->data.tx_errors;
+		rec->data.rx_dropped = it->data.rx_dropped;
+		rec->data.tx_dropped = it->data.tx_dropped;
+		rec->data.time = it->data.time;
 	}
 
-	file->addr = addr;
-	file->len = new_size;
-	file->max_len = new_size;
+	stats_file_reset(file);
+
+	for (i = 0; i < count; i++)
+		append_record(file, &records[i]);
+
+	g_free(records);
+
+	printf("Converted %u records of %s\n", count, file->name);
 
 	return 0;
 }
 
 static int stats_open(struct stats_file *file, const char *name)
 {
-	struct stats_file_header *hdr;
 	struct stat tm;
 	int err;
 	size_t size = 0;
@@ -495,8 +867,8 @@ static int stats_open(struct stats_file *file, const char *name)
 		}
 	}
 
-	if (size == 0)
-		size = sysconf(_SC_PAGESIZE);
+	if (size < STATS_BLOCK_SIZE)
+		size = STATS_BLOCK_SIZE;
 
 	err = stats_file_remap(file, size);
 	if (err < 0) {
@@ -504,23 +876,12 @@ static int stats_open(struct stats_file *file, const char *name)
 		return err;
 	}
 
+	if (get_hdr(file)->magic == MAGIC_V1)
+		stats_file_migrate(file);
+
 	/* Initialize new file */
-	hdr = get_hdr(file);
-	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
-		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
-
-	}
-	stats_file_update_cache(file);
+	if (stats_file_check(file) == FALSE)
+		stats_file_reset(file);
 
 	return 0;
 }
@@ -538,132 +899,77 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 {
 	unsigned int i;
 	int err;
-	struct stats_record *cur, *next;
-	struct stats_file_header *hdr;
+	struct stats_record cur, next;
 	unsigned int pkt;
 	unsigned int step_ts;
 	unsigned int roaming = FALSE;
 
-	hdr = get_hdr(file);
-
-	hdr->magic = MAGIC;
-	hdr->begin = sizeof(struct stats_file_header);
-	hdr->end = sizeof(struct stats_file_header);
-	hdr->home = UINT_MAX;
-	hdr->roaming = UINT_MAX;
-
-	stats_file_update_cache(file);
+	stats_file_reset(file);
+	stats_file_remap(file, STATS_BLOCK_SIZE);
 
-	if (start != NULL) {
-		struct stats_record *rec;
+	memset(&cur, 0, sizeof(struct stats_record));
 
-		rec = get_end(file);
-		memcpy(rec, start, sizeof(struct stats_record));
-	} else {
-		get_end(file)->ts = start_ts;
-	}
+	if (start != NULL)
+		memcpy(&cur, start, sizeof(struct stats_record));
+	else
+		cur.ts = start_ts;
 
 	for (i = 0; i < nr; i++) {
-		if (file->last == get_end(file)) {
-			err = stats_file_remap(file, file->len +
-						sysconf(_SC_PAGESIZE));
-			if (err < 0)
-				return err;
-
-			stats_file_update_cache(file);
-		}
-		cur = get_end(file);
-		next = get_next(file, cur);
+		memcpy(&next, &cur, sizeof(struct stats_record));
 
 		step_ts = (rand() % interval);
 		if (step_ts == 0)
 			step_ts = 1;
 
-		next->ts = cur->ts + step_ts;
-		next->roaming = roaming;
-		next->data.time = cur->data.time + step_ts;
-
-		next->data.rx_packets = cur->data.rx_packets;
-		next->data.rx_bytes = cur->data.rx_bytes;
+		next.ts = cur.ts + step_ts;
+		next.roaming = roaming;
+		next.data.time = cur.data.time + step_ts;
 
 		if (rand() % 3 == 0) {
 			pkt = rand() % 5;
-			next->data.rx_packets += pkt;
-			next->data.rx_bytes += pkt * (rand() % 1500);
+			next.data.rx_packets += pkt;
+			next.data.rx_bytes += pkt * (rand() % 1500);
 		}
 
-		next->data.tx_packets = cur->data.tx_packets;
-		next->data.tx_bytes = cur->data.tx_bytes;
-
 		if (rand() % 3 == 0) {
 			pkt = rand() % 5;
-			next->data.tx_packets += pkt;
-			next->data.tx_bytes += pkt * (rand() % 1500);
+			next.data.tx_packets += pkt;
+			next.data.tx_bytes += pkt * (rand() % 1500);
 		}
 
-		set_end(file, next);
-
-		if ((rand() % 50) == 0)
-			roaming = roaming == TRUE? FALSE : TRUE;
-
-	}
-
-	return 0;
-}
-
-static struct stats_record *get_next_record(struct stats_iter *iter)
-{
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
-
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
-
-		return tmp;
-	}
-
-	return NULL;
-}
-
-static int append_record(struct stats_file *file,
-				struct stats_record *rec)
-{
-	struct stats_record *cur, *next;
-	int err;
-
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
+		err = append_record(file, &next);
 		if (err < 0)
 			return err;
 
-		stats_file_update_cache(file);
-	}
+		memcpy(&cur, &next, sizeof(struct stats_record));
 
-	cur = get_end(file);
-	next = get_next(file, cur);
-
-	memcpy(next, rec, sizeof(struct stats_record));
+		if ((rand() % 50) == 0)
+			roaming = roaming == TRUE? FALSE : TRUE;
 
-	set_end(file, next);
+	}
 
 	return 0;
 }
 
-static struct stats_record *process_file(struct stats_iter *iter,
+static gboolean process_file(struct stats_iter *iter,
 					struct stats_file *temp_file,
 					struct stats_record *cur,
+					gboolean valid,
 					GDate *date_change_step_size,
 					int account_period_offset)
 {
-	struct stats_record *home, *roaming;
+	struct stats_record home, roaming;
+	gboolean have_home = FALSE, have_roaming = FALSE;
 	struct stats_record *next;
 
-	home = NULL;
-	roaming = NULL;
+	if (valid == FALSE) {
+		next = get_next_record(iter);
+		if (next == NULL)
+			return FALSE;
+
+		memcpy(cur, next, sizeof(struct stats_record));
+	}
 
-	if (cur == NULL)
-		cur = get_next_record(iter);
 	next = get_next_record(iter);
 
 	while (next != NULL) {
@@ -673,10 +979,13 @@ static struct stats_record *process_file(struct stats_iter *iter,
 
 		append = FALSE;
 
-		if (cur->roaming == TRUE)
-			roaming = cur;
-		else
-			home = cur;
+		if (cur->roaming == TRUE) {
+			memcpy(&roaming, cur, sizeof(struct stats_record));
+			have_roaming = TRUE;
+		} else {
+			memcpy(&home, cur, sizeof(struct stats_record));
+			have_home = TRUE;
+		}
 
 		g_date_set_time_t(&date_cur, cur->ts);
 		g_date_set_time_t(&date_next, next->ts);
@@ -703,22 +1012,22 @@ static struct stats_record *process_file(struct stats_iter *iter,
 		}
 
 		if (append == TRUE) {
-			if (home != NULL) {
-				append_record(temp_file, home);
-				home = NULL;
+			if (have_home == TRUE) {
+				append_record(temp_file, &home);
+				have_home = FALSE;
 			}
 
-			if (roaming != NULL) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
+			if (have_roaming == TRUE) {
+				append_record(temp_file, &roaming);
+				have_roaming = FALSE;
 			}
 		}
 
-		cur = next;
+		memcpy(cur, next, sizeof(struct stats_record));
 		next = get_next_record(iter);
 	}
 
-	return cur;
+	return TRUE;
 }
 
 static int summarize(struct stats_file *data_file,
@@ -728,7 +1037,8 @@ static int summarize(struct stats_file *data_file,
 {
 	struct stats_iter data_iter;
 	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
+	struct stats_record cur, *next;
+	gboolean valid = FALSE;
 
 	GDate today, date_change_step_size;
 
@@ -748,39 +1058,31 @@ static int summarize(struct stats_file *data_file,
 
 
 	/* Now process history file */
-	cur = NULL;
-
 	if (history_file != NULL) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
+		stats_iter_init(&history_iter, history_file);
 
-		cur = process_file(&history_iter, temp_file, NULL,
+		valid = process_file(&history_iter, temp_file, &cur, FALSE,
 					&date_change_step_size, account_period_offset);
 	}
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
+	stats_iter_init(&data_iter, data_file);
 
 	/*
 	 * Ensure date_file records are newer than the history_file
 	 * record
 	 */
-	if (cur != NULL) {
+	if (valid == TRUE) {
 		next = get_next_record(&data_iter);
-		while(next != NULL && cur->ts > next->ts)
+		while(next != NULL && cur.ts > next->ts)
 			next = get_next_record(&data_iter);
 	}
 
 	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
+	valid = process_file(&data_iter, temp_file, &cur, valid,
 				&date_change_step_size, account_period_offset);
 
-	if (cur != NULL)
-		append_record(temp_file, cur);
+	if (valid == TRUE)
+		append_record(temp_file, &cur);
 
 	return 0;
 }
@@ -824,6 +1126,267 @@ static void history_file_update(struct stats_file *data_file,
 	swap_and_close_files(history_file, &tempory_file);
 }
 
+static uint64_t query_delta(uint64_t cur, uint64_t last)
+{
+	if (cur < last)
+		return cur;
+
+	return cur - last;
+}
+
+static void query_add(struct stats_query *query,
+				const struct stats_record *rec)
+{
+	int index = rec->roaming == TRUE ? 1 : 0;
+	const struct connman_stats_data *last = &query->last[index].data;
+	const struct connman_stats_data *cur = &rec->data;
+	struct stats_bucket *bucket;
+	struct connman_stats_data *sum;
+
+	if (query->valid[index] == TRUE && rec->ts >= query->start &&
+						rec->ts < query->end) {
+		bucket = &query->buckets[(rec->ts - query->start) /
+							query->interval];
+		sum = index == 1 ? &bucket->roaming : &bucket->home;
+
+		sum->rx_packets += query_delta(cur->rx_packets,
+							last->rx_packets);
+		sum->tx_packets += query_delta(cur->tx_packets,
+							last->tx_packets);
+		sum->rx_bytes += query_delta(cur->rx_bytes, last->rx_bytes);
+		sum->tx_bytes += query_delta(cur->tx_bytes, last->tx_bytes);
+		sum->rx_errors += query_delta(cur->rx_errors,
+							last->rx_errors);
+		sum->tx_errors += query_delta(cur->tx_errors,
+							last->tx_errors);
+		sum->rx_dropped += query_delta(cur->rx_dropped,
+							last->rx_dropped);
+		sum->tx_dropped += query_delta(cur->tx_dropped,
+							last->tx_dropped);
+		sum->time += query_delta(cur->time, last->time);
+	}
+
+	memcpy(&query->last[index], rec, sizeof(struct stats_record));
+	query->valid[index] = TRUE;
+}
+
+static void query_file(struct stats_query *query, struct stats_file *file,
+					gboolean seek)
+{
+	struct stats_iter iter;
+	struct stats_record *rec;
+
+	if (seek == TRUE)
+		stats_iter_seek(&iter, file, query->start);
+	else
+		stats_iter_init(&iter, file);
+
+	while ((rec = get_next_record(&iter)) != NULL) {
+		query->decoded++;
+
+		if (rec->ts >= query->end)
+			break;
+
+		query_add(query, rec);
+	}
+}
+
+/*
+ * Runs the same random ranges once with the binary search over the
+ * blocks and once with a scan from the oldest record, and checks
+ * that both agree. Create a multi-year file first, e.g. with
+ * --create 10000000 --interval 20.
+ */
+static void stats_query_benchmark(struct stats_file *file, unsigned int nr)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_query seek, scan;
+	unsigned int i, n, mismatch = 0;
+	uint64_t decoded_seek = 0, decoded_scan = 0;
+	double elapsed, elapsed_seek = 0, elapsed_scan = 0, max_seek = 0;
+	int64_t first_ts, last_ts, span;
+	GTimer *timer;
+
+	if (get_block(file, hdr->begin)->count == 0) {
+		fprintf(stderr, "no entries in %s\n", file->name);
+		return;
+	}
+
+	first_ts = get_block(file, hdr->begin)->first_ts;
+	last_ts = get_block(file, hdr->end)->last_ts;
+	span = last_ts - first_ts;
+
+	timer = g_timer_new();
+
+	for (i = 0; i < nr; i++) {
+		memset(&seek, 0, sizeof(struct stats_query));
+
+		seek.interval = STATS_QUERY_INTERVAL;
+		seek.start = first_ts + (span > 0 ? (int64_t)
+				((double)rand() / RAND_MAX * span) : 0);
+		seek.end = seek.start + STATS_QUERY_INTERVAL +
+				rand() % STATS_QUERY_MAX_LEN;
+
+		n = (seek.end - seek.start + seek.interval - 1) /
+							seek.interval;
+		seek.buckets = g_new0(struct stats_bucket, n);
+
+		memcpy(&scan, &seek, sizeof(struct stats_query));
+		scan.buckets = g_new0(struct stats_bucket, n);
+
+		g_timer_start(timer);
+		query_file(&seek, file, TRUE);
+		elapsed = g_timer_elapsed(timer, NULL);
+
+		elapsed_seek += elapsed;
+		if (elapsed > max_seek)
+			max_seek = elapsed;
+
+		g_timer_start(timer);
+		query_file(&scan, file, FALSE);
+		elapsed_scan += g_timer_elapsed(timer, NULL);
+
+		decoded_seek += seek.decoded;
+		decoded_scan += scan.decoded;
+
+		if (memcmp(seek.buckets, scan.buckets,
+				n * sizeof(struct stats_bucket)) != 0)
+			mismatch++;
+
+		g_free(seek.buckets);
+		g_free(scan.buckets);
+	}
+
+	printf("Query benchmark with %u ranges of up to %d hourly buckets\n",
+			nr, STATS_QUERY_MAX_LEN / STATS_QUERY_INTERVAL);
+	printf("  file spans %.1f days in %u blocks\n",
+			(double)span / (24 * 3600), file->blocks);
+	printf("  method    avg us    max us  records/query\n");
+	printf("  seek    %8.1f  %8.1f  %13.0f\n",
+			elapsed_seek * 1e6 / nr, max_seek * 1e6,
+			(double)decoded_seek / nr);
+	printf("  scan    %8.1f  %8s  %13.0f\n",
+			elapsed_scan * 1e6 / nr, "-",
+			(double)decoded_scan / nr);
+	printf("  mismatches %u\n", mismatch);
+
+	g_timer_destroy(timer);
+}
+
+/*
+ * Appends the same faked records once as fixed size version 1 records
+ * and once encoded into blocks, both into anonymous memory so the page
+ * cache does not skew the numbers.
+ */
+static void stats_benchmark(unsigned int nr)
+{
+	struct stats_record *records;
+	struct stats_record_v1 *ring_v1;
+	struct stats_file file;
+	unsigned int i, max_v1, max_v2;
+	double elapsed_v1, elapsed_v2;
+	GTimer *timer;
+	size_t len;
+
+	records = g_new0(struct stats_record, nr);
+
+	for (i = 0; i < nr; i++) {
+		struct stats_record *rec = &records[i];
+		struct stats_record *prev = i > 0 ? &records[i - 1] : NULL;
+		unsigned int pkt;
+
+		if (prev != NULL)
+			memcpy(rec, prev, sizeof(struct stats_record));
+		else
+			rec->ts = time(NULL);
+
+		rec->ts += 1 + rand() % option_interval;
+		rec->data.time += 1;
+
+		pkt = rand() % 500;
+		rec->data.rx_packets += pkt;
+		rec->data.rx_bytes += pkt * (rand() % 1500);
+
+		pkt = rand() % 500;
+		rec->data.tx_packets += pkt;
+		rec->data.tx_bytes += pkt * (rand() % 1500);
+
+		if (rand() % 1000 == 0)
+			rec->data.rx_dropped++;
+	}
+
+	timer = g_timer_new();
+
+	/* version 1: one fixed size record per entry */
+	len = sizeof(struct stats_file_header_v1) +
+			(size_t)nr * sizeof(struct stats_record_v1);
+	ring_v1 = g_malloc0(len);
+
+	g_timer_start(timer);
+
+	for (i = 0; i < nr; i++) {
+		struct stats_record_v1 *rec = &ring_v1[i];
+
+		rec->ts = records[i].ts;
+		rec->roaming = records[i].roaming;
+		rec->data.rx_packets = records[i].data.rx_packets;
+		rec->data.tx_packets = records[i].data.tx_packets;
+		rec->data.rx_bytes = records[i].data.rx_bytes;
+		rec->data.tx_bytes = records[i].data.tx_bytes;
+		rec->data.rx_errors = records[i].data.rx_errors;
+		rec->data.tx_errors = records[i].data.tx_errors;
+		rec->data.rx_dropped = records[i].data.rx_dropped;
+		rec->data.tx_dropped = records[i].data.tx_dropped;
+		rec->data.time = records[i].data.time;
+	}
+
+	elapsed_v1 = g_timer_elapsed(timer, NULL);
+
+	/* version 2: delta encoded records in blocks */
+	memset(&file, 0, sizeof(struct stats_file));
+	file.len = STATS_BLOCK_SIZE * (nr / 32 + 2);
+	file.blocks = file.len / STATS_BLOCK_SIZE;
+	file.addr = g_malloc0(file.len);
+
+	stats_file_reset(&file);
+
+	g_timer_start(timer);
+
+	for (i = 0; i < nr; i++) {
+		struct stats_file_header *hdr = get_hdr(&file);
+
+		if (hdr->end + 1 == file.blocks)
+			break;
+
+		append_record(&file, &records[i]);
+	}
+
+	elapsed_v2 = g_timer_elapsed(timer, NULL);
+
+	len = get_block_offset(get_hdr(&file)->end) +
+			sizeof(struct stats_block) +
+			get_block(&file, get_hdr(&file)->end)->used;
+
+	max_v1 = (STATS_MAX_FILE_SIZE - sizeof(struct stats_file_header_v1)) /
+			sizeof(struct stats_record_v1);
+	max_v2 = (double)i * STATS_MAX_FILE_SIZE / len;
+
+	printf("Benchmark with %u records\n", i);
+	printf("  format  bytes/record  records/file  ns/append\n");
+	printf("  v1      %12zu  %12u  %9.1f\n",
+			sizeof(struct stats_record_v1), max_v1,
+			elapsed_v1 * 1e9 / nr);
+	printf("  v2      %12.1f  %12u  %9.1f\n",
+			(double)len / i, max_v2, elapsed_v2 * 1e9 / i);
+	printf("  (records/file for a %d bytes file)\n",
+			STATS_MAX_FILE_SIZE);
+
+	g_timer_destroy(timer);
+	g_free(file.addr);
+	g_free(ring_v1);
+	g_free(records);
+}
+
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
@@ -855,6 +1418,11 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
+	if (option_benchmark > 0) {
+		stats_benchmark(option_benchmark);
+		exit(0);
+	}
+
 	if (argc < 2) {
 		printf("Usage: %s [FILENAME]\n", argv[0]);
 		exit(0);
@@ -874,7 +1442,16 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 
-		rec = get_end(&last);
+		rec = g_new0(struct stats_record, 1);
+		if (get_hdr(&last)->flags & STATS_HAS_ROAMING)
+			memcpy(rec, &get_hdr(&last)->roaming,
+					sizeof(struct stats_record));
+		if ((get_hdr(&last)->flags & STATS_HAS_HOME) &&
+				get_hdr(&last)->home.ts >= rec->ts)
+			memcpy(rec, &get_hdr(&last)->home,
+					sizeof(struct stats_record));
+
+		stats_close(&last);
 	}
 
 	if (option_start_ts == -1)
@@ -885,13 +1462,18 @@ int main(int argc, char *argv[])
 	if (option_create > 0)
 		stats_create(data_file, option_create, option_interval, start_ts, rec);
 
+	g_free(rec);
+
 	hdr = get_hdr(data_file);
 	if (hdr->magic != MAGIC) {
 		fprintf(stderr, "header file magic test failed\n");
 		goto err;
 	}
 
-	stats_file_update_cache(data_file);
+	if (option_query > 0) {
+		stats_query_benchmark(data_file, option_query);
+		goto err;
+	}
 
 	stats_hdr_info(data_file);
 
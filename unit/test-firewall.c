@@ -0,0 +1,312 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2012  BWM CarIT GmbH. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "../src/connman.h"
+
+/*
+ * Drives the NAT code through whichever firewall backend was built in.
+ * The test moves itself into a fresh network namespace first, so it
+ * needs CAP_NET_ADMIN but never touches the host's firewall.
+ */
+
+struct connman_notifier *nat_notifier;
+
+struct connman_service {
+	const char *interface;
+};
+
+char *connman_service_get_interface(struct connman_service *service)
+{
+	return g_strdup(service->interface);
+}
+
+int connman_notifier_register(struct connman_notifier *notifier)
+{
+	nat_notifier = notifier;
+
+	return 0;
+}
+
+void connman_notifier_unregister(struct connman_notifier *notifier)
+{
+	nat_notifier = NULL;
+}
+
+static void set_default_interface(const char *interface)
+{
+	struct connman_service service = { .interface = interface };
+
+	g_assert(nat_notifier != NULL);
+
+	nat_notifier->default_changed(&service);
+}
+
+/* Exit status which makes automake count the test as skipped */
+#define TEST_SKIP	77
+
+/*
+ * Returns the NAT state in lower case, or NULL when it cannot be
+ * listed. The "connman" nftables table only exists when the nftables
+ * backend is in use, otherwise the iptables nat table is listed.
+ */
+static char *list_nat(void)
+{
+	char *output = NULL, *lower;
+	int status;
+
+	if (g_spawn_command_line_sync("nft list table ip connman",
+				&output, NULL, &status, NULL) == FALSE ||
+			status != 0) {
+		g_free(output);
+		output = NULL;
+
+		if (g_spawn_command_line_sync("iptables -t nat -S POSTROUTING",
+					&output, NULL, &status, NULL) == FALSE ||
+				status != 0) {
+			g_free(output);
+			return NULL;
+		}
+	}
+
+	lower = g_ascii_strdown(output, -1);
+	g_free(output);
+
+	return lower;
+}
+
+static void assert_nat(const char *needle, gboolean present)
+{
+	char *output;
+
+	output = list_nat();
+	if (output == NULL)
+		g_error("Failed to list the nat rules");
+
+	if ((strstr(output, needle) != NULL) != present)
+		g_error("'%s' %s in:\n%s", needle,
+				present == TRUE ? "missing" : "unexpected",
+				output);
+
+	g_free(output);
+}
+
+static void test_firewall_nat0(void)
+{
+	int err;
+
+	set_default_interface("eth0");
+
+	err = __connman_nat_enable("bridge", "192.168.2.1", 24);
+	g_assert(err == 0);
+
+	assert_nat("192.168.2.0/24", TRUE);
+	assert_nat("eth0", TRUE);
+	assert_nat("masquerade", TRUE);
+
+	__connman_nat_disable("bridge");
+
+	assert_nat("192.168.2.0/24", FALSE);
+	assert_nat("masquerade", FALSE);
+}
+
+static void test_firewall_nat1(void)
+{
+	int err;
+
+	set_default_interface("eth0");
+
+	err = __connman_nat_enable("bridge", "192.168.2.1", 24);
+	g_assert(err == 0);
+	err = __connman_nat_enable("usb", "192.168.4.1", 24);
+	g_assert(err == 0);
+
+	assert_nat("192.168.2.0/24", TRUE);
+	assert_nat("192.168.4.0/24", TRUE);
+
+	/* Both rules move over with the default interface */
+	set_default_interface("eth1");
+
+	assert_nat("eth0", FALSE);
+	assert_nat("eth1", TRUE);
+	assert_nat("192.168.2.0/24", TRUE);
+	assert_nat("192.168.4.0/24", TRUE);
+
+	__connman_nat_disable("bridge");
+
+	assert_nat("192.168.2.0/24", FALSE);
+	assert_nat("192.168.4.0/24", TRUE);
+
+	__connman_nat_disable("usb");
+
+	assert_nat("192.168.4.0/24", FALSE);
+	assert_nat("masquerade", FALSE);
+}
+
+static void test_firewall_nat2(void)
+{
+	int err;
+
+	set_default_interface("eth0");
+
+	/* A nat without an address masquerades everything */
+	err = __connman_nat_enable("modem", NULL, 0);
+	g_assert(err == 0);
+
+	assert_nat("eth0", TRUE);
+	assert_nat("masquerade", TRUE);
+
+	__connman_nat_disable("modem");
+
+	assert_nat("masquerade", FALSE);
+}
+
+static void test_firewall_nat3(void)
+{
+	int err;
+
+	set_default_interface("eth0");
+
+	/* The second prefix lies within the first one */
+	err = __connman_nat_enable("bridge", "192.168.2.1", 23);
+	g_assert(err == 0);
+	err = __connman_nat_enable("usb", "192.168.3.1", 24);
+	g_assert(err == 0);
+
+	assert_nat("192.168.2.0/23", TRUE);
+
+	__connman_nat_disable("bridge");
+
+	assert_nat("192.168.2.0/23", FALSE);
+	assert_nat("192.168.3.0/24", TRUE);
+
+	err = __connman_nat_enable("bridge", "192.168.2.1", 23);
+	g_assert(err == 0);
+
+	assert_nat("192.168.2.0/23", TRUE);
+
+	__connman_nat_disable("usb");
+
+	assert_nat("192.168.2.0/23", TRUE);
+	assert_nat("192.168.3.0/24", FALSE);
+
+	__connman_nat_disable("bridge");
+
+	assert_nat("masquerade", FALSE);
+}
+
+static void test_firewall_abort0(void)
+{
+	struct connman_firewall_nat *nat;
+	int err;
+
+	nat = __connman_firewall_nat_new("10.1.0.1", 16);
+	g_assert(nat != NULL);
+
+	err = __connman_firewall_nat_enable(nat, "eth0");
+	g_assert(err == 0);
+
+	__connman_firewall_abort();
+
+	err = __connman_firewall_commit();
+	g_assert(err == 0);
+
+	assert_nat("10.1.0.0/16", FALSE);
+
+	/* The aborted enable must not be remembered */
+	err = __connman_firewall_nat_enable(nat, "eth0");
+	g_assert(err == 0);
+	err = __connman_firewall_commit();
+	g_assert(err == 0);
+
+	assert_nat("10.1.0.0/16", TRUE);
+
+	err = __connman_firewall_nat_disable(nat);
+	g_assert(err == 0);
+
+	__connman_firewall_abort();
+
+	/* Still in the kernel, so disabling again has to remove it */
+	err = __connman_firewall_nat_disable(nat);
+	g_assert(err == 0);
+	err = __connman_firewall_commit();
+	g_assert(err == 0);
+
+	assert_nat("10.1.0.0/16", FALSE);
+
+	__connman_firewall_nat_free(nat);
+}
+
+int main(int argc, char *argv[])
+{
+	char *nft, *iptables;
+	gboolean found;
+	int err;
+
+	g_test_init(&argc, &argv, NULL);
+
+	nft = g_find_program_in_path("nft");
+	iptables = g_find_program_in_path("iptables");
+	found = nft != NULL || iptables != NULL;
+	g_free(nft);
+	g_free(iptables);
+
+	if (found == FALSE) {
+		fprintf(stderr, "Skipping: neither nft nor iptables found\n");
+		return TEST_SKIP;
+	}
+
+	if (unshare(CLONE_NEWNET) < 0) {
+		fprintf(stderr, "Skipping: no network namespace (%s)\n",
+							strerror(errno));
+		return TEST_SKIP;
+	}
+
+	__connman_log_init(argv[0], "*", FALSE, TRUE, "test-firewall",
+								VERSION);
+	__connman_firewall_init();
+	__connman_nat_init();
+
+	g_test_add_func("/firewall/nat0", test_firewall_nat0);
+	g_test_add_func("/firewall/nat1", test_firewall_nat1);
+	g_test_add_func("/firewall/nat2", test_firewall_nat2);
+	g_test_add_func("/firewall/nat3", test_firewall_nat3);
+	g_test_add_func("/firewall/abort0", test_firewall_abort0);
+
+	err = g_test_run();
+
+	__connman_nat_cleanup();
+	__connman_firewall_cleanup();
+	__connman_log_cleanup(TRUE);
+
+	return err;
+}
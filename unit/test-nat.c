@@ -93,6 +93,83 @@ static void test_iptables_basic0(void)
 	g_assert(err == 0);
 }
 
+static void test_iptables_transaction0(void)
+{
+	int err;
+
+	/* Two edits, one commit */
+	err = __connman_iptables_command("-I INPUT -i session-bridge -j ACCEPT");
+	g_assert(err == 0);
+	err = __connman_iptables_command("-I INPUT -i session-tunnel -j ACCEPT");
+	g_assert(err == 0);
+	err = __connman_iptables_commit("filter");
+	g_assert(err == 0);
+
+	err = __connman_iptables_command("-C INPUT -i session-bridge -j ACCEPT");
+	g_assert(err == 0);
+	err = __connman_iptables_command("-C INPUT -i session-tunnel -j ACCEPT");
+	g_assert(err == 0);
+
+	/* Aborted edits never reach the kernel */
+	err = __connman_iptables_command("-D INPUT -i session-bridge -j ACCEPT");
+	g_assert(err == 0);
+	__connman_iptables_abort("filter");
+
+	err = __connman_iptables_command("-C INPUT -i session-bridge -j ACCEPT");
+	g_assert(err == 0);
+
+	err = __connman_iptables_command("-D INPUT -i session-bridge -j ACCEPT");
+	g_assert(err == 0);
+	err = __connman_iptables_command("-D INPUT -i session-tunnel -j ACCEPT");
+	g_assert(err == 0);
+	err = __connman_iptables_commit("filter");
+	g_assert(err == 0);
+
+	err = __connman_iptables_command("-C INPUT -i session-bridge -j ACCEPT");
+	g_assert(err != 0);
+	err = __connman_iptables_command("-C INPUT -i session-tunnel -j ACCEPT");
+	g_assert(err != 0);
+}
+
+static void test_iptables_rule0(void)
+{
+	struct connman_iptables_rule *rule;
+	int err;
+
+	rule = __connman_iptables_rule_new("filter", "INPUT");
+	g_assert(rule);
+
+	err = __connman_iptables_rule_set_in_interface(rule, "session-bridge");
+	g_assert(err == 0);
+	err = __connman_iptables_rule_set_source(rule, "192.168.2.1", 24);
+	g_assert(err == 0);
+	err = __connman_iptables_rule_set_target(rule, "ACCEPT");
+	g_assert(err == 0);
+
+	err = __connman_iptables_rule_compare(rule);
+	g_assert(err != 0);
+
+	err = __connman_iptables_rule_append(rule);
+	g_assert(err == 0);
+	err = __connman_iptables_commit("filter");
+	g_assert(err == 0);
+
+	/* The built rule matches its command line equivalent */
+	err = __connman_iptables_command("-C INPUT -s 192.168.2.1/24 "
+					"-i session-bridge -j ACCEPT");
+	g_assert(err == 0);
+
+	err = __connman_iptables_rule_delete(rule);
+	g_assert(err == 0);
+	err = __connman_iptables_commit("filter");
+	g_assert(err == 0);
+
+	err = __connman_iptables_rule_compare(rule);
+	g_assert(err != 0);
+
+	__connman_iptables_rule_free(rule);
+}
+
 static void test_nat_basic0(void)
 {
 	int err;
@@ -152,6 +229,8 @@ int main(int argc, char *argv[])
 	__connman_nat_init();
 
 	g_test_add_func("/iptables/basic0", test_iptables_basic0);
+	g_test_add_func("/iptables/transaction0", test_iptables_transaction0);
+	g_test_add_func("/iptables/rule0", test_iptables_rule0);
 	g_test_add_func("/nat/basic0", test_nat_basic0);
 	g_test_add_func("/nat/basic1", test_nat_basic1);
 
@@ -311,25 +311,37 @@ static void set_user_networks(struct vpn_provider *provider, GSList *networks)
 	}
 }
 
+static unsigned char route_prefixlen(struct vpn_route *route)
+{
+	if (route->family == AF_INET6)
+		return atoi(route->netmask);
+
+	return __connman_ipaddress_netmask_prefix_len(route->netmask);
+}
+
 static void del_routes(struct vpn_provider *provider)
 {
+	struct __connman_inet_batch *batch = NULL;
 	GHashTableIter hash;
 	gpointer value, key;
 
+	if (handle_routes == TRUE)
+		batch = __connman_inet_batch_new();
+
 	g_hash_table_iter_init(&hash, provider->user_routes);
-	while (handle_routes == TRUE && g_hash_table_iter_next(&hash,
+	while (batch != NULL && g_hash_table_iter_next(&hash,
 						&key, &value) == TRUE) {
 		struct vpn_route *route = value;
-		if (route->family == AF_INET6) {
-			unsigned char prefixlen = atoi(route->netmask);
-			connman_inet_del_ipv6_network_route(provider->index,
-							route->network,
-							prefixlen);
-		} else
-			connman_inet_del_host_route(provider->index,
-						route->network);
+
+		__connman_inet_batch_add_route(batch, RTM_DELROUTE,
+					provider->index, route->family,
+					route->network, NULL,
+					route_prefixlen(route), NULL, NULL);
 	}
 
+	if (batch != NULL)
+		__connman_inet_batch_commit(batch);
+
 	g_hash_table_remove_all(provider->user_routes);
 	g_slist_free_full(provider->user_networks, free_route);
 	provider->user_networks = NULL;
@@ -1319,11 +1331,17 @@ static connman_bool_t check_host(char **hosts, char *host)
 	return FALSE;
 }
 
+struct append_routes_data {
+	struct vpn_provider *provider;
+	struct __connman_inet_batch *batch;
+};
+
 static void provider_append_routes(gpointer key, gpointer value,
 					gpointer user_data)
 {
 	struct vpn_route *route = value;
-	struct vpn_provider *provider = user_data;
+	struct append_routes_data *data = user_data;
+	struct vpn_provider *provider = data->provider;
 	int index = provider->index;
 
 	if (handle_routes == FALSE)
@@ -1340,23 +1358,19 @@ static void provider_append_routes(gpointer key, gpointer value,
 		return;
 	}
 
-	if (route->family == AF_INET6) {
-		unsigned char prefix_len = atoi(route->netmask);
-
-		connman_inet_add_ipv6_network_route(index, route->network,
-							route->gateway,
-							prefix_len);
-	} else {
-		connman_inet_add_network_route(index, route->network,
-						route->gateway,
-						route->netmask);
-	}
+	if (__connman_inet_batch_add_route(data->batch, RTM_NEWROUTE, index,
+					route->family, route->network,
+					route->gateway, route_prefixlen(route),
+					NULL, NULL) < 0)
+		connman_error("Invalid VPN route %s/%s via %s", route->network,
+					route->netmask, route->gateway);
 }
 
 static int set_connected(struct vpn_provider *provider,
 					connman_bool_t connected)
 {
 	struct vpn_ipconfig *ipconfig;
+	struct append_routes_data data;
 
 	DBG("provider %p id %s connected %d", provider,
 					provider->identifier, connected);
@@ -1375,11 +1389,19 @@ static int set_connected(struct vpn_provider *provider,
 		provider_indicate_state(provider,
 					VPN_PROVIDER_STATE_READY);
 
-		g_hash_table_foreach(provider->routes, provider_append_routes,
-					provider);
+		/* All routes go to the kernel in one transaction */
+		data.provider = provider;
+		data.batch = __connman_inet_batch_new();
+
+		if (data.batch != NULL) {
+			g_hash_table_foreach(provider->routes,
+					provider_append_routes, &data);
 
-		g_hash_table_foreach(provider->user_routes,
-					provider_append_routes, provider);
+			g_hash_table_foreach(provider->user_routes,
+					provider_append_routes, &data);
+
+			__connman_inet_batch_commit(data.batch);
+		}
 
 	} else {
 		provider_indicate_state(provider,